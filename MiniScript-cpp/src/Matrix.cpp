@@ -0,0 +1,113 @@
+//
+//  Matrix.cpp
+//  MiniScript
+//
+
+#include "Matrix.h"
+#include "MiniScript/MiniscriptErrors.h"
+#include "MiniScript/VectorMath.h"
+#include <string.h>
+
+namespace MiniScript {
+
+// Multiplication and transposition work on square blocks of this many rows
+// and columns at a time, so that the parts of each matrix in use stay in cache.
+static const long blockSize = 64;
+
+static inline long minLong(long a, long b) { return a < b ? a : b; }
+
+MatrixStorage::MatrixStorage(long rows, long cols) : rows(rows), cols(cols), data(nullptr) {
+	if (rows < 0 or cols < 0) IndexException("matrix rows and columns must be >= 0").raise();
+	if (rows > 0 and cols > Value::maxListSize / rows) LimitExceededException("matrix too large").raise();
+	accountFor(MemoryKind::Handle, (long)(sizeof(MatrixStorage) + rows * cols * sizeof(double)));
+	data = new double[rows * cols]();
+}
+
+MatrixStorage* MatrixStorage::FromList(Value list) {
+	// Check the shape first, so we don't raise with a half-built matrix.
+	long rows = list.ListCount();
+	long cols = 0;
+	for (long i=0; i<rows; i++) {
+		Value row = list.ListItem(i);
+		if (row.type != ValueType::List or (i > 0 and row.ListCount() != cols)) {
+			RuntimeException("Matrix.fromList: rows must be lists of the same length").raise();
+		}
+		cols = row.ListCount();
+	}
+	MatrixStorage *result = new MatrixStorage(rows, cols);
+	for (long i=0; i<rows; i++) {
+		Value row = list.ListItem(i);
+		double *dest = result->Row(i);
+		SimpleVector<double> *numbers = row.GetNumbers();
+		if (numbers) {
+			if (cols > 0) memcpy(dest, &(*numbers)[0], cols * sizeof(double));
+		} else {
+			for (long j=0; j<cols; j++) dest[j] = row.ListItem(j).DoubleValue();
+		}
+	}
+	return result;
+}
+
+ValueList MatrixStorage::ToList() {
+	ValueList result(rows);
+	for (long i=0; i<rows; i++) {
+		Value row = Value::NewNumberList(cols);
+		SimpleVector<double> *numbers = row.GetNumbers();
+		const double *src = Row(i);
+		for (long j=0; j<cols; j++) numbers->push_back(src[j]);
+		result.Add(row);
+	}
+	return result;
+}
+
+MatrixStorage* MatrixStorage::Multiply(MatrixStorage *a, MatrixStorage *b) {
+	long n = a->rows, m = a->cols, p = b->cols;
+	MatrixStorage *result = new MatrixStorage(n, p);
+	// Each result row is built up as a sum of rows of b, scaled by elements of
+	// a.  Blocking doesn't change the order of those additions (k still goes
+	// from 0 to m-1 for each element), so the result is the same as the
+	// textbook triple loop, only faster.
+	for (long i0=0; i0<n; i0+=blockSize) {
+		long i1 = minLong(i0 + blockSize, n);
+		for (long k0=0; k0<m; k0+=blockSize) {
+			long k1 = minLong(k0 + blockSize, m);
+			for (long j0=0; j0<p; j0+=blockSize) {
+				long width = minLong(j0 + blockSize, p) - j0;
+				for (long i=i0; i<i1; i++) {
+					double *dest = result->Row(i) + j0;
+					const double *aRow = a->Row(i);
+					for (long k=k0; k<k1; k++) VectorMath::AddScaled(dest, b->Row(k) + j0, aRow[k], width);
+				}
+			}
+		}
+	}
+	return result;
+}
+
+MatrixStorage* MatrixStorage::Add(MatrixStorage *a, MatrixStorage *b) {
+	MatrixStorage *result = new MatrixStorage(a->rows, a->cols);
+	VectorMath::Add(a->data, b->data, result->data, a->Count());
+	return result;
+}
+
+MatrixStorage* MatrixStorage::Scale(double factor) {
+	MatrixStorage *result = new MatrixStorage(rows, cols);
+	VectorMath::Multiply(data, factor, result->data, Count());
+	return result;
+}
+
+MatrixStorage* MatrixStorage::Transpose() {
+	MatrixStorage *result = new MatrixStorage(cols, rows);
+	for (long i0=0; i0<rows; i0+=blockSize) {
+		long i1 = minLong(i0 + blockSize, rows);
+		for (long j0=0; j0<cols; j0+=blockSize) {
+			long j1 = minLong(j0 + blockSize, cols);
+			for (long i=i0; i<i1; i++) {
+				for (long j=j0; j<j1; j++) result->At(j, i) = At(i, j);
+			}
+		}
+	}
+	return result;
+}
+
+}
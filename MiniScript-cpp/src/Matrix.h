@@ -0,0 +1,50 @@
+//
+//  Matrix.h
+//  MiniScript
+//
+//  A dense matrix of numbers, stored row by row in one contiguous block.
+//  This is the data behind the shell's Matrix class, so that matrix code
+//  (including list-of-lists libraries like matrixUtil, which can convert
+//  to and from it) doesn't have to do its arithmetic one element at a time.
+//
+
+#ifndef MATRIX_MODULE_H
+#define MATRIX_MODULE_H
+
+#include "MiniscriptTypes.h"
+
+namespace MiniScript {
+
+// MatrixStorage: RefCountedStorage holding a rows x cols matrix of doubles.
+class MatrixStorage : public RefCountedStorage {
+public:
+	// Make a matrix of the given size, filled with zeros.  Raises a
+	// LimitExceededException if it would be unreasonably big.
+	MatrixStorage(long rows, long cols);
+	virtual ~MatrixStorage() { delete[] data; }
+
+	double& At(long row, long col) { return data[row * cols + col]; }
+	double* Row(long row) { return data + row * cols; }
+	long Count() const { return rows * cols; }
+
+	// Make a new matrix from a list of lists of numbers (all the same length).
+	static MatrixStorage* FromList(Value list);
+
+	// Convert back into a list of lists.
+	ValueList ToList();
+
+	// Matrix arithmetic; each makes a new matrix.  The caller must make sure
+	// the sizes match (a.cols == b.rows for Multiply; same size for Add).
+	static MatrixStorage* Multiply(MatrixStorage *a, MatrixStorage *b);
+	static MatrixStorage* Add(MatrixStorage *a, MatrixStorage *b);
+	MatrixStorage* Scale(double factor);
+	MatrixStorage* Transpose();
+
+	long rows;
+	long cols;
+	double *data;
+};
+
+}
+
+#endif /* MATRIX_MODULE_H */
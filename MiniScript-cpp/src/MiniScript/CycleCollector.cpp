@@ -0,0 +1,364 @@
+//
+//  CycleCollector.cpp
+//  MiniScript
+//
+
+#include "CycleCollector.h"
+#include "MiniscriptTypes.h"
+#include "UnitTest.h"
+#include <vector>
+#include <mutex>
+
+namespace MiniScript {
+
+	CollectorHeap CollectorHeap::shared;
+	long CycleCollector::autoThreshold = 0;
+
+	thread_local int DeferredRelease::depth = 0;
+	thread_local long DeferredRelease::workDone = 0;
+	bool DeferredRelease::enabled = true;
+
+	// Lock guarding the shared heap.  (It's recursive, since freeing storage
+	// in the shared heap may free more storage in the shared heap; and like
+	// the heap itself, it's never destroyed.)
+	static std::recursive_mutex& sharedLock() {
+		static std::recursive_mutex *lock = new std::recursive_mutex();
+		return *lock;
+	}
+
+	// Holds the shared lock while in scope, if the given heap is the shared one.
+	class HeapLock {
+	public:
+		HeapLock(CollectorHeap *heap, CollectorHeap *shared) : locked(heap == shared) { if (locked) sharedLock().lock(); }
+		~HeapLock() { if (locked) sharedLock().unlock(); }
+	private:
+		bool locked;
+	};
+
+	void CollectorHeap::Delete(CollectorHeap *heap) {
+		delete heap->pendingQueue;
+		delete heap;
+	}
+
+	// The heap being collected, and the work list used while marking
+	// reachable objects in it (valid only during Collect).
+	static thread_local CollectorHeap *activeHeap = nullptr;
+	static thread_local std::vector<CollectableStorage*> *worklist = nullptr;
+
+	typedef void (*ChildVisitor)(CollectableStorage *child);
+
+	static inline void visitValue(const Value& v, ChildVisitor visit) {
+		if ((v.type == ValueType::List or v.type == ValueType::Map or v.type == ValueType::Function) and v.data.ref) {
+			visit(static_cast<CollectableStorage*>(v.data.ref));
+		}
+	}
+
+	void CycleCollector::visitChildren(CollectableStorage *storage, ChildVisitor visit) {
+		switch (storage->gcKind) {
+			case CollectableStorage::Kind::List: {
+				ValueListStorage *ls = static_cast<ValueListStorage*>(storage);
+				// (A view holds no references of its own to the items it
+				// shows, so it doesn't count when subtracting references;
+				// but it does keep those items reachable.)
+				if (ls->viewOf and visit == subtractRef) break;
+				for (unsigned long i=0; i<ls->size(); i++) visitValue((*ls)[i], visit);
+			} break;
+			case CollectableStorage::Kind::Map: {
+				ValueDictStorage *ds = static_cast<ValueDictStorage*>(storage);
+				for (long i=ds->mHead; i<ds->mUsed; i++) {
+					if (not ds->mEntries[i].live) continue;
+					visitValue(ds->mEntries[i].key, visit);
+					visitValue(ds->mEntries[i].value, visit);
+				}
+			} break;
+			case CollectableStorage::Kind::Function: {
+				// (A function's code and parameters hold only constants, so the
+				// only way it can be part of a cycle is through its outerVars.)
+				FunctionStorage *fs = static_cast<FunctionStorage*>(storage);
+				if (fs->outerVars.ds) visit(fs->outerVars.ds);
+			} break;
+			default:
+				break;
+		}
+	}
+
+	void CycleCollector::clearContents(CollectableStorage *storage) {
+		switch (storage->gcKind) {
+			case CollectableStorage::Kind::List: {
+				ValueListStorage *ls = static_cast<ValueListStorage*>(storage);
+				if (ls->viewOf) {
+					ls->unlinkView();
+				} else {
+					ls->detachViews();
+					ls->deleteAll();
+				}
+			} break;
+			case CollectableStorage::Kind::Map:
+				static_cast<ValueDictStorage*>(storage)->RemoveAll();
+				break;
+			case CollectableStorage::Kind::Function:
+				static_cast<FunctionStorage*>(storage)->outerVars.release();
+				break;
+			default:
+				break;
+		}
+	}
+
+	void CycleCollector::trackShared(CollectableStorage *storage, CollectableStorage::Kind kind) {
+		HeapLock lock(&CollectorHeap::shared, &CollectorHeap::shared);
+		link(&CollectorHeap::shared, storage, kind);
+	}
+
+	void CycleCollector::Untrack(CollectableStorage *storage) {
+		if (storage->gcKind == CollectableStorage::Kind::Untracked) return;
+		CollectorHeap *heap = CollectorHeap::Of(storage);
+		HeapLock lock(heap, &CollectorHeap::shared);
+		unlink(heap, storage);
+	}
+
+	// (While collecting, we only count and mark storage in the heap being
+	// collected; references to or from anything else count as outside ones.)
+	void CycleCollector::subtractRef(CollectableStorage *child) {
+		if (child->gcKind != CollectableStorage::Kind::Untracked and CollectorHeap::Of(child) == activeHeap) child->gcRefs--;
+	}
+
+	void CycleCollector::markReachable(CollectableStorage *child) {
+		if (child->gcKind == CollectableStorage::Kind::Untracked or child->gcReachable) return;
+		if (CollectorHeap::Of(child) != activeHeap) return;
+		child->gcReachable = true;
+		worklist->push_back(child);
+	}
+
+	long CycleCollector::Collect() {
+		CollectorHeap *heap = CollectorHeap::Current();
+		HeapLock lock(heap, &CollectorHeap::shared);
+		if (heap->collecting) return 0;
+		heap->collecting = true;
+		CollectorHeap *prevActive = activeHeap;
+		activeHeap = heap;
+
+		// Start each object's count at its actual reference count, then take
+		// away the references that come from other tracked objects.  What's
+		// left is the number of references from outside (variables, the host
+		// app, untracked objects, etc.).
+		for (CollectableStorage *s = heap->head; s; s = s->gcNext) {
+			s->gcRefs = s->refCount;
+			s->gcReachable = false;
+		}
+		for (CollectableStorage *s = heap->head; s; s = s->gcNext) {
+			visitChildren(s, subtractRef);
+		}
+
+		// Anything referenced from outside is reachable, and so is anything
+		// reachable from that.
+		std::vector<CollectableStorage*> work;
+		worklist = &work;
+		for (CollectableStorage *s = heap->head; s; s = s->gcNext) {
+			if (s->gcRefs > 0 and not s->gcReachable) {
+				s->gcReachable = true;
+				work.push_back(s);
+			}
+			while (not work.empty()) {
+				CollectableStorage *p = work.back();
+				work.pop_back();
+				visitChildren(p, markReachable);
+			}
+		}
+		worklist = nullptr;
+		activeHeap = prevActive;
+
+		// Everything else is garbage.  Hold onto it all while we clear out
+		// its contents (which breaks the cycles); then let it go.
+		std::vector<CollectableStorage*> garbage;
+		for (CollectableStorage *s = heap->head; s; s = s->gcNext) {
+			if (not s->gcReachable) garbage.push_back(s);
+		}
+		for (CollectableStorage *s : garbage) s->retain();
+		for (CollectableStorage *s : garbage) clearContents(s);
+		for (CollectableStorage *s : garbage) s->release();
+
+		long count = (long)garbage.size();
+		heap->totalReclaimed += count;
+		heap->survivors = heap->trackedCount;
+		heap->newSinceCollect = 0;
+		heap->collecting = false;
+		return count;
+	}
+
+	bool CycleCollector::collectionDue(CollectorHeap *heap) {
+		HeapLock lock(heap, &CollectorHeap::shared);
+		return heap->newSinceCollect >= autoThreshold and heap->newSinceCollect >= heap->survivors;
+	}
+
+	long CycleCollector::TrackedCount() {
+		CollectorHeap *heap = CollectorHeap::Current();
+		HeapLock lock(heap, &CollectorHeap::shared);
+		return heap->trackedCount;
+	}
+
+	long CycleCollector::TotalReclaimed() {
+		CollectorHeap *heap = CollectorHeap::Current();
+		HeapLock lock(heap, &CollectorHeap::shared);
+		return heap->totalReclaimed;
+	}
+
+	#pragma mark -
+
+	long DeferredRelease::itemCount(CollectableStorage *storage, CollectableStorage::Kind kind) {
+		if (kind == CollectableStorage::Kind::List) {
+			// (A view owns no items, so there's nothing to release bit by bit.)
+			ValueListStorage *ls = static_cast<ValueListStorage*>(storage);
+			return ls->viewOf ? 0 : (long)ls->size();
+		}
+		return static_cast<ValueDictStorage*>(storage)->mSize;
+	}
+
+	void DeferredRelease::releaseLast(CollectableStorage *storage, CollectableStorage::Kind kind) {
+		workDone++;
+		if (enabled and (depth >= DEFERRED_RELEASE_MAX_DEPTH or itemCount(storage, kind) >= DEFERRED_RELEASE_MIN_SIZE)) {
+			// Queue it up, in its own heap (the queue now holds the last
+			// reference).  Storage charged to no account goes in the current
+			// heap instead, so that it's drained by whoever let go of it.
+			CollectorHeap *heap = CollectorHeap::Of(storage);
+			if (heap == &CollectorHeap::shared) heap = CollectorHeap::Current();
+			HeapLock lock(heap, &CollectorHeap::shared);
+			if (!heap->pendingQueue) heap->pendingQueue = new std::vector<CollectorHeap::PendingRelease>();
+			heap->pendingQueue->push_back({storage, kind});
+			heap->pendingCount++;
+			return;
+		}
+		depth++;
+		storage->release();
+		depth--;
+	}
+
+	long DeferredRelease::Drain(long maxItems) {
+		CollectorHeap *heap = CollectorHeap::Current();
+		HeapLock lock(heap, &CollectorHeap::shared);
+		long startWork = workDone;
+		// Note that releasing an item may queue up more storage; we always
+		// work on the most recently queued, so nested data is freed depth-first.
+		while (heap->pendingCount > 0 and workDone - startWork < maxItems) {
+			CollectorHeap::PendingRelease p = heap->pendingQueue->back();
+			if (itemCount(p.storage, p.kind) == 0) {
+				heap->pendingQueue->pop_back();
+				heap->pendingCount--;
+				p.storage->release();	// (quick, now that it's empty)
+				continue;
+			}
+			workDone++;
+			if (p.kind == CollectableStorage::Kind::List) {
+				ValueListStorage *ls = static_cast<ValueListStorage*>(p.storage);
+				ls->detachViews();
+				ls->pop_back();
+			} else {
+				static_cast<ValueDictStorage*>(p.storage)->dropLast();
+			}
+		}
+		return heap->pendingCount;
+	}
+
+	long DeferredRelease::PendingCount() {
+		CollectorHeap *heap = CollectorHeap::Current();
+		HeapLock lock(heap, &CollectorHeap::shared);
+		return heap->pendingCount;
+	}
+
+	#pragma mark -
+
+	class TestCycleCollector : public UnitTest
+	{
+	public:
+		TestCycleCollector() : UnitTest("CycleCollector") {}
+		virtual void Run();
+	};
+
+	void TestCycleCollector::Run()
+	{
+		CycleCollector::Collect();
+		long baseline = CycleCollector::TrackedCount();
+
+		// A map that refers to itself, and a list/map pair that refer to each other.
+		{
+			ValueDict selfRef;
+			selfRef.SetValue(Value("self"), Value(selfRef));
+			ValueDict parent;
+			ValueList children;
+			parent.SetValue(Value("children"), Value(children));
+			children.Add(Value(parent));
+		}
+		// ...plus a pair that's still in use, and what it refers to.
+		ValueDict a, b;
+		a.SetValue(Value("other"), Value(b));
+		b.SetValue(Value("other"), Value(a));
+		ValueList data;
+		data.Add(Value(42));
+		b.SetValue(Value("data"), Value(data));
+
+		Assert(CycleCollector::TrackedCount() == baseline + 6);
+		long reclaimed = CycleCollector::Collect();
+		Assert(reclaimed == 3);
+		Assert(CycleCollector::TrackedCount() == baseline + 3);
+		Assert(a.Count() == 1 and b.Count() == 2 and data.Count() == 1);
+
+		// Once we let go of the live pair, it becomes garbage too.
+		a.RemoveAll();
+		a = ValueDict();
+		b = ValueDict();
+		data = ValueList();
+		Assert(CycleCollector::Collect() == 0);		// (no cycle left; freed normally)
+		Assert(CycleCollector::TrackedCount() == baseline);
+
+		// Big lists get freed a bit at a time.
+		Value hold;
+		{
+			ValueList big;
+			for (int i=0; i<DEFERRED_RELEASE_MIN_SIZE * 2; i++) {
+				ValueList inner;
+				inner.Add(Value(i));
+				big.Add(Value(inner));
+			}
+			hold = Value(big);
+		}
+		hold = Value::null;
+		Assert(DeferredRelease::PendingCount() == 1);
+		Assert(DeferredRelease::Drain(DEFERRED_RELEASE_MIN_SIZE) == 1);
+		Assert(CycleCollector::TrackedCount() > baseline);
+		DeferredRelease::DrainAll();
+		Assert(not DeferredRelease::Pending());
+		Assert(CycleCollector::TrackedCount() == baseline);
+
+		// And deeply nested maps don't recurse all the way down.
+		{
+			Value chain;
+			for (int i=0; i<10000; i++) {
+				ValueDict d;
+				d.SetValue(Value("next"), chain);
+				chain = Value(d);
+			}
+		}
+		Assert(DeferredRelease::Pending());
+		DeferredRelease::DrainAll();
+		Assert(CycleCollector::TrackedCount() == baseline);
+
+		// Big storage charged to no account, let go of while an account is
+		// current, is drained along with that account's own.
+		MemoryAccount *account = new MemoryAccount();
+		{
+			ValueList big;
+			for (int i=0; i<DEFERRED_RELEASE_MIN_SIZE; i++) big.Add(Value(i));
+			hold = Value(big);
+		}
+		{
+			MemoryAccount::Scope scope(account);
+			hold = Value::null;
+			Assert(DeferredRelease::Pending());
+			DeferredRelease::DrainAll();
+			Assert(not DeferredRelease::Pending());
+		}
+		Assert(not DeferredRelease::Pending() and CycleCollector::TrackedCount() == baseline);
+		account->Abandon();
+	}
+
+	RegisterUnitTest(TestCycleCollector);
+}
@@ -0,0 +1,271 @@
+//
+//  CycleCollector.h
+//  MiniScript
+//
+//  Reference counting alone can't reclaim cycles (a map that refers to
+//  itself, parent/child maps, a function whose outerVars contain that
+//  function, etc.).  The CycleCollector finds and frees such garbage by
+//  trial deletion: for every tracked list, map, and function, it subtracts
+//  the references that come from other tracked objects.  Whatever is left
+//  with no outside references, and can't be reached from anything that has
+//  them, is garbage; we break it up by clearing its contents.
+//
+//  Collection happens only when the host calls Collect(), or (if an auto
+//  threshold has been set) at the next safe point after enough new objects
+//  have been tracked.
+//
+//  Tracked storage is kept in a separate CollectorHeap for each MemoryAccount
+//  (i.e., for each Interpreter), so interpreters on different threads never
+//  touch each other's bookkeeping; Collect and Drain work on the heap of the
+//  account that's current.  Storage charged to no account goes in a shared
+//  heap, which is guarded by a lock.
+//
+//  Also here is DeferredRelease, which keeps the freeing of big (or deeply
+//  nested) lists and maps from happening all at once.
+//
+
+#ifndef CYCLECOLLECTOR_H
+#define CYCLECOLLECTOR_H
+
+#include "RefCountedStorage.h"
+#include <atomic>
+#include <vector>
+
+namespace MiniScript {
+
+	class CycleCollector;
+	class CollectableStorage;
+
+	// The collector's bookkeeping for one group of storage: everything charged
+	// to one MemoryAccount, or (the shared heap) everything charged to none.
+	class CollectorHeap {
+	public:
+		// The heap the given storage belongs to.
+		static inline CollectorHeap* Of(const RefCountedStorage *storage);
+
+		// The heap for storage created on this thread right now.
+		static inline CollectorHeap* Current();
+
+	private:
+		constexpr CollectorHeap() : head(nullptr), trackedCount(0), newSinceCollect(0), survivors(0),
+			totalReclaimed(0), pendingCount(0), pendingQueue(nullptr), collecting(false) {}
+
+		// Free an (empty) account heap.  (We have no destructor, so that the
+		// shared heap is never destroyed.)
+		static void Delete(CollectorHeap *heap);
+
+		struct PendingRelease;
+
+		CollectableStorage *head;		// tracked storage, as a doubly-linked list
+		long trackedCount;
+		long newSinceCollect;
+		long survivors;
+		long totalReclaimed;
+		long pendingCount;
+		std::vector<PendingRelease> *pendingQueue;	// (allocated on first use)
+		bool collecting;
+
+		// The shared heap is constant-initialized, and never destroyed, so
+		// that it's usable by static values constructed or destroyed in any order.
+		static CollectorHeap shared;
+
+		friend class MemoryAccount;
+		friend class CycleCollector;
+		friend class DeferredRelease;
+	};
+
+	// Base class for storage that can take part in reference cycles.
+	class CollectableStorage : public RefCountedStorage {
+	public:
+		enum class Kind : unsigned char {
+			Untracked = 0,
+			List,			// a ValueListStorage
+			Map,			// a ValueDictStorage
+			Function		// a FunctionStorage
+		};
+
+		// Stop tracking this storage (which depends on its memory account),
+		// then make it immortal.
+		inline void MakeImmortal();
+
+		// Whether this has been frozen (see Value::Freeze).
+		bool IsFrozen() const { return frozen; }
+
+	protected:
+		CollectableStorage() : gcPrev(nullptr), gcNext(nullptr), gcRefs(0), gcKind(Kind::Untracked), gcReachable(false),
+		  frozen(false), hashCached(false), cachedHash(0) {}
+		virtual ~CollectableStorage();
+
+	private:
+		CollectableStorage *gcPrev;
+		CollectableStorage *gcNext;
+		long gcRefs;			// (scratch, used during collection)
+		Kind gcKind;
+		bool gcReachable;		// (scratch, used during collection)
+
+		// A frozen list or map (see Value::Freeze) never changes, so it keeps
+		// its hash once it's been computed.  (Threads that both compute it
+		// just store the same thing.)
+		bool frozen;
+		std::atomic<bool> hashCached;
+		std::atomic<unsigned int> cachedHash;
+
+		friend class CycleCollector;
+		friend class DeferredRelease;
+		friend class Value;
+	};
+
+	struct CollectorHeap::PendingRelease {
+		CollectableStorage *storage;
+		CollectableStorage::Kind kind;
+	};
+
+	class CycleCollector {
+	public:
+		// Start tracking the given storage (which must really be of the given
+		// kind).  Does nothing if it's already tracked, or immortal.
+		static inline void Track(CollectableStorage *storage, CollectableStorage::Kind kind);
+
+		// Start tracking the storage of the given ValueDict (if any).
+		template <class DICT> static void TrackMap(const DICT& dict) {
+			if (dict.ds) Track(dict.ds, CollectableStorage::Kind::Map);
+		}
+
+		// Stop tracking the given storage (if it was tracked).
+		static void Untrack(CollectableStorage *storage);
+
+		// Find and free all unreachable cycles in the current heap now.
+		// Returns the number of objects reclaimed.  Must only be called when
+		// no MiniScript code using that heap is in the middle of executing
+		// (e.g., between calls to RunUntilDone).
+		static long Collect();
+
+		// Set the number of newly tracked objects after which we automatically
+		// collect (at the next safe point); 0 (the default) disables this.
+		// To keep the cost linear, we also wait until the number of new objects
+		// is at least the number that survived the last collection.
+		// (This applies to all heaps; set it before starting any threads.)
+		static void SetAutoThreshold(long objectCount) { autoThreshold = objectCount; }
+		static long AutoThreshold() { return autoThreshold; }
+
+		// Whether an automatic collection of the current heap is due.
+		static bool CollectionDue() { return autoThreshold > 0 and collectionDue(CollectorHeap::Current()); }
+
+		// Statistics (for the current heap).
+		static long TrackedCount();
+		static long TotalReclaimed();
+
+	private:
+		static bool collectionDue(CollectorHeap *heap);
+		static void trackShared(CollectableStorage *storage, CollectableStorage::Kind kind);
+		static inline void link(CollectorHeap *heap, CollectableStorage *storage, CollectableStorage::Kind kind);
+		static inline void unlink(CollectorHeap *heap, CollectableStorage *storage);
+		static void visitChildren(CollectableStorage *storage, void (*visit)(CollectableStorage *child));
+		static void clearContents(CollectableStorage *storage);
+		static void subtractRef(CollectableStorage *child);
+		static void markReachable(CollectableStorage *child);
+
+		static long autoThreshold;
+
+		friend class CollectableStorage;
+		friend class DeferredRelease;
+	};
+
+	// When the last reference to a big list or map goes away, freeing it
+	// (and everything only it refers to) all at once could take a long time,
+	// or even overflow the stack for deeply nested data.  So instead, such
+	// storage is put on a queue, and its contents released a bit at a time
+	// by Drain, which the VM calls between steps (and the host may call
+	// whenever it likes).  Storage charged to an account is queued in that
+	// account's heap; storage charged to none, in the heap that's current
+	// when it's let go of.
+	#define DEFERRED_RELEASE_MIN_SIZE 1024	// defer lists/maps with at least this many items
+	#define DEFERRED_RELEASE_MAX_DEPTH 64	// ...or nested at least this deep in a release
+	#define DEFERRED_RELEASE_STEP_ITEMS 64	// items released per VM step while any are pending
+
+	class DeferredRelease {
+	public:
+		// Release a reference to the given list or map storage.
+		static inline void Release(CollectableStorage *storage, CollectableStorage::Kind kind);
+
+		// Release up to (about) the given number of items from queued storage.
+		// Returns the number of storage objects still pending.
+		static long Drain(long maxItems);
+
+		// Release everything queued, however long that takes.
+		static void DrainAll() { while (Drain(DEFERRED_RELEASE_MIN_SIZE)) {} }
+
+		// Whether any storage in the current heap is waiting to be released.
+		static inline bool Pending();
+		static long PendingCount();
+
+		// Set whether big storage is queued (true, the default) or freed
+		// immediately.  (This applies to all heaps.)
+		static void SetEnabled(bool enable) { enabled = enable; }
+
+	private:
+		static void releaseLast(CollectableStorage *storage, CollectableStorage::Kind kind);
+		static long itemCount(CollectableStorage *storage, CollectableStorage::Kind kind);
+
+		static thread_local int depth;
+		static thread_local long workDone;
+		static bool enabled;
+	};
+
+	CollectorHeap* CollectorHeap::Of(const RefCountedStorage *storage) {
+		MemoryAccount *account = storage->Account();
+		return account ? account->gcHeap : &shared;
+	}
+
+	CollectorHeap* CollectorHeap::Current() {
+		MemoryAccount *account = MemoryAccount::current;
+		return account ? account->gcHeap : &shared;
+	}
+
+	void DeferredRelease::Release(CollectableStorage *storage, CollectableStorage::Kind kind) {
+		if (storage->refCount > 1) storage->refCount--;
+		else if (storage->refCount == 1) releaseLast(storage, kind);
+	}
+
+	bool DeferredRelease::Pending() {
+		MemoryAccount *account = MemoryAccount::current;
+		return account ? account->gcHeap->pendingCount > 0 : PendingCount() > 0;
+	}
+
+	void CycleCollector::link(CollectorHeap *heap, CollectableStorage *storage, CollectableStorage::Kind kind) {
+		storage->gcKind = kind;
+		storage->gcPrev = nullptr;
+		storage->gcNext = heap->head;
+		if (heap->head) heap->head->gcPrev = storage;
+		heap->head = storage;
+		heap->trackedCount++;
+		heap->newSinceCollect++;
+	}
+
+	void CycleCollector::unlink(CollectorHeap *heap, CollectableStorage *storage) {
+		if (storage->gcPrev) storage->gcPrev->gcNext = storage->gcNext;
+		else heap->head = storage->gcNext;
+		if (storage->gcNext) storage->gcNext->gcPrev = storage->gcPrev;
+		storage->gcKind = CollectableStorage::Kind::Untracked;
+		heap->trackedCount--;
+	}
+
+	void CycleCollector::Track(CollectableStorage *storage, CollectableStorage::Kind kind) {
+		if (storage->gcKind != CollectableStorage::Kind::Untracked or storage->IsImmortal()) return;
+		MemoryAccount *account = storage->Account();
+		if (account) link(account->gcHeap, storage, kind);
+		else trackShared(storage, kind);
+	}
+
+	inline CollectableStorage::~CollectableStorage() {
+		if (gcKind != Kind::Untracked) CycleCollector::Untrack(this);
+	}
+
+	inline void CollectableStorage::MakeImmortal() {
+		if (gcKind != Kind::Untracked) CycleCollector::Untrack(this);
+		RefCountedStorage::MakeImmortal();
+	}
+
+}
+
+#endif /* CYCLECOLLECTOR_H */
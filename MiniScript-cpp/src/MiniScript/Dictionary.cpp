@@ -66,6 +66,119 @@ namespace MiniScript {
 			Assert(d2.Lookup(i, -1) == i*i);
 		}
 
+		// Remove every other key, and make sure the rest are still findable
+		// (this exercises backward-shift deletion in the probe chains).
+		for (int i=0; i<1000; i+=2) {
+			int removed = -1;
+			Assert(d2.Remove(i, &removed));
+			Assert(removed == i*i);
+		}
+		Assert(d2.Count() == 500);
+		for (int i=0; i<1000; i++) {
+			Assert(d2.ContainsKey(i) == (i % 2 == 1));
+		}
+		Assert(not d2.Remove(0));
+		long iterCount = 0;
+		for (DictIterator<int, int> kv = d2.GetIterator(); not kv.Done(); kv.Next()) {
+			Assert(kv.Key() % 2 == 1 and kv.Value() == kv.Key() * kv.Key());
+			iterCount++;
+		}
+		Assert(iterCount == 500);
+		Assert(d2.Keys().Count() == 500);
+		Assert(d2.Values().Count() == 500);
+		Assert(d2.Capacity() * DICT_MAX_LOAD_NUM >= d2.Count() * DICT_MAX_LOAD_DEN);
+
+		// An empty dictionary shouldn't allocate any table at all.
+		Dictionary<int, int, hashInt> d3;
+		d3.SetValue(1, 1);
+		d3.RemoveAll();
+		Assert(d3.Capacity() == 0);
+		Assert(d3.GetIterator().Done());
+
+		// Small dictionaries keep their entries packed (with no table), in order,
+		// until they outgrow DICT_SMALL_CAPACITY.
+		for (int i=0; i<DICT_SMALL_CAPACITY; i++) d3.SetValue(i, i*10);
+		Assert(d3.Capacity() == 0);
+		d3.SetValue(3, 33);
+		Assert(d3.Count() == DICT_SMALL_CAPACITY and d3.Lookup(3, 0) == 33);
+		Assert(d3.Remove(2));
+		int expected = 0;
+		for (DictIterator<int, int> kv = d3.GetIterator(); not kv.Done(); kv.Next()) {
+			if (expected == 2) expected++;
+			Assert(kv.Key() == expected);
+			expected++;
+		}
+		Assert(expected == DICT_SMALL_CAPACITY);
+		d3.SetValue(2, 20);
+		d3.SetValue(100, 1000);
+		Assert(d3.Capacity() > 0);
+		Assert(d3.Count() == DICT_SMALL_CAPACITY + 1);
+		for (int i=0; i<DICT_SMALL_CAPACITY; i++) Assert(d3.Lookup(i, -1) == (i == 3 ? 33 : i*10));
+		Assert(d3.Lookup(100, -1) == 1000);
+
+		// Entries stay in insertion order, and are addressable by position,
+		// even after removals leave holes in (and get compacted out of) the table.
+		Dictionary<int, int, hashInt> d4;
+		for (int i=0; i<100; i++) d4.SetValue(i, i);
+		for (int i=0; i<100; i+=3) d4.Remove(i);
+		d4.SetValue(0, 0);
+		int key = -1, value = -1;
+		Assert(d4.GetEntryAt(0, &key, &value) and key == 1 and value == 1);
+		Assert(d4.GetEntryAt(d4.Count()-1, &key, nullptr) and key == 0);
+		Assert(not d4.GetEntryAt(d4.Count(), &key, &value));
+		long pos = 0;
+		for (DictIterator<int, int> kv = d4.GetIterator(); not kv.Done(); kv.Next()) {
+			Assert(d4.GetEntryAt(pos++, &key, nullptr) and key == kv.Key());
+		}
+		Assert(pos == d4.Count());
+		// Repeatedly removing the first entry (as pull does) keeps working.
+		while (d4.Count() > 1) {
+			int first;
+			d4.GetEntryAt(0, &first, nullptr);
+			Assert(first % 3 != 0);
+			d4.Remove(first);
+		}
+		Assert(d4.GetEntryAt(0, &key, nullptr) and key == 0);
+		for (int i=0; i<100; i++) d4.SetValue(i, -i);
+		Assert(d4.Count() == 100 and d4.Lookup(99, 0) == -99);
+
+		// Reading by position steps over holes (from either end, or from the
+		// last position read), both before and after enough removals to get
+		// them compacted away.
+		Dictionary<int, int, hashInt> d5;
+		for (int i=0; i<40; i++) d5.SetValue(i, i);
+		d5.Remove(10);
+		d5.Remove(30);
+		for (long i=0; i<38; i++) {
+			Assert(d5.GetEntryAt(i, &key, nullptr) and key == i + (i >= 10) + (i >= 29));
+		}
+		for (int i=11; i<15; i++) d5.Remove(i);
+		Assert(d5.Count() == 34);
+		for (long i=0; i<34; i++) {
+			Assert(d5.GetEntryAt(i, &key, nullptr) and key == i + (i >= 10 ? 5 : 0) + (i >= 25));
+		}
+
+		// That holds in any order, and with removals in between.
+		Dictionary<int, int, hashInt> d6;
+		for (int i=0; i<200; i++) d6.SetValue(i, i);
+		for (int i=50; i<60; i++) d6.Remove(i * 2);
+		for (long step=0; step<3; step++) {
+			List<int> keys = d6.Keys();
+			for (long j=0; j<keys.Count(); j++) {
+				long i = (step == 0 ? keys.Count() - 1 - j : (j * 37) % keys.Count());
+				Assert(d6.GetEntryAt(i, &key, nullptr) and key == keys[i]);
+			}
+		}
+		for (long i=0; i < d6.Count(); i++) {
+			Assert(d6.GetEntryAt(i, &key, nullptr));
+			if (key % 7 == 3) {
+				d6.Remove(key);
+				d6.Remove(key - 1);
+				i -= 2;
+			}
+			if (i + 1 < d6.Count()) Assert(d6.GetEntryAt(i + 1, &key, nullptr) and key == d6.Keys()[i + 1]);
+		}
+		Assert(d6.Count() == 190 - 28 - 26 and not d6.ContainsKey(199) and d6.ContainsKey(197));
 	}
 
 	RegisterUnitTest(TestDictionary);
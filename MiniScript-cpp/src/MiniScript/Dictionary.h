@@ -9,13 +9,36 @@
 #define HASHMAP_H
 
 #include "List.h"
+#include <algorithm>	// for std::swap
 
 namespace MiniScript {
 
-	// This is the number of hash cells in the table
-	// this will work best as a prime number
-	// samples: 101, 521, 1009
-	#define TABLE_SIZE 251
+	// Dictionaries keep their entries in a dense array, in insertion order,
+	// plus a separate sparse index: a power-of-two table of entry numbers,
+	// using open addressing with Robin Hood probing.  Iteration is a linear
+	// scan of the entries, and the i-th entry can be had in O(1).
+	//
+	// The entry array holds DICT_MAX_LOAD_NUM/DICT_MAX_LOAD_DEN as many entries
+	// as the index has slots; when it fills up, we either compact it (if
+	// enough entries have been removed) or grow both (doubling the index).
+	// Removed entries are left as holes, until there are enough of them that
+	// Remove compacts the array; mHead tracks the first live entry, so
+	// repeatedly removing the first entry stays cheap.  While there are holes,
+	// finding the i-th entry starts from where the last such search ended, so
+	// stepping through the entries in order is still O(1) per entry.  Reading
+	// a map without holes never changes the storage (and a map is compacted
+	// before it's shared, so a frozen map can be read from several threads).
+	//
+	// Small dictionaries (most maps are objects with just a handful of keys)
+	// skip the index entirely: up to DICT_SMALL_CAPACITY entries are kept
+	// packed, and found by a linear scan on the cached hash.  That entry
+	// array is allocated on first insert, at half size, and doubled once
+	// before we build an index; so an empty dictionary's storage holds no
+	// entries at all, just the bookkeeping below.
+	#define DICT_SMALL_CAPACITY 8
+	#define DICT_MIN_CAPACITY 16
+	#define DICT_MAX_LOAD_NUM 7
+	#define DICT_MAX_LOAD_DEN 8
 
 	template <class K, class V, unsigned int HASH(const K&)> class Dictionary;
 	
@@ -23,40 +46,279 @@ namespace MiniScript {
 	class HashMapEntry
 	{
 	public:
-		HashMapEntry() : next(nullptr) {}
-		~HashMapEntry() { if (next) delete next; }
+		HashMapEntry() : hash(0), live(false) {}
 		
-		HashMapEntry *Clone() {
-			HashMapEntry *result = new HashMapEntry();
-			result->key = key;
-			result->value = value;
-			if (next) result->next = next->Clone();
-			return result;
-		}
-		
-		HashMapEntry<K, V> *next;
 		K key;
 		V value;
+		unsigned int hash;		// full (cached) hash of key
+		bool live;				// false for unused or removed entries
+	};
+
+	struct DictIndexSlot {
+		unsigned int hash;		// hash of the entry (so we needn't touch it while probing)
+		long entry;				// index into the entry array, or -1 if this slot is empty
 	};
 
 	template <class K, class V>
-	class DictionaryStorage : public RefCountedStorage {
+	class DictionaryStorage : public CollectableStorage {
 	private:
-		DictionaryStorage() : RefCountedStorage(), mSize(0), assignOverride(nullptr), evalOverride(nullptr) { for (int i=0; i<TABLE_SIZE; i++) mTable[i] = nullptr; }
+		DictionaryStorage() : CollectableStorage(), mSize(0), mUsed(0), mHead(0),
+			mCursorEntry(0), mCursorPos(0), mEntryCapacity(0), mEntries(nullptr),
+			mCapacity(0), mShift(32), mIndex(nullptr),
+			assignOverride(nullptr), evalOverride(nullptr) { updateAccount(); }
 		~DictionaryStorage() { RemoveAll(); }
 
+		// Update our memory accounting (including the entry array and index,
+		// when we have them).
+		void updateAccount() {
+			long byteCount = (long)sizeof(DictionaryStorage);
+			byteCount += mEntryCapacity * sizeof(HashMapEntry<K, V>) + mCapacity * sizeof(DictIndexSlot);
+			accountFor(MemoryKind::Map, byteCount);
+		}
+
 		void RemoveAll() {
-			for (int i = 0; i < TABLE_SIZE; i++) {
-				if (mTable[i]) {
-					delete mTable[i];
-					mTable[i] = nullptr;
+			if (mEntries) {
+				delete[] mEntries;
+				delete[] mIndex;
+				mEntries = nullptr;
+				mEntryCapacity = 0;
+				mIndex = nullptr;
+				mCapacity = 0;
+				mShift = 32;
+				updateAccount();
+			}
+			mSize = mUsed = mHead = mCursorEntry = mCursorPos = 0;
+		}
+
+		// Map a full hash to its home slot in the index.  We use Fibonacci
+		// hashing here, so that weak hash functions (e.g. ones that vary only
+		// in the high bits) still spread out over the table.
+		unsigned long homeSlot(unsigned int hash) const {
+			return (unsigned int)(hash * 2654435769u) >> mShift;
+		}
+
+		// How far the given index slot is from its home slot.
+		unsigned long probeDistance(unsigned long slot) const {
+			return (slot - homeSlot(mIndex[slot].hash)) & (mCapacity - 1);
+		}
+
+		// Find the index slot referring to the given key, or -1 if not found.
+		// (Only valid when we have an index, i.e. are not in small mode.)
+		long findSlot(const K& key, unsigned int hash) const {
+			unsigned long mask = mCapacity - 1;
+			unsigned long i = homeSlot(hash);
+			for (unsigned long dist = 0; ; dist++) {
+				const DictIndexSlot& slot = mIndex[i];
+				if (slot.entry < 0) return -1;
+				// Robin Hood invariant: once we find a slot closer to its home
+				// than we are to ours, our key can't be here.
+				if (probeDistance(i) < dist) return -1;
+				// Note: We rely here on our key types defining == in a way
+				// that is intended to equate keys that should be unique in
+				// the dictionary (and consistent with the hash function).
+				if (slot.hash == hash and mEntries[slot.entry].key == key) return (long)i;
+				i = (i + 1) & mask;
+			}
+		}
+
+		// Find the entry index of the given key, or -1 if not found.
+		long findIndex(const K& key, unsigned int hash) const {
+			if (!mIndex) {
+				for (long i=0; i<mUsed; i++) {
+					if (mEntries[i].hash == hash and mEntries[i].key == key) return i;
 				}
+				return -1;
 			}
-			mSize = 0;
+			long slot = findSlot(key, hash);
+			return slot < 0 ? -1 : mIndex[slot].entry;
 		}
 		
-		long mSize;
-		HashMapEntry<K, V> *mTable[TABLE_SIZE];
+		// Add a key we know is not already in the dictionary.
+		void insertNew(const K& key, const V& value, unsigned int hash) {
+			if (mUsed == mEntryCapacity) {
+				// Out of room.  Compact in place if at least a quarter of the
+				// entries are holes; otherwise grow (which compacts too).
+				// (In small mode, grow the entry array until it's full size.)
+				if (mIndex and (mUsed - mSize) * 4 >= mUsed) resizeTable(mCapacity);
+				else if (mIndex) resizeTable(mCapacity * 2);
+				else if (mEntryCapacity < DICT_SMALL_CAPACITY) growSmall();
+				else resizeTable(DICT_MIN_CAPACITY);
+			}
+			HashMapEntry<K, V>& entry = mEntries[mUsed];
+			entry.key = key;
+			entry.value = value;
+			entry.hash = hash;
+			entry.live = true;
+			if (mIndex) place(hash, mUsed);
+			mUsed++;
+			mSize++;
+		}
+
+		// Allocate (or double) the small-mode entry array.
+		void growSmall() {
+			long newEntryCapacity = mEntryCapacity ? mEntryCapacity * 2 : DICT_SMALL_CAPACITY / 2;
+			HashMapEntry<K, V> *newEntries = new HashMapEntry<K, V>[newEntryCapacity];
+			for (long i=0; i<mUsed; i++) swapEntries(newEntries[i], mEntries[i]);
+			delete[] mEntries;
+			mEntries = newEntries;
+			mEntryCapacity = newEntryCapacity;
+			updateAccount();
+		}
+
+		// Robin Hood placement of an entry number into the index.
+		void place(unsigned int hash, long entry) {
+			unsigned long mask = mCapacity - 1;
+			unsigned long i = homeSlot(hash);
+			DictIndexSlot carry = { hash, entry };
+			for (unsigned long dist = 0; ; dist++) {
+				DictIndexSlot& slot = mIndex[i];
+				if (slot.entry < 0) {
+					slot = carry;
+					return;
+				}
+				unsigned long slotDist = probeDistance(i);
+				if (slotDist < dist) {
+					// Take from the rich: this slot's entry is closer to home than
+					// ours, so it gives up its place and we carry it on instead.
+					std::swap(slot, carry);
+					dist = slotDist;
+				}
+				i = (i + 1) & mask;
+			}
+		}
+
+		// Remove the entry with the given entry index.
+		void removeAt(long index) {
+			if (!mIndex) {
+				// Small mode: close the gap, keeping the rest in order.
+				for (long i=index; i+1<mUsed; i++) swapEntries(mEntries[i], mEntries[i+1]);
+				clearEntry(mEntries[mUsed-1]);
+				mUsed--;
+				mSize--;
+				return;
+			}
+
+			// Find and remove the index slot, using backward-shift deletion
+			// (so the index never needs tombstones).
+			unsigned long mask = mCapacity - 1;
+			unsigned long i = homeSlot(mEntries[index].hash);
+			while (mIndex[i].entry != index) i = (i + 1) & mask;
+			while (true) {
+				unsigned long j = (i + 1) & mask;
+				if (mIndex[j].entry < 0 or probeDistance(j) == 0) break;
+				mIndex[i] = mIndex[j];
+				i = j;
+			}
+			mIndex[i].entry = -1;
+
+			// Then leave a hole in the entry array.
+			clearEntry(mEntries[index]);
+			mSize--;
+			if (index < mCursorEntry) mCursorPos--;
+			if (mSize == 0) {
+				mUsed = mHead = mCursorEntry = mCursorPos = 0;
+			} else if (index + 1 == mUsed) {
+				while (not mEntries[mUsed-1].live) mUsed--;
+			} else if (index == mHead) {
+				while (not mEntries[mHead].live) mHead++;
+			}
+
+			// Compact once there are enough holes among the live entries (so
+			// that they don't take up too much room, or time to step over).
+			if ((mUsed - mHead - mSize) * 8 >= mUsed) resizeTable(mCapacity);
+		}
+
+		// Get the entry index of the n-th live entry (0 <= n < mSize).  If
+		// there are holes, step over them, starting from the end or from the
+		// entry found last time, whichever is nearest; and remember where we
+		// end up, so that the next entry in order is found in O(1).
+		long entryIndexFor(long n) const {
+			if (mUsed - mHead == mSize) return mHead + n;
+			long i = mCursorEntry, pos = mCursorPos;
+			long distance = n > pos ? n - pos : pos - n;
+			if (n < distance) { i = mHead; pos = 0; distance = n; }
+			if (mSize - n < distance) { i = mUsed; pos = mSize; }
+			if (n >= pos) {
+				while (not mEntries[i].live or pos++ != n) i++;
+			} else {
+				do { i--; } while (not mEntries[i].live or --pos != n);
+			}
+			mCursorEntry = i;
+			mCursorPos = n;
+			return i;
+		}
+
+		// Squeeze out any holes left by Remove.  (Done before a map is shared
+		// between threads, since after that it must never change.)
+		void compact() {
+			if (mIndex and mUsed != mSize) resizeTable(mCapacity);
+		}
+
+		// Allocate a new index of the given capacity (and an entry array to
+		// match), moving the live entries over in order, without holes.
+		// Called with the current capacity, this just compacts the entries.
+		void resizeTable(unsigned long newCapacity) {
+			HashMapEntry<K, V> *oldEntries = mEntries;
+			long newEntryCapacity = (long)(newCapacity * DICT_MAX_LOAD_NUM / DICT_MAX_LOAD_DEN);
+			if (newCapacity != mCapacity) {
+				mEntries = new HashMapEntry<K, V>[newEntryCapacity];
+				delete[] mIndex;
+				mIndex = new DictIndexSlot[newCapacity];
+				mCapacity = newCapacity;
+				mEntryCapacity = newEntryCapacity;
+				mShift = 32;
+				while (newCapacity > 1) { mShift--; newCapacity >>= 1; }
+			}
+			for (unsigned long i = 0; i < mCapacity; i++) mIndex[i].entry = -1;
+			long count = 0;
+			for (long i = mHead; i < mUsed; i++) {
+				if (not oldEntries[i].live) continue;
+				if (oldEntries != mEntries or i != count) {
+					swapEntries(mEntries[count], oldEntries[i]);
+					clearEntry(oldEntries[i]);
+				}
+				place(mEntries[count].hash, count);
+				count++;
+			}
+			if (oldEntries != mEntries) delete[] oldEntries;
+			mUsed = mSize = count;
+			mHead = mCursorEntry = mCursorPos = 0;
+			if (oldEntries != mEntries) updateAccount();
+		}
+
+		// Release the last live entry.  This is only for storage that's being
+		// destroyed: it leaves the index stale.
+		void dropLast() {
+			while (mUsed > mHead and not mEntries[mUsed-1].live) mUsed--;
+			if (mUsed == mHead) return;
+			mUsed--;
+			mSize--;
+			clearEntry(mEntries[mUsed]);
+		}
+
+		static void clearEntry(HashMapEntry<K, V>& entry) {
+			entry.key = K();
+			entry.value = V();
+			entry.live = false;
+		}
+
+		static void swapEntries(HashMapEntry<K, V>& a, HashMapEntry<K, V>& b) {
+			std::swap(a.key, b.key);
+			std::swap(a.value, b.value);
+			std::swap(a.hash, b.hash);
+			std::swap(a.live, b.live);
+		}
+
+		long mSize;						// number of live entries
+		long mUsed;						// entries 0..mUsed-1 are in use (live or removed)
+		long mHead;						// no live entries before this one
+		mutable long mCursorEntry;		// (where entryIndexFor last ended up:
+		mutable long mCursorPos;		// there are mCursorPos live entries before mCursorEntry)
+		long mEntryCapacity;			// number of entries mEntries can hold
+		HashMapEntry<K, V> *mEntries;	// null until the first insert
+		unsigned long mCapacity;		// number of slots in mIndex (0, or a power of 2)
+		int mShift;						// 32 - log2(mCapacity), for homeSlot
+		DictIndexSlot *mIndex;			// null while we're in small mode
 
 		void *assignOverride;
 		void *evalOverride;
@@ -64,18 +326,20 @@ namespace MiniScript {
 		template <class K2, class V2, unsigned int HASH(const K2&)> friend class Dictionary;
 		template <class K2, class V2> friend class DictIterator;
 		friend class Value;
+		friend class CycleCollector;
+		friend class DeferredRelease;
 	};
 	
 	template <class K, class V>
 	class DictIterator {
 	public:
-		bool Done() const { return entry == nullptr; }
-		K Key() const { return entry->key;}
-		V Value() const { return entry->value; }
+		bool Done() const { return storage == nullptr or index >= storage->mUsed; }
+		K Key() const { return storage->mEntries[index].key;}
+		V Value() const { return storage->mEntries[index].value; }
 		void Next();
 		
 		bool operator==(const DictIterator<K, V>& other) {
-			return storage == other.storage and binIndex == other.binIndex and entry == other.entry;
+			return storage == other.storage and index == other.index;
 		}
 		
 		bool operator!=(const DictIterator<K, V>& other) {
@@ -85,8 +349,7 @@ namespace MiniScript {
 	private:
 		DictIterator(DictionaryStorage<K, V> *storage);
 		DictionaryStorage<K, V> *storage;
-		int binIndex;
-		HashMapEntry<K, V> *entry;
+		long index;
 
 		template <class K2, class V2, unsigned int HASH(const K2&)> friend class Dictionary;
 	};
@@ -109,7 +372,7 @@ namespace MiniScript {
 		/// OPERATORS
 		
 		// Assignment Operator
-		Dictionary& operator=(const Dictionary &other) { ((Dictionary&)other).ensureStorage(); other.ds->refCount++; release(); ds = other.ds; isTemp = false; return *this; }
+		Dictionary& operator=(const Dictionary &other) { ((Dictionary&)other).ensureStorage(); other.ds->retain(); release(); ds = other.ds; isTemp = false; return *this; }
 		
 		/// OPERATIONS
 		inline void SetValue(const K& key, const V& value);
@@ -129,7 +392,9 @@ namespace MiniScript {
 		inline bool empty() const { return Count() == 0; }
 		
 		/// ITERATION
+		// (Iteration is in insertion order.)
 		DictIterator<K,V> GetIterator() const { return DictIterator<K,V>(ds); }
+		inline bool GetEntryAt(long index, K *outKey, V *outValue) const;
 		
 		/// ASSIGNMENT OVERRIDE
 		typedef bool (*AssignOverrideCallback)(Dictionary<K,V,HASH> &dict, K key, V value);
@@ -150,15 +415,17 @@ namespace MiniScript {
 		}
 		
 		/// DEBUGGING
-		inline int BinEntries(int binNum) const;
+		inline long Capacity() const { return ds ? (long)ds->mCapacity : 0; }	// index size (0 in small mode)
+		inline int MaxProbeLength() const;
 		
 	protected:
 		Dictionary(DictionaryStorage<K, V>* storage, bool temp=true) : ds(storage), isTemp(temp) { retain(); }
 
 	private:
 		friend class Value;
+		friend class CycleCollector;
 		
-		inline int hashKey(const K& key) const;
+		inline unsigned int hashKey(const K& key) const;
 
 		
 		void forget() { ds = nullptr; }
@@ -177,50 +444,26 @@ namespace MiniScript {
 
 	template <class K, class V, unsigned int HASH(const K&)>
 	void Dictionary<K, V, HASH>::SetValue(const K& key, const V& value) {
-		int hash = hashKey(key);
+		unsigned int hash = hashKey(key);
 		ensureStorage();
-		HashMapEntry<K, V> *entry = ds->mTable[hash];
-		while (entry) {
-			// Note: We rely here on our key types defining == in a way
-			// that is intended to equate keys that should be unique in
-			// the dictionary (and consistent with the hash function).
-			if (entry->key == key) {
-				entry->value = value;
-				return;
-			}
-			entry = entry->next;
+		long i = ds->findIndex(key, hash);
+		if (i >= 0) {
+			ds->mEntries[i].value = value;
+			return;
 		}
 		
 		// A KeyValuePair does not exist yet so make a new one
-		entry = new HashMapEntry<K, V>();
-		entry->key = key;
-		entry->value = value;
-		entry->next = ds->mTable[hash];
-		ds->mTable[hash] = entry;
-
-		ds->mSize++;
+		ds->insertNew(key, value, hash);
 	}
 	
 	template <class K, class V, unsigned int HASH(const K&)>
 	bool Dictionary<K, V, HASH>::Remove(const K& key, V *output) {
 		if (!ds) return false;
-		int hash = hashKey(key);
-		HashMapEntry<K, V> *entry = ds->mTable[hash];
-		HashMapEntry<K, V> *prev = nullptr;
-		while (entry) {
-			if (entry->key == key) {
-				if (prev) prev->next = entry->next;
-				else ds->mTable[hash] = entry->next;
-				entry->next = nullptr;
-				delete entry;
-				ds->mSize--;
-				return true;
-			}
-			prev = entry;
-			entry = entry->next;
-		}
-
-		return false;
+		long i = ds->findIndex(key, hashKey(key));
+		if (i < 0) return false;
+		if (output) *output = ds->mEntries[i].value;
+		ds->removeAt(i);
+		return true;
 	}
 
 	template <class K, class V, unsigned int HASH(const K&)>
@@ -231,41 +474,25 @@ namespace MiniScript {
 	template <class K, class V, unsigned int HASH(const K&)>
 	V Dictionary<K, V, HASH>::Lookup(const K& key, const V& defaultValue) const {
 		if (!ds) return defaultValue;
-		int hash = hashKey(key);
-		HashMapEntry<K, V> *entry = ds->mTable[hash];
-		while (entry) {
-			if (entry->key == key) return entry->value;
-			entry = entry->next;
-		}
-		
-		return defaultValue;
+		long i = ds->findIndex(key, hashKey(key));
+		if (i < 0) return defaultValue;
+		return ds->mEntries[i].value;
 	}
 
 	template <class K, class V, unsigned int HASH(const K&)>
 	bool Dictionary<K, V, HASH>::Get(const K& key, V *outValue) const {
 		if (!ds) return false;
-		int hash = hashKey(key);
-		HashMapEntry<K, V> *entry = ds->mTable[hash];
-		while (entry) {
-			if (entry->key == key) {
-				*outValue = entry->value;
-				return true;
-			}
-			entry = entry->next;
-		}
-		
-		return false;
+		long i = ds->findIndex(key, hashKey(key));
+		if (i < 0) return false;
+		*outValue = ds->mEntries[i].value;
+		return true;
 	}
 
 	template <class K, class V, unsigned int HASH(const K&)>
 	const V Dictionary<K, V, HASH>::operator[](const K& key) const {
 		Assert(ds);
-		int hash = hashKey(key);
-		HashMapEntry<K, V> *entry = ds->mTable[hash];
-		while (entry) {
-			if (entry->key == key) return entry->value;
-			entry = entry->next;
-		}
+		long i = ds->findIndex(key, hashKey(key));
+		if (i >= 0) return ds->mEntries[i].value;
 		Error("Dictionary key not found");
 		return V();
 	}
@@ -277,15 +504,12 @@ namespace MiniScript {
 
 	template <class K, class V, unsigned int HASH(const K&)>
 	List<K> Dictionary<K, V, HASH>::Keys() const {
-		List<K> keys;
+		List<K> keys(Count());
 		if (!ds) return keys;
 		
-		for (int i=0; i<TABLE_SIZE; i++) {
-			HashMapEntry<K, V> *entry = ds->mTable[i];
-			while (entry) {
-				keys.Add(entry->key);
-				entry = entry->next;
-			}
+		for (long i=ds->mHead; i<ds->mUsed; i++) {
+			const HashMapEntry<K, V>& entry = ds->mEntries[i];
+			if (entry.live) keys.Add(entry.key);
 		}
 		
 		return keys;
@@ -293,15 +517,12 @@ namespace MiniScript {
 
 	template <class K, class V, unsigned int HASH(const K&)>
 	List<V> Dictionary<K, V, HASH>::Values() const {
-		List<K> values;
+		List<V> values(Count());
 		if (!ds) return values;
 		
-		for (int i=0; i<TABLE_SIZE; i++) {
-			HashMapEntry<K, V> *entry = ds->mTable[i];
-			while (entry) {
-				values.Add(entry->value);
-				entry = entry->next;
-			}
+		for (long i=ds->mHead; i<ds->mUsed; i++) {
+			const HashMapEntry<K, V>& entry = ds->mEntries[i];
+			if (entry.live) values.Add(entry.value);
 		}
 		
 		return values;
@@ -310,65 +531,59 @@ namespace MiniScript {
 	template <class K, class V, unsigned int HASH(const K&)>
 	bool Dictionary<K, V, HASH>::ContainsKey(const K& key) const {
 		if (!ds) return false;
-		int hash = hashKey(key);
-		HashMapEntry<K, V> *entry = ds->mTable[hash];
-		while (entry) {
-			if (entry->key == key) return true;
-			entry = entry->next;
-		}
-
-		return false;
+		return ds->findIndex(key, hashKey(key)) >= 0;
 	}
 	
 	template <class K, class V, unsigned int HASH(const K&)>
-	int Dictionary<K, V, HASH>::BinEntries(int binNum) const {
+	int Dictionary<K, V, HASH>::MaxProbeLength() const {
 		if (!ds) return 0;
-		int count = 0;
-		HashMapEntry<K, V> *entry = ds->mTable[binNum];
-		while (entry) {
-			count++;
-			entry = entry->next;
+		unsigned long result = 0;
+		for (unsigned long i=0; i<ds->mCapacity; i++) {
+			if (ds->mIndex[i].entry >= 0 and ds->probeDistance(i) + 1 > result) result = ds->probeDistance(i) + 1;
 		}
-		return count;
+		return (int)result;
+	}
+
+	#pragma mark -
+	#pragma mark ITERATION
+
+	// Get the key and value of the index-th entry (in iteration order).  This is
+	// O(1) when there are no holes left by Remove, or when called with each index
+	// in turn.  Returns false if index is out of range.
+	template <class K, class V, unsigned int HASH(const K&)>
+	bool Dictionary<K, V, HASH>::GetEntryAt(long index, K *outKey, V *outValue) const {
+		if (!ds or index < 0 or index >= ds->mSize) return false;
+		const HashMapEntry<K, V>& entry = ds->mEntries[ds->entryIndexFor(index)];
+		if (outKey) *outKey = entry.key;
+		if (outValue) *outValue = entry.value;
+		return true;
 	}
 
 	#pragma mark -
 	#pragma mark Private
 
 	template <class K, class V, unsigned int HASH(const K&)>
-	int Dictionary<K, V, HASH>::hashKey(const K& key) const {
-		unsigned int hash = ((unsigned int)HASH(key)) % TABLE_SIZE;
-		return hash;
+	unsigned int Dictionary<K, V, HASH>::hashKey(const K& key) const {
+		return HASH(key);
 	}
 
 	// DictIterator methods:
 	
 	template <class K, class V>
-	DictIterator<K, V>::DictIterator(DictionaryStorage<K, V> *storage) : storage(storage), binIndex(0) {
-		// Find and attach to the first bin with any data in it.
-		if (storage) {
-			for (int i=0; i<TABLE_SIZE; i++) {
-				if (storage->mTable[i]) {
-					binIndex = i;
-					entry = storage->mTable[i];
-					return;
-				}
-			}
-		}
-		entry = nullptr;	// (dictionary is empty)
+	DictIterator<K, V>::DictIterator(DictionaryStorage<K, V> *storage) : storage(storage), index(-1) {
+		// Find and attach to the first live entry (if any).
+		if (storage) index = storage->mHead - 1;
+		Next();
 	}
 
 	template <class K, class V>
 	void DictIterator<K, V>::Next() {
-		entry = entry->next;
-		if (!entry) {
-			// Advance to the next bin with any data in it.
-			while (binIndex+1 < TABLE_SIZE) {
-				binIndex++;
-				entry = storage->mTable[binIndex];
-				if (entry) return;
-			}
-		}
+		if (!storage) return;
+		// Advance to the next live entry.
+		long count = storage->mUsed;
+		do {
+			index++;
+		} while (index < count and not storage->mEntries[index].live);
 	}
 
 
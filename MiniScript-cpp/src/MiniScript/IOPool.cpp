@@ -0,0 +1,163 @@
+//
+//  IOPool.cpp
+//  MiniScript
+//
+
+#include "IOPool.h"
+#include "Reactor.h"
+#include "UnitTest.h"
+#include <chrono>
+
+#if defined(__linux__)
+	#include <stdint.h>
+	#include <sys/eventfd.h>
+	#include <unistd.h>
+#endif
+
+namespace MiniScript {
+
+	IOJob::IOJob() : done(false), wakeFd(-1) {
+		#if defined(__linux__)
+		wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		#endif
+	}
+
+	IOJob::~IOJob() {
+		#if defined(__linux__)
+		if (wakeFd >= 0) close(wakeFd);
+		#endif
+	}
+
+	bool IOJob::WaitFor(double timeout) {
+		if (Done()) return true;
+		std::unique_lock<std::mutex> guard(lock);
+		auto isDone = [this] { return Done(); };
+		if (timeout < 0) {
+			finished.wait(guard, isDone);
+			return true;
+		}
+		return finished.wait_for(guard, std::chrono::duration<double>(timeout), isDone);
+	}
+
+	void IOJob::AddWakeFd(std::vector<int>& fds) const {
+		if (wakeFd >= 0) fds.push_back(wakeFd);
+	}
+
+	void IOJob::finish() {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			done.store(true, std::memory_order_release);
+		}
+		finished.notify_all();
+		#if defined(__linux__)
+		if (wakeFd >= 0) {
+			uint64_t one = 1;
+			if (write(wakeFd, &one, sizeof(one)) < 0) {}	// (can't be full; we only write once)
+		}
+		#endif
+	}
+
+	IOPool::IOPool(int threadCount) : stopping(false) {
+		for (int i=0; i<threadCount; i++) threads.push_back(std::thread(&IOPool::workerLoop, this));
+	}
+
+	IOPool::~IOPool() {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
+		}
+		jobAvailable.notify_all();
+		for (std::thread& t : threads) t.join();
+	}
+
+	IOPool& IOPool::Shared() {
+		static IOPool pool;
+		return pool;
+	}
+
+	void IOPool::Submit(std::shared_ptr<IOJob> job) {
+		if (threads.empty()) {
+			job->Run();
+			job->finish();
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			jobs.push_back(job);
+		}
+		jobAvailable.notify_one();
+	}
+
+	void IOPool::workerLoop() {
+		std::unique_lock<std::mutex> guard(lock);
+		while (true) {
+			jobAvailable.wait(guard, [this] { return stopping or not jobs.empty(); });
+			if (jobs.empty()) return;	// (stopping, with nothing left to do)
+			std::shared_ptr<IOJob> job = jobs.front();
+			jobs.pop_front();
+			guard.unlock();
+			job->Run();
+			job->finish();
+			job = nullptr;
+			guard.lock();
+		}
+	}
+
+
+	#pragma mark -
+
+	class TestIOPool : public UnitTest
+	{
+	public:
+		TestIOPool() : UnitTest("IOPool") {}
+		virtual void Run();
+	};
+
+	struct TestSleepJob : public IOJob {
+		TestSleepJob(int ms) : ms(ms), ran(false) {}
+		virtual void Run() {
+			std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+			ran = true;
+		}
+		int ms;
+		bool ran;
+	};
+
+	void TestIOPool::Run()
+	{
+		// A job runs in the background, and says when it's done.
+		std::shared_ptr<TestSleepJob> slow = std::make_shared<TestSleepJob>(50);
+		{
+			IOPool pool(2);
+			pool.Submit(slow);
+			Assert(not slow->Done());
+			Assert(not slow->WaitFor(0.001));
+
+			// Its wake fd (if any) becomes readable once it's done.
+			Reactor reactor;
+			std::vector<int> fds;
+			slow->AddWakeFd(fds);
+			if (not fds.empty()) {
+				Assert(reactor.WaitFor(fds, 5) and slow->Done());
+			}
+			Assert(slow->WaitFor(5) and slow->ran);
+
+			// Jobs still queued when the pool goes away get done first.
+			std::shared_ptr<TestSleepJob> jobs[6];
+			for (int i=0; i<6; i++) {
+				jobs[i] = std::make_shared<TestSleepJob>(5);
+				pool.Submit(jobs[i]);
+			}
+			slow = jobs[5];
+		}
+		Assert(slow->Done() and slow->ran);
+
+		// A pool with no threads runs each job right away.
+		IOPool solo(0);
+		std::shared_ptr<TestSleepJob> quick = std::make_shared<TestSleepJob>(0);
+		solo.Submit(quick);
+		Assert(quick->Done() and quick->ran);
+	}
+
+	RegisterSlowUnitTest(TestIOPool);
+}
@@ -0,0 +1,89 @@
+//
+//  IOPool.h
+//  MiniScript
+//
+//  An IOPool runs blocking work (like reading a big file, or any file on a
+//  slow disk or network filesystem) on a few threads of its own, so that an
+//  intrinsic can hand it off and return a partial result, instead of holding
+//  up its interpreter's thread.  Meanwhile the interpreter's other green
+//  threads can run, or under a Scheduler, other interpreters can; and the
+//  host can sleep until the job's done (see Reactor).
+//
+//  Jobs run on the pool's threads, so they must not touch Values (which
+//  aren't safe to share between threads); they work on plain data, which
+//  the intrinsic turns into Values once the job is done.
+//
+
+#ifndef IOPOOL_H
+#define IOPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace MiniScript {
+
+	class IOJob {
+	public:
+		IOJob();
+		virtual ~IOJob();
+
+		// Do the work (on one of the pool's threads).  Must not touch Values
+		// or raise exceptions.
+		virtual void Run() = 0;
+
+		bool Done() const { return done.load(std::memory_order_acquire); }
+
+		// Wait until the job's done, or the timeout (in seconds; < 0 for none)
+		// runs out.  Return whether it's done.
+		bool WaitFor(double timeout);
+
+		// Add the file descriptor that becomes readable once the job's done
+		// (if we have one) to the given list; see Machine::wakeFds.
+		void AddWakeFd(std::vector<int>& fds) const;
+
+	private:
+		void finish();
+
+		std::atomic<bool> done;
+		std::mutex lock;
+		std::condition_variable finished;
+		int wakeFd;		// (an eventfd, on Linux; otherwise -1)
+
+		friend class IOPool;
+	};
+
+	class IOPool {
+	public:
+		// Start the given number of threads.  (These mostly wait on I/O, so
+		// there can be more of them than cores.)  A pool with no threads just
+		// runs each job as it's submitted.
+		IOPool(int threadCount=4);
+
+		// Finish the jobs already submitted, then stop the threads.
+		~IOPool();
+
+		// The pool shared by the intrinsics (started on first use).
+		static IOPool& Shared();
+
+		// Queue the given job to run on one of our threads.
+		void Submit(std::shared_ptr<IOJob> job);
+
+	private:
+		void workerLoop();
+
+		std::vector<std::thread> threads;
+
+		// Everything below is guarded by `lock`.
+		std::mutex lock;
+		std::condition_variable jobAvailable;
+		std::deque<std::shared_ptr<IOJob>> jobs;
+		bool stopping;
+	};
+}
+
+#endif // IOPOOL_H
@@ -126,6 +126,23 @@ namespace MiniScript {
 		check(list3, 4, 0, 1, 2, 3);
 		list3.RemoveRange(1, 3);
 		check(list3, 4, 3);
+		
+		// Slices share their list's buffer until either one is changed.
+		List<int> big;
+		for (int i=0; i<100; i++) big.Add(i);
+		List<int> slice = big.Slice(10, 20);
+		List<int> sliceOfSlice = slice.Slice(5, 16);
+		Assert(slice.Count() == 20 and slice[0] == 10 and slice[19] == 29);
+		Assert(&slice[0] == &big[10] and &sliceOfSlice[0] == &big[15]);
+		slice.SetItem(0, -1);
+		Assert(slice[0] == -1 and big[10] == 10 and slice[19] == 29);
+		Assert(&slice[0] != &big[10] and &sliceOfSlice[0] == &big[15]);
+		big.Add(100);
+		Assert(sliceOfSlice.Count() == 16 and sliceOfSlice[0] == 15 and &sliceOfSlice[0] != &big[15]);
+		List<int> tail = big.Slice(90, 11);
+		check(big.Slice(1, 3), 1, 2, 3);	// (small slices are just copied)
+		big = List<int>();
+		Assert(tail.Count() == 11 and tail[0] == 90 and tail[10] == 100);
 	}
 	
 	RegisterUnitTest(TestList);
@@ -14,18 +14,114 @@
 // For now, we'll build it around SimpleVector.
 // ToDo: merge that into here, and SimpleVector goes away.
 #include "SimpleVector.h"
-#include "RefCountedStorage.h"
+#include "CycleCollector.h"
 
 namespace MiniScript {
 	
+	// Slices of at least this many items share the buffer of the list they
+	// come from (until either list is changed), rather than copying the items.
+	#define LIST_SHARE_MIN_ITEMS 16
+
 	template <class T>
-	class ListStorage : public RefCountedStorage, public SimpleVector<T> {
+	class ListStorage : public CollectableStorage, public SimpleVector<T> {
 	private:
-		ListStorage() {}
-		ListStorage(long slots) : SimpleVector<T>(slots) {}
-		virtual ~ListStorage() {}
+		ListStorage() : viewOf(nullptr), firstView(nullptr), prevView(nullptr), nextView(nullptr), numbers(nullptr) { updateAccount(); }
+		ListStorage(long slots) : SimpleVector<T>(slots), viewOf(nullptr), firstView(nullptr), prevView(nullptr), nextView(nullptr), numbers(nullptr) { updateAccount(); }
+		virtual ~ListStorage() {
+			if (viewOf) unlinkView();
+			else detachViews();
+			delete numbers;
+		}
+
+		// Update our memory accounting, if our buffer has changed size.
+		void updateAccount(bool canRaise=true) {
+			long byteCount = (long)(sizeof(ListStorage) + this->bufbytes());
+			if (numbers) byteCount += (long)(sizeof(SimpleVector<double>) + numbers->bufbytes());
+			if (byteCount != this->accountedSize()) this->accountFor(MemoryKind::List, byteCount, canRaise);
+		}
+
+		// Number of items, whether packed or not.
+		long itemCount() const { return numbers ? (long)numbers->size() : (long)this->size(); }
+
+		// A view is a list whose items are really a range of another list's
+		// buffer.  The view doesn't own (or hold references to) those items,
+		// nor does it keep the other list alive; instead, before the other
+		// list is changed or destroyed, its views copy their items into
+		// buffers of their own.  The same happens when a view itself is changed.
+		// A frozen list never changes or goes away, and may be read by several
+		// threads at once; so its views aren't linked into it at all.
+
+		// Make a new list that is a view of the given range of our items.
+		ListStorage* newView(long start, long count) {
+			ListStorage *owner = viewOf ? viewOf : this;
+			ListStorage *view = new ListStorage();
+			view->mBuf = this->mBuf + start;
+			view->mQtyItems = count;
+			view->mBufItems = 0;		// (the buffer isn't ours)
+			view->viewOf = owner;
+			if (owner->IsFrozen()) return view;
+			view->nextView = owner->firstView;
+			if (owner->firstView) owner->firstView->prevView = view;
+			owner->firstView = view;
+			return view;
+		}
+
+		// Call this before changing our items or buffer in any way.
+		void prepareToChange() { if (viewOf or firstView) stopSharing(); }
+		
+		void stopSharing() {
+			if (viewOf) ownBuffer(true);
+			else detachViews();
+		}
+
+		// Copy the items we're viewing into a buffer of our own.
+		void ownBuffer(bool canRaise) {
+			T* items = this->mBuf;
+			unsigned long count = this->mQtyItems;
+			unlinkView();
+			if (count) {
+				this->mBuf = SimpleVector<T>::allocBuf(count);
+				for (unsigned long i=0; i<count; i++) new (&this->mBuf[i]) T(items[i]);
+				this->mQtyItems = this->mBufItems = count;
+			}
+			updateAccount(canRaise);
+		}
+
+		// Stop viewing another list's buffer (leaving us empty).
+		void unlinkView() {
+			if (not viewOf->IsFrozen()) {
+				if (prevView) prevView->nextView = nextView;
+				else viewOf->firstView = nextView;
+				if (nextView) nextView->prevView = prevView;
+			}
+			viewOf = prevView = nextView = nullptr;
+			this->mBuf = nullptr;
+			this->mQtyItems = this->mBufItems = 0;
+		}
+
+		// Have all views of our buffer copy their items.  (This isn't something
+		// the script did to those views, so it never raises a memory limit error.)
+		void detachViews() {
+			while (firstView) firstView->ownBuffer(false);
+		}
+
+		ListStorage *viewOf;		// list whose buffer we're a view into, if any
+		ListStorage *firstView;		// first of the views into our own buffer
+		ListStorage *prevView;		// neighbors in viewOf's list of views
+		ListStorage *nextView;
+
+		// A list of Values that are all numbers may keep just the numbers,
+		// packed in here, instead of its items (which are then empty).  This
+		// is managed entirely by Value: the first time anything else stores
+		// a non-number, or asks for the list in general form (GetList), the
+		// numbers are unpacked into ordinary items, and stay that way.  So
+		// a List wrapper never refers to packed storage.
+		SimpleVector<double> *numbers;
 		
 		template <class T2> friend class List;
+		friend class Value;
+		friend class CycleCollector;
+		friend class DeferredRelease;
 	};
 
 	template <class T>
@@ -34,25 +130,46 @@ namespace MiniScript {
 		// constructors and assignment-op
 		List(long sizeHint=0) : ls(nullptr), isTemp(false) { if (sizeHint) ls = new ListStorage<T>(sizeHint); }
 		List(const List& other) : isTemp(false) { ((List&)other).ensureStorage(); ls = other.ls; retain(); }
-		List& operator= (const List& other) { ((List&)other).ensureStorage(); other.ls->refCount++; release(); ls = other.ls; isTemp = false; return *this; }
+		List& operator= (const List& other) { ((List&)other).ensureStorage(); other.ls->retain(); release(); ls = other.ls; isTemp = false; return *this; }
 
 		// inspectors
 		long Count() const { return ls ? ls->size() : 0; }
 		long IndexOf(T item) const { return ls ? ls->indexOf(item) : -1; }
 		bool Contains(T item) const { return ls ? ls->Contains(item) : false; }
 		T& Last() const { Assert(ls); return ls->peek_back(); }
+
+		// Make our storage immortal, so it can be shared between threads (see
+		// RefCountedStorage::MakeImmortal).  The items are up to the caller.
+		void MakeImmortal() { ensureStorage(); ls->MakeImmortal(); }
 		
 		// mutators
-		void Add(T item) { ensureStorage(); ls->push_back(item); }
-		void Clear() { if (ls) ls->deleteAll(); }
-		void Insert(T item, long index) { ensureStorage(); ls->insert(item, index); }
-		void RemoveAt(long index) { if (ls) ls->deleteIdx(index); }
+		void Add(T item) { ensureStorage(); ls->prepareToChange(); ls->push_back(item); ls->updateAccount(); }
+		void Clear() { if (ls) { ls->prepareToChange(); ls->deleteAll(); ls->updateAccount(); } }
+		void Insert(T item, long index) { ensureStorage(); ls->prepareToChange(); ls->insert(item, index); ls->updateAccount(); }
+		void RemoveAt(long index) { if (ls) { ls->prepareToChange(); ls->deleteIdx(index); } }
 		void RemoveRange(long startIndex, long count) { for (long i=0; i<count; i++) RemoveAt(startIndex); }	// OFI: do this without looping
-		void Reposition(long indexFrom, long indexTo) { if (ls) ls->reposition(indexFrom, indexTo); }
-		T Pop() { Assert(ls); return ls->pop_back(); }
-		void ResizeBuffer(long newBufSize) { if (newBufSize == 0) Clear(); else { ensureStorage(); ls->resizeBuffer(newBufSize); } }
-		void Resize(long newLength) { if (newLength == 0) Clear(); else { ensureStorage(); ls->resize(newLength); } }
-		void Reverse() { if (ls) ls->reverse(); }
+		void Reposition(long indexFrom, long indexTo) { if (ls) { ls->prepareToChange(); ls->reposition(indexFrom, indexTo); } }
+		T Pop() { Assert(ls); ls->prepareToChange(); return ls->pop_back(); }
+		void ResizeBuffer(long newBufSize) { if (newBufSize == 0) Clear(); else { ensureStorage(); ls->prepareToChange(); ls->resizeBuffer(newBufSize); ls->updateAccount(); } }
+		void Resize(long newLength) { if (newLength == 0) Clear(); else { ensureStorage(); ls->prepareToChange(); ls->resize(newLength); ls->updateAccount(); } }
+		void Reverse() { if (ls) { ls->prepareToChange(); ls->reverse(); } }
+		void MakeWritable() { if (ls) ls->prepareToChange(); }	// (call before changing items in place via [])
+		
+		// Get a new list of count items, starting at the given index.  A big
+		// enough slice shares our buffer (until either list is changed), unless
+		// we're immortal but not frozen: then other threads may be reading us,
+		// and we can still change, so the slice gets a copy.
+		List Slice(long start, long count) const {
+			List result;
+			if (count <= 0) return result;
+			if (count >= LIST_SHARE_MIN_ITEMS and (ls->IsFrozen() or not ls->IsImmortal())) {
+				result.ls = ls->newView(start, count);
+			} else {
+				result.ls = new ListStorage<T>(count);
+				for (long i=0; i<count; i++) result.ls->push_back((*ls)[start + i]);
+			}
+			return result;
+		}
 		void EnsureStorage() { ensureStorage(); }	// (call before copying a reference, if you want both to refer to same object)
 		
 		// array-like access (both read and write)
@@ -61,7 +178,7 @@ namespace MiniScript {
 		
 		// Explicit get/set item indexes wrap around, so -1 is the last item, -2 is two from the end, etc.
 		inline T& Item(long idx) const { Assert(ls); return ls->item(idx); }
-		inline void SetItem(long idx, const T& item) { Assert(ls); ls->setItem(idx, item); }
+		inline void SetItem(long idx, const T& item) { Assert(ls); ls->prepareToChange(); ls->setItem(idx, item); }
 
 		// destructor
 		~List() { release(); }
@@ -72,8 +189,8 @@ namespace MiniScript {
 		List(ListStorage<T>* storage, bool temp=true) : ls(storage), isTemp(temp) { retain(); }
 		void forget() { ls = nullptr; }
 		
-		void retain() { if (ls and !isTemp) ls->refCount++; }
-		void release() { if (ls and !isTemp and --(ls->refCount) == 0) { delete ls; ls = nullptr; } }
+		void retain() { if (ls and !isTemp) ls->retain(); }
+		void release() { if (ls and !isTemp) { ls->release(); ls = nullptr; } }
 		void ensureStorage() { if (!ls) ls = new ListStorage<T>(); }
 		ListStorage<T> *ls;
 		bool isTemp;	// indicates temp wrapper which does not participate in ref counting
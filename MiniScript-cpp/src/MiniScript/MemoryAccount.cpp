@@ -0,0 +1,110 @@
+//
+//  MemoryAccount.cpp
+//  MiniScript
+//
+
+#include "MemoryAccount.h"
+#include "MiniscriptTypes.h"
+#include "MiniscriptErrors.h"
+#include "CycleCollector.h"
+#include "UnitTest.h"
+
+namespace MiniScript {
+
+	thread_local MemoryAccount *MemoryAccount::current = nullptr;
+
+	MemoryAccount::MemoryAccount() : liveBytes(0), liveObjects(0), peakBytes(0),
+		softLimit(0), hardLimit(0), abandoned(false), gcHeap(new CollectorHeap()) {
+		for (int i=0; i<MEMORY_KIND_COUNT; i++) bytes[i] = objects[i] = 0;
+	}
+
+	MemoryAccount::~MemoryAccount() {
+		CollectorHeap::Delete(gcHeap);
+	}
+
+	void MemoryAccount::Abandon() {
+		abandoned = true;
+		if (liveObjects == 0) delete this;
+	}
+
+	void MemoryAccount::hardLimitExceeded() {
+		Scope scope(nullptr);	// (don't charge the error message to this account!)
+		LimitExceededException("out of memory (hard limit of " + String::Format(hardLimit) + " bytes exceeded)").raise();
+	}
+
+	void MemoryAccount::handleSoftLimit() {
+		// See whether we can get back under the limit by freeing whatever is
+		// waiting to be freed.  (We're the current account here, so this works
+		// on our own heap, not anybody else's.)
+		DeferredRelease::DrainAll();
+		CycleCollector::Collect();
+		if (OverSoftLimit()) {
+			Scope scope(nullptr);
+			LimitExceededException("out of memory (soft limit of " + String::Format(softLimit) + " bytes exceeded)").raise();
+		}
+	}
+
+	#pragma mark -
+
+	class TestMemoryAccount : public UnitTest
+	{
+	public:
+		TestMemoryAccount() : UnitTest("MemoryAccount") {}
+		virtual void Run();
+	};
+
+	void TestMemoryAccount::Run()
+	{
+		MemoryAccount *account = new MemoryAccount();
+		{
+			MemoryAccount::Scope scope(account);
+			Value s = Value(String("Hello") + " world");
+			ValueList list;
+			for (int i=0; i<100; i++) list.Add(s);
+			ValueDict map;
+			map.SetValue(s, Value(list));
+			Assert(account->Objects(MemoryKind::String) == 1);
+			Assert(account->Objects(MemoryKind::List) == 1);
+			Assert(account->Objects(MemoryKind::Map) == 1);
+			Assert(account->Bytes(MemoryKind::List) >= 100 * (long)sizeof(Value));
+			Assert(account->LiveBytes() == account->PeakBytes());
+
+			// Going over the hard limit raises an exception, but leaves
+			// everything in a usable state.
+			account->SetHardLimit(account->LiveBytes() + 1000);
+			bool raised = false;
+			try {
+				for (int i=0; i<1000; i++) list.Add(Value(i));
+			} catch (LimitExceededException& e) {
+				raised = true;
+			}
+			Assert(raised);
+			Assert(list.Count() > 100 and list.Count() < 1100);
+			account->SetHardLimit(0);
+
+			// The soft limit is only checked when we ask (e.g. between VM steps).
+			account->SetSoftLimit(account->LiveBytes() - 1);
+			raised = false;
+			try {
+				account->CheckSoftLimit();
+			} catch (LimitExceededException& e) {
+				raised = true;
+			}
+			Assert(raised);
+			account->SetSoftLimit(0);
+
+			// Frozen (or otherwise immortal) storage may outlive us, so it
+			// leaves the account.
+			long mapBytes = account->Bytes(MemoryKind::Map);
+			Value frozen = Value(map).Freeze();
+			Assert(account->Objects(MemoryKind::Map) == 0 and account->Objects(MemoryKind::List) == 0);
+			Assert(account->Bytes(MemoryKind::Map) == 0 and mapBytes > 0);
+		}
+		// Storage is credited back as it goes away, whatever account is current.
+		Assert(account->LiveObjects() == 0 and account->LiveBytes() == 0);
+		Assert(account->PeakBytes() > 0);
+		account->Abandon();
+	}
+
+	RegisterUnitTest(TestMemoryAccount);
+}
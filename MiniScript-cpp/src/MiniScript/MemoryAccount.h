@@ -0,0 +1,130 @@
+//
+//  MemoryAccount.h
+//  MiniScript
+//
+//  A MemoryAccount keeps track of the memory used by the runtime objects
+//  (strings, lists, maps, functions, handles) of one interpreter: how many
+//  bytes and objects of each kind are live, and the peak byte count.  It
+//  can also enforce a memory budget, so that one script can't use up all
+//  the memory in a process shared with others.
+//
+//  Each storage object is charged to the account that was current (on its
+//  thread) when it was created, and credited back to that same account when
+//  it is destroyed, however long that takes.  The Interpreter makes its own
+//  account current while it compiles and runs code.
+//
+//  An account (like its interpreter) must only be used by one thread at a
+//  time; but different accounts may be used on different threads at once.
+//
+
+#ifndef MEMORYACCOUNT_H
+#define MEMORYACCOUNT_H
+
+namespace MiniScript {
+
+	class CollectorHeap;
+
+	enum class MemoryKind : unsigned char {
+		Other = 0,		// anything else (sequence elements, intrinsic results, etc.)
+		String,
+		List,
+		Map,
+		Function,
+		Handle
+	};
+	#define MEMORY_KIND_COUNT 6
+
+	class MemoryAccount {
+	public:
+		MemoryAccount();
+
+		// The account charged for storage created on this thread (or nullptr).
+		static thread_local MemoryAccount *current;
+
+		// Makes the given account current for as long as this is in scope.
+		class Scope {
+		public:
+			Scope(MemoryAccount *account) : prev(current) { current = account; }
+			~Scope() { current = prev; }
+		private:
+			MemoryAccount *prev;
+		};
+
+		// Current usage, in total and by kind; and the most bytes ever in use
+		// (since creation, or the last call to ResetPeak).
+		long LiveBytes() const { return liveBytes; }
+		long LiveObjects() const { return liveObjects; }
+		long Bytes(MemoryKind kind) const { return bytes[(int)kind]; }
+		long Objects(MemoryKind kind) const { return objects[(int)kind]; }
+		long PeakBytes() const { return peakBytes; }
+		void ResetPeak() { peakBytes = liveBytes; }
+
+		// Memory budgets, in bytes (0 means no limit).  Going over the hard
+		// limit raises a LimitExceededException right away, from whatever
+		// allocation did it.  Going over the soft limit is noticed at the next
+		// safe point (between VM steps), where we first try to get back under
+		// it by freeing deferred releases and garbage cycles, and raise a
+		// LimitExceededException only if that doesn't do it.
+		void SetSoftLimit(long byteCount) { softLimit = byteCount; }
+		long SoftLimit() const { return softLimit; }
+		void SetHardLimit(long byteCount) { hardLimit = byteCount; }
+		long HardLimit() const { return hardLimit; }
+
+		bool OverSoftLimit() const { return softLimit > 0 and liveBytes > softLimit; }
+
+		// Called at a safe point; deals with being over the soft limit, as above.
+		void CheckSoftLimit() { if (OverSoftLimit()) handleSoftLimit(); }
+
+		// Called by the owner instead of deleting the account.  The account is
+		// deleted as soon as no storage is charged to it.
+		void Abandon();
+
+	private:
+		~MemoryAccount();
+
+		void added() {
+			objects[(int)MemoryKind::Other]++;
+			liveObjects++;
+		}
+
+		void removed(MemoryKind kind, long byteCount) {
+			objects[(int)kind]--;
+			bytes[(int)kind] -= byteCount;
+			liveBytes -= byteCount;
+			if (--liveObjects == 0 and abandoned) delete this;
+		}
+
+		void changed(MemoryKind oldKind, long oldBytes, MemoryKind newKind, long newBytes, bool canRaise) {
+			objects[(int)oldKind]--;
+			objects[(int)newKind]++;
+			bytes[(int)oldKind] -= oldBytes;
+			bytes[(int)newKind] += newBytes;
+			liveBytes += newBytes - oldBytes;
+			if (newBytes > oldBytes) {
+				if (liveBytes > peakBytes) peakBytes = liveBytes;
+				if (canRaise and hardLimit > 0 and liveBytes > hardLimit) hardLimitExceeded();
+			}
+		}
+
+		void hardLimitExceeded();
+		void handleSoftLimit();
+
+		long bytes[MEMORY_KIND_COUNT];
+		long objects[MEMORY_KIND_COUNT];
+		long liveBytes;
+		long liveObjects;
+		long peakBytes;
+		long softLimit;
+		long hardLimit;
+		bool abandoned;
+		CollectorHeap *gcHeap;		// cycle-collector bookkeeping for our storage
+
+		friend class RefCountedStorage;
+		friend class CollectorHeap;
+		friend class CycleCollector;
+		friend class DeferredRelease;
+	};
+
+}
+
+#endif /* MEMORYACCOUNT_H */
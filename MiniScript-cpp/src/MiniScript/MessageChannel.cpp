@@ -0,0 +1,273 @@
+//
+//  MessageChannel.cpp
+//  MiniScript
+//
+//  The queue is a ring of cells, each with a sequence number saying which
+//  position it's ready for: a sender may fill the cell for position p when
+//  its sequence is p, and then sets it to p+1; a receiver may empty it when
+//  its sequence is p+1, and then sets it to p+capacity (ready for the next
+//  time around).  Senders and receivers claim positions by bumping
+//  enqueuePos and dequeuePos.  (This is Dmitry Vyukov's bounded MPMC queue.)
+//
+
+#include "MessageChannel.h"
+#include "CycleCollector.h"
+#include "MiniscriptErrors.h"
+#include "MiniscriptInterpreter.h"
+#include "MiniscriptIntrinsics.h"
+#include "Scheduler.h"
+#include "UnitTest.h"
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace MiniScript {
+
+	// Let go of a value that belongs to no account (i.e., a copy made by a
+	// channel), freeing anything big now rather than leaving it queued.
+	static void discard(Value& value) {
+		MemoryAccount::Scope scope(nullptr);
+		value = Value::null;
+		if (DeferredRelease::Pending()) DeferredRelease::DrainAll();
+	}
+
+	MessageChannel::MessageChannel(long capacity) : enqueuePos(0), dequeuePos(0), closed(false) {
+		size_t size = 2;
+		while ((long)size < capacity) size *= 2;
+		cells = new Cell[size];
+		for (size_t i=0; i<size; i++) cells[i].sequence.store(i, std::memory_order_relaxed);
+		mask = size - 1;
+	}
+
+	MessageChannel::~MessageChannel() {
+		for (size_t i=0; i<=mask; i++) discard(cells[i].value);
+		delete[] cells;
+	}
+
+	std::shared_ptr<MessageChannel> MessageChannel::Named(String name, long capacity) {
+		static std::mutex lock;
+		static std::map<std::string, std::weak_ptr<MessageChannel>> channels;
+		std::lock_guard<std::mutex> guard(lock);
+		std::weak_ptr<MessageChannel>& entry = channels[std::string(name.c_str(), name.sizeB())];
+		std::shared_ptr<MessageChannel> channel = entry.lock();
+		if (not channel) {
+			channel = std::make_shared<MessageChannel>(capacity);
+			entry = channel;
+		}
+		// (Forget any others that have gone away meanwhile.)
+		for (auto i = channels.begin(); i != channels.end(); ) {
+			if (i->second.expired()) i = channels.erase(i);
+			else ++i;
+		}
+		return channel;
+	}
+
+	long MessageChannel::Count() const {
+		size_t taken = dequeuePos.load(std::memory_order_relaxed);
+		size_t sent = enqueuePos.load(std::memory_order_relaxed);
+		return sent > taken ? (long)(sent - taken) : 0;
+	}
+
+	bool MessageChannel::TrySend(const Value& value) {
+		if (closed) RuntimeException("can't send to a closed channel").raise();
+		if (Count() > (long)mask) return false;		// (no sense making a copy yet)
+
+		Value copy;
+		{
+			MemoryAccount::Scope scope(nullptr);
+			ValueCopies copies;
+			copy = value.DeepCopy(copies);
+		}
+
+		// Claim the next position, if its cell is free.
+		Cell *cell;
+		size_t pos = enqueuePos.load(std::memory_order_relaxed);
+		while (true) {
+			cell = &cells[pos & mask];
+			size_t sequence = cell->sequence.load(std::memory_order_acquire);
+			long diff = (long)(sequence - pos);
+			if (diff == 0) {
+				if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+			} else if (diff < 0) {
+				discard(copy);		// (filled up after all)
+				return false;
+			} else {
+				pos = enqueuePos.load(std::memory_order_relaxed);
+			}
+		}
+		cell->value = copy;
+		copy = Value::null;
+		cell->sequence.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool MessageChannel::TryReceive(Value *outValue) {
+		// Claim the oldest position, if its cell has been filled.
+		Cell *cell;
+		size_t pos = dequeuePos.load(std::memory_order_relaxed);
+		while (true) {
+			cell = &cells[pos & mask];
+			size_t sequence = cell->sequence.load(std::memory_order_acquire);
+			long diff = (long)(sequence - (pos + 1));
+			if (diff == 0) {
+				if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+			} else if (diff < 0) {
+				return false;
+			} else {
+				pos = dequeuePos.load(std::memory_order_relaxed);
+			}
+		}
+		Value message = cell->value;
+		cell->value = Value::null;
+		cell->sequence.store(pos + mask + 1, std::memory_order_release);
+
+		// Copy it into the current account, then throw ours away -- emptying
+		// everything in it first, so that any cycles in it are freed too.
+		// (If copying it fails, say by hitting a memory limit, it's lost.)
+		ValueCopies copies;
+		try {
+			*outValue = message.DeepCopy(copies);
+		} catch (...) {
+			copies.ClearOriginals();
+			discard(message);
+			throw;
+		}
+		copies.ClearOriginals();
+		discard(message);
+		return true;
+	}
+
+
+	#pragma mark -
+
+	class TestMessageChannel : public UnitTest
+	{
+	public:
+		TestMessageChannel() : UnitTest("MessageChannel") {}
+		virtual void Run();
+	};
+
+	// A pipeline of three interpreters: one sends numbers, one squares them,
+	// and one adds them up.
+	static const char *producerSource =
+		"ch = sharedChannel(\"test.numbers\", 4)\n"
+		"for i in range(1, 200)\n"
+		"  ch.send i\n"
+		"end for\n"
+		"ch.close\n";
+	static const char *squarerSource =
+		"input = sharedChannel(\"test.numbers\", 4)\n"
+		"output = sharedChannel(\"test.squares\", 4)\n"
+		"while true\n"
+		"  x = input.receive\n"
+		"  if x == null then break\n"
+		"  output.send {\"n\": x, \"square\": x * x}\n"
+		"end while\n"
+		"output.close\n";
+	static const char *summerSource =
+		"input = sharedChannel(\"test.squares\", 4)\n"
+		"result = 0\n"
+		"while true\n"
+		"  m = input.receive\n"
+		"  if m == null then break\n"
+		"  result = result + m.square\n"
+		"end while\n";
+
+	void TestMessageChannel::Run()
+	{
+		Intrinsics::InitIfNeeded();
+
+		// Values go through in order, as copies; a full channel refuses more.
+		MessageChannel channel(3);
+		Assert(channel.Capacity() == 4);
+		ValueList list;
+		list.Add(Value("hello"));
+		list.Add(Value(list));		// (a cycle)
+		Assert(channel.TrySend(Value(42)));
+		Assert(channel.TrySend(Value(list)));
+		Assert(channel.TrySend(Value::null));
+		Assert(channel.TrySend(Value("last")));
+		Assert(not channel.TrySend(Value(5)));
+		Assert(channel.Count() == 4);
+		Value v;
+		Assert(channel.TryReceive(&v) and v.IntValue() == 42);
+		Assert(channel.TryReceive(&v) and v.type == ValueType::List);
+		ValueList copy = v.GetList();
+		Assert(copy.Count() == 2 and copy[0].ToString() == "hello");
+		Assert(copy[1].data.ref == v.data.ref and v.data.ref != Value(list).data.ref);
+		Assert(channel.TryReceive(&v) and v.IsNull());
+		Assert(channel.TryReceive(&v) and v.ToString() == "last");
+		Assert(not channel.TryReceive(&v));
+		list.Clear();
+		copy.Clear();
+
+		// Frozen values go through as they are.
+		ValueList table;
+		table.Add(Value("frozen"));
+		Value frozen = Value(table).Freeze();
+		Assert(channel.TrySend(frozen) and channel.TryReceive(&v) and v.RefEquals(frozen));
+
+		// Handles can't be sent; nor can anything, once the channel is closed.
+		bool raised = false;
+		try {
+			channel.TrySend(Value::NewHandle(new MessageChannelStorage(nullptr)));
+		} catch (const TypeException&) {
+			raised = true;
+		}
+		Assert(raised and channel.Count() == 0);
+		channel.Close();
+		raised = false;
+		try {
+			channel.TrySend(Value(1));
+		} catch (const RuntimeException&) {
+			raised = true;
+		}
+		Assert(raised and channel.Closed());
+
+		// Many threads can send and receive at once.
+		MessageChannel busy(16);
+		const int threadCount = 4;
+		const long perThread = 5000;
+		std::atomic<long> total(0), received(0);
+		std::thread senders[threadCount], receivers[threadCount];
+		for (int t=0; t<threadCount; t++) {
+			senders[t] = std::thread([&busy, t] {
+				for (long i=1; i<=perThread; i++) {
+					Value message = (i % 2) ? Value((double)i) : Value(String("n") + String::Format(i));
+					while (not busy.TrySend(message)) std::this_thread::yield();
+				}
+			});
+			receivers[t] = std::thread([&busy, &total, &received] {
+				Value message;
+				while (received < threadCount * perThread) {
+					if (not busy.TryReceive(&message)) {
+						std::this_thread::yield();
+						continue;
+					}
+					received++;
+					if (message.type == ValueType::Number) total += message.IntValue();
+					else total += message.GetString().Substring(1).IntValue();
+				}
+			});
+		}
+		for (int t=0; t<threadCount; t++) senders[t].join();
+		for (int t=0; t<threadCount; t++) receivers[t].join();
+		Assert(received == threadCount * perThread);
+		Assert(total == threadCount * perThread * (perThread + 1) / 2);
+
+		// Scripts on a Scheduler make a pipeline out of named channels.
+		{
+			Scheduler scheduler(3);
+			Interpreter producer(producerSource), squarer(squarerSource), summer(summerSource);
+			scheduler.Add(&summer);
+			scheduler.Add(&squarer);
+			scheduler.Add(&producer);
+			scheduler.WaitUntilIdle();
+			Assert(summer.GetGlobalValue("result").IntValue() == 2686700);
+		}
+		Assert(MessageChannel::Named("test.numbers", 1)->Capacity() == 2);	// (a new one; the others are gone)
+	}
+
+	RegisterSlowUnitTest(TestMessageChannel);
+}
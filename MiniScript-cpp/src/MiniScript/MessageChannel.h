@@ -0,0 +1,93 @@
+//
+//  MessageChannel.h
+//  MiniScript
+//
+//  A MessageChannel passes values between interpreters that may be running
+//  on different threads (say, the stages of a pipeline under a Scheduler).
+//  It's a bounded queue that any number of threads may send to and receive
+//  from at once, without locking.
+//
+//  Interpreters can't share mutable values (reference counts aren't atomic),
+//  so each value sent is deep-copied into the channel, and copied again into
+//  the interpreter that receives it.  Numbers, and immortal values (such as
+//  frozen lists and maps; see Value::Freeze), aren't copied at all.  Handles
+//  can't be sent.
+//
+//  Scripts see a MessageChannel as a channel (see the channel intrinsic),
+//  with the same send, receive and close methods; when it's full or empty,
+//  those wait (by returning a partial result, so that the interpreter can be
+//  descheduled) until it isn't.
+//
+
+#ifndef MESSAGECHANNEL_H
+#define MESSAGECHANNEL_H
+
+#include "MiniscriptTypes.h"
+#include <atomic>
+#include <memory>
+
+namespace MiniScript {
+
+	class MessageChannel {
+	public:
+		// Make a channel that holds at most the given number of values
+		// (rounded up to a power of two, and at least 2).
+		MessageChannel(long capacity);
+		~MessageChannel();
+
+		// Get the channel with the given name, shared by every interpreter in
+		// the process, making it (with the given capacity) if there isn't one.
+		// A named channel goes away when nothing refers to it any more.
+		static std::shared_ptr<MessageChannel> Named(String name, long capacity);
+
+		// Send a copy of the given value, charged to nobody.  Return false
+		// (without sending) if the channel is full.  Raises a RuntimeException
+		// if the channel is closed, or a TypeException if the value contains
+		// a handle.
+		bool TrySend(const Value& value);
+
+		// Receive the oldest value sent, copied into the current memory
+		// account.  Return false if the channel is empty.
+		bool TryReceive(Value *outValue);
+
+		// Close the channel: no more sends are allowed, but the values already
+		// sent may still be received.
+		void Close() { closed = true; }
+		bool Closed() const { return closed; }
+
+		long Capacity() const { return (long)(mask + 1); }
+
+		// Number of values waiting (only a snapshot, if other threads are busy).
+		long Count() const;
+
+	private:
+		struct Cell {
+			std::atomic<size_t> sequence;	// position this cell is next ready for
+			Value value;
+		};
+
+		Cell *cells;
+		size_t mask;
+		// (The positions are padded onto separate cache lines, so that senders
+		// and receivers don't slow each other down.)
+		char pad0[64];
+		std::atomic<size_t> enqueuePos;
+		char pad1[64];
+		std::atomic<size_t> dequeuePos;
+		char pad2[64];
+		std::atomic<bool> closed;
+	};
+
+	// Handle storage for a MessageChannel, to put in an interpreter's values.
+	// (Each interpreter gets its own, since handles are reference counted.)
+	class MessageChannelStorage : public RefCountedStorage {
+	public:
+		MessageChannelStorage(std::shared_ptr<MessageChannel> channel) : channel(channel) {
+			accountFor(MemoryKind::Handle, sizeof(MessageChannelStorage));
+		}
+
+		std::shared_ptr<MessageChannel> channel;
+	};
+}
+
+#endif // MESSAGECHANNEL_H
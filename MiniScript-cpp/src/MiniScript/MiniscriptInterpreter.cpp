@@ -9,29 +9,85 @@
 #include "MiniscriptInterpreter.h"
 #include "MiniscriptParser.h"
 #include "SplitJoin.h"
+#include "UnitTest.h"
+#include <chrono>
+#include <thread>
 
 namespace MiniScript {
 	
+	Program::Program(String source, String errorContext) : error(nullptr) {
+		// (The compiled code is shared by every interpreter that runs it, so
+		// it's charged to none of them.)
+		MemoryAccount::Scope scope(nullptr);
+		Parser parser;
+		parser.errorContext = errorContext;
+		try {
+			parser.Parse(source);
+			FunctionStorage *func = new FunctionStorage();
+			func->code = parser.output->code;
+			function = Value(func).MakeImmortal();
+		} catch (const LexerException& e) {
+			error = new LexerException(e);
+		} catch (const CompilerException& e) {
+			error = new CompilerException(e);
+		} catch (const MiniscriptException& e) {
+			error = new MiniscriptException(e);
+		}
+		if (error) {
+			// (Interpreters on any thread may report this, so it's immortal too.)
+			error->message.MakeImmortal();
+			error->location.context.MakeImmortal();
+		}
+	}
+
+	Program::~Program() {
+		delete error;
+	}
+
+	Machine *Program::CreateVM(TextOutputMethod standardOutput) const {
+		Context *root = new Context();
+		if (function.type == ValueType::Function) {
+			root->code = ((FunctionStorage*)function.data.ref)->code;
+		}
+		return new Machine(root, standardOutput);
+	}
+
+	#pragma mark -
+
 	Interpreter::Interpreter() : standardOutput(nullptr), errorOutput(nullptr), implicitOutput(nullptr),
-								parser(nullptr), vm(nullptr), hostData(nullptr) {
+								program(nullptr), parser(nullptr), vm(nullptr), hostData(nullptr), memory(new MemoryAccount()) {
 		
 	}
 
 	Interpreter::Interpreter(String source) : standardOutput(nullptr), errorOutput(nullptr), implicitOutput(nullptr),
-	parser(nullptr), vm(nullptr), hostData(nullptr) {
+	program(nullptr), parser(nullptr), vm(nullptr), hostData(nullptr), memory(new MemoryAccount()) {
 		Reset(source);
 	}
 	
 	Interpreter::Interpreter(List<String> source) : standardOutput(nullptr), errorOutput(nullptr), implicitOutput(nullptr),
-	parser(nullptr), vm(nullptr), hostData(nullptr) {
+	program(nullptr), parser(nullptr), vm(nullptr), hostData(nullptr), memory(new MemoryAccount()) {
 		Reset(source);
 	}
 
+	Interpreter::Interpreter(const Program& program) : standardOutput(nullptr), errorOutput(nullptr), implicitOutput(nullptr),
+	program(nullptr), parser(nullptr), vm(nullptr), hostData(nullptr), memory(new MemoryAccount()) {
+		Reset(program);
+	}
+
 	Interpreter::~Interpreter() {
 		// We own the parser and the VM...
 		delete(parser); parser = nullptr;
 		delete(vm); vm = nullptr;
 		// But we do not own hostData; it's up to the host to deal with that.
+		// Free whatever of ours is still waiting to be freed (including any
+		// garbage cycles); our memory account goes away once everything
+		// charged to it does.
+		{
+			MemoryAccount::Scope scope(memory);
+			DeferredRelease::DrainAll();
+			CycleCollector::Collect();
+		}
+		memory->Abandon();
 	}
 
 	void Interpreter::Reset(List<String> source) {
@@ -40,8 +96,19 @@ namespace MiniScript {
 
 	void Interpreter::Compile() {
 		if (vm) return;		// already compiled
+		if (program) {
+			if (not program->Compiled()) {
+				ReportError(*program->error);
+				return;
+			}
+			MemoryAccount::Scope scope(memory);
+			vm = program->CreateVM(standardOutput);
+			vm->interpreter = this;
+			return;
+		}
 		if (not parser) parser = new Parser();
 		try {
+			MemoryAccount::Scope scope(memory);
 			parser->Parse(source);
 			vm = parser->CreateVM(standardOutput);
 			vm->interpreter = this;
@@ -57,6 +124,7 @@ namespace MiniScript {
 	void Interpreter::Step() {
 		try {
 			Compile();
+			MemoryAccount::Scope scope(memory);
 			if (vm) vm->Step();
 		} catch (const MiniscriptException& mse) {
 			ReportError(mse);
@@ -86,6 +154,9 @@ namespace MiniScript {
 				Compile();
 				if (not vm) return;	// (must have been some error)
 			}
+			// (Note that this scope ends before any error is reported, so that
+			// reporting an error is never charged to our account.)
+			MemoryAccount::Scope scope(memory);
 			startImpResultCount = vm->GetGlobalContext()->implicitResultCounter;
 			double startTime = vm->RunTime();
 			vm->yielding = false;
@@ -96,7 +167,7 @@ namespace MiniScript {
 					checkRuntimeIn = 15;
 				}
 				vm->Step();		// update the machine
-				if (returnEarly and not vm->GetTopContext()->partialResult.Done()) return;	// waiting for something
+				if (returnEarly and vm->Waiting()) return;	// waiting for something
 			}
 		} catch (const MiniscriptException& mse) {
 			ReportError(mse);
@@ -135,6 +206,7 @@ namespace MiniScript {
 		vm->yielding = false;
 		
 		try {
+			MemoryAccount::Scope scope(memory);
 			if (not sourceLine.empty()) parser->Parse(sourceLine, true);
 			if (not parser->NeedMoreInput()) {
 				while (not vm->Done() && !vm->yielding) {
@@ -194,6 +266,7 @@ namespace MiniScript {
     /// <param name="value">value to set</param>	
 	void Interpreter::SetGlobalValue(String varName, Value value)
     {
+		MemoryAccount::Scope scope(memory);
         if (vm) vm->GetGlobalContext()->SetVar(varName, value);
 	}
 
@@ -216,4 +289,239 @@ namespace MiniScript {
 		if (errorOutput) (*errorOutput)(mse.Description(), true);
 	}
 
+
+	#pragma mark -
+
+	class TestInterpreter : public UnitTest
+	{
+	public:
+		TestInterpreter() : UnitTest("Interpreter") {}
+		virtual void Run();
+	};
+
+	// Exercises strings, lists, maps (with cycles), the shared type maps and
+	// intrinsics, and random numbers; leaves the total in "result".
+	static const char *threadTestSource =
+		"result = 0\n"
+		"for i in range(1, 300)\n"
+		"  a = {\"n\": i, \"name\": \"item\" + i}\n"
+		"  a.self = a\n"
+		"  b = [i, str(i), a]\n"
+		"  b.push b\n"
+		"  s = b[1].upper + a.name.len\n"
+		"  result = result + b.len + s.val + a.indexes.len + round(rnd)*0\n"
+		"  x = [3,1,2]; x.sort; x.shuffle\n"
+		"  result = result + x.sum\n"
+		"end for\n";
+
+	// Exercises function, closure, class, and literal values in shared
+	// compiled code; leaves "result" = 6 + 12 + 2 + 30 = 50.
+	static const char *programTestSource =
+		"makeAdder = function(n)\n"
+		"  f = function(x)\n"
+		"    return x + n\n"
+		"  end function\n"
+		"  return @f\n"
+		"end function\n"
+		"Point = {\"x\": 0, \"y\": 0}\n"
+		"Point.sum = function\n"
+		"  return self.x + self.y\n"
+		"end function\n"
+		"p = new Point; p.x = 5; p.y = 7\n"
+		"list = [1, 2, 3]; list.push \"four\"\n"
+		"add1 = makeAdder(1)\n"
+		"result = add1(5) + p.sum + list.indexOf(3)\n"
+		"for i in range(1, 4)\n"
+		"  result = result + i * 3\n"
+		"end for\n";
+
+	// Green threads: two workers take turns (at each yield), a producer and
+	// consumer share a channel, and one thread waits; "log" records the order.
+	static const char *greenThreadTestSource =
+		"log = []\n"
+		"worker = function(name, n)\n"
+		"  for i in range(1, n)\n"
+		"    log.push name + i\n"
+		"    yield\n"
+		"  end for\n"
+		"  return n * 10\n"
+		"end function\n"
+		"a = spawn(@worker, [\"a\", 3])\n"
+		"b = spawn(@worker, [\"b\", 2])\n"
+		"ch = channel(2)\n"
+		"producer = function\n"
+		"  for i in range(1, 5)\n"
+		"    ch.send i\n"
+		"  end for\n"
+		"  ch.close\n"
+		"end function\n"
+		"consumer = function\n"
+		"  total = 0\n"
+		"  while true\n"
+		"    x = ch.receive\n"
+		"    if x == null then return total\n"
+		"    total = total + x\n"
+		"  end while\n"
+		"end function\n"
+		"spawn @producer\n"
+		"c = spawn(@consumer)\n"
+		"sleep = function\n"
+		"  wait 0.01\n"
+		"  return \"rested\"\n"
+		"end function\n"
+		"sleeper = spawn(@sleep)\n"
+		"result = [a.join, b.join, c.join, sleeper.join, a.done]\n";
+
+	// parallelMap, with a function that uses a global function, a global
+	// class, and print; and one that fails partway through.
+	static const char *parallelMapTestSource =
+		"Point = {}\n"
+		"scale = 3\n"
+		"helper = function(v)\n"
+		"  return v * scale\n"
+		"end function\n"
+		"f = function(n)\n"
+		"  p = new Point\n"
+		"  p.x = helper(n)\n"
+		"  if n % 250 == 0 then print n\n"
+		"  return p\n"
+		"end function\n"
+		"r = parallelMap(range(1, 1000), @f, 4)\n"
+		"ok = r.len == 1000 and r[0].x == 3 and r[999].x == 3000 and r[500] isa Point\n"
+		"bad = function(n)\n"
+		"  if n == 600 then return n.foo\n"
+		"  return n\n"
+		"end function\n"
+		"result = \"unfinished\"\n"
+		"result = parallelMap(range(1, 1000), @bad, 4)\n";
+
+	static String printed;
+	static void collectOutput(String text, bool addLineBreak) { printed += text; if (addLineBreak) printed += "\n"; }
+
+	static long errorsReported = 0;
+	static void countError(String text, bool addLineBreak) { errorsReported++; }
+
+	void TestInterpreter::Run()
+	{
+		// Immortal values ignore retain and release, so anyone may share them.
+		Value s = Value(String("immortal ") + "string");
+		ValueList items;
+		items.Add(s);
+		Value list = items;
+		list.MakeImmortal();
+		Assert(list.data.ref->IsImmortal() and s.data.ref->IsImmortal());
+		{
+			Value copy = list;
+			ValueList same = copy.GetList();
+		}
+		Assert(list.GetList()[0] == s);
+		Assert(IntrinsicResult::Null.Result().IsNull());
+
+		// Separate interpreters can run at the same time on separate threads.
+		Intrinsics::InitIfNeeded();
+		const int threadCount = 4;
+		Interpreter *interps[threadCount];
+		std::thread threads[threadCount];
+		for (int i=0; i<threadCount; i++) {
+			interps[i] = new Interpreter(threadTestSource);
+			threads[i] = std::thread([](Interpreter *interp) { interp->RunUntilDone(60, false); }, interps[i]);
+		}
+		for (int i=0; i<threadCount; i++) threads[i].join();
+		Value expected = interps[0]->GetGlobalValue("result");
+		Assert(expected.DoubleValue() > 0);
+		for (int i=0; i<threadCount; i++) {
+			Assert(interps[i]->Done());
+			Assert(interps[i]->GetGlobalValue("result") == expected);
+			delete interps[i];
+		}
+
+		// A Program is compiled once, and run by many interpreters on many threads.
+		Program program(programTestSource);
+		Assert(program.Compiled());
+		for (int i=0; i<threadCount; i++) {
+			threads[i] = std::thread([](const Program *program) {
+				for (int run=0; run<10; run++) {
+					Interpreter interp(*program);
+					interp.RunUntilDone(60, false);
+					if (interp.GetGlobalValue("result").IntValue() != 50) errorsReported++;
+				}
+			}, &program);
+		}
+		for (int i=0; i<threadCount; i++) threads[i].join();
+		Assert(errorsReported == 0);
+		{
+			// Each interpreter has its own globals, which start out fresh.
+			Interpreter interp(program);
+			interp.RunUntilDone();
+			interp.SetGlobalValue("result", Value(1));
+			interp.Restart();
+			interp.RunUntilDone();
+			Assert(interp.GetGlobalValue("result").IntValue() == 50);
+			Interpreter other(program);
+			other.Compile();
+			Assert(other.GetGlobalValue("result").IsNull());
+		}
+
+		// Green threads take turns within one interpreter.
+		{
+			Interpreter interp(greenThreadTestSource);
+			interp.errorOutput = countError;
+			int frames = 0;
+			do {
+				interp.RunUntilDone(60, true);
+				if (interp.vm->Waiting()) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				frames++;
+			} while (not interp.Done() and frames < 10000);
+			Assert(interp.Done() and errorsReported == 0);
+			Assert(interp.GetGlobalValue("log").ToString() == "[\"a1\", \"b1\", \"a2\", \"b2\", \"a3\"]");
+			Assert(interp.GetGlobalValue("result").ToString() == "[30, 20, 15, \"rested\", 1]");
+			Assert(frames > 3);		// (each round of yields ends a frame, as does waiting)
+		}
+
+		// parallelMap runs a function on many threads, and gives back results
+		// (and output, and the first error) as if it had run them in order.
+		{
+			Interpreter interp(parallelMapTestSource);
+			interp.standardOutput = collectOutput;
+			interp.errorOutput = countError;
+			interp.RunUntilDone(60, false);
+			Assert(interp.GetGlobalValue("ok").BoolValue());
+			Assert(printed == "250\n500\n750\n1000\n");
+			Assert(errorsReported == 1);
+			Assert(interp.GetGlobalValue("result").ToString() == "unfinished");
+			errorsReported = 0;
+			printed = String();
+		}
+		{
+			// A function may wait; and its error says where in it things went wrong.
+			Interpreter interp("f = function(n)\n  wait 0.01\n  return n.foo\nend function\nparallelMap([1, 2], @f)");
+			interp.errorOutput = collectOutput;
+			interp.RunUntilDone(60, false);
+			Assert(printed.Contains("not found") and printed.Contains("[line 3]"));
+			printed = String();
+		}
+		{
+			// A global holding a handle is fine, unless the function needs it
+			// (or may, by looking at globals); then nothing gets started.
+			Interpreter interp("ch = channel\nf = function(n)\n  return n + 1\nend function\n"
+				"ok = parallelMap([1, 2], @f) == [2, 3]\n"
+				"g = function(n)\n  return globals.len\nend function\nparallelMap([1, 2], @g)");
+			interp.errorOutput = collectOutput;
+			interp.RunUntilDone(60, false);
+			Assert(interp.GetGlobalValue("ok").BoolValue());
+			Assert(printed.Contains("can't copy a handle"));
+			printed = String();
+		}
+
+		// A Program that doesn't compile reports its error when run.
+		Program bad("x = (1 +");
+		Assert(not bad.Compiled() and bad.ErrorDescription().StartsWith("Compiler Error"));
+		Interpreter badInterp(bad);
+		badInterp.errorOutput = countError;
+		badInterp.RunUntilDone();
+		Assert(errorsReported == 1 and badInterp.Done());
+	}
+
+	RegisterSlowUnitTest(TestInterpreter);
+
 }
@@ -16,7 +16,58 @@ namespace MiniScript {
 
 	
 	class Parser;
+
+	// Threads: separate Interpreters may run on separate threads at the same
+	// time, as long as:
+	//  - each Interpreter (and its VM) is used by only one thread at a time
+	//    (it may move from one thread to another in between);
+	//  - values are not passed from one Interpreter to another while either
+	//    is running, unless they are immortal (see Value::MakeImmortal), as
+	//    all the built-in intrinsics and type maps are;
+	//  - custom intrinsics are added, and process-wide settings (hostName,
+	//    Value::maxListSize, CycleCollector::SetAutoThreshold, etc.) are set,
+	//    before any thread starts running scripts.
+	// Each Interpreter has its own memory account, cycle-collector heap, and
+	// random number generator, so they don't otherwise share any mutable state.
 	
+	/// <summary>
+	/// Program: source code compiled once, which any number of Interpreters
+	/// can then run (each with its own globals, and on any thread) without
+	/// parsing it again.  A Program never changes after it's made, and its code
+	/// is immortal (see Value::MakeImmortal) so that VMs on different threads
+	/// can share it; that also means it's never freed, so compile each script
+	/// once and keep it, rather than making a new Program for every run.
+	/// </summary>
+	class Program {
+	public:
+		/// Compile the given source (errorContext is the file name, etc., used
+		/// in error messages).  Call Intrinsics::InitIfNeeded first if you add
+		/// custom intrinsics; and like them, make Programs before starting threads
+		/// or hand them to other threads only after they're made.
+		Program(String source, String errorContext="");
+		~Program();
+
+		/// Whether the source compiled without error.  (If not, an Interpreter
+		/// running this Program reports the error, as if it had compiled it.)
+		bool Compiled() const { return error == nullptr; }
+
+		/// Description of the compiler error, if any.
+		String ErrorDescription() const { return error ? error->Description() : String(); }
+
+		/// Create a new virtual machine to run this code.  (Usually you'll make
+		/// an Interpreter from the Program instead.)
+		Machine *CreateVM(TextOutputMethod standardOutput) const;
+
+	private:
+		Program(const Program& other);				// (not copyable)
+		Program& operator=(const Program& other);
+
+		Value function;					// immortal function holding the compiled code
+		MiniscriptException *error;		// what went wrong, if it didn't compile
+
+		friend class Interpreter;
+	};
+
 	class Interpreter {
 		
 	public:
@@ -48,9 +99,17 @@ namespace MiniScript {
 		Interpreter();
 		Interpreter(String source);
 		Interpreter(List<String> source);
+		Interpreter(const Program& program);	// (the Program must outlive the Interpreter)
 		
 		/// Destructor
-		~Interpreter();
+		virtual ~Interpreter();
+		
+		/// <summary>
+		/// Memory: the account that tracks the memory used by this interpreter's
+		/// values (everything created while it compiles or runs code), and lets
+		/// you limit it.  See MemoryAccount.h.
+		/// </summary>
+		MemoryAccount& Memory() { return *memory; }
 		
 		/// <summary>
 		/// done: returns true when we don't have a virtual machine, or we do have
@@ -69,12 +128,22 @@ namespace MiniScript {
 		/// <param name="source"></param>
 		void Reset(String source="") {
 			this->source = source;
+			program = nullptr;
 			parser = nullptr;
 			vm = nullptr;
 		}
 		
 		void Reset(List<String> source);
 
+		/// <summary>
+		/// Reset the interpreter to run the given precompiled Program.  (Use
+		/// RunUntilDone etc. with this, not REPL.)
+		/// </summary>
+		void Reset(const Program& program) {
+			Reset();
+			this->program = &program;
+		}
+
 		/// <summary>
 		/// Reset the virtual machine to the beginning of the code.  Note that this
 		/// does *not* reset global variables; it simply clears the stack and jumps
@@ -86,6 +155,7 @@ namespace MiniScript {
 		/// <summary>
 		/// Compile our source code, if we haven't already done so, so that we are
 		/// either ready to run, or generate compiler errors (reported via errorOutput).
+		/// (With a Program, this just creates the VM.)
 		/// </summary>
 		void Compile();
 
@@ -152,7 +222,9 @@ namespace MiniScript {
 
 	private:
 		String source;
+		const Program *program;		// (if we're running one, instead of source)
 		Parser *parser;
+		MemoryAccount *memory;
 	};
 }
 
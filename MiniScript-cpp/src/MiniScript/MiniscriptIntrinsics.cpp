@@ -11,9 +11,24 @@
 #include "MiniscriptTAC.h"
 #include "UnicodeUtil.h"
 #include "SplitJoin.h"
+#include "VectorMath.h"
+#include "ThreadPool.h"
+#include "MessageChannel.h"
+#include "Reactor.h"
 #include <cmath>
 #include <ctime>
 #include <algorithm>
+#include <atomic>
+#include <climits>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 
 namespace MiniScript {
 
@@ -21,34 +36,65 @@ namespace MiniScript {
 	String hostInfo = "";
 	double hostVersion = 0;
 	
-	static Value _functionType;
-	static Value _listType;
-	static Value _mapType;
-	static Value _numberType;
-	static Value _stringType;
-	static Value _EOL("\n");
+	static Value _EOL = Value("\n").MakeImmortal();
 
 	List<Intrinsic*> Intrinsic::all;
 	Dictionary<String, Intrinsic*, hashString> Intrinsic::nameMap;
-	IntrinsicResult IntrinsicResult::Null;	// represents a completed, null result
-	IntrinsicResult IntrinsicResult::EmptyString(Value("")); // represents an empty string result
+	IntrinsicResult IntrinsicResult::Null = IntrinsicResult(Value()).MakeImmortal();	// represents a completed, null result
+	IntrinsicResult IntrinsicResult::EmptyString = IntrinsicResult(Value("")).MakeImmortal(); // represents an empty string result
 
-	bool Intrinsics::initialized = false;
-	static ValueDict _intrinsicsMap;
+	static std::once_flag initOnce;
 
-	static bool randInitialized = false;
+	// Intrinsics that are list methods only (not global functions).
+	static Intrinsic *i_plus = nullptr;
+	static Intrinsic *i_minus = nullptr;
+	static Intrinsic *i_times = nullptr;
+	static Intrinsic *i_dividedBy = nullptr;
 
-	static inline void InitRand() {
-		if (!randInitialized) {
-			srand((unsigned int)time(nullptr));
-			for (int i=0; i<10; i++) rand();
-			randInitialized = true;
-		}
+	// Intrinsics that are methods of threads and channels.
+	static Intrinsic *i_threadJoin = nullptr;
+	static Intrinsic *i_threadDone = nullptr;
+	static Intrinsic *i_channelSend = nullptr;
+	static Intrinsic *i_channelReceive = nullptr;
+	static Intrinsic *i_channelClose = nullptr;
+
+	// Get the numbers in the given list: directly, if it's packed, or else
+	// by copying them into the given scratch vector (with anything that isn't
+	// a number counting as 0, as in sum).
+	static const double* listNumbers(const Value& list, SimpleVector<double>& scratch) {
+		SimpleVector<double> *numbers = list.GetNumbers();
+		if (numbers) return numbers->size() > 0 ? &(*numbers)[0] : nullptr;
+		ValueList items = list.GetList();
+		long count = items.Count();
+		scratch.resize(count);
+		for (long i=0; i<count; i++) scratch[i] = items[i].DoubleValue();
+		return count > 0 ? &scratch[0] : nullptr;
 	}
 
-	void InitRand(unsigned int seed) {
-		srand(seed);
-		randInitialized = true;
+	typedef void (*ElementwiseListOp)(const double *a, const double *b, double *result, long n);
+	typedef void (*ElementwiseScalarOp)(const double *a, double b, double *result, long n);
+
+	// Shared code for the elementwise list methods (plus, minus, etc.): combine
+	// self with another list of the same length, or with a single number.
+	static IntrinsicResult elementwise(Context *context, const char *name, ElementwiseListOp listOp, ElementwiseScalarOp scalarOp) {
+		Value self = context->GetVar("self");
+		Value other = context->GetVar("other");
+		if (self.type != ValueType::List) return IntrinsicResult::Null;
+		long count = self.ListCount();
+		if (other.type == ValueType::List) {
+			if (other.ListCount() != count) RuntimeException(String(name) + ": lists must be the same length").raise();
+		} else if (other.type != ValueType::Number) {
+			RuntimeException(String(name) + ": list or number required").raise();
+		}
+		SimpleVector<double> scratchA, scratchB;
+		const double *a = listNumbers(self, scratchA);
+		Value result = Value::NewNumberList(count);
+		SimpleVector<double> *numbers = result.GetNumbers();
+		numbers->resize(count);
+		double *out = count > 0 ? &(*numbers)[0] : nullptr;
+		if (other.type == ValueType::List) (*listOp)(a, listNumbers(other, scratchB), out, count);
+		else (*scalarOp)(a, other.DoubleValue(), out, count);
+		return IntrinsicResult(result);
 	}
 
 	static IntrinsicResult intrinsic_abs(Context *context, IntrinsicResult partialResult) {
@@ -76,29 +122,65 @@ namespace MiniScript {
 	static std::pair<bool, uint64_t> doubleToUnsignedSplit(double val) {
 		return { std::signbit(val), std::abs(val) };
 	}
+
+	// The bit intrinsics work on sign and magnitude separately.  Integers
+	// split exactly; other numbers are truncated to an integer first.
+	static std::pair<bool, uint64_t> signMagnitudeSplit(const Value& v) {
+		if (not v.isInt) return doubleToUnsignedSplit(v.DoubleValue());
+		int64_t i = v.data.integer;
+		return { i < 0, i < 0 ? 0 - (uint64_t)i : (uint64_t)i };
+	}
+
+	// ...and put the result back together, as an integer if it fits.
+	static Value signMagnitudeJoin(bool sign, uint64_t val) {
+		if (val == 0 and sign) return Value(-0.0);
+		if (val <= (uint64_t)INT64_MAX) return Value::Integer(sign ? -(int64_t)val : (int64_t)val);
+		if (sign and val == (uint64_t)INT64_MAX + 1) return Value::Integer(INT64_MIN);
+		return Value(sign ? -(double)val : (double)val);
+	}
 	
 	static IntrinsicResult intrinsic_bitAnd(Context *context, IntrinsicResult partialResult) {
-		auto i = doubleToUnsignedSplit(context->GetVar("i").DoubleValue());
-		auto j = doubleToUnsignedSplit(context->GetVar("j").DoubleValue());
-		auto sign = i.first & j.first;
-		double val = i.second & j.second;
-		return IntrinsicResult(sign ? -val : val);
+		auto i = signMagnitudeSplit(context->GetVar("i"));
+		auto j = signMagnitudeSplit(context->GetVar("j"));
+		return IntrinsicResult(signMagnitudeJoin(i.first & j.first, i.second & j.second));
 	}
 	
 	static IntrinsicResult intrinsic_bitOr(Context *context, IntrinsicResult partialResult) {
-		auto i = doubleToUnsignedSplit(context->GetVar("i").DoubleValue());
-		auto j = doubleToUnsignedSplit(context->GetVar("j").DoubleValue());
-		auto sign = i.first | j.first;
-		double val = i.second | j.second;
-		return IntrinsicResult(sign ? -val : val);
+		auto i = signMagnitudeSplit(context->GetVar("i"));
+		auto j = signMagnitudeSplit(context->GetVar("j"));
+		return IntrinsicResult(signMagnitudeJoin(i.first | j.first, i.second | j.second));
 	}
 	
 	static IntrinsicResult intrinsic_bitXor(Context *context, IntrinsicResult partialResult) {
-		auto i = doubleToUnsignedSplit(context->GetVar("i").DoubleValue());
-		auto j = doubleToUnsignedSplit(context->GetVar("j").DoubleValue());
-		auto sign = i.first ^ j.first;
-		double val = i.second ^ j.second;
-		return IntrinsicResult(sign ? -val : val);
+		auto i = signMagnitudeSplit(context->GetVar("i"));
+		auto j = signMagnitudeSplit(context->GetVar("j"));
+		return IntrinsicResult(signMagnitudeJoin(i.first ^ j.first, i.second ^ j.second));
+	}
+
+	// Shift the magnitude of i left by n bits (right, if n is negative),
+	// keeping its sign; so this multiplies by 2^n, truncating toward zero.
+	static Value bitShift(const Value& iVal, int64_t n) {
+		auto i = signMagnitudeSplit(iVal);
+		uint64_t val = i.second;
+		if (n < 0) {
+			val = (n <= -64 ? 0 : val >> -n);
+		} else if (n >= 64 or (n > 0 and val > (UINT64_MAX >> n))) {
+			// Too big for 64 bits; give the (inexact) floating-point answer.
+			double d = ldexp((double)val, n > 2000 ? 2000 : (int)n);
+			return Value(i.first ? -d : d);
+		} else {
+			val <<= n;
+		}
+		return signMagnitudeJoin(i.first and val != 0, val);
+	}
+
+	static IntrinsicResult intrinsic_bitShiftLeft(Context *context, IntrinsicResult partialResult) {
+		return IntrinsicResult(bitShift(context->GetVar("i"), context->GetVar("n").Int64Value()));
+	}
+
+	static IntrinsicResult intrinsic_bitShiftRight(Context *context, IntrinsicResult partialResult) {
+		int64_t n = context->GetVar("n").Int64Value();
+		return IntrinsicResult(bitShift(context->GetVar("i"), n == INT64_MIN ? INT64_MAX : -n));
 	}
 
 	static IntrinsicResult intrinsic_char(Context *context, IntrinsicResult partialResult) {
@@ -126,11 +208,30 @@ namespace MiniScript {
 		return IntrinsicResult(cos(radians.DoubleValue()));
 	}
 
+	static IntrinsicResult intrinsic_dividedBy(Context *context, IntrinsicResult partialResult) {
+		return elementwise(context, "dividedBy", &VectorMath::Divide, &VectorMath::Divide);
+	}
+
+	static IntrinsicResult intrinsic_dot(Context *context, IntrinsicResult partialResult) {
+		Value self = context->GetVar("self");
+		Value other = context->GetVar("other");
+		if (self.type != ValueType::List or other.type != ValueType::List) return IntrinsicResult::Null;
+		long count = self.ListCount();
+		if (other.ListCount() != count) RuntimeException("dot: lists must be the same length").raise();
+		SimpleVector<double> scratchA, scratchB;
+		return IntrinsicResult(VectorMath::Dot(listNumbers(self, scratchA), listNumbers(other, scratchB), count));
+	}
+
 	static IntrinsicResult intrinsic_floor(Context *context, IntrinsicResult partialResult) {
 		Value x = context->GetVar("x");
 		return IntrinsicResult(floor(x.DoubleValue()));
 	}
 	
+	static IntrinsicResult intrinsic_freeze(Context *context, IntrinsicResult partialResult) {
+		Value x = context->GetVar("x");
+		return IntrinsicResult(x.Freeze());
+	}
+
 	static IntrinsicResult intrinsic_function(Context *context, IntrinsicResult partialResult) {
 		if (context->vm->functionType.IsNull()) {
 			context->vm->functionType = Intrinsics::FunctionType().EvalCopy(context->vm->GetGlobalContext());
@@ -148,9 +249,9 @@ namespace MiniScript {
 		Value index = context->GetVar("index");
 		if (self.type == ValueType::List) {
 			if (index.type == ValueType::Number) {
-				ValueList list = self.GetList();
+				long count = self.ListCount();
 				long i = index.IntValue();
-				return IntrinsicResult(Value::Truth(i >= -list.Count() and i < list.Count()));
+				return IntrinsicResult(Value::Truth(i >= -count and i < count));
 			}
 			return IntrinsicResult(Value::zero);
 		} else if (self.type == ValueType::String) {
@@ -193,12 +294,24 @@ namespace MiniScript {
 		Value value = context->GetVar("value");
 		Value after = context->GetVar("after");
 		if (self.type == ValueType::List) {
-			ValueList list = self.GetList();
-			long count = list.Count();
+			long count = self.ListCount();
 			long afterIdx = -1;
 			if (!after.IsNull()) afterIdx = after.IntValue();
 			if (afterIdx < -1) afterIdx += count;
 			if (afterIdx < -1 || afterIdx > count-1) return IntrinsicResult::Null;
+			SimpleVector<double> *numbers = self.GetNumbers();
+			if (numbers) {
+				// Packed list: only a number can match (and not an integer
+				// too big for a double to hold exactly).
+				if (value.type != ValueType::Number) return IntrinsicResult::Null;
+				double target = value.DoubleValue();
+				if (value.isInt and not (Value(target) == value)) return IntrinsicResult::Null;
+				for (long i=afterIdx+1; i<count; i++) {
+					if ((*numbers)[i] == target) return IntrinsicResult(i);
+				}
+				return IntrinsicResult::Null;
+			}
+			ValueList list = self.GetList();
 			for (long i=afterIdx+1; i<count; i++) {
 				if (Value::Equality(list[i], value) == 1) return IntrinsicResult(i);
 			}
@@ -232,11 +345,10 @@ namespace MiniScript {
 		if (index.type != ValueType::Number) RuntimeException("insert: number required for index argument").raise();
 		long idx = index.IntValue();
 		if (self.type == ValueType::List) {
-			ValueList list = self.GetList();
-			long count = list.Count();
+			long count = self.ListCount();
 			if (idx < 0) idx += count + 1;	// +1 because we are inserting AND counting from the end.
 			CheckRange(idx, 0, count);		// and allowing all the way up to .Count here, because insert.
-			list.Insert(value, idx);
+			self.ListInsert(idx, value);
 			return IntrinsicResult(self);
 		} else if (self.type == ValueType::String) {
 			String s = self.ToString();
@@ -251,15 +363,15 @@ namespace MiniScript {
 	}
 
 	static IntrinsicResult intrinsic_intrinsics(Context *context, IntrinsicResult partialResult) {
-		if (_intrinsicsMap.Count() > 0) return IntrinsicResult(_intrinsicsMap);
-		
+		// (A new map each time, since the caller may change it.)
+		ValueDict intrinsicsMap;
 		for (int i=0; i<Intrinsic::all.Count(); i++) {
 			Intrinsic* intrinsic = Intrinsic::all[i];
 			if (intrinsic == nullptr || intrinsic->name.empty()) continue;
-			_intrinsicsMap.SetValue(intrinsic->name, intrinsic->GetFunc());
+			intrinsicsMap.SetValue(intrinsic->name, intrinsic->GetFunc());
 		}
 		
-		return IntrinsicResult(_intrinsicsMap);
+		return IntrinsicResult(intrinsicsMap);
 	}
 
 	static IntrinsicResult intrinsic_join(Context *context, IntrinsicResult partialResult) {
@@ -278,8 +390,7 @@ namespace MiniScript {
 	static IntrinsicResult intrinsic_len(Context *context, IntrinsicResult partialResult) {
 		Value val = context->GetVar("self");
 		if (val.type == ValueType::List) {
-			ValueList list = val.GetList();
-			return IntrinsicResult(list.Count());
+			return IntrinsicResult(val.ListCount());
 		} else if (val.type == ValueType::String) {
 			String str = val.GetString();
 			return IntrinsicResult(str.Length());
@@ -323,6 +434,34 @@ namespace MiniScript {
 	};
 	
 	
+	static IntrinsicResult intrinsic_max(Context *context, IntrinsicResult partialResult) {
+		Value self = context->GetVar("self");
+		if (self.type != ValueType::List or self.ListCount() == 0) return IntrinsicResult::Null;
+		long count = self.ListCount();
+		SimpleVector<double> scratch;
+		return IntrinsicResult(VectorMath::Max(listNumbers(self, scratch), count));
+	}
+
+	static IntrinsicResult intrinsic_mean(Context *context, IntrinsicResult partialResult) {
+		Value self = context->GetVar("self");
+		if (self.type != ValueType::List or self.ListCount() == 0) return IntrinsicResult::Null;
+		long count = self.ListCount();
+		SimpleVector<double> scratch;
+		return IntrinsicResult(VectorMath::Sum(listNumbers(self, scratch), count) / count);
+	}
+
+	static IntrinsicResult intrinsic_min(Context *context, IntrinsicResult partialResult) {
+		Value self = context->GetVar("self");
+		if (self.type != ValueType::List or self.ListCount() == 0) return IntrinsicResult::Null;
+		long count = self.ListCount();
+		SimpleVector<double> scratch;
+		return IntrinsicResult(VectorMath::Min(listNumbers(self, scratch), count));
+	}
+
+	static IntrinsicResult intrinsic_minus(Context *context, IntrinsicResult partialResult) {
+		return elementwise(context, "minus", &VectorMath::Subtract, &VectorMath::Subtract);
+	}
+
 	static IntrinsicResult intrinsic_number(Context *context, IntrinsicResult partialResult) {
 		if (context->vm->numberType.IsNull()) {
 			context->vm->numberType = Intrinsics::NumberType().EvalCopy(context->vm->GetGlobalContext());
@@ -335,6 +474,10 @@ namespace MiniScript {
 		return IntrinsicResult(M_PI);
 	}
 
+	static IntrinsicResult intrinsic_plus(Context *context, IntrinsicResult partialResult) {
+		return elementwise(context, "plus", &VectorMath::Add, &VectorMath::Add);
+	}
+
 	static IntrinsicResult intrinsic_print(Context *context, IntrinsicResult partialResult) {
 		Value s = context->GetVar("s");
 		if (s.IsNull()) s = "null";
@@ -351,12 +494,12 @@ namespace MiniScript {
 	
 	static IntrinsicResult intrinsic_pop(Context *context, IntrinsicResult partialResult) {
 		Value self = context->GetVar("self");
+		self.CheckNotFrozen();
 		if (self.type == ValueType::List) {
-			ValueList list = self.GetList();
-			long count = list.Count();
+			long count = self.ListCount();
 			if (count < 1) return IntrinsicResult::Null;
-			Value result = list[count-1];
-			list.RemoveAt(count-1);
+			Value result = self.ListItem(count-1);
+			self.ListRemove(count-1);
 			return IntrinsicResult(result);
 		} else if (self.type == ValueType::Map) {
 			ValueDict map = self.GetDict();
@@ -373,12 +516,11 @@ namespace MiniScript {
 	
 	static IntrinsicResult intrinsic_pull(Context *context, IntrinsicResult partialResult) {
 		Value self = context->GetVar("self");
+		self.CheckNotFrozen();
 		if (self.type == ValueType::List) {
-			ValueList list = self.GetList();
-			long count = list.Count();
-			if (count < 1) return IntrinsicResult::Null;
-			Value result = list[0];
-			list.RemoveAt(0);
+			if (self.ListCount() < 1) return IntrinsicResult::Null;
+			Value result = self.ListItem(0);
+			self.ListRemove(0);
 			return IntrinsicResult(result);
 		} else if (self.type == ValueType::Map) {
 			ValueDict map = self.GetDict();
@@ -395,10 +537,10 @@ namespace MiniScript {
 	
 	static IntrinsicResult intrinsic_push(Context *context, IntrinsicResult partialResult) {
 		Value self = context->GetVar("self");
+		self.CheckNotFrozen();
 		Value value = context->GetVar("value");
 		if (self.type == ValueType::List) {
-			ValueList list = self.GetList();
-			list.Add(value);
+			self.ListAdd(value);
 			return IntrinsicResult(self);
 		} else if (self.type == ValueType::Map) {
 			ValueDict map = self.GetDict();
@@ -420,9 +562,9 @@ namespace MiniScript {
 		int count = (int)((toVal - fromVal) / step) + 1;
 		if (count > Value::maxListSize) LimitExceededException("list too large").raise();
 		try {
-			ValueList values(count);
+			Value values = Value::NewNumberList(count);
 			for (double v = fromVal; step > 0 ? (v <= toVal) : (v >= toVal); v += step) {
-				values.Add(v);
+				values.ListAdd(v);
 			}
 			return IntrinsicResult(values);
 		} catch (std::bad_alloc e) {
@@ -455,6 +597,7 @@ namespace MiniScript {
 	
 	static IntrinsicResult intrinsic_remove(Context *context, IntrinsicResult partialResult) {
 		Value self = context->GetVar("self");
+		self.CheckNotFrozen();
 		Value k = context->GetVar("k");
 		if (self.IsNull()) RuntimeException("argument to 'remove' must not be null").raise();
 		if (self.type == ValueType::Map) {
@@ -466,11 +609,11 @@ namespace MiniScript {
 			return IntrinsicResult(Value::zero);
 		} else if (self.type == ValueType::List) {
 			if (k.IsNull()) RuntimeException("argument to 'remove' must not be null").raise();
-			ValueList selfList = self.GetList();
+			long count = self.ListCount();
 			long idx = k.IntValue();
-			if (idx < 0) idx += selfList.Count();
-			CheckRange(idx, 0, selfList.Count()-1);
-			selfList.RemoveAt(idx);
+			if (idx < 0) idx += count;
+			CheckRange(idx, 0, count-1);
+			self.ListRemove(idx);
 			return IntrinsicResult::Null;
 		} else if (self.type == ValueType::String) {
 			if (k.IsNull()) RuntimeException("argument to 'remove' must not be null").raise();
@@ -486,6 +629,7 @@ namespace MiniScript {
 	
 	static IntrinsicResult intrinsic_replace(Context *context, IntrinsicResult partialResult) {
 		Value self = context->GetVar("self");
+		self.CheckNotFrozen();
 		Value oldval = context->GetVar("oldval");
 		Value newval = context->GetVar("newval");
 		Value maxCountVal = context->GetVar("maxCount");
@@ -511,6 +655,7 @@ namespace MiniScript {
 			long listCount = selfList.Count();
 			for (long i=0; i<listCount; i++) {
 				if (Value::Equality(selfList[i], oldval) == 1) {
+					selfList.MakeWritable();
 					selfList[i] = newval;
 					count++;
 					if (maxCount > 0 and count == maxCount) break;
@@ -547,10 +692,8 @@ namespace MiniScript {
 	
 	static IntrinsicResult intrinsic_rnd(Context *context, IntrinsicResult partialResult) {
 		Value seed = context->GetVar("seed");
-		if (seed.IsNull()) InitRand();
-		else InitRand((unsigned int)seed.IntValue());
-		double d = (double)rand() / (RAND_MAX + 1.0);
-		return IntrinsicResult(d);
+		if (not seed.IsNull()) context->vm->SeedRandom((uint64_t)seed.Int64Value());
+		return IntrinsicResult(context->vm->Random());
 	};
 
 	static IntrinsicResult intrinsic_sign(Context *context, IntrinsicResult partialResult) {
@@ -572,20 +715,21 @@ namespace MiniScript {
 		long toIdx = 0;
 		if (not toVal.IsNull()) toIdx = toVal.IntValue();
 		if (seq.type == ValueType::List) {
-			ValueList list = seq.GetList();
-			long count = list.Count();
+			long count = seq.ListCount();
 			if (fromIdx < 0) fromIdx += count;
 			if (fromIdx < 0) fromIdx = 0;
 			if (toVal.IsNull()) toIdx = count;
 			if (toIdx < 0) toIdx += count;
 			if (toIdx > count) toIdx = count;
-			ValueList slice;
-			if (fromIdx < count and toIdx > fromIdx) {
-				for (long i = fromIdx; i < toIdx; i++) {
-					slice.Add(list[i]);
-				}
+			if (fromIdx >= count or toIdx <= fromIdx) return IntrinsicResult(ValueList());
+			SimpleVector<double> *numbers = seq.GetNumbers();
+			if (numbers) {
+				// (A packed list has no views; its slices are packed copies.)
+				Value result = Value::NewNumberList(toIdx - fromIdx);
+				for (long i=fromIdx; i<toIdx; i++) result.ListAdd((*numbers)[i]);
+				return IntrinsicResult(result);
 			}
-			return IntrinsicResult(slice);
+			return IntrinsicResult(seq.GetList().Slice(fromIdx, toIdx - fromIdx));
 		} else if (seq.type == ValueType::String) {
 			String str = seq.GetString();
 			long length = str.Length();
@@ -636,44 +780,123 @@ namespace MiniScript {
 		return sort_lesser(b.sortKey, a.sortKey);
 	}
 
+	// Lists at least this long are sorted on several threads (see ThreadPool).
+	#define PARALLEL_SORT_MIN_ITEMS 100000
+
+	template <class T, class Less> static void stableSort(T *items, long count, Less less) {
+		if (count >= PARALLEL_SORT_MIN_ITEMS) ParallelStableSort(items, count, less, ThreadPool::Shared());
+		else std::stable_sort(items, items + count, less);
+	}
+
+	// Sort keys for when the keys are all numbers, or all strings (apart from
+	// nulls, which we set aside).  These are cheap to compare and copy, and
+	// hold no references, so they're safe to sort on several threads.
+	struct NumberKey {
+		double key;
+		long index;
+	};
+
+	struct StringKey {
+		const char *key;	// (the data of a string that the list keeps alive)
+		long index;
+	};
+
 	static IntrinsicResult intrinsic_sort(Context *context, IntrinsicResult partialResult) {
 		Value self = context->GetVar("self");
+		self.CheckNotFrozen();
 		if (self.type != ValueType::List) return IntrinsicResult(self);
-		ValueList list = self.GetList();
-		if (list.Count() < 2) return IntrinsicResult(list);
+		if (self.ListCount() < 2) return IntrinsicResult(self);
 		
 		bool ascending = context->GetVar("ascending").BoolValue();
 		
 		Value byKey = context->GetVar("byKey");
+		SimpleVector<double> *numbers = self.GetNumbers();
+		if (byKey.IsNull() and numbers) {
+			// Packed numbers: sort them directly (same order as sort_lesser).
+			double *first = &(*numbers)[0];
+			if (ascending) stableSort(first, (long)numbers->size(), std::less<double>());
+			else stableSort(first, (long)numbers->size(), std::greater<double>());
+			return IntrinsicResult(self);
+		}
+		ValueList list = self.GetList();
+		list.MakeWritable();
+		long count = list.Count();
+
+		// The key for each item will be the item itself, unless we're sorting
+		// byKey and it is a map, in which case it's the item indexed by the
+		// given key.  (Works too for lists if our index is an integer.)
+		std::vector<Value> keys;
+		if (not byKey.IsNull()) {
+			keys.resize(count);
+			long byKeyInt = byKey.IntValue();
+			for (long i=0; i<count; i++) {
+				Value& item = list[i];
+				if (item.type == ValueType::Map) keys[i] = item.Lookup(byKey);
+				else if (item.type == ValueType::List) {
+					ValueList itemList = item.GetList();
+					if (byKeyInt > -itemList.Count() && byKeyInt < itemList.Count()) keys[i] = itemList.Item(byKeyInt);
+				} else keys[i] = item;
+			}
+		}
+		Value *keyOf = keys.empty() ? &list[0] : keys.data();
+		bool allNumbers = true, allStrings = true;
+		for (long i=0; i<count and (allNumbers or allStrings); i++) {
+			if (keyOf[i].type == ValueType::Null) continue;
+			if (keyOf[i].type != ValueType::Number) allNumbers = false;
+			if (keyOf[i].type != ValueType::String) allStrings = false;
+		}
+
+		if (allNumbers or allStrings) {
+			// Sort the non-null keys; then the values go in that order, with
+			// the nulls last (or first, if descending), as sort_lesser does.
+			std::vector<long> order, nulls;
+			order.reserve(count);
+			if (not ascending) {
+				for (long i=0; i<count; i++) if (keyOf[i].type == ValueType::Null) order.push_back(i);
+			}
+			if (allNumbers) {
+				std::vector<NumberKey> sortKeys;
+				sortKeys.reserve(count);
+				for (long i=0; i<count; i++) {
+					if (keyOf[i].type == ValueType::Null) nulls.push_back(i);
+					else sortKeys.push_back({keyOf[i].DoubleValue(), i});
+				}
+				if (ascending) stableSort(sortKeys.data(), (long)sortKeys.size(), [](const NumberKey& a, const NumberKey& b) { return a.key < b.key; });
+				else stableSort(sortKeys.data(), (long)sortKeys.size(), [](const NumberKey& a, const NumberKey& b) { return b.key < a.key; });
+				for (const NumberKey& k : sortKeys) order.push_back(k.index);
+			} else {
+				std::vector<StringKey> sortKeys;
+				sortKeys.reserve(count);
+				for (long i=0; i<count; i++) {
+					if (keyOf[i].type == ValueType::Null) nulls.push_back(i);
+					else sortKeys.push_back({keyOf[i].GetString().c_str(), i});
+				}
+				if (ascending) stableSort(sortKeys.data(), (long)sortKeys.size(), [](const StringKey& a, const StringKey& b) { return strcmp(a.key, b.key) < 0; });
+				else stableSort(sortKeys.data(), (long)sortKeys.size(), [](const StringKey& a, const StringKey& b) { return strcmp(b.key, a.key) < 0; });
+				for (const StringKey& k : sortKeys) order.push_back(k.index);
+			}
+			if (ascending) order.insert(order.end(), nulls.begin(), nulls.end());
+			std::vector<Value> values(&list[0], &list[0] + count);
+			for (long i=0; i<count; i++) list[i] = values[order[i]];
+			return IntrinsicResult(list);
+		}
+
 		if (byKey.IsNull()) {
 			// Simple case: sorting values as themselves.
-			std::stable_sort(&list[0], &list[0] + list.Count(), ascending ? &sort_lesser : &sort_greater);
+			std::stable_sort(&list[0], &list[0] + count, ascending ? &sort_lesser : &sort_greater);
 			return IntrinsicResult(list);
 		}
-		// Harder case: sorting values by a given map key or function.
-		// Construct an array of ValuePair, sort that, and then convert back into a list of values.
-		KeyedValue *arr = new KeyedValue[list.Count()];
-		for (int i=0; i<list.Count(); i++) {
+		// Harder case: sorting values by their keys.
+		// Construct an array of KeyedValue, sort that, and then convert back into a list of values.
+		KeyedValue *arr = new KeyedValue[count];
+		for (long i=0; i<count; i++) {
+			arr[i].sortKey = keys[i];
 			arr[i].value = list[i];
-			arr[i].valueIndex = i;
-		}
-		// The key for each item will be the item itself, unless it is a map, in which
-		// case it's the item indexed by the given key.  (Works too for lists if our
-		// index is an integer.)
-		long byKeyInt = byKey.IntValue();
-		for (long i=0; i<list.Count(); i++) {
-			Value& item = list[i];
-			if (item.type == ValueType::Map) arr[i].sortKey = item.Lookup(byKey);
-			else if (item.type == ValueType::List) {
-				ValueList itemList = item.GetList();
-				if (byKeyInt > -itemList.Count() && byKeyInt < itemList.Count()) arr[i].sortKey = itemList.Item(byKeyInt);
-				else arr[i].sortKey = Value::null;
-			} else arr[i].sortKey = item;
+			arr[i].valueIndex = (int)i;
 		}
-		// Sort our valueKey array
-		std::sort(arr, arr + list.Count(), ascending ? &sort_KeyedValue : &sort_KeyedValueDesc);
+		std::stable_sort(arr, arr + count, ascending ? &sort_KeyedValue : &sort_KeyedValueDesc);
 		// Build our output (and release the temp array)
-		for (int i=0; i<list.Count(); i++) list[i] = arr[i].value;
+		for (long i=0; i<count; i++) list[i] = arr[i].value;
 		delete[] arr;
 		return IntrinsicResult(list);
 	}
@@ -709,13 +932,15 @@ namespace MiniScript {
 	
 	static IntrinsicResult intrinsic_shuffle(Context *context, IntrinsicResult partialResult) {
 		Value self = context->GetVar("self");
-		InitRand();
+		self.CheckNotFrozen();
+		Machine *vm = context->vm;
 		if (self.type == ValueType::List) {
 			ValueList list = self.GetList();
+			list.MakeWritable();
 			// We'll do a Fisher-Yates shuffle, i.e., swap each element
 			// with a randomly selected one.
 			for (long i=list.Count()-1; i >= 1; i--) {
-				int j = rand() % (i+1);
+				long j = (long)(vm->Random() * (i+1));
 				Value temp = list[j];
 				list[j] = list[i];
 				list[i] = temp;
@@ -726,7 +951,7 @@ namespace MiniScript {
 			// is the values associated with the keys, not the keys themselves.
 			ValueList keys = map.Keys();
 			for (long i=keys.Count()-1; i >= 1; i--) {
-				int j = rand() % (i+1);
+				long j = (long)(vm->Random() * (i+1));
 				Value keyi = keys[i];
 				Value keyj = keys[j];
 				Value temp = map[keyj];
@@ -760,10 +985,8 @@ namespace MiniScript {
 		Value val = context->GetVar("self");
 		double sum = 0;
 		if (val.type == ValueType::List) {
-			ValueList list = val.GetList();
-			for (long i=list.Count()-1; i>=0; i--) {
-				sum += list[i].DoubleValue();
-			}
+			SimpleVector<double> scratch;
+			sum = VectorMath::Sum(listNumbers(val, scratch), val.ListCount());
 		} else if (val.type == ValueType::Map) {
 			ValueDict map = val.GetDict();
 			for (ValueDictIterator kv = map.GetIterator(); !kv.Done(); kv.Next()) {
@@ -782,6 +1005,10 @@ namespace MiniScript {
 		return IntrinsicResult(context->vm->RunTime());
 	}
 
+	static IntrinsicResult intrinsic_times(Context *context, IntrinsicResult partialResult) {
+		return elementwise(context, "times", &VectorMath::Multiply, &VectorMath::Multiply);
+	}
+
 	static IntrinsicResult intrinsic_upper(Context *context, IntrinsicResult partialResult) {
 		Value val = context->GetVar("self");
 		if (val.type == ValueType::String) {
@@ -847,8 +1074,10 @@ namespace MiniScript {
 			d.SetValue("buildDate", yyyy + "-" + mm + "-" + dd);
 
 			d.SetValue("host", hostVersion);
-			d.SetValue("hostName", hostName);
-			d.SetValue("hostInfo", hostInfo);
+			// (Copies, since the host's strings aren't immortal, and other
+			// threads may be reading them too.)
+			d.SetValue("hostName", String(hostName.c_str()));
+			d.SetValue("hostInfo", String(hostInfo.c_str()));
 			context->vm->versionMap = Value(d);
 		}
 		return IntrinsicResult(context->vm->versionMap);
@@ -859,10 +1088,12 @@ namespace MiniScript {
 		if (partialResult.Done()) {
 			// Just starting our wait; calculate end time and return as partial result
 			double interval = context->GetVar("seconds").DoubleValue();
+			context->vm->wakeTime = now + interval;
 			return IntrinsicResult(Value(now + interval), false);
 		} else {
 			// Continue until current time exceeds the time in the partial result
 			if (now > partialResult.Result().DoubleValue()) return IntrinsicResult::Null;
+			context->vm->wakeTime = partialResult.Result().DoubleValue();
 			return partialResult;
 		}
 	}
@@ -872,6 +1103,461 @@ namespace MiniScript {
 		return IntrinsicResult::Null;
 	}
 
+	//------------------------------------------------------------------------------------------
+	// Green threads (see Machine::Spawn), and channels for passing values
+	// between them.  Both are maps (with a class as __isa) holding a handle.
+	// Blocking methods return a partial result, so the machine runs other
+	// threads until they can go on.
+
+	static Value _handle = Value("_handle").MakeImmortal();
+
+	class ChannelStorage : public RefCountedStorage {
+	public:
+		ChannelStorage(long capacity) : capacity(capacity), closed(false) {
+			accountFor(MemoryKind::Handle, sizeof(ChannelStorage));
+		}
+
+		std::deque<Value> items;
+		long capacity;		// most items it holds before send blocks (or 0 for no limit)
+		bool closed;
+	};
+
+	static bool disallowAssignment(ValueDict& dict, Value key, Value value) {
+		return true;
+	}
+
+	// (These classes are shared by all interpreters, so they're immortal, and
+	// scripts may not change them.)
+	static Value newThreadClass() {
+		MemoryAccount::Scope scope(nullptr);
+		ValueDict d;
+		d.SetValue("join", i_threadJoin->GetFunc());
+		d.SetValue("done", i_threadDone->GetFunc());
+		d.SetAssignOverride(disallowAssignment);
+		return Value(d).MakeImmortal();
+	}
+
+	static Value newChannelClass() {
+		MemoryAccount::Scope scope(nullptr);
+		ValueDict d;
+		d.SetValue("send", i_channelSend->GetFunc());
+		d.SetValue("receive", i_channelReceive->GetFunc());
+		d.SetValue("close", i_channelClose->GetFunc());
+		d.SetAssignOverride(disallowAssignment);
+		return Value(d).MakeImmortal();
+	}
+
+	// Get the storage of the given kind from the _handle of the given map (or
+	// nullptr, if it hasn't got one).
+	template <class T> static T* handleOf(Value instance) {
+		if (instance.type != ValueType::Map) return nullptr;
+		Value handle = instance.Lookup(_handle);
+		if (handle.type != ValueType::Handle) return nullptr;
+		return dynamic_cast<T*>(handle.data.ref);
+	}
+
+	static IntrinsicResult intrinsic_spawn(Context *context, IntrinsicResult partialResult) {
+		Value f = context->GetVar("f");
+		Value args = context->GetVar("args");
+		if (f.type != ValueType::Function) TypeException("spawn requires a function").raise();
+		if (not args.IsNull() and args.type != ValueType::List) TypeException("spawn args must be a list").raise();
+		static const Value threadClass = newThreadClass();
+		ValueDict instance;
+		instance.SetValue(Value::magicIsA, threadClass);
+		instance.SetValue(_handle, context->vm->Spawn((FunctionStorage*)f.data.ref, args.IsNull() ? ValueList() : args.GetList()));
+		return IntrinsicResult(instance);
+	}
+
+	static IntrinsicResult intrinsic_threadJoin(Context *context, IntrinsicResult partialResult) {
+		ThreadStorage *thread = handleOf<ThreadStorage>(context->GetVar("self"));
+		if (not thread) return IntrinsicResult::Null;
+		if (thread->state == ThreadStorage::State::Finished) return IntrinsicResult(thread->result);
+		return partialResult.Done() ? IntrinsicResult(Value::null, false) : partialResult;
+	}
+
+	static IntrinsicResult intrinsic_threadDone(Context *context, IntrinsicResult partialResult) {
+		ThreadStorage *thread = handleOf<ThreadStorage>(context->GetVar("self"));
+		return IntrinsicResult(Value::Truth(not thread or thread->state == ThreadStorage::State::Finished));
+	}
+
+	// Make a channel map with the given handle.
+	static Value newChannel(RefCountedStorage *handle) {
+		static const Value channelClass = newChannelClass();
+		ValueDict instance;
+		instance.SetValue(Value::magicIsA, channelClass);
+		instance.SetValue(_handle, Value::NewHandle(handle));
+		return instance;
+	}
+
+	static IntrinsicResult intrinsic_channel(Context *context, IntrinsicResult partialResult) {
+		long capacity = context->GetVar("capacity").IntValue();
+		if (capacity < 0) capacity = 0;
+		return IntrinsicResult(newChannel(new ChannelStorage(capacity)));
+	}
+
+	// A channel may also stand for a MessageChannel, shared with interpreters
+	// on other threads (see MessageChannel.h); the methods handle both.
+	static IntrinsicResult intrinsic_sharedChannel(Context *context, IntrinsicResult partialResult) {
+		Value name = context->GetVar("name");
+		if (name.type != ValueType::String) TypeException("sharedChannel name must be a string").raise();
+		long capacity = context->GetVar("capacity").IntValue();
+		return IntrinsicResult(Intrinsics::MessageChannelValue(MessageChannel::Named(name.ToString(), capacity)));
+	}
+
+	static IntrinsicResult intrinsic_channelSend(Context *context, IntrinsicResult partialResult) {
+		Value self = context->GetVar("self");
+		if (MessageChannelStorage *shared = handleOf<MessageChannelStorage>(self)) {
+			if (shared->channel->TrySend(context->GetVar("value"))) return IntrinsicResult::Null;
+			return partialResult.Done() ? IntrinsicResult(Value::null, false) : partialResult;
+		}
+		ChannelStorage *channel = handleOf<ChannelStorage>(self);
+		if (not channel) return IntrinsicResult::Null;
+		if (channel->closed) RuntimeException("can't send to a closed channel").raise();
+		if (channel->capacity > 0 and (long)channel->items.size() >= channel->capacity) {
+			// Full; wait until somebody takes something out.
+			return partialResult.Done() ? IntrinsicResult(Value::null, false) : partialResult;
+		}
+		channel->items.push_back(context->GetVar("value"));
+		return IntrinsicResult::Null;
+	}
+
+	static IntrinsicResult intrinsic_channelReceive(Context *context, IntrinsicResult partialResult) {
+		Value self = context->GetVar("self");
+		if (MessageChannelStorage *shared = handleOf<MessageChannelStorage>(self)) {
+			Value result;
+			if (shared->channel->TryReceive(&result)) return IntrinsicResult(result);
+			if (shared->channel->Closed()) {
+				// (Check again: something may have been sent just before it closed.)
+				if (shared->channel->TryReceive(&result)) return IntrinsicResult(result);
+				return IntrinsicResult::Null;
+			}
+			return partialResult.Done() ? IntrinsicResult(Value::null, false) : partialResult;
+		}
+		ChannelStorage *channel = handleOf<ChannelStorage>(self);
+		if (not channel) return IntrinsicResult::Null;
+		if (channel->items.empty()) {
+			if (channel->closed) return IntrinsicResult::Null;
+			// Empty; wait until somebody sends something.
+			return partialResult.Done() ? IntrinsicResult(Value::null, false) : partialResult;
+		}
+		Value result = channel->items.front();
+		channel->items.pop_front();
+		return IntrinsicResult(result);
+	}
+
+	static IntrinsicResult intrinsic_channelClose(Context *context, IntrinsicResult partialResult) {
+		Value self = context->GetVar("self");
+		if (MessageChannelStorage *shared = handleOf<MessageChannelStorage>(self)) shared->channel->Close();
+		ChannelStorage *channel = handleOf<ChannelStorage>(self);
+		if (channel) channel->closed = true;
+		return IntrinsicResult::Null;
+	}
+
+	Value Intrinsics::MessageChannelValue(std::shared_ptr<MessageChannel> channel) {
+		return newChannel(new MessageChannelStorage(channel));
+	}
+
+	//------------------------------------------------------------------------------------------
+	// parallelMap: call a function on each item of a list, on several threads
+	// at once, and return the results in order.  Each worker thread has its
+	// own machine and memory account, with copies (see Value::DeepCopy) of the
+	// function and of the globals it refers to.  Items are copied to the
+	// workers a block at a time (except frozen ones, which are shared), and
+	// the results copied back.  So the function should be pure: anything it
+	// changes is only a copy.  Output is held and printed in order; the first
+	// error (in list order) is raised here, with its location in the function.
+	// A function that waits (e.g. on a channel) puts its worker to sleep.
+
+	// Finds the names of the globals needed by some code: the variables that
+	// code refers to, and those that the values of those refer to, and so on.
+	class GlobalsNeeded {
+	public:
+		GlobalsNeeded(ValueDict globals) : globals(globals), all(false), handle(false), globalsValue(globals) {}
+
+		ValueDict globals;
+		ValueDict names;	// (name -> value) of globals needed
+		bool all;			// true if the code looks at globals or outer directly
+		bool handle;		// true if any of what we've scanned holds a handle (which can't be copied)
+
+		void Add(const Value& v) {
+			pending.push_back(v);
+			while (not pending.empty()) {
+				Value item = pending.back();
+				pending.pop_back();
+				scan(item);
+			}
+		}
+
+	private:
+		Value globalsValue;
+		std::vector<Value> pending;
+		std::unordered_set<const RefCountedStorage*> seen;
+
+		void scan(Value v) {
+			if (v.type == ValueType::Var) {
+				Value name(v.GetString());
+				if (name.GetString() == "globals" or name.GetString() == "outer") all = true;
+				Value value;
+				if (not names.ContainsKey(name) and globals.Get(name, &value)) {
+					names.SetValue(name, value);
+					pending.push_back(value);
+				}
+				return;
+			}
+			if (v.type < ValueType::List or not v.data.ref) return;
+			if (seen.count(v.data.ref)) return;
+			seen.insert(v.data.ref);
+			switch (v.type) {
+				case ValueType::List: {
+					long count = v.ListCount();
+					for (long i=0; i<count; i++) pending.push_back(v.ListItem(i));
+				} break;
+				case ValueType::Map: {
+					for (ValueDictIterator kv = v.GetDict().GetIterator(); not kv.Done(); kv.Next()) {
+						pending.push_back(kv.Key());
+						pending.push_back(kv.Value());
+					}
+				} break;
+				case ValueType::Function: {
+					FunctionStorage *fs = (FunctionStorage*)v.data.ref;
+					for (long i=0; i<fs->parameters.Count(); i++) pending.push_back(fs->parameters[i].defaultValue);
+					for (long i=0; i<fs->code.Count(); i++) {
+						TACLine& line = fs->code[i];
+						pending.push_back(line.lhs);
+						pending.push_back(line.rhsA);
+						pending.push_back(line.rhsB);
+					}
+					Value outer(fs->outerVars);
+					if (not outer.RefEquals(globalsValue)) pending.push_back(outer);
+				} break;
+				case ValueType::Handle:
+					handle = true;
+					break;
+				case ValueType::SeqElem: {
+					SeqElemStorage *se = (SeqElemStorage*)v.data.ref;
+					pending.push_back(se->sequence);
+					pending.push_back(se->index);
+				} break;
+				default:
+					break;
+			}
+		}
+	};
+
+	struct MapJob;
+
+	struct MapWorker {
+		MemoryAccount *account;
+		Machine *vm;
+		Value func;
+		ValueCopies shared;		// copies of the function and globals
+		std::vector<std::pair<long, Value> > results;
+		long errorIndex;		// item that raised an error (or LONG_MAX)
+		std::string errorMessage;
+		std::string errorContext;
+		int errorLine;
+		bool limitExceeded;
+		std::thread thread;
+
+		MapWorker() : account(new MemoryAccount()), vm(nullptr), errorIndex(LONG_MAX), errorLine(0), limitExceeded(false) {}
+
+		// Free everything we made, under our own account.
+		~MapWorker() {
+			if (thread.joinable()) thread.join();
+			{
+				MemoryAccount::Scope scope(account);
+				results.clear();
+				func = Value::null;
+				shared = ValueCopies();
+				delete vm;
+				DeferredRelease::DrainAll();
+				CycleCollector::Collect();
+			}
+			account->Abandon();
+		}
+
+		// Note that item i raised the given error, and stop the others from
+		// starting on any item after it.
+		void fail(MapJob *job, long i, const String& message, const String& context, int line, bool overLimit);
+	};
+
+	// Output held for printing later: the text and line-break flag of each
+	// call to standardOutput, in order.
+	typedef std::vector<std::pair<std::string, bool> > PrintedText;
+
+	struct MapJob {
+		ValueList items;						// (if not packed)
+		SimpleVector<double> *numbers;			// (if packed)
+		long count;
+		long blockSize;
+		std::vector<PrintedText> blockOutput;	// what each block printed
+		std::atomic<long> nextBlock;
+		std::atomic<long> stopAt;				// first item that raised an error
+	};
+
+	void MapWorker::fail(MapJob *job, long i, const String& message, const String& context, int line, bool overLimit) {
+		errorIndex = i;
+		errorMessage = message.c_str();
+		errorContext = context.c_str();
+		errorLine = line;
+		limitExceeded = overLimit;
+		vm->Stop();
+		long prev = job->stopAt;
+		while (i < prev and not job->stopAt.compare_exchange_weak(prev, i)) {}
+	}
+
+	// Output of the block that this thread is working on.
+	static thread_local PrintedText *capturedOutput = nullptr;
+
+	static void captureOutput(String text, bool addLineBreak) {
+		if (not capturedOutput) return;
+		capturedOutput->push_back(std::make_pair(std::string(text.c_str(), text.sizeB()), addLineBreak));
+	}
+
+	static void runMapWorker(MapWorker *w, MapJob *job) {
+		MemoryAccount::Scope scope(w->account);
+		Context *root = w->vm->GetGlobalContext();
+		FunctionStorage *fs = (FunctionStorage*)w->func.data.ref;
+		Reactor reactor;	// (to sleep in while the function waits for something)
+		while (true) {
+			long block = job->nextBlock++;
+			long start = block * job->blockSize;
+			if (start >= job->count or start > job->stopAt) break;
+			long end = std::min(start + job->blockSize, job->count);
+			capturedOutput = &job->blockOutput[block];
+			long i = start;
+			try {
+				for (; i < end and i <= job->stopAt; i++) {
+					ValueList args;
+					if (job->numbers) args.Add((*job->numbers)[i]);
+					else {
+						ValueCopies itemCopies(&w->shared);
+						args.Add(job->items[i].DeepCopy(itemCopies));
+					}
+					w->vm->ManuallyPushCall(fs, args, Value::Temp(0));
+					while (not w->vm->Done()) {
+						w->vm->Step();
+						if (w->vm->Waiting()) reactor.Wait(w->vm);
+					}
+					w->results.push_back(std::make_pair(i, root->GetTemp(0)));
+				}
+			} catch (const MiniscriptException& mse) {
+				bool overLimit = (dynamic_cast<const LimitExceededException*>(&mse) != nullptr);
+				w->fail(job, i, mse.message, mse.location.context, mse.location.lineNum, overLimit);
+				break;
+			} catch (const std::bad_alloc&) {
+				// (Nothing may escape this thread, so these become errors too.)
+				w->fail(job, i, "out of memory", "", 0, true);
+				break;
+			} catch (...) {
+				w->fail(job, i, "parallelMap: unexpected error", "", 0, false);
+				break;
+			}
+		}
+		capturedOutput = nullptr;
+	}
+
+	static IntrinsicResult intrinsic_parallelMap(Context *context, IntrinsicResult partialResult) {
+		Value list = context->GetVar("list");
+		Value func = context->GetVar("func");
+		long threadCount = context->GetVar("threads").IntValue();
+		if (list.type != ValueType::List) TypeException("parallelMap requires a list").raise();
+		if (func.type != ValueType::Function) TypeException("parallelMap requires a function").raise();
+
+		MapJob job;
+		job.numbers = list.GetNumbers();
+		if (not job.numbers) job.items = list.GetList();
+		job.count = list.ListCount();
+		if (job.count == 0) return IntrinsicResult(Value::NewNumberList());
+		if (threadCount <= 0) threadCount = (long)std::thread::hardware_concurrency();
+		if (threadCount <= 0) threadCount = 1;
+		if (threadCount > job.count) threadCount = job.count;
+		job.blockSize = std::max(1L, std::min(1024L, job.count / (threadCount * 8)));
+		long blockCount = (job.count + job.blockSize - 1) / job.blockSize;
+		job.blockOutput.resize(blockCount);
+		job.nextBlock = 0;
+		job.stopAt = LONG_MAX;
+
+		// Find the globals the function needs (none of which may hold a handle,
+		// since those can't be copied), and give each worker a copy.  (The
+		// workers free everything they made when they go away, however we leave.)
+		ValueDict globals = context->vm->GetGlobalContext()->variables;
+		GlobalsNeeded needed(globals);
+		needed.Add(func);
+		if (needed.all) {
+			needed.names = globals;
+			needed.Add(Value(globals));
+		}
+		if (needed.handle) TypeException("parallelMap can't copy a handle (like a file or channel) to its workers").raise();
+		MemoryAccount *callerAccount = MemoryAccount::current;
+		std::vector<std::unique_ptr<MapWorker> > workers;
+		for (long t=0; t<threadCount; t++) {
+			workers.push_back(std::unique_ptr<MapWorker>(new MapWorker()));
+			MapWorker *w = workers.back().get();
+			if (callerAccount) {
+				w->account->SetSoftLimit(callerAccount->SoftLimit());
+				w->account->SetHardLimit(callerAccount->HardLimit());
+			}
+			MemoryAccount::Scope scope(w->account);
+			w->vm = new Machine(new Context(), &captureOutput);
+			Context *root = w->vm->GetGlobalContext();
+			w->shared.Add(Value(globals).data.ref, Value(root->variables));
+			for (ValueDictIterator kv = needed.names.GetIterator(); not kv.Done(); kv.Next()) {
+				root->variables.SetValue(kv.Key().DeepCopy(w->shared), kv.Value().DeepCopy(w->shared));
+			}
+			w->func = func.DeepCopy(w->shared);
+		}
+
+		for (auto& w : workers) w->thread = std::thread(runMapWorker, w.get(), &job);
+		for (auto& w : workers) w->thread.join();
+
+		// Copy back the results (mapping copies of globals to the originals),
+		// and print what was printed, up to the first error.
+		ValueList results;
+		long stopAt = job.stopAt;
+		if (stopAt == LONG_MAX) {
+			results.Resize(job.count);
+			ValueCopies copies;
+			for (auto& w : workers) copies.AddReversed(w->shared);
+			for (auto& w : workers) {
+				for (auto& r : w->results) {
+					ValueCopies resultCopies(&copies);
+					results[r.first] = r.second.DeepCopy(resultCopies);
+				}
+			}
+		}
+		long lastBlock = stopAt == LONG_MAX ? blockCount - 1 : stopAt / job.blockSize;
+		for (long b=0; b<=lastBlock; b++) {
+			if (not context->vm->standardOutput) break;
+			for (auto& printed : job.blockOutput[b]) {
+				(*context->vm->standardOutput)(String(printed.first.c_str(), printed.first.size()), printed.second);
+			}
+		}
+		MapWorker *failed = nullptr;
+		for (auto& w : workers) {
+			if (stopAt != LONG_MAX and w->errorIndex == stopAt) failed = w.get();
+		}
+		std::string errorMessage, errorContext;
+		int errorLine = 0;
+		bool limitExceeded = false;
+		if (failed) {
+			errorMessage = failed->errorMessage;
+			errorContext = failed->errorContext;
+			errorLine = failed->errorLine;
+			limitExceeded = failed->limitExceeded;
+		}
+
+		workers.clear();
+
+		if (failed) {
+			String msg(errorMessage.c_str(), errorMessage.size());
+			String where(errorContext.c_str(), errorContext.size());
+			if (limitExceeded) LimitExceededException(where, errorLine, msg).raise();
+			RuntimeException(where, errorLine, msg).raise();
+		}
+		return IntrinsicResult(results);
+	}
+
 	//------------------------------------------------------------------------------------------
 	
 	IntrinsicResult Intrinsic::Execute(long id, Context *context, IntrinsicResult partialResult) {
@@ -891,12 +1577,21 @@ namespace MiniScript {
 		result->name = name;
 		result->numericID = all.Count();
 		result->function = new FunctionStorage();
-		result->valFunction = Value(result->function);
+		// Our little wrapper function is a single opcode: CallIntrinsicA.
+		// It really exists only to provide a local variable context for the parameters.
+		result->function->code.Add(TACLine(Value::Temp(0), TACLine::Op::CallIntrinsicA, Value(result->numericID)));
+		// (Intrinsics are shared by all interpreters, so they're immortal.)
+		result->valFunction = Value(result->function).MakeImmortal();
 		all.Add(result);
 		if (!name.empty()) nameMap.SetValue(name, result);
 		return result;
 	}
 	
+	void Intrinsic::AddParam(String name, Value defaultValue) {
+		function->parameters.MakeImmortal();
+		function->parameters.Add(FuncParam(name.MakeImmortal(), defaultValue.MakeImmortal()));
+	}
+
 	void Intrinsic::AddParam(String name, double defaultValue) {
 		if (defaultValue == 0) AddParam(name, Value::zero);
 		else if (defaultValue == 1) AddParam(name, Value::one);
@@ -906,17 +1601,16 @@ namespace MiniScript {
 	/// GetFunc is used internally by the compiler to get the MiniScript function
 	/// that makes an intrinsic call.
 	Value Intrinsic::GetFunc() {
-		if (function->code.Count() == 0) {
-			// Our little wrapper function is a single opcode: CallIntrinsicA.
-			// It really exists only to provide a local variable context for the parameters.
-			function->code.Add(TACLine(Value::Temp(0), TACLine::Op::CallIntrinsicA, Value(numericID)));
-		}
 		return valFunction;
 	}
 
 	void Intrinsics::InitIfNeeded() {
-		if (initialized) return;		// our work is already done; bail out
-		initialized = true;
+		// (This may be called from several threads at once; only the first does the work.)
+		std::call_once(initOnce, init);
+	}
+
+	void Intrinsics::init() {
+		MemoryAccount::Scope scope(nullptr);	// (intrinsics belong to no one interpreter)
 		Intrinsic *f;
 		
 		f = Intrinsic::Create("abs");
@@ -951,6 +1645,20 @@ namespace MiniScript {
 		f->AddParam("j", 0);
 		f->code = &intrinsic_bitXor;
 		
+		f = Intrinsic::Create("bitShiftLeft");
+		f->AddParam("i", 0);
+		f->AddParam("n", 1);
+		f->code = &intrinsic_bitShiftLeft;
+		
+		f = Intrinsic::Create("bitShiftRight");
+		f->AddParam("i", 0);
+		f->AddParam("n", 1);
+		f->code = &intrinsic_bitShiftRight;
+		
+		f = Intrinsic::Create("channel");
+		f->AddParam("capacity", 0);
+		f->code = &intrinsic_channel;
+
 		f = Intrinsic::Create("char");
 		f->AddParam("codePoint", 65);
 		f->code = &intrinsic_char;
@@ -967,10 +1675,19 @@ namespace MiniScript {
 		f->AddParam("radians", 0);
 		f->code = &intrinsic_cos;
 		
+		f = Intrinsic::Create("dot");
+		f->AddParam("self");
+		f->AddParam("other");
+		f->code = &intrinsic_dot;
+
 		f = Intrinsic::Create("floor");
 		f->AddParam("x", 0);
 		f->code = &intrinsic_floor;
 		
+		f = Intrinsic::Create("freeze");
+		f->AddParam("x");
+		f->code = &intrinsic_freeze;
+		
 		f = Intrinsic::Create("funcRef");
 		f->code = &intrinsic_function;
 		
@@ -1026,9 +1743,27 @@ namespace MiniScript {
 		f = Intrinsic::Create("map");
 		f->code = &intrinsic_map;
 		
+		f = Intrinsic::Create("max");
+		f->AddParam("self");
+		f->code = &intrinsic_max;
+
+		f = Intrinsic::Create("mean");
+		f->AddParam("self");
+		f->code = &intrinsic_mean;
+
+		f = Intrinsic::Create("min");
+		f->AddParam("self");
+		f->code = &intrinsic_min;
+
 		f = Intrinsic::Create("number");
 		f->code = &intrinsic_number;
 		
+		f = Intrinsic::Create("parallelMap");
+		f->AddParam("list");
+		f->AddParam("func");
+		f->AddParam("threads", 0);
+		f->code = &intrinsic_parallelMap;
+		
 		f = Intrinsic::Create("pi");
 		f->code = &intrinsic_pi;
 		
@@ -1102,6 +1837,11 @@ namespace MiniScript {
 		f->AddParam("ascending", 1);
 		f->code = &intrinsic_sort;
 		
+		f = Intrinsic::Create("spawn");
+		f->AddParam("f");
+		f->AddParam("args");
+		f->code = &intrinsic_spawn;
+
 		f = Intrinsic::Create("split");
 		f->AddParam("self");
 		f->AddParam("delimiter", " ");
@@ -1126,6 +1866,11 @@ namespace MiniScript {
 		f->AddParam("self");
 		f->code = &intrinsic_shuffle;
 
+		f = Intrinsic::Create("sharedChannel");
+		f->AddParam("name");
+		f->AddParam("capacity", 64);
+		f->code = &intrinsic_sharedChannel;
+
 		f = Intrinsic::Create("sum");
 		f->AddParam("self");
 		f->code = &intrinsic_sum;
@@ -1159,6 +1904,49 @@ namespace MiniScript {
 		f = Intrinsic::Create("yield");
 		f->code = &intrinsic_yield;
 		
+		// Elementwise arithmetic on lists of numbers.  (These are list methods
+		// only; globals named "plus", "times" etc. would get in the way.)
+		i_plus = Intrinsic::Create("");
+		i_plus->AddParam("self");
+		i_plus->AddParam("other");
+		i_plus->code = &intrinsic_plus;
+
+		i_minus = Intrinsic::Create("");
+		i_minus->AddParam("self");
+		i_minus->AddParam("other");
+		i_minus->code = &intrinsic_minus;
+
+		i_times = Intrinsic::Create("");
+		i_times->AddParam("self");
+		i_times->AddParam("other");
+		i_times->code = &intrinsic_times;
+
+		i_dividedBy = Intrinsic::Create("");
+		i_dividedBy->AddParam("self");
+		i_dividedBy->AddParam("other");
+		i_dividedBy->code = &intrinsic_dividedBy;
+
+		// Thread and channel methods.
+		i_threadJoin = Intrinsic::Create("");
+		i_threadJoin->AddParam("self");
+		i_threadJoin->code = &intrinsic_threadJoin;
+
+		i_threadDone = Intrinsic::Create("");
+		i_threadDone->AddParam("self");
+		i_threadDone->code = &intrinsic_threadDone;
+
+		i_channelSend = Intrinsic::Create("");
+		i_channelSend->AddParam("self");
+		i_channelSend->AddParam("value");
+		i_channelSend->code = &intrinsic_channelSend;
+
+		i_channelReceive = Intrinsic::Create("");
+		i_channelReceive->AddParam("self");
+		i_channelReceive->code = &intrinsic_channelReceive;
+
+		i_channelClose = Intrinsic::Create("");
+		i_channelClose->AddParam("self");
+		i_channelClose->code = &intrinsic_channelClose;
 	}
 	
 	// Helper method to compile a call to Slice (when invoked directly via slice syntax).
@@ -1187,84 +1975,109 @@ namespace MiniScript {
 
 	}
 	
+	// The core type maps are built just once, and shared by all interpreters
+	// (each VM makes its own copy of them, which scripts may change).
+	static Value newFunctionType() {
+		MemoryAccount::Scope scope(nullptr);
+		ValueDict d;
+		return Value(d).MakeImmortal();
+	}
+
 	Value Intrinsics::FunctionType() {
-		if (_functionType.IsNull()) {
-			ValueDict d;
-			_functionType = d;
-		}
-		return _functionType;
+		static const Value type = newFunctionType();
+		return type;
+	}
+
+	static Value newListType() {
+		MemoryAccount::Scope scope(nullptr);
+		ValueDict d;
+		d.SetValue("hasIndex", Intrinsic::GetByName("hasIndex")->GetFunc());
+		d.SetValue("indexes", Intrinsic::GetByName("indexes")->GetFunc());
+		d.SetValue("indexOf",  Intrinsic::GetByName("indexOf")->GetFunc());
+		d.SetValue("insert",  Intrinsic::GetByName("insert")->GetFunc());
+		d.SetValue("join",  Intrinsic::GetByName("join")->GetFunc());
+		d.SetValue("len",  Intrinsic::GetByName("len")->GetFunc());
+		d.SetValue("pop",  Intrinsic::GetByName("pop")->GetFunc());
+		d.SetValue("pull",  Intrinsic::GetByName("pull")->GetFunc());
+		d.SetValue("push",  Intrinsic::GetByName("push")->GetFunc());
+		d.SetValue("shuffle",  Intrinsic::GetByName("shuffle")->GetFunc());
+		d.SetValue("sort",  Intrinsic::GetByName("sort")->GetFunc());
+		d.SetValue("sum",  Intrinsic::GetByName("sum")->GetFunc());
+		d.SetValue("remove",  Intrinsic::GetByName("remove")->GetFunc());
+		d.SetValue("replace",  Intrinsic::GetByName("replace")->GetFunc());
+		d.SetValue("values",  Intrinsic::GetByName("values")->GetFunc());
+		d.SetValue("min",  Intrinsic::GetByName("min")->GetFunc());
+		d.SetValue("max",  Intrinsic::GetByName("max")->GetFunc());
+		d.SetValue("mean",  Intrinsic::GetByName("mean")->GetFunc());
+		d.SetValue("dot",  Intrinsic::GetByName("dot")->GetFunc());
+		d.SetValue("plus",  i_plus->GetFunc());
+		d.SetValue("minus",  i_minus->GetFunc());
+		d.SetValue("times",  i_times->GetFunc());
+		d.SetValue("dividedBy",  i_dividedBy->GetFunc());
+		return Value(d).MakeImmortal();
 	}
 
 	Value Intrinsics::ListType() {
-		if (_listType.IsNull()) {
-			ValueDict d;
-			d.SetValue("hasIndex", Intrinsic::GetByName("hasIndex")->GetFunc());
-			d.SetValue("indexes", Intrinsic::GetByName("indexes")->GetFunc());
-			d.SetValue("indexOf",  Intrinsic::GetByName("indexOf")->GetFunc());
-			d.SetValue("insert",  Intrinsic::GetByName("insert")->GetFunc());
-			d.SetValue("join",  Intrinsic::GetByName("join")->GetFunc());
-			d.SetValue("len",  Intrinsic::GetByName("len")->GetFunc());
-			d.SetValue("pop",  Intrinsic::GetByName("pop")->GetFunc());
-			d.SetValue("pull",  Intrinsic::GetByName("pull")->GetFunc());
-			d.SetValue("push",  Intrinsic::GetByName("push")->GetFunc());
-			d.SetValue("shuffle",  Intrinsic::GetByName("shuffle")->GetFunc());
-			d.SetValue("sort",  Intrinsic::GetByName("sort")->GetFunc());
-			d.SetValue("sum",  Intrinsic::GetByName("sum")->GetFunc());
-			d.SetValue("remove",  Intrinsic::GetByName("remove")->GetFunc());
-			d.SetValue("replace",  Intrinsic::GetByName("replace")->GetFunc());
-			d.SetValue("values",  Intrinsic::GetByName("values")->GetFunc());
-			_listType = d;
-		}
-		return _listType;
+		static const Value type = newListType();
+		return type;
+	}
+
+	static Value newMapType() {
+		MemoryAccount::Scope scope(nullptr);
+		ValueDict d;
+		d.SetValue("hasIndex",  Intrinsic::GetByName("hasIndex")->GetFunc());
+		d.SetValue("indexes",  Intrinsic::GetByName("indexes")->GetFunc());
+		d.SetValue("indexOf",  Intrinsic::GetByName("indexOf")->GetFunc());
+		d.SetValue("len",  Intrinsic::GetByName("len")->GetFunc());
+		d.SetValue("pop",  Intrinsic::GetByName("pop")->GetFunc());
+		d.SetValue("pull",  Intrinsic::GetByName("pull")->GetFunc());
+		d.SetValue("push",  Intrinsic::GetByName("push")->GetFunc());
+		d.SetValue("shuffle",  Intrinsic::GetByName("shuffle")->GetFunc());
+		d.SetValue("sum",  Intrinsic::GetByName("sum")->GetFunc());
+		d.SetValue("remove",  Intrinsic::GetByName("remove")->GetFunc());
+		d.SetValue("replace",  Intrinsic::GetByName("replace")->GetFunc());
+		d.SetValue("values",  Intrinsic::GetByName("values")->GetFunc());
+		return Value(d).MakeImmortal();
 	}
 
 	Value Intrinsics::MapType() {
-		if (_mapType.IsNull()) {
-			ValueDict d;
-			d.SetValue("hasIndex",  Intrinsic::GetByName("hasIndex")->GetFunc());
-			d.SetValue("indexes",  Intrinsic::GetByName("indexes")->GetFunc());
-			d.SetValue("indexOf",  Intrinsic::GetByName("indexOf")->GetFunc());
-			d.SetValue("len",  Intrinsic::GetByName("len")->GetFunc());
-			d.SetValue("pop",  Intrinsic::GetByName("pop")->GetFunc());
-			d.SetValue("pull",  Intrinsic::GetByName("pull")->GetFunc());
-			d.SetValue("push",  Intrinsic::GetByName("push")->GetFunc());
-			d.SetValue("shuffle",  Intrinsic::GetByName("shuffle")->GetFunc());
-			d.SetValue("sum",  Intrinsic::GetByName("sum")->GetFunc());
-			d.SetValue("remove",  Intrinsic::GetByName("remove")->GetFunc());
-			d.SetValue("replace",  Intrinsic::GetByName("replace")->GetFunc());
-			d.SetValue("values",  Intrinsic::GetByName("values")->GetFunc());
-			_mapType = d;
-		}
-		return _mapType;
+		static const Value type = newMapType();
+		return type;
 	}
 	
+	static Value newNumberType() {
+		MemoryAccount::Scope scope(nullptr);
+		ValueDict d;
+		return Value(d).MakeImmortal();
+	}
+
 	Value Intrinsics::NumberType() {
-		if (_numberType.IsNull()) {
-			ValueDict d;
-			_numberType = d;
-		}
-		return _numberType;
+		static const Value type = newNumberType();
+		return type;
 	}
 	
+	static Value newStringType() {
+		MemoryAccount::Scope scope(nullptr);
+		ValueDict d;
+		d.SetValue("hasIndex",  Intrinsic::GetByName("hasIndex")->GetFunc());
+		d.SetValue("indexes",  Intrinsic::GetByName("indexes")->GetFunc());
+		d.SetValue("indexOf",  Intrinsic::GetByName("indexOf")->GetFunc());
+		d.SetValue("insert",  Intrinsic::GetByName("insert")->GetFunc());
+		d.SetValue("code",  Intrinsic::GetByName("code")->GetFunc());
+		d.SetValue("len",  Intrinsic::GetByName("len")->GetFunc());
+		d.SetValue("lower",  Intrinsic::GetByName("lower")->GetFunc());
+		d.SetValue("val",  Intrinsic::GetByName("val")->GetFunc());
+		d.SetValue("remove",  Intrinsic::GetByName("remove")->GetFunc());
+		d.SetValue("replace",  Intrinsic::GetByName("replace")->GetFunc());
+		d.SetValue("split",  Intrinsic::GetByName("split")->GetFunc());
+		d.SetValue("upper",  Intrinsic::GetByName("upper")->GetFunc());
+		d.SetValue("values",  Intrinsic::GetByName("values")->GetFunc());
+		return Value(d).MakeImmortal();
+	}
+
 	Value Intrinsics::StringType() {
-		if (_stringType.IsNull()) {
-			ValueDict d;
-			d.SetValue("hasIndex",  Intrinsic::GetByName("hasIndex")->GetFunc());
-			d.SetValue("indexes",  Intrinsic::GetByName("indexes")->GetFunc());
-			d.SetValue("indexOf",  Intrinsic::GetByName("indexOf")->GetFunc());
-			d.SetValue("insert",  Intrinsic::GetByName("insert")->GetFunc());
-			d.SetValue("code",  Intrinsic::GetByName("code")->GetFunc());
-			d.SetValue("len",  Intrinsic::GetByName("len")->GetFunc());
-			d.SetValue("lower",  Intrinsic::GetByName("lower")->GetFunc());
-			d.SetValue("val",  Intrinsic::GetByName("val")->GetFunc());
-			d.SetValue("remove",  Intrinsic::GetByName("remove")->GetFunc());
-			d.SetValue("replace",  Intrinsic::GetByName("replace")->GetFunc());
-			d.SetValue("split",  Intrinsic::GetByName("split")->GetFunc());
-			d.SetValue("upper",  Intrinsic::GetByName("upper")->GetFunc());
-			d.SetValue("values",  Intrinsic::GetByName("values")->GetFunc());
-			_stringType = Value(d);
-		}
-		return _stringType;
+		static const Value type = newStringType();
+		return type;
 	}
 
 }
@@ -26,13 +26,16 @@
 #define MINISCRIPTINTRINSICS_H
 
 #include "MiniscriptTypes.h"
+#include <memory>
 
 namespace MiniScript {
 
 	class Context;
+	class MessageChannel;
 
 	// Host app information.  If you fill these in, they will be presented to
-	// the user via the `version` intrinsic.
+	// the user via the `version` intrinsic.  (Set them before starting any
+	// threads that run scripts.)
 	extern String hostName;
 	extern String hostInfo;
 	extern double hostVersion;
@@ -53,8 +56,12 @@ namespace MiniScript {
 		static Value MapType();
 		static Value NumberType();
 		static Value StringType();
+
+		// Make a channel (like the channel intrinsic returns) for the given
+		// MessageChannel, to give to an interpreter (say, with SetGlobalValue).
+		static Value MessageChannelValue(std::shared_ptr<MessageChannel> channel);
 	private:
-		static bool initialized;
+		static void init();
 	};
 	
 	class IntrinsicResultStorage : public RefCountedStorage {
@@ -77,13 +84,17 @@ namespace MiniScript {
 			rs->done = done;
 		}
 		IntrinsicResult(const IntrinsicResult& other) {	((IntrinsicResult&)other).ensureStorage(); rs = other.rs; retain(); }
-		IntrinsicResult& operator= (const IntrinsicResult& other) {	((IntrinsicResult&)other).ensureStorage(); other.rs->refCount++; release(); rs = other.rs; return *this; }
+		IntrinsicResult& operator= (const IntrinsicResult& other) {	((IntrinsicResult&)other).ensureStorage(); other.rs->retain(); release(); rs = other.rs; return *this; }
 
 		~IntrinsicResult() { release(); }
 		
 		bool Done() { return not rs or rs->done; }
 		Value Result() { return rs ? rs->result : Value::null; }
 
+		// Make this result (and its value) immortal, so it can be shared
+		// between threads (see Value::MakeImmortal).  Returns *this.
+		IntrinsicResult& MakeImmortal() { ensureStorage(); rs->result.MakeImmortal(); rs->MakeImmortal(); return *this; }
+
 		static IntrinsicResult Null;		// represents a completed, null result
 		static IntrinsicResult EmptyString;	// represents "" (empty string) result
 		
@@ -91,8 +102,8 @@ namespace MiniScript {
 		IntrinsicResult(IntrinsicResultStorage* storage) : rs(storage) {}  // (assumes we grab an existing reference)
 		void forget() { rs = nullptr; }
 		
-		void retain() { if (rs) rs->refCount++; }
-		void release() { if (rs and --(rs->refCount) == 0) { delete rs; rs = nullptr; } }
+		void retain() { if (rs) rs->retain(); }
+		void release() { if (rs) { rs->release(); rs = nullptr; } }
 		void ensureStorage() { if (!rs) rs = new IntrinsicResultStorage(); }
 		IntrinsicResultStorage *rs;
 	};
@@ -108,7 +119,7 @@ namespace MiniScript {
 		// a numeric ID (used internally -- don't worry about this)
 		long id() { return numericID; }
 		
-		void AddParam(String name, Value defaultValue) { function->parameters.Add(FuncParam(name, defaultValue)); }
+		void AddParam(String name, Value defaultValue);
 		void AddParam(String name, double defaultValue);
 		void AddParam(String name) { AddParam(name, Value::null); }
 
@@ -149,7 +160,6 @@ namespace MiniScript {
 		static Dictionary<String, Intrinsic*, hashString> nameMap;
 	};
 
-	void InitRand(unsigned int seed);
 }
 
 
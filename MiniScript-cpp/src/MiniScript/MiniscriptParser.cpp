@@ -10,6 +10,9 @@
 #include "MiniscriptErrors.h"
 #include "MiniscriptIntrinsics.h"
 #include "UnitTest.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
 
 namespace MiniScript {
 	
@@ -780,7 +783,9 @@ namespace MiniScript {
 		Value val = (*this.*nextLevel)(tokens, false, false);
 		if (val.type == ValueType::Number) {
 			// If what follows is a numeric literal, just invert it and be done!
-			val.data.number = -val.data.number;
+			// (Integer zero becomes -0.0, just as it would in floating point.)
+			if (val.isInt and val.data.integer != 0) val.data.integer = -val.data.integer;
+			else val = Value(-val.DoubleValue());
 			return val;
 		}
 		// Otherwise, subtract it from 0 and return a new temporary.
@@ -1055,6 +1060,15 @@ namespace MiniScript {
 	Value Parser::ParseAtom(Lexer tokens, bool asLval, bool statementStart) {
 		Token tok = !tokens.atEnd() ? tokens.Dequeue() : Token::EOL;
 		if (tok.type == Token::Type::Number) {
+			// Plain digits make an integer, if it fits in 64 bits.
+			const char *text = tok.text.c_str();
+			size_t lenB = tok.text.LengthB();
+			if (lenB > 0 and strspn(text, "0123456789") == lenB) {
+				char *end;
+				errno = 0;
+				unsigned long long u = strtoull(text, &end, 10);
+				if (errno == 0 and u <= (unsigned long long)INT64_MAX) return Value::Integer((int64_t)u);
+			}
 			int ok = 0;
 			double retval = 0;
 			if (tok.text.LengthB() > 0 && tok.text[tok.text.LengthB()-1] != 'e') {
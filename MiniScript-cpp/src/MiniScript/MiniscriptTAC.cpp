@@ -9,6 +9,7 @@
 #include "MiniscriptTAC.h"
 #include <math.h>		// for pow() and fmod()
 #include <cmath>		// for std::signbit()
+#include <atomic>
 #if _WIN32 || _WIN64
 	#include <windows.h>	// for GetTickCount
 #else
@@ -23,6 +24,42 @@ namespace MiniScript {
 		if (d > 1) return 1;
 		return d;
 	}
+
+	// 64-bit integer arithmetic that reports overflow (by returning false)
+	// rather than wrapping around.
+	static inline bool AddInt64(int64_t a, int64_t b, int64_t *result) {
+	#if defined(__GNUC__) || defined(__clang__)
+		return not __builtin_add_overflow(a, b, result);
+	#else
+		if ((b > 0 and a > INT64_MAX - b) or (b < 0 and a < INT64_MIN - b)) return false;
+		*result = a + b;
+		return true;
+	#endif
+	}
+
+	static inline bool SubtractInt64(int64_t a, int64_t b, int64_t *result) {
+	#if defined(__GNUC__) || defined(__clang__)
+		return not __builtin_sub_overflow(a, b, result);
+	#else
+		if ((b < 0 and a > INT64_MAX + b) or (b > 0 and a < INT64_MIN + b)) return false;
+		*result = a - b;
+		return true;
+	#endif
+	}
+
+	static inline bool MultiplyInt64(int64_t a, int64_t b, int64_t *result) {
+	#if defined(__GNUC__) || defined(__clang__)
+		return not __builtin_mul_overflow(a, b, result);
+	#else
+		if (a != 0 and b != 0) {
+			if ((a == -1 and b == INT64_MIN) or (b == -1 and a == INT64_MIN)) return false;
+			if (a > 0 ? (b > 0 ? a > INT64_MAX / b : b < INT64_MIN / a)
+					  : (b > 0 ? a < INT64_MIN / b : a < INT64_MAX / b)) return false;
+		}
+		*result = a * b;
+		return true;
+	#endif
+	}
 	
 	String TACLine::ToString() {
 		String text;
@@ -212,7 +249,43 @@ namespace MiniScript {
 
 		
 		if (opA.type == ValueType::Number) {
-			double fA = opA.data.number;
+			if (opA.isInt and opB.type == ValueType::Number and opB.isInt) {
+				// Both integers: stay integral as long as the result is exact,
+				// and otherwise fall through to the floating-point code below.
+				// (That includes results that would be -0, to match it exactly.)
+				int64_t iA = opA.data.integer, iB = opB.data.integer, result;
+				switch (op) {
+					case Op::APlusB:
+						if (AddInt64(iA, iB, &result)) return Value::Integer(result);
+						break;
+					case Op::AMinusB:
+						if (SubtractInt64(iA, iB, &result)) return Value::Integer(result);
+						break;
+					case Op::ATimesB:
+						if (MultiplyInt64(iA, iB, &result) and (result != 0 or (iA >= 0 and iB >= 0))) return Value::Integer(result);
+						break;
+					case Op::AModB:
+						if (iB == 0) break;
+						result = (iB == -1 ? 0 : iA % iB);
+						if (result != 0 or iA >= 0) return Value::Integer(result);
+						break;
+					case Op::AEqualB:
+						return Value::Truth(iA == iB);
+					case Op::ANotEqualB:
+						return Value::Truth(iA != iB);
+					case Op::AGreaterThanB:
+						return Value::Truth(iA > iB);
+					case Op::AGreatOrEqualB:
+						return Value::Truth(iA >= iB);
+					case Op::ALessThanB:
+						return Value::Truth(iA < iB);
+					case Op::ALessOrEqualB:
+						return Value::Truth(iA <= iB);
+					default:
+						break;
+				}
+			}
+			double fA = opA.DoubleValue();
 			switch (op) {
 				case Op::GotoA:
 					context->lineNum = (int)fA;
@@ -240,9 +313,12 @@ namespace MiniScript {
 					// they execute directly in the current context.  (But usually, the
 					// current context is a wrapper function that was invoked via
 					// Op::CallFunction, so it got a parameter context at that time.)
+					// (Anything the last one said about when it would be ready is stale now.)
+					context->vm->wakeTime = 0;
+					context->vm->wakeFds.clear();
 					IntrinsicResult result = Intrinsic::Execute((int)fA, context, context->partialResult);
 					if (result.Done()) {
-//						context->partialResult = null;
+						if (not context->partialResult.Done()) context->partialResult = IntrinsicResult::Null;
 						return result.Result();
 					}
 					// OK, this intrinsic function is not yet done with its work.
@@ -258,7 +334,7 @@ namespace MiniScript {
 					break;
 			}
 			if (opB.type == ValueType::Number or opB.IsNull()) {
-				double fB = not opB.IsNull() ? opB.data.number : 0;
+				double fB = not opB.IsNull() ? opB.DoubleValue() : 0;
 				switch (op) {
 					case Op::APlusB:
 						return Value(fA + fB);
@@ -273,8 +349,11 @@ namespace MiniScript {
 					case Op::APowB:
 						return Value(pow(fA, fB));
 					case Op::AEqualB:
+						// (An integer and a double compare exactly, as in a map.)
+						if (opA.isInt != opB.isInt and opB.type == ValueType::Number) return Value::Truth(opA == opB);
 						return Value::Truth(fA == fB);
 					case Op::ANotEqualB:
+						if (opA.isInt != opB.isInt and opB.type == ValueType::Number) return Value::Truth(opA != opB);
 						return Value::Truth(fA != fB);
 					case Op::AGreaterThanB:
 						return Value::Truth(fA > fB);
@@ -308,10 +387,10 @@ namespace MiniScript {
 					double factor = 0;
 					if (op == Op::ATimesB) {
 						CheckType(opB, ValueType::Number, "String replication");
-						factor = opB.data.number;
+						factor = opB.DoubleValue();
 					} else {
 						CheckType(opB, ValueType::Number, "String division");
-						factor = 1.0 / opB.data.number;
+						factor = 1.0 / opB.DoubleValue();
 					}
 					int factorClass = std::fpclassify(factor);
 					if (factorClass == FP_NAN || factorClass == FP_INFINITE) return Value::null;
@@ -381,12 +460,13 @@ namespace MiniScript {
 				if (op == Op::ANotEqualB) return Value::one;
 			}
 		 } else if (opA.type == ValueType::List) {
-			 ValueList list = opA.GetList();
+			// (Careful here not to unpack a packed number list, by calling
+			// GetList, unless we really need to.)
 			if (op == Op::ElemBofA || op == Op::ElemBofIterA) {
 				// list indexing
 				return opA.GetElem(opB);
 			} else if (op == Op::LengthOfA) {
-				return Value(list.Count());
+				return Value(opA.ListCount());
 			} else if (op == Op::AEqualB) {
 				return Value::Truth(Value::Equality(opA, opB));
 			} else if (op == Op::ANotEqualB) {
@@ -394,30 +474,50 @@ namespace MiniScript {
 			} else if (op == Op::APlusB) {
 				// list concatenation
 				CheckType(opB, ValueType::List, "list concatenation");
-				ValueList list2 = opB.GetList();
-				long count1 = list.Count();
-				long count2 = list2.Count();
+				long count1 = opA.ListCount();
+				long count2 = opB.ListCount();
 				if (count1 + count2 > Value::maxListSize) LimitExceededException("list too large").raise();
+				// (A frozen list plus nothing is just that list; no need to copy it.)
+				if (count2 == 0 and opA.IsFrozen()) return opA;
+				if (count1 == 0 and opB.IsFrozen()) return opB;
+				SimpleVector<double> *nums1 = opA.GetNumbers();
+				SimpleVector<double> *nums2 = opB.GetNumbers();
+				if ((nums1 or count1 == 0) and (nums2 or count2 == 0)) {
+					// Numbers plus numbers: the result can stay packed.
+					Value result = Value::NewNumberList(count1 + count2);
+					SimpleVector<double> *numbers = result.GetNumbers();
+					for (long i=0; i<count1; i++) numbers->push_back((*nums1)[i]);
+					for (long i=0; i<count2; i++) numbers->push_back((*nums2)[i]);
+					return result;
+				}
 				ValueList result(count1 + count2);
-				for (long i=0; i<count1; i++) result.Add(list[i].Val(context));
-				for (long i=0; i<count2; i++) result.Add(list2[i].Val(context));
+				for (long i=0; i<count1; i++) result.Add(opA.ListItem(i).Val(context));
+				for (long i=0; i<count2; i++) result.Add(opB.ListItem(i).Val(context));
 				return Value(result);
 			} else if (op == Op::ATimesB || op == Op::ADividedByB) {
 				// list replication (or division)
 				double factor = 0;
 				if (op == Op::ATimesB) {
 					CheckType(opB, ValueType::Number, "list replication");
-					factor = opB.data.number;
+					factor = opB.DoubleValue();
 				} else {
 					CheckType(opB, ValueType::Number, "list division");
-					factor = 1.0 / opB.data.number;
+					factor = 1.0 / opB.DoubleValue();
 				}
 				int factorClass = std::fpclassify(factor);
 				if (factorClass == FP_NAN || factorClass == FP_INFINITE) return Value::null;
 				if (factor <= 0) return ValueList();
-				long listCount = list.Count();
+				long listCount = opA.ListCount();
 				long finalCount = (long)(listCount * factor);
 				if (finalCount > Value::maxListSize) LimitExceededException("list too large").raise();
+				SimpleVector<double> *nums = opA.GetNumbers();
+				if (nums) {
+					Value result = Value::NewNumberList(finalCount);
+					SimpleVector<double> *numbers = result.GetNumbers();
+					for (long i = 0; i < finalCount; i++) numbers->push_back((*nums)[i % listCount]);
+					return result;
+				}
+				ValueList list = opA.GetList();
 				ValueList result(finalCount);
 				for (long i = 0; i < finalCount; i++) {
 					result.Add(list[i % listCount].Val(context));
@@ -449,6 +549,8 @@ namespace MiniScript {
 				ValueDict map = opA.GetDict();
 				CheckType(opB, ValueType::Map, "map combination");
 				ValueDict map2 = opB.GetDict();
+				if (map2.Count() == 0 and opA.IsFrozen()) return opA;
+				if (map.Count() == 0 and opB.IsFrozen()) return opB;
 				ValueDict result;
 				for (ValueDictIterator i = map.GetIterator(); !i.Done(); i.Next()) {
 					result.SetValue(i.Key(), i.Value().Val(context));
@@ -498,7 +600,7 @@ namespace MiniScript {
 			// this code handles the case where opA is something else.
 			double fA = opA.BoolValue() ? 1 : 0;
 			double fB;
-			if (opB.type == ValueType::Number) fB = opB.data.number;
+			if (opB.type == ValueType::Number) fB = opB.DoubleValue();
 			else fB = opB.BoolValue() ? 1 : 0;
 			double result;
 			if (op == Op::AAndB) {
@@ -639,13 +741,19 @@ namespace MiniScript {
 //
 //	}
 	
-	Machine::Machine(Context *root, TextOutputMethod output) : stack(16), storeImplicit(false), standardOutput(output), startTime(0), yielding(false) {
+	Machine::Machine(Context *root, TextOutputMethod output) : stack(16), storeImplicit(false), standardOutput(output), startTime(0), yielding(false), wakeTime(0),
+	  globalContext(root), currentThread(0), readyCount(0) {
 		// Note: this constructor adopts the given context, and destroys it later.
 		root->vm = this;
 		stack.Add(root);
+		// Seed our random numbers from the clock, and a count of machines made
+		// so far (so machines started at the same moment still differ).
+		static std::atomic<uint64_t> machineCount(0);
+		SeedRandom((uint64_t)(CurrentWallClockTime() * 1000000) ^ (++machineCount * 0x9E3779B97F4A7C15ULL));
 	}
 	
 	Machine::~Machine() {
+		killThreads();
 		for (long i = stack.Count() - 1; i >= 0; i--) {
 			delete stack[i];
 		}
@@ -657,26 +765,199 @@ namespace MiniScript {
 		
 		if (startTime == 0) startTime = CurrentWallClockTime();
 		
+		// Between lines is a safe point to collect garbage cycles, if that's due,
+		// and to do a bit of any deferred freeing of big data.
+		if (CycleCollector::CollectionDue()) CycleCollector::Collect();
+		if (DeferredRelease::Pending()) DeferredRelease::Drain(DEFERRED_RELEASE_STEP_ITEMS);
+		
 		Context* context = stack.Last();
 		while (context->Done()) {
-			if (stack.Count() == 1) return;		// all done (can't pop the global context)
+			if (stack.Count() == 1) {
+				// All done (can't pop the bottom context).
+				if (threads.Count() > 0) finishThread();
+				return;
+			}
 			PopContext();
 			context = stack.Last();
 		}
 		
 		TACLine& line = context->code[context->lineNum++];
+		bool threaded = threads.Count() > 0;
+		if (threaded) yielding = false;
 		try {
+			// This is also where we enforce the soft memory limit, if any.
+			if (MemoryAccount::current) MemoryAccount::current->CheckSoftLimit();
 			DoOneLine(line, context);
 		} catch (MiniscriptException& mse) {
-			mse.location = line.location;
+			// (An intrinsic's own code has no location; so keep any that the
+			// error came with, e.g. from code that an intrinsic ran.)
+			if (not line.location.IsEmpty()) mse.location = line.location;
 			throw;
 		}
+		if (threaded) switchThreads();
+	}
+	
+	void Machine::Reset() {
+		killThreads();
+		while (stack.Count() > 1) delete stack.Pop();
+		stack[0]->Reset(false);
 	}
 	
 	void Machine::Stop() {
+		killThreads();
 		while (stack.Count() > 1) delete stack.Pop();
 		stack[0]->JumpToEnd();
 	}
+
+	bool Machine::Waiting() {
+		if (threads.Count() == 0) return not stack.Last()->partialResult.Done();
+		if (readyCount > 0) return false;
+		// Every thread is blocked (or has yielded, or finished).  We'll be ready
+		// when the first blocked one is -- if they all said when that would be,
+		// or what file descriptors they're waiting on.
+		wakeTime = 0;
+		wakeFds.clear();
+		for (long i=0; i<threads.Count(); i++) {
+			ThreadStorage *t = threads[i];
+			if (t->state != ThreadStorage::State::Blocked) continue;
+			if (t->wakeTime <= 0 and t->wakeFds.empty()) {
+				wakeTime = 0;
+				wakeFds.clear();
+				break;
+			}
+			if (t->wakeTime > 0 and (wakeTime == 0 or t->wakeTime < wakeTime)) wakeTime = t->wakeTime;
+			wakeFds.insert(wakeFds.end(), t->wakeFds.begin(), t->wakeFds.end());
+		}
+		return true;
+	}
+
+	Value Machine::Spawn(FunctionStorage *func, ValueList args) {
+		if (args.Count() > func->parameters.Count()) TooManyArgumentsException().raise();
+		if (threads.Count() == 0) {
+			// Our first extra thread; so, make one for the main code, too.
+			ThreadStorage *main = new ThreadStorage();
+			main->stack = stack;
+			threads.Add(main);
+			currentThread = 0;
+			readyCount = 1;
+		}
+		// The new thread starts in a call to the function, made (like a function
+		// invoked by the host) from the global context.
+		Context *context = new Context();
+		context->code = func->code;
+		context->parent = globalContext;
+		context->vm = this;
+		context->outerVars = func->outerVars;
+		for (long i = 0; i < func->parameters.Count(); i++) {
+			FuncParam& param = func->parameters[i];
+			context->SetVar(param.name, i < args.Count() ? args[i] : param.defaultValue);
+		}
+		ThreadStorage *thread = new ThreadStorage();
+		thread->stack = List<Context*>(4);
+		thread->stack.Add(context);
+		threads.Add(thread);
+		readyCount++;
+		thread->retain();		// (one reference for us, one for the handle)
+		return Value::NewHandle(thread);
+	}
+
+	void Machine::setState(ThreadStorage *thread, ThreadStorage::State state) {
+		if (thread->state == ThreadStorage::State::Ready) readyCount--;
+		if (state == ThreadStorage::State::Ready) readyCount++;
+		thread->state = state;
+	}
+
+	// Called after each step when we have threads: note whether the running
+	// thread yielded or blocked, and if so, switch to the next one.
+	void Machine::switchThreads() {
+		ThreadStorage *thread = threads[currentThread];
+		if (yielding) {
+			yielding = false;
+			setState(thread, ThreadStorage::State::Yielded);
+		} else if (not stack.Last()->partialResult.Done()) {
+			thread->wakeTime = wakeTime;
+			thread->wakeFds = wakeFds;
+			setState(thread, ThreadStorage::State::Blocked);
+		} else {
+			if (thread->state != ThreadStorage::State::Ready) setState(thread, ThreadStorage::State::Ready);
+			return;		// (keep going with this one)
+		}
+		wakeTime = 0;
+		wakeFds.clear();
+		nextThread();
+	}
+
+	// Switch to the next thread after the running one that hasn't yielded.
+	// (Blocked ones get another try, in turn.)  If none is ready but some have
+	// yielded, that's the end of the frame: set yielding (as a yield does
+	// without threads), and let those go again in the next frame.
+	void Machine::nextThread() {
+		long count = threads.Count();
+		if (readyCount == 0) {
+			for (long i = 0; i < count; i++) {
+				if (threads[i]->state != ThreadStorage::State::Yielded) continue;
+				setState(threads[i], ThreadStorage::State::Ready);
+				yielding = true;
+			}
+		}
+		for (long i = 1; i <= count; i++) {
+			long index = (currentThread + i) % count;
+			ThreadStorage *thread = threads[index];
+			if (thread->state == ThreadStorage::State::Ready or thread->state == ThreadStorage::State::Blocked) {
+				currentThread = index;
+				stack = thread->stack;
+				return;
+			}
+		}
+		// Nothing left to run at all (only the finished main thread remains);
+		// we'll be Done once finishThread cleans that up.
+	}
+
+	// The running thread has reached the end of its code.
+	void Machine::finishThread() {
+		ThreadStorage *thread = threads[currentThread];
+		if (thread->state != ThreadStorage::State::Finished) setState(thread, ThreadStorage::State::Finished);
+		if (currentThread > 0) {
+			// Keep its result, and drop the thread.
+			Context *context = stack[0];
+			thread->result = context->GetTemp(0, Value::null);
+			delete context;
+			stack.Clear();
+			threads.RemoveAt(currentThread);
+			thread->release();
+			currentThread--;
+		}
+		if (threads.Count() == 1) {
+			// Only the main thread is left; go back to running without threads.
+			ThreadStorage *main = threads[0];
+			stack = main->stack;
+			if (main->state == ThreadStorage::State::Yielded) yielding = true;
+			main->release();
+			threads.Clear();
+			currentThread = 0;
+			readyCount = 0;
+			return;
+		}
+		nextThread();
+	}
+
+	// Stop all the threads other than the main one.
+	void Machine::killThreads() {
+		if (threads.Count() == 0) return;
+		stack = threads[0]->stack;
+		for (long i = threads.Count() - 1; i >= 0; i--) {
+			ThreadStorage *thread = threads[i];
+			if (i > 0) {
+				for (long j = thread->stack.Count() - 1; j >= 0; j--) delete thread->stack[j];
+				thread->stack.Clear();
+			}
+			thread->state = ThreadStorage::State::Finished;
+			thread->release();
+		}
+		threads.Clear();
+		currentThread = 0;
+		readyCount = 0;
+	}
 	
 	/// <summary>
 	/// Directly invoke a ValFunction by manually pushing it onto the call stack.
@@ -692,6 +973,18 @@ namespace MiniScript {
 		stack.Add(nextContext);
 	}
 
+	/// <summary>
+	/// Push a call to the given function with the given arguments (bound to
+	/// its parameters in order, as if called from the top context).
+	/// </summary>
+	void Machine::ManuallyPushCall(FunctionStorage* func, const ValueList& args, Value resultStorage) {
+		Context *context = stack.Last();
+		for (long i = 0; i < args.Count(); i++) context->PushParamArgument(args[i]);
+		Context* nextContext = context->NextCallContext(func, args.Count(), false, resultStorage);
+		nextContext->outerVars = func->outerVars;
+		stack.Add(nextContext);
+	}
+
 	void Machine::DoOneLine(TACLine& line, Context *context) {
 		if (line.op == TACLine::Op::PushParam) {
 			Value val = line.rhsA.IsNull() ? line.rhsA : line.rhsA.Val(context);
@@ -745,7 +1038,12 @@ namespace MiniScript {
 
 	void Machine::PopContext() {
 		// Our top context is done; pop it off, and copy the return value in temp 0.
-		if (stack.Count() == 1) return;	// down to just the global stack (which we keep)
+		if (stack.Count() == 1) {
+			// Down to just the bottom context, which we keep.  (But if this is a
+			// green thread, returning from that ends the thread.)
+			if (currentThread > 0) stack[0]->JumpToEnd();
+			return;
+		}
 		Context* context = stack.Pop();
 		Value result = context->GetTemp(0, Value::null);
 		Value storage = context->resultStorage;
@@ -756,8 +1054,6 @@ namespace MiniScript {
 
 	String Machine::FindShortName(const Value& val) {
 		String nullStr;
-		if (stack.Count() < 1) return nullStr;
-		Context *globalContext = stack[0];
 		if (globalContext == nullptr) return nullStr;
 		for (ValueDictIterator kv = globalContext->variables.GetIterator(); !kv.Done(); kv.Next()) {
 			if (!kv.Value().RefEquals(val)) continue;
@@ -777,6 +1073,15 @@ namespace MiniScript {
 		#endif
 	}
 
+	double Machine::Random() {
+		// (This is splitmix64; we use the top 53 bits of its output.)
+		uint64_t z = (randState += 0x9E3779B97F4A7C15ULL);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+		z = z ^ (z >> 31);
+		return (double)(z >> 11) * (1.0 / 9007199254740992.0);
+	}
+
 	List<SourceLoc> Machine::GetStack() {
 		long count = stack.Count();
 		List<SourceLoc> result(count);
@@ -12,6 +12,7 @@
 #include "MiniscriptTypes.h"
 #include "MiniscriptErrors.h"
 #include "MiniscriptIntrinsics.h"
+#include <vector>
 
 namespace MiniScript {
 	class Context;
@@ -139,6 +140,17 @@ namespace MiniScript {
 		/// <param name="resultStorage">Value to stuff the result into when done.</param>
 		Context* NextCallContext(FunctionStorage *func, long argCount, bool gotSelf, Value resultStorage);
 
+		/// <summary>
+		/// Go back to the first line, clearing temporaries (and variables,
+		/// unless told not to).
+		/// </summary>
+		void Reset(bool clearVariables=true) {
+			lineNum = 0;
+			temps.Clear();
+			partialResult = IntrinsicResult::Null;
+			if (clearVariables) variables = ValueDict();
+		}
+
 		void JumpToEnd() { lineNum = code.Count(); }
 		
 		SourceLoc GetSourceLoc();
@@ -147,30 +159,80 @@ namespace MiniScript {
 		List<Value> temps;			// values of temporaries; temps[0] is always return value
 	};
 	
+	/// <summary>
+	/// ThreadStorage: one green thread of a Machine, i.e. a separate stack of
+	/// call contexts, which runs by turns with the machine's other threads
+	/// (see Machine::Spawn).  Scripts hold these as handles.
+	/// </summary>
+	class ThreadStorage : public RefCountedStorage {
+	public:
+		enum class State : unsigned char {
+			Ready,			// can run
+			Blocked,		// waiting on an intrinsic (wait, a channel, etc.)
+			Yielded,		// called yield, so done until the next frame
+			Finished
+		};
+		State state;
+		Value result;		// what the thread's function returned, once finished
+
+	private:
+		ThreadStorage() : state(State::Ready), wakeTime(0) {}
+		virtual ~ThreadStorage() {}
+
+		List<Context*> stack;	// (the main thread's starts with the global context)
+		double wakeTime;		// (Machine::wakeTime, as of when it blocked)
+		std::vector<int> wakeFds;	// (Machine::wakeFds, likewise)
+
+		friend class Machine;
+	};
+
 	class Machine {
 	public:
 //		Machine();
 		Machine(Context *context, TextOutputMethod standardOutput);
 		~Machine();
 		
-		bool Done() { return stack.Count() <= 1 and stack.Last()->Done(); }
+		bool Done() { return stack.Count() <= 1 and stack.Last()->Done() and threads.Count() == 0; }
 		void Step();
 		void Stop();
 		void Reset();
 		void ManuallyPushCall(FunctionStorage* func, Value resultStorage=Value::null);
+		void ManuallyPushCall(FunctionStorage* func, const ValueList& args, Value resultStorage=Value::null);
 
-		Context* GetGlobalContext() { return stack[0]; }
+		// Whether there's nothing to do but wait: the running code is waiting on
+		// an intrinsic that returned a partial result (and so is every other
+		// thread that hasn't yielded).  If so, wakeTime and wakeFds say what
+		// it's waiting for (see Reactor).
+		bool Waiting();
+
+		// Start a green thread running the given function (with the given
+		// arguments), and return a handle to its ThreadStorage.  Threads take
+		// turns: we switch to the next one whenever the running one yields,
+		// waits on an intrinsic, or finishes.  A yield lets the others run
+		// before this one continues; the frame ends (and the host sees the
+		// yield) once every thread has yielded.  The machine is done when all
+		// its threads are.
+		Value Spawn(FunctionStorage *func, ValueList args);
+
+		Context* GetGlobalContext() { return globalContext; }
 		Context* GetTopContext() { return stack.Last(); }
 		String FindShortName(const Value& val);
 		
 		double RunTime() { return startTime  == 0 ? 0 : CurrentWallClockTime() - startTime; }
 		
 		List<SourceLoc> GetStack();
+
+		// Random numbers (for rnd and shuffle).  Each machine has its own
+		// generator, so machines on different threads share no state here.
+		double Random();				// (uniform in [0, 1))
+		void SeedRandom(uint64_t seed) { randState = seed; }
 		
 		TextOutputMethod standardOutput;
 		bool storeImplicit;
 		Interpreter *interpreter;		// (weak reference to interpreter that owns this VM)
 		bool yielding;					// set to true by the yield intrinsic
+		double wakeTime;				// (RunTime) when a waiting intrinsic expects to be ready, or 0 if unknown
+		std::vector<int> wakeFds;		// file descriptors it's waiting on to become readable (if any)
 		Value functionType;
 		Value listType;
 		Value mapType;
@@ -183,9 +245,20 @@ namespace MiniScript {
 		
 		void DoOneLine(TACLine& line, Context *context);
 		void PopContext();
+
+		void switchThreads();
+		void nextThread();
+		void finishThread();
+		void killThreads();
+		void setState(ThreadStorage *thread, ThreadStorage::State state);
 		
-		List<Context*> stack;
+		List<Context*> stack;			// call stack of the running thread
+		Context *globalContext;
+		List<ThreadStorage*> threads;	// all threads, the main one first (if any were spawned)
+		long currentThread;				// index of the running one in threads
+		long readyCount;				// how many threads are Ready
 		double startTime;		// value of CurrentWallClockTime() when machine began its run
+		uint64_t randState;		// state of our random number generator
 	};
 }
 
@@ -14,11 +14,17 @@
 #include "SplitJoin.h"
 
 #include <iostream>
+#include <atomic>
 #include <math.h>
+#include <inttypes.h>
+#include <string.h>
+#include <thread>
+#include <unordered_set>
+#include <vector>
 
 namespace MiniScript {
 
-	const String VERSION = "1.6.2";
+	const String VERSION = String("1.6.2").MakeImmortal();
 
 	long Value::maxStringSize = 0xFFFFFF;		// about 16MB
 	long Value::maxListSize   = 0xFFFFFF;		// about 16M elements
@@ -26,22 +32,29 @@ namespace MiniScript {
 
 	Value Value::zero(0.0);
 	Value Value::one(1.0);
-	Value Value::emptyString("");
-	Value Value::magicIsA("__isa");
+	Value Value::emptyString = Value("").MakeImmortal();
+	Value Value::magicIsA = Value("__isa").MakeImmortal();
 	Value Value::null;
-	Value Value::keyString("key");
-	Value Value::valueString("value");
-	Value Value::implicitResult = Value::Var("_");
+	Value Value::keyString = Value("key").MakeImmortal();
+	Value Value::valueString = Value("value").MakeImmortal();
+	Value Value::implicitResult = Value::Var("_").MakeImmortal();
 
 	static int rotateBits(int n) {
 		return (n >> 1) | (n << (sizeof(int) * 8 - 1));
 	}
 
+	FunctionStorage::FunctionStorage() {
+		accountFor(MemoryKind::Function, sizeof(FunctionStorage));
+	}
+
 	FunctionStorage *FunctionStorage::BindAndCopy(ValueDict contextVariables) {
 		FunctionStorage *result = new FunctionStorage();
 		result->parameters = parameters;
 		result->code = code;
 		result->outerVars = contextVariables;
+		// (The context's variables may end up referring to this function, so
+		// the cycle collector needs to know about them.)
+		CycleCollector::TrackMap(result->outerVars);
 		return result;
 	}
 
@@ -64,6 +77,11 @@ namespace MiniScript {
 
 	String Value::ToString(Machine *vm) {
 		if (type == ValueType::Number) {
+			if (isInt) {
+				char buf[24];
+				snprintf(buf, sizeof(buf), "%" PRId64, data.integer);
+				return String(buf);
+			}
 			// Convert number to string in the standard Miniscript way.
 			double value = data.number;
 			if (fmod(value, 1.0) == 0.0) {
@@ -131,13 +149,12 @@ namespace MiniScript {
 			case ValueType::List:
 			{
 				if (recursionLimit <= 0) return "[...]";
-				List<Value> list((ListStorage<Value>*)data.ref);
-				long count = list.Count();
+				long count = ListCount();
 				if (count == 0) {
 					 return "[]";
 				}
 				List<String> strs(count);
-				for (long i=0; i<count; i++) strs.Add(list[i].CodeForm(vm, recursionLimit-1));
+				for (long i=0; i<count; i++) strs.Add(ListItem(i).CodeForm(vm, recursionLimit-1));
 				String result = String("[") + Join(", ", strs) + "]";
 				return result;
 			} break;
@@ -225,22 +242,35 @@ namespace MiniScript {
 	}
 	
 	int32_t Value::IntValue() const noexcept {
-		return type == ValueType::Number ? data.number : 0;
+		if (type != ValueType::Number) return 0;
+		return isInt ? (int32_t)data.integer : data.number;
 	}
 
 	uint32_t Value::UIntValue() const noexcept {
-		return type == ValueType::Number ? data.number : 0;
+		if (type != ValueType::Number) return 0;
+		return isInt ? (uint32_t)data.integer : data.number;
+	}
+
+	int64_t Value::Int64Value() const noexcept {
+		if (type != ValueType::Number) return 0;
+		if (isInt) return data.integer;
+		// Truncate toward zero, clamping to the int64 range (and NaN to 0).
+		double d = data.number;
+		if (d != d) return 0;
+		if (d >= 9223372036854775808.0) return INT64_MAX;
+		if (d <= -9223372036854775808.0) return INT64_MIN;
+		return (int64_t)d;
 	}
 
 	float Value::FloatValue() const noexcept {
-		return type == ValueType::Number ? data.number : 0;
+		return DoubleValue();
 	}
 	
 	bool Value::BoolValue() const noexcept {
 		switch (type) {
 			case ValueType::Number:
 				// Any nonzero value is considered true, when treated as a bool.
-				return data.number != 0;
+				return isInt ? data.integer != 0 : data.number != 0;
 				
 			case ValueType::String:
 			{
@@ -253,9 +283,7 @@ namespace MiniScript {
 			case ValueType::List:
 			{
 				// Any nonempty list is true.
-				ValueList l((ListStorage<Value>*)(data.ref));
-				bool result = (l.Count() > 0);
-				return result;
+				return ListCount() > 0;
 			}
 
 			case ValueType::Map:
@@ -288,7 +316,9 @@ namespace MiniScript {
 	/// or temp, then resolve them now.  CAUTION: do not mutate the original list
 	/// or map!  We may need it in its original form on future iterations.
 	Value Value::FullEval(Context *context) {
+		if (IsFrozen()) return *this;	// (nothing to evaluate, and nothing to copy)
 		if (type == ValueType::List) {
+			if (GetNumbers()) return *this;	// (nothing to evaluate in a packed list)
 			ValueList result;
 			bool gotNewResult = false;
 			ValueList src((ValueListStorage*)(data.ref));
@@ -353,19 +383,36 @@ namespace MiniScript {
 	}
 
 
+	// Whether the given item can go into a packed list without changing it:
+	// any double, or an integer small enough for a double to hold exactly.
+	static inline bool packable(const Value& item) {
+		if (item.type != ValueType::Number) return false;
+		if (not item.isInt) return true;
+		return item.data.integer >= -9007199254740992LL and item.data.integer <= 9007199254740992LL;
+	}
+
 	/// Create a copy of this value, evaluating sub-values as we go.
 	/// This is used when a list or map literal appears in the source, to
 	/// ensure that each time that code executes, we get a new, distinct
 	/// mutable object, rather than the same object referenced each time.
 	/// (Used with literals, and in the case of a Map, it's also used with 'new'.)
 	Value Value::EvalCopy(Context *context) {
+		if (IsFrozen()) return *this;	// (it can't change, so no need for a copy)
 		if (type == ValueType::List) {
-			ValueList src((ValueListStorage*)(data.ref));
-			long count = src.Count();
+			long count = ListCount();
 			ValueList result(count);
-			for (long i=0; i<count; i++) result.Add(src[i].Val(context));
-//			src.forget();
-			return result;
+			bool allNumbers = true;
+			for (long i=0; i<count; i++) {
+				Value item = ListItem(i).Val(context);
+				if (not packable(item)) allNumbers = false;
+				result.Add(item);
+			}
+			if (not allNumbers) return result;
+			// All numbers (or empty), so we can return it packed.
+			Value packed = NewNumberList(count);
+			SimpleVector<double> *numbers = packed.GetNumbers();
+			for (long i=0; i<count; i++) numbers->push_back(result[i].DoubleValue());
+			return packed;
 		} else if (type == ValueType::Map) {
 			ValueDict src((ValueDictStorage*)(data.ref));
 			ValueDict result;
@@ -393,14 +440,15 @@ namespace MiniScript {
 	/// <param name="index">index/key for the value to set</param>
 	/// <param name="value">value to set</param>
 	void Value::SetElem(Value index, Value value) {
+		CheckNotFrozen();
 		if (type == ValueType::List) {
 			long i = index.IntValue();
-			ValueList list = GetList();
-			if (i < 0) i += list.Count();
-			if (i < 0 or i >= list.Count()) {
+			long count = ListCount();
+			if (i < 0) i += count;
+			if (i < 0 or i >= count) {
 				IndexException(String("Index Error (list index " + String::Format(i) + " out of range)")).raise();
 			}
-			list[i] = value;
+			ListSet(i, value);
 		} else if (type == ValueType::Map) {
 			ValueDict dict = GetDict();
 			if (!dict.ApplyAssignOverride(index, value)) {
@@ -412,14 +460,13 @@ namespace MiniScript {
 	Value Value::GetElem(Value index) {
 		if (type == ValueType::List) {
 			if (index.type == ValueType::Number) {
-				ValueList baseLst((ValueListStorage*)(data.ref));
-				int i = index.data.number;
-				if (i < 0) i += baseLst.Count();
-				if (i < 0 || i >= baseLst.Count()) {
+				long count = ListCount();
+				int i = index.IntValue();
+				if (i < 0) i += count;
+				if (i < 0 || i >= count) {
 					IndexException(String("Index Error (list index ") + index.ToString() + " out of range)").raise();
 				}
-				Value result = baseLst.Item((long)(index.data.number));
-				return result;
+				return ListItem(i);
 			}
 			KeyException("List index must be numeric").raise();
 		}
@@ -427,7 +474,7 @@ namespace MiniScript {
 			if (index.type == ValueType::Number) {
 				String baseStr((StringStorage*)(data.ref));
 				long len = baseStr.Length();
-				long i = (long)index.data.number;
+				long i = (long)index.Int64Value();
 				if (i < 0) i += len;
 				if (i < 0 or i >= len) {
 					IndexException(String("Index Error (string index ") + i + " out of range").raise();
@@ -558,7 +605,7 @@ namespace MiniScript {
 		if (lhs.IsNull()) {
 			return rhs.IsNull();
 		} else if (lhs.type == ValueType::Number) {
-			return (lhs.data.number == rhs.data.number);
+			return lhs == rhs;
 		} else if (lhs.type == ValueType::String) {
 			// We treat string as if it is a value type (since they're immutable).
 			return (lhs.GetString() == rhs.GetString());
@@ -573,17 +620,24 @@ namespace MiniScript {
 		if (lhs.IsNull()) {
 			return rhs.IsNull() ? 1 : 0;
 		} else if (lhs.type == ValueType::Number) {
-			return (rhs.type == ValueType::Number and lhs.data.number == rhs.data.number) ? 1 : 0;
+			return (rhs.type == ValueType::Number and lhs == rhs) ? 1 : 0;
 		} else if (lhs.type == ValueType::String) {
 			return (rhs.type == ValueType::String and lhs.GetString() == rhs.GetString()) ? 1 : 0;
 		} else if (lhs.type == ValueType::List) {
 			if (rhs.type != ValueType::List) return 0;
-			const SimpleVector<Value>* lhl = (ValueListStorage*)(lhs.data.ref);
-			const SimpleVector<Value>* rhl = (ValueListStorage*)(rhs.data.ref);
+			const ValueListStorage* lhl = (ValueListStorage*)(lhs.data.ref);
+			const ValueListStorage* rhl = (ValueListStorage*)(rhs.data.ref);
 			if (lhl == rhl) return 1;	// same data
 			if (lhl == nullptr) return rhl == nullptr ? 1 : 0;
-			long count = lhl->size();
-			if (count != rhl->size()) return 0;
+			long count = lhl->itemCount();
+			if (rhl == nullptr or count != rhl->itemCount()) return 0;
+			if (lhl->numbers and rhl->numbers) {
+				// Two packed lists: just compare the numbers.
+				const SimpleVector<double>& a = *lhl->numbers;
+				const SimpleVector<double>& b = *rhl->numbers;
+				for (long i=0; i<count; i++) if (a[i] != b[i]) return 0;
+				return 1;
+			}
 			return lhs.RecursiveEqual(rhs) ? 1 : 0;
 		} else if (lhs.type == ValueType::Map) {
 			if (rhs.type != ValueType::Map) return 0;
@@ -624,26 +678,372 @@ namespace MiniScript {
 		if (index < 0) IndexException(String("index " ) + String::Format(index) + " out of range for map").raise();
 		if (map.type != ValueType::Map) return Value::null;
 		ValueDict dict = map.GetDict();
-		// For now, we'll just iterate from the beginning every time.  This is horribly
-		// inefficient on big maps (and not great even on small ones).  OFI: Optimize.
-		long i = 0;
-		for (ValueDictIterator iter = dict.GetIterator(); !iter.Done(); iter.Next()) {
-			if (i == index) {
-				// Found the requested entry.  Convert to its own little map.
-				ValueDict result;
-				result.SetValue(Value::keyString, iter.Key());
-				result.SetValue(Value::valueString, iter.Value());
-//				dict.forget();
-				return Value(result);
-			}
-			i++;
+		// Entries are kept in order, so we can get the index-th one directly.
+		Value key, value;
+		if (dict.GetEntryAt(index, &key, &value)) {
+			// Convert to its own little map.
+			ValueDict result;
+			result.SetValue(Value::keyString, key);
+			result.SetValue(Value::valueString, value);
+			return Value(result);
 		}
 		// Out of bounds (index too high).
-//		dict.forget();
 		IndexException(String("index " ) + String::Format(index) + " out of range for map").raise();
 		return Value::null;
 	}
 
+	Value Value::NewNumberList(long capacity) {
+		ValueList list;
+		list.ensureStorage();
+		Value result(list);
+		list.ls->numbers = new SimpleVector<double>(capacity);
+		list.ls->updateAccount();
+		return result;
+	}
+
+	void Value::ListAdd(const Value& item) {
+		CheckNotFrozen();
+		ValueListStorage *ls = (ValueListStorage*)data.ref;
+		if (ls and ls->numbers and packable(item)) {
+			ls->numbers->push_back(item.DoubleValue());
+			ls->updateAccount();
+		} else {
+			GetList().Add(item);
+		}
+	}
+
+	void Value::ListSet(long index, const Value& item) {
+		CheckNotFrozen();
+		ValueListStorage *ls = (ValueListStorage*)data.ref;
+		if (ls->numbers and packable(item)) {
+			(*ls->numbers)[index] = item.DoubleValue();
+		} else {
+			ValueList list = GetList();
+			list.MakeWritable();
+			list[index] = item;
+		}
+	}
+
+	void Value::ListInsert(long index, const Value& item) {
+		CheckNotFrozen();
+		ValueListStorage *ls = (ValueListStorage*)data.ref;
+		if (ls and ls->numbers and packable(item)) {
+			ls->numbers->insert(item.DoubleValue(), index);
+			ls->updateAccount();
+		} else {
+			GetList().Insert(item, index);
+		}
+	}
+
+	void Value::ListRemove(long index) {
+		CheckNotFrozen();
+		ValueListStorage *ls = (ValueListStorage*)data.ref;
+		if (ls->numbers) ls->numbers->deleteIdx(index);
+		else GetList().RemoveAt(index);
+	}
+
+	void Value::unpackList(ValueListStorage *ls) {
+		// (Packed storage never has views, so we can just fill in the items.)
+		SimpleVector<double> *numbers = ls->numbers;
+		ls->numbers = nullptr;
+		long count = numbers->size();
+		if (count > 0) ls->resizeBuffer(count);
+		for (long i=0; i<count; i++) ls->push_back(Value((*numbers)[i]));
+		delete numbers;
+		ls->updateAccount(false);
+	}
+
+	Value& Value::MakeImmortal() {
+		if (usesRef() and data.ref) makeImmortal(data.ref, type);
+		return *this;
+	}
+
+	void Value::makeImmortal(RefCountedStorage *storage, ValueType type) {
+		if (storage->IsImmortal()) return;
+		switch (type) {
+			case ValueType::String:
+			case ValueType::Var:
+				storage->retain();
+				String(static_cast<StringStorage*>(storage), false).MakeImmortal();
+				return;
+			case ValueType::List: {
+				// (Unpack it now, since reading a packed list may unpack it.)
+				ValueListStorage *ls = static_cast<ValueListStorage*>(storage);
+				if (ls->numbers) unpackList(ls);
+				CycleCollector::Untrack(ls);
+				ls->MakeImmortal();
+				if (ls->viewOf) makeImmortal(ls->viewOf, ValueType::List);
+				for (unsigned long i=0; i<ls->size(); i++) (*ls)[i].MakeImmortal();
+			} return;
+			case ValueType::Map: {
+				ValueDictStorage *ds = static_cast<ValueDictStorage*>(storage);
+				ds->compact();
+				CycleCollector::Untrack(ds);
+				ds->MakeImmortal();
+				for (long i=ds->mHead; i<ds->mUsed; i++) {
+					if (not ds->mEntries[i].live) continue;
+					ds->mEntries[i].key.MakeImmortal();
+					ds->mEntries[i].value.MakeImmortal();
+				}
+			} return;
+			case ValueType::Function: {
+				FunctionStorage *fs = static_cast<FunctionStorage*>(storage);
+				CycleCollector::Untrack(fs);
+				fs->MakeImmortal();
+				// (Calling or binding a function copies its parameters, code, and
+				// outerVars, which gives them storage if they have none; so do
+				// that now, while we can.)
+				fs->parameters.MakeImmortal();
+				for (long i=0; i<fs->parameters.Count(); i++) {
+					FuncParam& param = fs->parameters[i];
+					param.name.MakeImmortal();
+					param.defaultValue.MakeImmortal();
+				}
+				fs->code.MakeImmortal();
+				for (long i=0; i<fs->code.Count(); i++) {
+					TACLine& line = fs->code[i];
+					line.lhs.MakeImmortal();
+					line.rhsA.MakeImmortal();
+					line.rhsB.MakeImmortal();
+					line.comment.MakeImmortal();
+					line.location.context.MakeImmortal();
+				}
+				fs->outerVars.ensureStorage();
+				makeImmortal(fs->outerVars.ds, ValueType::Map);
+			} return;
+			case ValueType::SeqElem: {
+				SeqElemStorage *se = static_cast<SeqElemStorage*>(storage);
+				se->MakeImmortal();
+				se->sequence.MakeImmortal();
+				se->index.MakeImmortal();
+			} return;
+			default:
+				// (A handle's contents are up to the host app.)
+				storage->MakeImmortal();
+				return;
+		}
+	}
+
+	Value& Value::Freeze() {
+		if (usesRef() and data.ref) {
+			checkFreezable(data.ref, type);
+			freeze(data.ref, type);
+		}
+		return *this;
+	}
+
+	// Raise a TypeException if there's a handle anywhere in the given storage
+	// (which it would be unsafe to share between threads).
+	void Value::checkFreezable(RefCountedStorage *storage, ValueType type) {
+		std::vector<Value> toDo;
+		std::unordered_set<RefCountedStorage*> visited;
+		auto add = [&toDo, &visited](const Value& v) {
+			if (v.usesRef() and v.data.ref and not v.data.ref->IsImmortal() and visited.insert(v.data.ref).second) toDo.push_back(v);
+		};
+		Value start;
+		start.type = type;
+		start.data.ref = storage;
+		storage->retain();
+		add(start);
+		while (not toDo.empty()) {
+			Value v = toDo.back();
+			toDo.pop_back();
+			switch (v.type) {
+				case ValueType::List: {
+					ValueListStorage *ls = static_cast<ValueListStorage*>(v.data.ref);
+					if (ls->numbers) break;
+					for (unsigned long i=0; i<ls->size(); i++) add((*ls)[i]);
+				} break;
+				case ValueType::Map: {
+					ValueDictStorage *ds = static_cast<ValueDictStorage*>(v.data.ref);
+					for (long i=ds->mHead; i<ds->mUsed; i++) {
+						if (not ds->mEntries[i].live) continue;
+						add(ds->mEntries[i].key);
+						add(ds->mEntries[i].value);
+					}
+				} break;
+				case ValueType::Function: {
+					FunctionStorage *fs = static_cast<FunctionStorage*>(v.data.ref);
+					if (fs->outerVars.ds) add(Value(fs->outerVars));
+				} break;
+				case ValueType::SeqElem: {
+					SeqElemStorage *se = static_cast<SeqElemStorage*>(v.data.ref);
+					add(se->sequence);
+					add(se->index);
+				} break;
+				case ValueType::Handle:
+					TypeException("can't freeze a handle").raise();
+					break;
+				default:
+					break;
+			}
+		}
+	}
+
+	void Value::freeze(RefCountedStorage *storage, ValueType type) {
+		if (storage->IsImmortal()) return;	// (already shared, e.g. the intrinsic classes)
+		switch (type) {
+			case ValueType::List: {
+				ValueListStorage *ls = static_cast<ValueListStorage*>(storage);
+				// (Stop sharing a buffer with any other list, since that one may
+				// change; and unpack, since reading a packed list may unpack it.)
+				ls->stopSharing();
+				if (ls->numbers) unpackList(ls);
+				CycleCollector::Untrack(ls);
+				ls->MakeImmortal();
+				ls->frozen = true;
+				for (unsigned long i=0; i<ls->size(); i++) {
+					Value& item = (*ls)[i];
+					if (item.usesRef() and item.data.ref) freeze(item.data.ref, item.type);
+				}
+			} return;
+			case ValueType::Map: {
+				ValueDictStorage *ds = static_cast<ValueDictStorage*>(storage);
+				ds->compact();
+				CycleCollector::Untrack(ds);
+				ds->MakeImmortal();
+				ds->frozen = true;
+				for (long i=ds->mHead; i<ds->mUsed; i++) {
+					if (not ds->mEntries[i].live) continue;
+					Value& key = ds->mEntries[i].key;
+					Value& value = ds->mEntries[i].value;
+					if (key.usesRef() and key.data.ref) freeze(key.data.ref, key.type);
+					if (value.usesRef() and value.data.ref) freeze(value.data.ref, value.type);
+				}
+			} return;
+			case ValueType::Function: {
+				// (Its outerVars are frozen too, so the function can't change them.)
+				FunctionStorage *fs = static_cast<FunctionStorage*>(storage);
+				if (fs->outerVars.ds) freeze(fs->outerVars.ds, ValueType::Map);
+				makeImmortal(storage, type);
+			} return;
+			case ValueType::SeqElem: {
+				SeqElemStorage *se = static_cast<SeqElemStorage*>(storage);
+				if (se->sequence.usesRef() and se->sequence.data.ref) freeze(se->sequence.data.ref, se->sequence.type);
+				makeImmortal(storage, type);
+			} return;
+			default:
+				makeImmortal(storage, type);
+				return;
+		}
+	}
+
+	void Value::raiseFrozen(ValueType type) {
+		RuntimeException(type == ValueType::List ? "can't change a frozen list" : "can't change a frozen map").raise();
+	}
+
+	unsigned int Value::frozenHash() const {
+		CollectableStorage *storage = static_cast<CollectableStorage*>(data.ref);
+		if (storage->hashCached.load(std::memory_order_acquire)) return storage->cachedHash.load(std::memory_order_relaxed);
+		unsigned int result = RecursiveHash();
+		storage->cachedHash.store(result, std::memory_order_relaxed);
+		storage->hashCached.store(true, std::memory_order_release);
+		return result;
+	}
+
+	Value Value::DeepCopy(ValueCopies& copies) const {
+		if (not usesRef() or not data.ref or data.ref->IsImmortal()) return *this;
+		Value result = deepCopy(data.ref, type, copies);
+		result.noInvoke = noInvoke;
+		result.localOnly = localOnly;
+		return result;
+	}
+
+	// Copy a string without touching the original's reference count.
+	static String copyString(const String& s) {
+		return String(s.c_str(), s.sizeB());
+	}
+
+	Value Value::deepCopy(RefCountedStorage *storage, ValueType type, ValueCopies& copies) {
+		Value result;
+		if (type != ValueType::String and type != ValueType::Var and copies.Find(storage, &result)) return result;
+		switch (type) {
+			case ValueType::String:
+			case ValueType::Var: {
+				StringStorage *ss = static_cast<StringStorage*>(storage);
+				String s = ss->data ? String(ss->data, ss->dataSize - 1) : String();
+				return type == ValueType::Var ? Value::Var(s) : Value(s);
+			}
+			case ValueType::List: {
+				ValueListStorage *ls = static_cast<ValueListStorage*>(storage);
+				if (ls->numbers) {
+					SimpleVector<double> *numbers = ls->numbers;
+					long count = numbers->size();
+					result = NewNumberList(count);
+					SimpleVector<double> *copy = result.GetNumbers();
+					for (long i=0; i<count; i++) copy->push_back((*numbers)[i]);
+					copies.Add(storage, result);
+					return result;
+				}
+				long count = ls->size();
+				ValueList list(count);
+				result = Value(list);
+				copies.Add(storage, result);		// (before the items, which may refer to it)
+				for (long i=0; i<count; i++) list.Add((*ls)[i].DeepCopy(copies));
+			} return result;
+			case ValueType::Map: {
+				ValueDictStorage *ds = static_cast<ValueDictStorage*>(storage);
+				ValueDict dict;
+				result = Value(dict);
+				copies.Add(storage, result);
+				for (long i=ds->mHead; i<ds->mUsed; i++) {
+					if (not ds->mEntries[i].live) continue;
+					dict.SetValue(ds->mEntries[i].key.DeepCopy(copies), ds->mEntries[i].value.DeepCopy(copies));
+				}
+				dict.ds->assignOverride = ds->assignOverride;
+				dict.ds->evalOverride = ds->evalOverride;
+			} return result;
+			case ValueType::Function: {
+				FunctionStorage *fs = static_cast<FunctionStorage*>(storage);
+				FunctionStorage *copy = new FunctionStorage();
+				result = Value(copy);
+				copies.Add(storage, result);
+				for (long i=0; i<fs->parameters.Count(); i++) {
+					const FuncParam& param = fs->parameters[i];
+					copy->parameters.Add(FuncParam(copyString(param.name), param.defaultValue.DeepCopy(copies)));
+				}
+				for (long i=0; i<fs->code.Count(); i++) {
+					const TACLine& line = fs->code[i];
+					TACLine lineCopy(line.lhs.DeepCopy(copies), line.op, line.rhsA.DeepCopy(copies), line.rhsB.DeepCopy(copies));
+					lineCopy.comment = copyString(line.comment);
+					lineCopy.location = SourceLoc(copyString(line.location.context), line.location.lineNum);
+					copy->code.Add(lineCopy);
+				}
+				if (fs->outerVars.ds and fs->outerVars.ds->IsImmortal()) copy->outerVars = fs->outerVars;
+				else if (fs->outerVars.ds) copy->outerVars = deepCopy(fs->outerVars.ds, ValueType::Map, copies).GetDict();
+			} return result;
+			case ValueType::SeqElem: {
+				SeqElemStorage *se = static_cast<SeqElemStorage*>(storage);
+				return Value::SeqElem(se->sequence.DeepCopy(copies), se->index.DeepCopy(copies));
+			}
+			default:
+				TypeException("can't copy a handle").raise();
+				return result;
+		}
+	}
+
+	void Value::clearContents(RefCountedStorage *storage, ValueType type) {
+		switch (type) {
+			case ValueType::List: {
+				ValueListStorage *ls = static_cast<ValueListStorage*>(storage);
+				if (ls->viewOf) {
+					ls->unlinkView();
+				} else {
+					ls->detachViews();
+					ls->deleteAll();
+				}
+			} break;
+			case ValueType::Map:
+				static_cast<ValueDictStorage*>(storage)->RemoveAll();
+				break;
+			case ValueType::Function:
+				static_cast<FunctionStorage*>(storage)->outerVars.release();
+				break;
+			default:
+				break;
+		}
+	}
+
 	unsigned int HashValue(const Value& v) {
 		return v.Hash();
 	}
@@ -656,6 +1056,14 @@ namespace MiniScript {
 		return x;
 	}
 	
+	// Hash of a 64-bit value (the splitmix64 finalizer, folded to 32 bits).
+	static inline unsigned int Int64Hash(uint64_t x) {
+		x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+		x = x ^ (x >> 31);
+		return (unsigned int)(x ^ (x >> 32));
+	}
+
 	unsigned int Value::Hash() const {
 		switch (type) {
 			case ValueType::Null:
@@ -663,9 +1071,16 @@ namespace MiniScript {
 				
 			case ValueType::Number:
 			{
-				// Not sure how to hash doubles... for now, we'll just do:
-				int i = data.number;
-				return IntHash(i);
+				// Whole numbers hash by their integer value, so that 3 and 3.0
+				// (and -0.0 and 0) hash the same; other doubles by their bits.
+				if (isInt) return Int64Hash((uint64_t)data.integer);
+				double d = data.number;
+				if (d >= -9223372036854775808.0 and d < 9223372036854775808.0 and d == (double)(int64_t)d) {
+					return Int64Hash((uint64_t)(int64_t)d);
+				}
+				uint64_t bits;
+				memcpy(&bits, &d, sizeof(bits));
+				return Int64Hash(bits);
 			}
 				
 			case ValueType::String:
@@ -678,12 +1093,9 @@ namespace MiniScript {
 			} break;
 				
 			case ValueType::List:
-			{
-				return RecursiveHash();
-			} break;
-			
 			case ValueType::Map:
 			{
+				if (IsFrozen()) return frozenHash();
 				return RecursiveHash();
 			} break;
 
@@ -727,13 +1139,11 @@ namespace MiniScript {
 			visited.push_back(pair);
 			if (pair.a.type == ValueType::List) {
 				if (pair.b.type != ValueType::List) return false;
-				ValueList listA((ListStorage<Value>*)pair.a.data.ref);
-				long aCount = listA.Count();
-				ValueList listB((ListStorage<Value>*)pair.b.data.ref);
-				if (listB.Count() != aCount) return false;
+				long aCount = pair.a.ListCount();
+				if (pair.b.ListCount() != aCount) return false;
 				if (Value::RefEqual(pair.a, pair.b)) continue;
 				for (int i=0; i < aCount; i++) {
-					ValuePair newPair(listA[i], listB[i]);
+					ValuePair newPair(pair.a.ListItem(i), pair.b.ListItem(i));
 					if (!visited.Contains(newPair)) toDo.push_back(newPair);
 				}
 			} else if (pair.a.type == ValueType::Map) {
@@ -771,11 +1181,10 @@ namespace MiniScript {
 		while (!toDo.empty()) {
 			Value item = toDo.pop_back();
 			if (item.type == ValueType::List) {
-				ValueList list((ListStorage<Value>*)item.data.ref);
-				long count = list.Count();
+				long count = item.ListCount();
 				result = rotateBits(result) ^ IntHash((int)count);
 				for (int i=0; i<count; i++) {
-					Value child = list[i];
+					Value child = item.ListItem(i);
 					if (!(child.type == ValueType::List || child.type == ValueType::Map) || !visited.Contains(child.data.ref)) {
 						toDo.push_back(child);
 						visited.push_back(child.data.ref);
@@ -816,15 +1225,11 @@ namespace MiniScript {
 	}
 
 	bool Value::Equal(ListStorage<Value> *lhs, ListStorage<Value> *rhs) {
-		ValueList a(lhs);
-		ValueList b(rhs);
-		long count = a.Count();
-		bool result = (b.Count() == count);
+		long count = lhs->itemCount();
+		bool result = (rhs->itemCount() == count);
 		if (result) {
-			for (long i=0; i<count; i++) if (a[i] != b[i]) { result = false; break; }
+			for (long i=0; i<count; i++) if (listItem(lhs, i) != listItem(rhs, i)) { result = false; break; }
 		}
-//		a.forget();
-//		b.forget();
 		return result;
 	}
 
@@ -867,11 +1272,19 @@ private:
 	void TestBasics();
 	void TestHashAndEquality();
 	void TestSeqElem();
+	void TestPackedList();
+	void TestIntegers();
+	void TestDeepCopy();
+	void TestFreeze();
 };
 
 void TestValue::Run()
 {
 	TestBasics();
+	TestPackedList();
+	TestIntegers();
+	TestDeepCopy();
+	TestFreeze();
 //	TestHashAndEquality();
 //	TestSeqElem();
 }
@@ -907,6 +1320,59 @@ void TestValue::TestBasics()
 	Assert(s == "[1, \"two\", 3.14157]");
 }
 
+void TestValue::TestPackedList()
+{
+	Value a = Value::NewNumberList();
+	for (int i=0; i<10; i++) a.ListAdd(i * 0.5);
+	a.ListInsert(0, -1);
+	a.ListSet(1, 42);
+	Assert(a.GetNumbers() and a.ListCount() == 11);
+	Assert(a.ListItem(0).data.number == -1 and a.ListItem(1).data.number == 42);
+
+	// A packed list is equal to (and hashes the same as) the unpacked equivalent.
+	ValueList lst;
+	for (long i=0; i<a.ListCount(); i++) lst.Add(a.ListItem(i));
+	Value b = lst;
+	Assert(a == b and a.Hash() == b.Hash());
+
+	// Storing anything but a number unpacks it for good.
+	a.ListAdd("x");
+	Assert(not a.GetNumbers() and a.ListCount() == 12);
+	Assert(a.GetList()[1].data.number == 42 and a.GetList()[11].ToString() == "x");
+	a.ListRemove(11);
+	Assert(not a.GetNumbers() and a == b);
+}
+
+void TestValue::TestIntegers()
+{
+	// Integers are numbers, equal to (and hashing like) the same double.
+	Value a = Value::Integer(3);
+	Value b(3.0);
+	Assert(a.type == ValueType::Number and a.isInt and not b.isInt);
+	Assert(a == b and a.Hash() == b.Hash() and Value::Equality(a, b) == 1);
+	Assert(a.ToString() == "3" and a.IntValue() == 3 and a.DoubleValue() == 3);
+
+	// ...but they keep all 64 bits, which a double can't.
+	Value big = Value::Integer(9007199254740993LL);
+	Assert(big.ToString() == "9007199254740993" and big.Int64Value() == 9007199254740993LL);
+	Assert(big != Value::Integer(9007199254740992LL) and big != Value(9007199254740992.0));
+	Assert(Value::Integer(9007199254740992LL) == Value(9007199254740992.0));
+
+	// Numbers hash well even when they aren't small whole numbers.
+	Assert(Value(-0.0) == Value::zero and Value(-0.0).Hash() == Value::zero.Hash());
+	Assert(Value(0.25).Hash() != Value(0.75).Hash() and Value(1.1).Hash() != Value(1.9).Hash());
+	Assert(big.Hash() != Value::Integer(9007199254740992LL).Hash());
+	Assert(Value(1e15).Hash() == Value::Integer(1000000000000000LL).Hash());
+	Assert(Value(-1e300).Int64Value() == INT64_MIN and Value(0.0/0.0).Int64Value() == 0);
+
+	// A packed list holds small integers, but not ones a double would round.
+	Value lst = Value::NewNumberList();
+	lst.ListAdd(a);
+	Assert(lst.GetNumbers() and lst.ListItem(0) == a);
+	lst.ListAdd(big);
+	Assert(not lst.GetNumbers() and lst.ListItem(1).Int64Value() == 9007199254740993LL);
+}
+
 void TestValue::TestHashAndEquality() {
 	Value a(42);
 	Value b(42);
@@ -953,6 +1419,123 @@ void TestValue::TestHashAndEquality() {
 	Assert(!(a != b));
 }
 
+void TestValue::TestDeepCopy() {
+	// A copy is equal but separate, and keeps shared and cyclic structure.
+	ValueList inner;
+	inner.Add("shared");
+	ValueDict d;
+	d.SetValue("a", inner);
+	d.SetValue("b", inner);
+	Value map = d;
+	d.SetValue("self", map);
+	ValueCopies copies;
+	Value copy = map.DeepCopy(copies);
+	Assert(copy.type == ValueType::Map and not copy.RefEquals(map));
+	ValueDict cd = copy.GetDict();
+	Assert(cd.Lookup("a", Value::null).RefEquals(cd.Lookup("b", Value::null)));
+	Assert(not cd.Lookup("a", Value::null).RefEquals(Value(inner)));
+	Assert(cd.Lookup("self", Value::null).RefEquals(copy));
+	Assert(cd.Lookup("a", Value::null).GetList()[0] == Value("shared"));
+
+	// Copying back with the copies reversed gets the originals.
+	ValueCopies back;
+	back.AddReversed(copies);
+	Assert(copy.DeepCopy(back).RefEquals(map));
+	d.Remove("self");		// (break the cycle)
+	cd.Remove("self");
+
+	// Packed lists stay packed; immortal values are shared.
+	Value numbers = Value::NewNumberList();
+	numbers.ListAdd(1.5);
+	Value numCopy = numbers.DeepCopy(copies);
+	Assert(numCopy.GetNumbers() and numCopy.ListItem(0) == Value(1.5));
+	Assert(Value::magicIsA.DeepCopy(copies).RefEquals(Value::magicIsA));
+}
+
+class TestHandleStorage : public RefCountedStorage {};
+
+void TestValue::TestFreeze() {
+	// Freezing makes a whole structure immortal and unchangeable.
+	Value numbers = Value::NewNumberList();
+	for (int i=0; i<20; i++) numbers.ListAdd(i);
+	ValueDict d;
+	d.SetValue("numbers", numbers);
+	d.SetValue("name", "config");
+	Value map = d;
+	d.SetValue("self", map);
+	long hash = map.Hash();
+	Value view = numbers.GetList().Slice(2, 16);		// (shares numbers' buffer)
+	map.Freeze();
+	Assert(map.IsFrozen() and numbers.IsFrozen() and not view.IsFrozen());
+	Assert(map.data.ref->IsImmortal() and d.Lookup("name", Value::null).data.ref->IsImmortal());
+	Assert(not numbers.GetNumbers() and numbers.ListItem(19) == Value(19));
+	Assert(map.Hash() == hash and map.Hash() == hash);
+	view.ListSet(0, Value(-1));
+	Assert(numbers.ListItem(2) == Value(2));
+
+	// Changing it raises; evaluating or copying it gives back the same one.
+	bool raised = false;
+	try {
+		map.SetElem("name", "changed");
+	} catch (const RuntimeException&) {
+		raised = true;
+	}
+	Assert(raised and d.Lookup("name", Value::null) == Value("config"));
+	raised = false;
+	try {
+		numbers.ListAdd(20);
+	} catch (const RuntimeException&) {
+		raised = true;
+	}
+	Assert(raised and numbers.ListCount() == 20);
+	Assert(map.EvalCopy(nullptr).RefEquals(map) and numbers.FullEval(nullptr).RefEquals(numbers));
+	ValueCopies copies;
+	Assert(map.DeepCopy(copies).RefEquals(map));
+
+	// Big slices of a frozen list share its buffer, but leave the list itself
+	// alone, so that several threads can slice it at once.
+	Value slice = numbers.GetList().Slice(1, 16);
+	Value sliceOfSlice = slice.GetList().Slice(0, 16);
+	Assert(&slice.GetList()[0] == &numbers.GetList()[1] and &sliceOfSlice.GetList()[0] == &numbers.GetList()[1]);
+	slice.ListSet(0, Value(-1));
+	Assert(slice.ListItem(0) == Value(-1) and sliceOfSlice.ListItem(0) == Value(1) and numbers.ListItem(1) == Value(1));
+	std::atomic<long> sum(0);
+	std::thread slicers[4];
+	for (int t=0; t<4; t++) {
+		slicers[t] = std::thread([numbers, &sum] {
+			for (int i=0; i<2000; i++) {
+				Value s = numbers.GetList().Slice(i % 4, 16);
+				sum += s.ListItem(15).IntValue();
+			}
+		});
+	}
+	for (int t=0; t<4; t++) slicers[t].join();
+	Assert(sum == 4 * 500 * (15 + 16 + 17 + 18));
+
+	// A map with holes (from removals) still reads back in order once frozen.
+	ValueDict holey;
+	for (int i=0; i<20; i++) holey.SetValue(i, i);
+	holey.Remove(5);
+	holey.Remove(10);
+	Value(holey).Freeze();
+	Value key;
+	Assert(holey.GetEntryAt(5, &key, nullptr) and key == Value(6));
+	Assert(holey.GetEntryAt(17, &key, nullptr) and key == Value(19));
+
+	// A handle can't be frozen, and then nothing is.
+	ValueList list;
+	list.Add("a");
+	list.Add(Value::NewHandle(new TestHandleStorage()));
+	Value withHandle = list;
+	raised = false;
+	try {
+		withHandle.Freeze();
+	} catch (const TypeException&) {
+		raised = true;
+	}
+	Assert(raised and not withHandle.IsFrozen() and not list[0].data.ref->IsImmortal());
+}
+
 void TestValue::TestSeqElem() {
 	ValueList lst;
 	lst.Add(42);
@@ -14,6 +14,13 @@
 #include "Dictionary.h"
 
 #include <cstdint>
+#include <unordered_map>
+
+// Value and TACLine hold only (refcounted) pointers and plain data, so
+// SimpleVector may move them around with memcpy, without refcount churn.
+namespace MiniScript { class Value; class TACLine; }
+SIMPLEVECTOR_RELOCATABLE(MiniScript::Value)
+SIMPLEVECTOR_RELOCATABLE(MiniScript::TACLine)
 
 namespace MiniScript {
 	
@@ -24,6 +31,7 @@ namespace MiniScript {
 	class Value;
 	class Context;
 	class Machine;
+	class ValueCopies;
 	
 	unsigned int HashValue(const Value& v);
 	
@@ -39,7 +47,7 @@ namespace MiniScript {
 	/// actually HAVE names; instead there are named variables whose value may happen to be
 	/// a function.)
 	/// </summary>
-	class FunctionStorage : public RefCountedStorage {
+	class FunctionStorage : public CollectableStorage {
 	public:
 		// Function parameters
 		List<FuncParam> parameters;
@@ -50,6 +58,8 @@ namespace MiniScript {
 		// Local variables where the function was defined {#8}
 		ValueDict outerVars;
 		
+		FunctionStorage();
+		
 		FunctionStorage *BindAndCopy(ValueDict contextVariables);
 	};
 
@@ -79,6 +89,7 @@ namespace MiniScript {
 
 	class Value {
 	public:
+		// Limits (shared by all interpreters; set these before starting any threads).
 		static long maxStringSize;
 		static long maxListSize;
 		static int maxIsaDepth;
@@ -86,34 +97,41 @@ namespace MiniScript {
 		ValueType type;
 		bool noInvoke;
 		LocalOnlyMode localOnly;
+		bool isInt;		// (for numbers: true if data.integer holds the value, rather than data.number)
 		union {
 			double number;
+			int64_t integer;
 			RefCountedStorage *ref;
 			int tempNum;
 		} data;
 		
 		// constructors from base types
-		Value() : type(ValueType::Null), noInvoke(false), localOnly(LocalOnlyMode::Off) {}
-		Value(double number) : type(ValueType::Number), noInvoke(false), localOnly(LocalOnlyMode::Off) { data.number = number; }
-		Value(const char *s) : type(ValueType::String), noInvoke(false), localOnly(LocalOnlyMode::Off) { String temp(s); data.ref = temp.ss; temp.forget(); }
-		Value(const String& s) : type(ValueType::String), noInvoke(false), localOnly(LocalOnlyMode::Off) { data.ref = (s.ss ? s.ss : emptyString.data.ref);	retain(); }
-		Value(const ValueList& l) : type(ValueType::List), noInvoke(false), localOnly(LocalOnlyMode::Off) { ((ValueList&)l).ensureStorage(); data.ref = l.ls; retain(); }
-		Value(const ValueDict& d) : type(ValueType::Map), noInvoke(false), localOnly(LocalOnlyMode::Off) { ((ValueDict&)d).ensureStorage(); data.ref = d.ds; retain(); }
-		Value(FunctionStorage *s) : type(ValueType::Function), noInvoke(false), localOnly(LocalOnlyMode::Off) { data.ref = s; }
+		Value() : type(ValueType::Null), noInvoke(false), localOnly(LocalOnlyMode::Off), isInt(false) {}
+		Value(double number) : type(ValueType::Number), noInvoke(false), localOnly(LocalOnlyMode::Off), isInt(false) { data.number = number; }
+		Value(const char *s) : type(ValueType::String), noInvoke(false), localOnly(LocalOnlyMode::Off), isInt(false) { String temp(s); data.ref = temp.ss; temp.forget(); }
+		Value(const String& s) : type(ValueType::String), noInvoke(false), localOnly(LocalOnlyMode::Off), isInt(false) { data.ref = (s.ss ? s.ss : emptyString.data.ref);	retain(); }
+		Value(const ValueList& l) : type(ValueType::List), noInvoke(false), localOnly(LocalOnlyMode::Off), isInt(false) { ((ValueList&)l).ensureStorage(); data.ref = l.ls; retain(); CycleCollector::Track(l.ls, CollectableStorage::Kind::List); }
+		Value(const ValueDict& d) : type(ValueType::Map), noInvoke(false), localOnly(LocalOnlyMode::Off), isInt(false) { ((ValueDict&)d).ensureStorage(); data.ref = d.ds; retain(); CycleCollector::Track(d.ds, CollectableStorage::Kind::Map); }
+		Value(FunctionStorage *s) : type(ValueType::Function), noInvoke(false), localOnly(LocalOnlyMode::Off), isInt(false) { data.ref = s; CycleCollector::Track(s, CollectableStorage::Kind::Function); }
 		Value(SeqElemStorage *s);
 
 		// some factory functions to make things clearer
 		static Value Temp(const int tempNum) { return Value(tempNum, ValueType::Temp); }
 		static Value Var(const String& ident) { return Value(ident, ValueType::Var); }
 		static Value SeqElem(const Value& seq, const Value& idx);
-		static Value NewHandle(RefCountedStorage* data) { Value v; v.type = ValueType::Handle; v.data.ref = data; return v; }
+		static Value NewHandle(RefCountedStorage* data) {
+			Value v; v.type = ValueType::Handle; v.data.ref = data;
+			if (data) data->accountFor(MemoryKind::Handle, data->accountedSize());
+			return v;
+		}
+		static Value Integer(int64_t i) { Value v(0.0); v.isInt = true; v.data.integer = i; return v; }
 		static Value Truth(bool b) { return b ? one : zero; }
 		static Value Truth(double b);
 
 		static Value GetKeyValuePair(Value map, long index);
 		
 		// copy-ctor, assignment-op, destructor
-		Value(const Value &other) : type(other.type), noInvoke(other.noInvoke), localOnly(other.localOnly) {
+		Value(const Value &other) : type(other.type), noInvoke(other.noInvoke), localOnly(other.localOnly), isInt(other.isInt) {
 			data = other.data;
 			if (usesRef()) retain();
 		}
@@ -123,6 +141,7 @@ namespace MiniScript {
 			type = other.type;
 			noInvoke = other.noInvoke;
 			localOnly = other.localOnly;
+			isInt = other.isInt;
 			data = other.data;
 			return *this;
 		}
@@ -135,7 +154,8 @@ namespace MiniScript {
 		uint32_t UIntValue() const noexcept;
 		float FloatValue() const noexcept;
 		bool BoolValue() const noexcept;
-		double DoubleValue() const noexcept { return type == ValueType::Number ? data.number : 0; }
+		int64_t Int64Value() const noexcept;
+		double DoubleValue() const noexcept { return type != ValueType::Number ? 0 : isInt ? (double)data.integer : data.number; }
 		
 		// Looking up the inner value, *without* conversion.
 		// Note that these do NOT return a temp string/list/dict; they return
@@ -145,8 +165,24 @@ namespace MiniScript {
 			if (!data.ref) return String();
 			ss->retain();
 			return String(ss, false); }
-		ValueList GetList() const { Assert(type == ValueType::List); ValueList l((ValueListStorage*)(data.ref), false); return l; }
-		ValueDict GetDict() { Assert(type == ValueType::Map); if (not data.ref) data.ref = new ValueDictStorage(); ValueDict d((ValueDictStorage*)(data.ref)); d.retain(); return d; }
+		ValueList GetList() const { Assert(type == ValueType::List);
+			ValueListStorage *ls = (ValueListStorage*)(data.ref);
+			if (ls and ls->numbers) unpackList(ls);
+			ValueList l(ls, false);
+			return l; }
+		ValueDict GetDict() { Assert(type == ValueType::Map); if (not data.ref) { ValueDictStorage *ds = new ValueDictStorage(); CycleCollector::Track(ds, CollectableStorage::Kind::Map); data.ref = ds; } ValueDict d((ValueDictStorage*)(data.ref)); d.retain(); return d; }
+
+		// Lists whose items are all numbers may keep them packed, as plain
+		// doubles (see ListStorage::numbers).  GetList unpacks such a list for
+		// good; these work with either form, and keep it packed when they can.
+		static Value NewNumberList(long capacity=0);
+		SimpleVector<double>* GetNumbers() const { Assert(type == ValueType::List); return data.ref ? ((ValueListStorage*)data.ref)->numbers : nullptr; }
+		long ListCount() const { Assert(type == ValueType::List); return data.ref ? ((ValueListStorage*)data.ref)->itemCount() : 0; }
+		Value ListItem(long index) const { return listItem((ValueListStorage*)data.ref, index); }	// (index must be in range)
+		void ListAdd(const Value& item);
+		void ListSet(long index, const Value& item);	// (index must be in range)
+		void ListInsert(long index, const Value& item);	// (index may be 0 through ListCount())
+		void ListRemove(long index);	// (index must be in range)
 
 		// evaluation
 		bool IsNull() const {
@@ -212,6 +248,36 @@ namespace MiniScript {
 		/// </summary>
 		bool IsA(Value type, Machine *vm);
 		
+		// Make this value, and everything it refers to, immortal (see
+		// RefCountedStorage::MakeImmortal), so that interpreters on different
+		// threads can share it.  It must never be changed after this.
+		// Returns *this.
+		Value& MakeImmortal();
+
+		// Make a deep copy of this value, charged to the current memory account,
+		// for use on another thread.  This never touches the reference counts of
+		// the original, so other threads may copy the same value at once (as
+		// long as nothing changes it meanwhile).  Immortal storage is shared, not
+		// copied.  Lists, maps and functions already in the given copies are
+		// reused, so shared (and cyclic) structure stays that way.  A handle
+		// can't be copied, and raises a TypeException.
+		Value DeepCopy(ValueCopies& copies) const;
+
+		// Freeze this value, and everything it refers to: make it immortal (so
+		// interpreters on any thread may share it, and DeepCopy needn't copy
+		// it), and make its lists and maps unchangeable -- trying raises a
+		// RuntimeException.  Evaluating a frozen list or map (as a literal, or
+		// with +) gives back the same one, not a copy; and its hash is only
+		// computed once.  A frozen value is never freed.  Raises a
+		// TypeException (before changing anything) if it contains a handle.
+		// Returns *this.
+		Value& Freeze();
+		inline bool IsFrozen() const;
+
+		// Raise a RuntimeException if this is a frozen list or map.  (Call this
+		// before changing one.)
+		void CheckNotFrozen() const { if (IsFrozen()) raiseFrozen(type); }
+
 		// handy statics (DO NOT MUTATE THESE!)
 		static Value zero;			// 0
 		static Value one;			// 1
@@ -228,17 +294,41 @@ namespace MiniScript {
 		static double Equality(const Value& lhs, const Value& rhs, int recursionDepth=16);
 		inline bool RefEquals(const Value& rhs) const;
 		
+		friend class ValueCopies;
+
 	private:
 		// private constructors used by factory functions
-		Value(const int tempNum, ValueType type) : type(type), noInvoke(false), localOnly(LocalOnlyMode::Off) { data.tempNum = tempNum; }	// (type should be ValueType::Temp)
-		Value(const String& s, ValueType type) : type(type), noInvoke(false), localOnly(LocalOnlyMode::Off) { data.ref = s.ss; retain(); }
+		Value(const int tempNum, ValueType type) : type(type), noInvoke(false), localOnly(LocalOnlyMode::Off), isInt(false) { data.tempNum = tempNum; }	// (type should be ValueType::Temp)
+		Value(const String& s, ValueType type) : type(type), noInvoke(false), localOnly(LocalOnlyMode::Off), isInt(false) { data.ref = s.ss; retain(); }
 
 		// reference handling (for types where that applies)
 		bool usesRef() const { return type >= ValueType::String; }
 		void retain() { if (data.ref) data.ref->retain(); }
-		void release() { if (data.ref) { data.ref->release(); data.ref = nullptr; } }
+		void release() {
+			if (not data.ref) return;
+			// (Lists and maps may be big; let DeferredRelease decide when to free them.)
+			if (type == ValueType::List) DeferredRelease::Release(static_cast<CollectableStorage*>(data.ref), CollectableStorage::Kind::List);
+			else if (type == ValueType::Map) DeferredRelease::Release(static_cast<CollectableStorage*>(data.ref), CollectableStorage::Kind::Map);
+			else data.ref->release();
+			data.ref = nullptr;
+		}
+
+		static void makeImmortal(RefCountedStorage *storage, ValueType type);
+		static Value deepCopy(RefCountedStorage *storage, ValueType type, ValueCopies& copies);
+		static void clearContents(RefCountedStorage *storage, ValueType type);
+		static void freeze(RefCountedStorage *storage, ValueType type);
+		static void checkFreezable(RefCountedStorage *storage, ValueType type);
+		static void raiseFrozen(ValueType type);
+		unsigned int frozenHash() const;
+
+		// packed list helpers
+		static inline Value listItem(ValueListStorage *ls, long index);
+		static void unpackList(ValueListStorage *ls);
 
 		// equality helpers
+		static bool IntEqualsDouble(int64_t i, double d) {	// (exactly, not after rounding i to a double)
+			return (double)i == d and d < 9223372036854775808.0 and (int64_t)d == i;
+		}
 		static bool Equal(StringStorage *lhs, StringStorage *rhs);
 		static bool Equal(ListStorage<Value> *lhs, ListStorage<Value> *rhs);
 		static bool Equal(DictionaryStorage<Value, Value> *lhs, DictionaryStorage<Value, Value> *rhs);
@@ -270,7 +360,8 @@ namespace MiniScript {
 				return true;		// null values are always equal
 				
 			case ValueType::Number:
-				return data.number == rhs.data.number;
+				if (isInt == rhs.isInt) return isInt ? data.integer == rhs.data.integer : data.number == rhs.data.number;
+				return isInt ? IntEqualsDouble(data.integer, rhs.data.number) : IntEqualsDouble(rhs.data.integer, data.number);
 				
 			case ValueType::String:
 			case ValueType::Var:
@@ -336,7 +427,60 @@ namespace MiniScript {
 		SeqElemStorage(Value seq, Value idx) : sequence(seq), index(idx) {}
 	};
 
-	inline Value::Value(SeqElemStorage *s) : type(ValueType::SeqElem), noInvoke(false) {
+	inline bool Value::IsFrozen() const {
+		return (type == ValueType::List or type == ValueType::Map) and data.ref and static_cast<CollectableStorage*>(data.ref)->frozen;
+	}
+
+	inline Value Value::listItem(ValueListStorage *ls, long index) {
+		if (ls->numbers) return (*ls->numbers)[index];
+		return (*ls)[index];
+	}
+
+	/// ValueCopies: the bookkeeping for Value::DeepCopy -- which lists, maps and
+	/// functions have been copied already, and to what.  Lookups that miss
+	/// here go on to the fallback, if any (say, copies of data shared by many
+	/// separate copies), but new copies are always added here.
+	class ValueCopies {
+	public:
+		ValueCopies(const ValueCopies *fallback=nullptr) : fallback(fallback) {}
+
+		// Say that the given storage is to be "copied" as the given value.
+		void Add(const RefCountedStorage *storage, const Value& copy) { copies[storage] = copy; }
+
+		// Find the copy of the given storage, if there is one.
+		bool Find(const RefCountedStorage *storage, Value *outCopy) const {
+			auto found = copies.find(storage);
+			if (found != copies.end()) { *outCopy = found->second; return true; }
+			return fallback and fallback->Find(storage, outCopy);
+		}
+
+		// Add the reverse of each copy in the given set, so that copying one of
+		// those copies gets back the original.  (Call this on the thread that
+		// owns the originals.)
+		void AddReversed(const ValueCopies& other) {
+			for (auto& entry : other.copies) {
+				Value original;
+				original.type = entry.second.type;
+				original.data.ref = (RefCountedStorage*)entry.first;
+				original.retain();
+				copies[entry.second.data.ref] = original;
+			}
+		}
+
+		// Empty every list, map and function that was copied, so that any
+		// cycles among them are broken, and they're freed once released.
+		// (For originals that are about to be thrown away, and that nothing
+		// else is using.)
+		void ClearOriginals() {
+			for (auto& entry : copies) Value::clearContents((RefCountedStorage*)entry.first, entry.second.type);
+		}
+
+	private:
+		std::unordered_map<const RefCountedStorage*, Value> copies;
+		const ValueCopies *fallback;
+	};
+
+	inline Value::Value(SeqElemStorage *s) : type(ValueType::SeqElem), noInvoke(false), isInt(false) {
 		data.ref = s;
 	}
 
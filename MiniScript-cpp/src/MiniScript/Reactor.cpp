@@ -0,0 +1,231 @@
+//
+//  Reactor.cpp
+//  MiniScript
+//
+
+#include "Reactor.h"
+#include "MiniscriptInterpreter.h"
+#include "MiniscriptTAC.h"
+#include "UnitTest.h"
+#include <algorithm>
+#include <chrono>
+#include <math.h>
+#include <thread>
+
+#if defined(__linux__)
+	#include <errno.h>
+	#include <stdint.h>
+	#include <sys/epoll.h>
+	#include <sys/eventfd.h>
+	#include <sys/timerfd.h>
+	#include <unistd.h>
+#endif
+
+namespace MiniScript {
+
+	// How long to sleep at a time, when waiting on file descriptors we can't watch.
+	static const double fallbackPollInterval = 0.01;
+
+	#if defined(__linux__)
+
+	static bool watch(int epollFd, int fd) {
+		struct epoll_event event = {};
+		event.events = EPOLLIN;
+		event.data.fd = fd;
+		return epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) == 0;
+	}
+
+	static void drain(int fd) {
+		uint64_t count;
+		while (read(fd, &count, sizeof(count)) > 0) {}
+	}
+
+	Reactor::Reactor() : interruptPending(false) {
+		epollFd = epoll_create1(EPOLL_CLOEXEC);
+		timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (epollFd >= 0 and (timerFd < 0 or eventFd < 0 or not watch(epollFd, timerFd) or not watch(epollFd, eventFd))) {
+			close(epollFd);
+			epollFd = -1;
+		}
+	}
+
+	Reactor::~Reactor() {
+		if (epollFd >= 0) close(epollFd);
+		if (timerFd >= 0) close(timerFd);
+		if (eventFd >= 0) close(eventFd);
+	}
+
+	bool Reactor::watchesFds() const {
+		return epollFd >= 0;
+	}
+
+	bool Reactor::WaitFor(const std::vector<int>& fds, double timeout) {
+		if (epollFd < 0) return sleepFor(fds, timeout);
+
+		// Watch the given file descriptors, just for this wait.  Any we can't
+		// watch (say, a plain file's, or one that's been closed) count as ready.
+		std::vector<int> watched;
+		bool ready = false;
+		for (int fd : fds) {
+			if (watch(epollFd, fd)) watched.push_back(fd);
+			else if (errno != EEXIST) ready = true;		// (EEXIST: listed twice)
+		}
+		if (ready) timeout = 0;
+
+		// Time the wait with our timerfd (epoll_wait only counts milliseconds).
+		if (timeout > 0) {
+			struct itimerspec spec = {};
+			spec.it_value.tv_sec = (time_t)timeout;
+			spec.it_value.tv_nsec = (long)((timeout - floor(timeout)) * 1e9);
+			if (spec.it_value.tv_sec == 0 and spec.it_value.tv_nsec == 0) spec.it_value.tv_nsec = 1;	// (zero would disarm it)
+			timerfd_settime(timerFd, 0, &spec, nullptr);
+		}
+
+		struct epoll_event events[16];
+		int count = epoll_wait(epollFd, events, 16, timeout == 0 ? 0 : -1);
+		bool timedOut = (count == 0 and not ready);
+		for (int i=0; i<count; i++) {
+			if (events[i].data.fd == timerFd) {
+				if (count == 1) timedOut = true;
+			} else if (events[i].data.fd == eventFd) {
+				drain(eventFd);
+			}
+		}
+		// (A count < 0 means a signal interrupted us; that's a wake-up too.)
+
+		if (timeout > 0) {
+			struct itimerspec off = {};
+			timerfd_settime(timerFd, 0, &off, nullptr);
+			drain(timerFd);
+		}
+		for (int fd : watched) epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+		return not timedOut;
+	}
+
+	void Reactor::Interrupt() {
+		if (epollFd >= 0) {
+			uint64_t one = 1;
+			if (write(eventFd, &one, sizeof(one)) < 0) {}	// (full is as good as written)
+			return;
+		}
+		std::lock_guard<std::mutex> guard(lock);
+		interruptPending = true;
+		interrupted.notify_all();
+	}
+
+	#else
+
+	Reactor::Reactor() : interruptPending(false) {}
+	Reactor::~Reactor() {}
+
+	bool Reactor::watchesFds() const {
+		return false;
+	}
+
+	bool Reactor::WaitFor(const std::vector<int>& fds, double timeout) {
+		return sleepFor(fds, timeout);
+	}
+
+	void Reactor::Interrupt() {
+		std::lock_guard<std::mutex> guard(lock);
+		interruptPending = true;
+		interrupted.notify_all();
+	}
+
+	#endif
+
+	bool Reactor::sleepFor(const std::vector<int>& fds, double timeout) {
+		// We can't tell when the file descriptors are ready, so just say they
+		// might be, after a short nap.
+		if (not fds.empty() and (timeout < 0 or timeout > fallbackPollInterval)) timeout = fallbackPollInterval;
+		std::unique_lock<std::mutex> guard(lock);
+		auto woken = [this] { return interruptPending; };
+		bool wasInterrupted;
+		if (timeout < 0) {
+			interrupted.wait(guard, woken);
+			wasInterrupted = true;
+		} else {
+			wasInterrupted = interrupted.wait_for(guard, std::chrono::duration<double>(timeout), woken);
+		}
+		interruptPending = false;
+		return wasInterrupted or not fds.empty();
+	}
+
+	void Reactor::Wait(Machine *vm, double pollInterval) {
+		if (not vm->Waiting()) return;
+		double timeout = vm->wakeTime > 0 ? std::max(0.0, vm->wakeTime - vm->RunTime()) : -1;
+		bool watching = watchesFds() and not vm->wakeFds.empty();
+		if (not watching and (vm->wakeTime <= 0 or not vm->wakeFds.empty())) {
+			// We don't know when it'll be ready (or can't watch what it's
+			// waiting on); so come back and check soon.
+			if (timeout < 0 or timeout > pollInterval) timeout = pollInterval;
+		}
+		WaitFor(watching ? vm->wakeFds : std::vector<int>(), timeout);
+	}
+
+
+	#pragma mark -
+
+	class TestReactor : public UnitTest
+	{
+	public:
+		TestReactor() : UnitTest("Reactor") {}
+		virtual void Run();
+	};
+
+	static double secondsSince(std::chrono::steady_clock::time_point start) {
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	void TestReactor::Run()
+	{
+		Reactor reactor;
+		std::vector<int> none;
+
+		// A timeout times out (not much) later.
+		auto start = std::chrono::steady_clock::now();
+		Assert(not reactor.WaitFor(none, 0.02));
+		Assert(secondsSince(start) >= 0.019);
+
+		// Interrupt wakes a waiter, even one with no time limit.
+		std::thread interrupter([&reactor] {
+			std::this_thread::sleep_for(std::chrono::milliseconds(20));
+			reactor.Interrupt();
+		});
+		Assert(reactor.WaitFor(none, -1));
+		interrupter.join();
+
+		#if defined(__linux__)
+		// A pipe wakes us when there's something to read (and not before).
+		int fds[2];
+		Assert(pipe(fds) == 0);
+		std::vector<int> readEnd(1, fds[0]);
+		Assert(not reactor.WaitFor(readEnd, 0));
+		Assert(write(fds[1], "x", 1) == 1);
+		start = std::chrono::steady_clock::now();
+		Assert(reactor.WaitFor(readEnd, 10));
+		Assert(secondsSince(start) < 1);
+		close(fds[0]);
+		close(fds[1]);
+		#endif
+
+		// A machine running `wait` sleeps until it's done, not a poll at a time.
+		Intrinsics::InitIfNeeded();
+		Interpreter interp("wait 0.05\nx = 42");
+		interp.Compile();
+		start = std::chrono::steady_clock::now();
+		int waits = 0;
+		while (not interp.Done()) {
+			interp.RunUntilDone();
+			if (interp.Done()) break;
+			reactor.Wait(interp.vm, 1);
+			waits++;
+		}
+		Assert(interp.GetGlobalValue("x").IntValue() == 42);
+		Assert(waits >= 1 and waits <= 3);
+		Assert(secondsSince(start) >= 0.045 and secondsSince(start) < 0.9);
+	}
+
+	RegisterSlowUnitTest(TestReactor);
+}
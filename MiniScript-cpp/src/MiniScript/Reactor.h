@@ -0,0 +1,70 @@
+//
+//  Reactor.h
+//  MiniScript
+//
+//  A Reactor lets a host that runs an interpreter on its own thread sleep
+//  while the interpreter waits for something (see Machine::Waiting), rather
+//  than polling it.  An intrinsic that returns a partial result says what
+//  it's waiting for: a time (Machine::wakeTime, as the wait intrinsic sets),
+//  and/or file descriptors that it will have something to do once any of
+//  them becomes readable (Machine::wakeFds, as exec sets for its pipes and
+//  child process).  Wait sleeps until the first of those happens, or for
+//  pollInterval if the intrinsic didn't say.
+//
+//  On Linux, this is done with epoll, with a timerfd for the time; so the
+//  host wakes exactly when it's due, and uses no CPU meanwhile.  Elsewhere,
+//  we can't watch the file descriptors, so we sleep until the time (or for
+//  no more than pollInterval, if waiting on file descriptors too).
+//
+//  A Reactor is used by one thread at a time, except for Interrupt.
+//
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+namespace MiniScript {
+
+	class Machine;
+
+	class Reactor {
+	public:
+		Reactor();
+		~Reactor();
+
+		// If the given machine is waiting, sleep until it's likely to be ready.
+		void Wait(Machine *vm, double pollInterval=0.01);
+
+		// Sleep until any of the given file descriptors is readable (or has
+		// hung up), or the timeout (in seconds; < 0 for none) runs out, or
+		// Interrupt is called.  Return false if the time ran out.  (A file
+		// descriptor that can't be watched, like a plain file's, counts as
+		// readable.)
+		bool WaitFor(const std::vector<int>& fds, double timeout);
+
+		// Wake a thread sleeping in Wait or WaitFor (or that next will).
+		// Safe to call from any thread.
+		void Interrupt();
+
+	private:
+		// Whether WaitFor really watches file descriptors.
+		bool watchesFds() const;
+
+		// WaitFor, without watching the file descriptors.
+		bool sleepFor(const std::vector<int>& fds, double timeout);
+
+		#if defined(__linux__)
+		int epollFd;	// (-1 if we couldn't make one; then we sleep instead)
+		int timerFd;
+		int eventFd;	// (for Interrupt)
+		#endif
+		std::mutex lock;
+		std::condition_variable interrupted;
+		bool interruptPending;
+	};
+}
+
+#endif // REACTOR_H
@@ -10,6 +10,8 @@
 #define REFCOUNTEDSTORAGE_H
 
 #include <stdio.h>
+#include "SlabAllocator.h"
+#include "MemoryAccount.h"
 
 namespace MiniScript {
 
@@ -19,24 +21,70 @@ extern long _stringInstanceCount();
 
 	class RefCountedStorage {
 	public:
-		void retain() { refCount++; }
-		void release() { if (--refCount == 0) delete this; }
+		void retain() { if (refCount > 0) refCount++; }
+		void release() { if (refCount > 0 and --refCount == 0) delete this; }
+
+		// Make this storage immortal: from now on, retain and release leave it
+		// alone, and it is never freed.  That makes it safe to share between
+		// interpreters running on different threads (as long as nobody changes
+		// it).  See Value::MakeImmortal, which does this to everything a value
+		// refers to.  Since it no longer belongs to any one interpreter, it's
+		// also taken out of its memory account (like a message in a channel).
+		void MakeImmortal() {
+			refCount = -1;
+			if (account) {
+				MemoryAccount *oldAccount = account;
+				account = nullptr;
+				oldAccount->removed(accountKind, accountedBytes);
+			}
+		}
+		bool IsImmortal() const { return refCount < 0; }
+
+		// The memory account this storage is charged to (or nullptr).
+		MemoryAccount* Account() const { return account; }
+
+		// Record what kind of object this is, and how many bytes it now uses
+		// in all (including any separately allocated buffers), in the memory
+		// account it's charged to.  May raise a LimitExceededException, if
+		// this takes that account over its hard limit (unless canRaise is false).
+		void accountFor(MemoryKind kind, long byteCount, bool canRaise=true) {
+			MemoryKind oldKind = accountKind;
+			long oldBytes = accountedBytes;
+			accountKind = kind;
+			accountedBytes = byteCount;
+			if (account) account->changed(oldKind, oldBytes, kind, byteCount, canRaise);
+		}
+		long accountedSize() const { return accountedBytes; }
+
+#if MINISCRIPT_SLAB_ALLOC
+		// All storage objects come from the slab allocator.  (Our destructor is
+		// virtual, so the sized delete gets the size of the actual subclass.)
+		static void* operator new(size_t size) { return SlabAllocator::Alloc(size); }
+		static void operator delete(void* ptr, size_t size) { SlabAllocator::Free(ptr, size); }
+#endif
 		
 	protected:
-		RefCountedStorage() : refCount(1) {
+		RefCountedStorage() : refCount(1), account(MemoryAccount::current), accountedBytes(0), accountKind(MemoryKind::Other) {
+			if (account) account->added();
 #if(DEBUG)
 			instanceCount++;
 			printf("+++ %ld instances (%ld strings)\n", instanceCount, _stringInstanceCount());
 #endif
 		}
 		virtual ~RefCountedStorage() {
+			if (account) account->removed(accountKind, accountedBytes);
 #if(DEBUG)
 			instanceCount--;
 			printf("--- %ld instances (%ld strings)\n", instanceCount, _stringInstanceCount());
 #endif
 		}
 		
-		long refCount;
+		long refCount;		// (or -1 if immortal)
+		
+	private:
+		MemoryAccount *account;		// account this object is charged to (if any)
+		long accountedBytes;		// bytes charged for it
+		MemoryKind accountKind;		// kind of object it was charged as
 		
 #if(DEBUG)
 	public:
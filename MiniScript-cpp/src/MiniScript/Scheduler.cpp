@@ -0,0 +1,351 @@
+//
+//  Scheduler.cpp
+//  MiniScript
+//
+
+#include "Scheduler.h"
+#include "MiniscriptInterpreter.h"
+#include "MiniscriptIntrinsics.h"
+#include "UnitTest.h"
+#include <atomic>
+#include <chrono>
+#include <limits>
+
+namespace MiniScript {
+
+	struct Scheduler::Task {
+		Interpreter *interp;
+		double readySince;			// when it last became runnable
+		bool isParked;				// (guarded by the scheduler's lock)
+		std::multimap<double, Task*>::iterator parkedAt;
+		std::atomic<bool> wakeRequested;	// Wake was called while it wasn't parked
+
+		Task(Interpreter *interp) : interp(interp), readySince(0), isParked(false), wakeRequested(false) {}
+	};
+
+	// Per-worker statistics (guarded by the worker's lock).
+	struct WorkerStats {
+		long slices = 0;
+		long steals = 0;
+		long maxQueueDepth = 0;
+		double totalSliceTime = 0;
+		double maxSliceTime = 0;
+		double totalLatency = 0;
+		double maxLatency = 0;
+	};
+
+	struct Scheduler::Worker {
+		std::mutex lock;
+		std::deque<Task*> queue;	// the owner takes from the front; thieves, from the back
+		WorkerStats stats;
+		std::thread thread;
+	};
+
+	Scheduler::Scheduler(int workerCount) : timeSlice(0.005), pollInterval(0.002),
+	  onFinished(nullptr), onFinishedData(nullptr), nextWorker(0), finished(0), stopping(false),
+	  runnableCount(0), sleepingWorkers(0), nextWake(std::numeric_limits<double>::infinity()) {
+		if (workerCount <= 0) workerCount = (int)std::thread::hardware_concurrency();
+		if (workerCount <= 0) workerCount = 1;
+		// (Make sure the intrinsics are set up before any worker could need them.)
+		Intrinsics::InitIfNeeded();
+		for (int i=0; i<workerCount; i++) workers.push_back(new Worker());
+		for (int i=0; i<workerCount; i++) workers[i]->thread = std::thread(&Scheduler::workerLoop, this, i);
+	}
+
+	Scheduler::~Scheduler() {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
+		}
+		workAvailable.notify_all();
+		for (Worker *w : workers) w->thread.join();
+		for (Worker *w : workers) delete w;
+		for (auto& entry : tasks) delete entry.second;
+	}
+
+	double Scheduler::now() {
+		return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	void Scheduler::Add(Interpreter *interp) {
+		std::lock_guard<std::mutex> guard(lock);
+		if (tasks.count(interp)) return;
+		Task *task = new Task(interp);
+		tasks[interp] = task;
+		makeRunnable(task, nextWorker);
+		nextWorker = (nextWorker + 1) % workers.size();
+		if (sleepingWorkers > 0) workAvailable.notify_one();
+	}
+
+	void Scheduler::Wake(Interpreter *interp) {
+		std::lock_guard<std::mutex> guard(lock);
+		auto found = tasks.find(interp);
+		if (found == tasks.end()) return;
+		Task *task = found->second;
+		if (not task->isParked) {
+			// It's running (or about to); don't let it park after this slice.
+			task->wakeRequested = true;
+			return;
+		}
+		parked.erase(task->parkedAt);
+		task->isParked = false;
+		nextWake = parked.empty() ? std::numeric_limits<double>::infinity() : parked.begin()->first;
+		makeRunnable(task, nextWorker);
+		nextWorker = (nextWorker + 1) % workers.size();
+		if (sleepingWorkers > 0) workAvailable.notify_one();
+	}
+
+	void Scheduler::WaitUntilIdle() {
+		std::unique_lock<std::mutex> guard(lock);
+		allDone.wait(guard, [this] { return tasks.empty(); });
+	}
+
+	Scheduler::Stats Scheduler::GetStats() {
+		Stats result = {};
+		double totalSliceTime = 0, totalLatency = 0;
+		for (Worker *w : workers) {
+			std::lock_guard<std::mutex> guard(w->lock);
+			const WorkerStats& ws = w->stats;
+			result.slices += ws.slices;
+			result.steals += ws.steals;
+			if (ws.maxQueueDepth > result.maxQueueDepth) result.maxQueueDepth = ws.maxQueueDepth;
+			totalSliceTime += ws.totalSliceTime;
+			totalLatency += ws.totalLatency;
+			if (ws.maxSliceTime > result.maxSliceTime) result.maxSliceTime = ws.maxSliceTime;
+			if (ws.maxLatency > result.maxLatency) result.maxLatency = ws.maxLatency;
+		}
+		if (result.slices > 0) {
+			result.meanSliceTime = totalSliceTime / result.slices;
+			result.meanLatency = totalLatency / result.slices;
+		}
+		std::lock_guard<std::mutex> guard(lock);
+		result.active = (long)tasks.size();
+		result.parked = (long)parked.size();
+		result.runnable = runnableCount;
+		result.finished = finished;
+		return result;
+	}
+
+	// Put the given task at the back of the given worker's queue.
+	void Scheduler::makeRunnable(Task *task, int index) {
+		task->readySince = now();
+		Worker *w = workers[index];
+		std::lock_guard<std::mutex> guard(w->lock);
+		w->queue.push_back(task);
+		if ((long)w->queue.size() > w->stats.maxQueueDepth) w->stats.maxQueueDepth = (long)w->queue.size();
+		runnableCount++;
+	}
+
+	// Get the next task for the given worker: from its own queue if it can,
+	// or else stolen from another worker's.
+	Scheduler::Task* Scheduler::take(int index, bool *stolen) {
+		long count = (long)workers.size();
+		for (long i=0; i<count; i++) {
+			Worker *w = workers[(index + i) % count];
+			std::lock_guard<std::mutex> guard(w->lock);
+			if (w->queue.empty()) continue;
+			Task *task;
+			if (i == 0) {
+				task = w->queue.front();
+				w->queue.pop_front();
+			} else {
+				task = w->queue.back();
+				w->queue.pop_back();
+			}
+			runnableCount--;
+			*stolen = (i > 0);
+			return task;
+		}
+		return nullptr;
+	}
+
+	// Make runnable any parked tasks whose time has come (giving them to
+	// the given worker).  Return how many there were.
+	long Scheduler::wakeDue(int index) {
+		std::lock_guard<std::mutex> guard(lock);
+		double t = now();
+		long count = 0;
+		while (not parked.empty() and parked.begin()->first <= t) {
+			Task *task = parked.begin()->second;
+			parked.erase(parked.begin());
+			task->isParked = false;
+			makeRunnable(task, index);
+			count++;
+		}
+		nextWake = parked.empty() ? std::numeric_limits<double>::infinity() : parked.begin()->first;
+		if (count > 1 and sleepingWorkers > 0) workAvailable.notify_all();
+		return count;
+	}
+
+	void Scheduler::workerLoop(int index) {
+		while (true) {
+			if (now() >= nextWake) wakeDue(index);
+			bool stolen = false;
+			Task *task = take(index, &stolen);
+			if (task) {
+				runSlice(index, task, stolen);
+				continue;
+			}
+
+			// Nothing to do; sleep until there is, or until a parked task is due.
+			std::unique_lock<std::mutex> guard(lock);
+			if (stopping) return;
+			sleepingWorkers++;		// (before checking, so that makeRunnable can't miss us)
+			if (runnableCount == 0 and nextWake > now()) {
+				if (parked.empty()) workAvailable.wait(guard);
+				else workAvailable.wait_for(guard, std::chrono::duration<double>(nextWake - now()));
+			}
+			sleepingWorkers--;
+			if (stopping) return;
+		}
+	}
+
+	void Scheduler::runSlice(int index, Task *task, bool stolen) {
+		Interpreter *interp = task->interp;
+		Worker *w = workers[index];
+		task->wakeRequested = false;
+		if (interp->vm) interp->vm->wakeTime = 0;
+		double start = now();
+		interp->RunUntilDone(timeSlice, true);
+		double end = now();
+		{
+			std::lock_guard<std::mutex> guard(w->lock);
+			WorkerStats& ws = w->stats;
+			double latency = start - task->readySince;
+			double sliceTime = end - start;
+			ws.slices++;
+			if (stolen) ws.steals++;
+			ws.totalSliceTime += sliceTime;
+			ws.totalLatency += latency;
+			if (sliceTime > ws.maxSliceTime) ws.maxSliceTime = sliceTime;
+			if (latency > ws.maxLatency) ws.maxLatency = latency;
+		}
+
+		if (interp->Done()) {
+			finish(task);
+			return;
+		}
+
+		Machine *vm = interp->vm;
+		if (not vm->yielding and vm->Waiting()) {
+			// Waiting for something: park it until it's likely to be ready.
+			double delay = vm->wakeTime > 0 ? vm->wakeTime - vm->RunTime() : pollInterval;
+			if (not vm->wakeFds.empty() and delay > pollInterval) delay = pollInterval;	// (we don't watch those; poll)
+			if (delay > 0) {
+				std::lock_guard<std::mutex> guard(lock);
+				if (not task->wakeRequested) {
+					task->isParked = true;
+					task->parkedAt = parked.emplace(end + delay, task);
+					nextWake = parked.begin()->first;
+					if (sleepingWorkers > 0) workAvailable.notify_one();	// (so it can reconsider how long to sleep)
+					return;
+				}
+			}
+		}
+
+		// Out of time (or yielded, or ready to go again): back of the line.
+		makeRunnable(task, index);
+		if (sleepingWorkers > 0) {
+			std::lock_guard<std::mutex> guard(lock);
+			workAvailable.notify_one();
+		}
+	}
+
+	void Scheduler::finish(Task *task) {
+		if (onFinished) onFinished(task->interp, onFinishedData);
+		std::lock_guard<std::mutex> guard(lock);
+		tasks.erase(task->interp);
+		finished++;
+		delete task;
+		if (tasks.empty()) allDone.notify_all();
+	}
+
+
+	#pragma mark -
+
+	class TestScheduler : public UnitTest
+	{
+	public:
+		TestScheduler() : UnitTest("Scheduler") {}
+		virtual void Run();
+	};
+
+	static std::atomic<int> finishedCount(0);
+
+	static void countFinished(Interpreter *interp, void *userData) {
+		finishedCount++;
+	}
+
+	// An intrinsic that waits (with no idea how long) until gateOpen is set.
+	// (It has no name, so it's only visible where we assign it to a variable.)
+	static std::atomic<bool> gateOpen(false);
+	static Intrinsic *testGate = nullptr;
+
+	static IntrinsicResult intrinsic_testGate(Context *context, IntrinsicResult partialResult) {
+		if (gateOpen) return IntrinsicResult(Value(42));
+		return IntrinsicResult(Value::null, false);
+	}
+
+	void TestScheduler::Run()
+	{
+		Intrinsics::InitIfNeeded();
+		if (!testGate) {
+			testGate = Intrinsic::Create("");
+			testGate->code = &intrinsic_testGate;
+		}
+
+		Scheduler scheduler(3);
+		scheduler.timeSlice = 0.001;
+		scheduler.onFinished = countFinished;
+		finishedCount = 0;
+
+		// A mix of scripts that compute, wait, and yield.
+		const int count = 24;
+		Interpreter *interps[count];
+		for (int i=0; i<count; i++) {
+			switch (i % 3) {
+				case 0:
+					interps[i] = new Interpreter("result = 0; for i in range(1, 2000); result = result + i; end for");
+					break;
+				case 1:
+					interps[i] = new Interpreter("wait 0.01; result = 2001000");
+					break;
+				default:
+					interps[i] = new Interpreter("result = 0; for i in range(1, 2000); result = result + i; if i % 100 == 0 then yield; end for");
+			}
+			scheduler.Add(interps[i]);
+		}
+		scheduler.WaitUntilIdle();
+
+		Assert(finishedCount == count);
+		for (int i=0; i<count; i++) {
+			Assert(interps[i]->Done());
+			Assert(interps[i]->GetGlobalValue("result").IntValue() == 2001000);
+			delete interps[i];
+		}
+		Scheduler::Stats stats = scheduler.GetStats();
+		Assert(stats.active == 0 and stats.runnable == 0 and stats.parked == 0);
+		Assert(stats.finished == count);
+		Assert(stats.slices >= count);
+		Assert(stats.maxQueueDepth >= 1);
+		Assert(stats.maxSliceTime >= stats.meanSliceTime and stats.meanSliceTime > 0);
+
+		// Wake brings a parked interpreter back without waiting for the poll.
+		Scheduler patient(1);
+		patient.pollInterval = 60;
+		Interpreter *waiter = new Interpreter("result = testGate");
+		waiter->Compile();
+		waiter->SetGlobalValue("testGate", testGate->GetFunc());
+		patient.Add(waiter);
+		while (patient.GetStats().parked == 0) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		patient.Add(waiter);		// (already added; ignored)
+		Assert(patient.GetStats().active == 1);
+		gateOpen = true;
+		patient.Wake(waiter);
+		patient.WaitUntilIdle();
+		Assert(waiter->GetGlobalValue("result").IntValue() == 42);
+		delete waiter;
+	}
+
+	RegisterSlowUnitTest(TestScheduler);
+}
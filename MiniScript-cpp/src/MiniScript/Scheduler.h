@@ -0,0 +1,120 @@
+//
+//  Scheduler.h
+//  MiniScript
+//
+//  A Scheduler runs many Interpreters at once, on a pool of worker threads
+//  (one per core by default), giving each a time slice in turn via
+//  RunUntilDone.  Each worker keeps its own queue of runnable interpreters;
+//  a worker with nothing to do steals from the others, so the load evens
+//  out without a single shared queue for every worker to fight over.
+//
+//  An interpreter that returns early because it's waiting for something (an
+//  intrinsic returned a partial result, as wait and exec do) is parked,
+//  rather than spinning: it's retried when the intrinsic said it would be
+//  ready (see Machine::wakeTime), or after pollInterval if it didn't say (or
+//  is waiting on a file descriptor -- the scheduler doesn't watch those), or
+//  as soon as the host calls Wake.  One that calls yield goes to the back of
+//  the line.
+//
+//  See the threading notes in MiniscriptInterpreter.h; in particular, an
+//  Interpreter must not be touched by anything else while the scheduler has it.
+//
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace MiniScript {
+
+	class Interpreter;
+
+	class Scheduler {
+	public:
+		// Statistics, for monitoring.  (Times are in seconds.)
+		struct Stats {
+			long active;			// interpreters added and not yet finished
+			long runnable;			// ...of which, waiting in a queue for a turn
+			long parked;			// ...of which, waiting for something else
+			long maxQueueDepth;		// most runnable at once, on any one worker
+			long finished;			// interpreters that have run to completion
+			long slices;			// time slices run
+			long steals;			// slices taken from another worker's queue
+			double meanSliceTime;	// how long a slice ran
+			double maxSliceTime;
+			double meanLatency;		// how long a runnable interpreter waited for its slice
+			double maxLatency;
+		};
+
+		// Called (on a worker thread) when an interpreter is done.
+		typedef void (*FinishedCallback)(Interpreter *interp, void *userData);
+
+		// Start the given number of worker threads (or one per core, if 0).
+		Scheduler(int workerCount=0);
+
+		// Stop the workers (waiting for any slices in progress), and forget
+		// any unfinished interpreters.  (They aren't deleted; they're still yours.)
+		~Scheduler();
+
+		// Settings.  Change these before adding any interpreters.
+		double timeSlice;			// how long to run an interpreter per turn
+		double pollInterval;		// how soon to retry a parked interpreter that didn't say when
+		FinishedCallback onFinished;
+		void *onFinishedData;
+
+		// Add an interpreter to run.  The scheduler doesn't take ownership, but
+		// you mustn't touch or delete it until it's finished (see onFinished and
+		// WaitUntilIdle).  Adding one that's already here does nothing.
+		void Add(Interpreter *interp);
+
+		// Make a parked interpreter runnable right away (because whatever it was
+		// waiting for is ready).  Safe to call from any thread, including from
+		// an intrinsic; does nothing for an interpreter that isn't here.
+		void Wake(Interpreter *interp);
+
+		// Wait until every interpreter added has finished.
+		void WaitUntilIdle();
+
+		int WorkerCount() const { return (int)workers.size(); }
+		Stats GetStats();
+
+	private:
+		struct Task;
+		struct Worker;
+
+		void workerLoop(int index);
+		Task* take(int index, bool *stolen);
+		void runSlice(int index, Task *task, bool stolen);
+		void makeRunnable(Task *task, int index);
+		long wakeDue(int index);
+		void finish(Task *task);
+
+		static double now();
+
+		std::vector<Worker*> workers;
+
+		// Everything below is guarded by `lock`.
+		std::mutex lock;
+		std::condition_variable workAvailable;	// (for idle workers)
+		std::condition_variable allDone;		// (for WaitUntilIdle)
+		std::unordered_map<Interpreter*, Task*> tasks;
+		std::multimap<double, Task*> parked;	// by time to retry
+		int nextWorker;			// (where to put the next interpreter added or woken)
+		long finished;
+		bool stopping;
+
+		// ...and these may be read without it.
+		std::atomic<long> runnableCount;
+		std::atomic<int> sleepingWorkers;
+		std::atomic<double> nextWake;			// when the first parked task is due
+	};
+}
+
+#endif // SCHEDULER_H
@@ -6,7 +6,10 @@
 #include "UnicodeUtil.h"
 #include "UnitTest.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <cmath>
+#include <random>
+#include <chrono>
 
 namespace MiniScript {
 
@@ -28,6 +31,95 @@ namespace MiniScript {
 
 	
 	using std::fabs;
+
+	// Hashing
+	//
+	//	String::Hash uses SipHash-1-3, which resists deliberate collisions
+	//	as long as the key is secret.
+
+	static inline uint64_t rotl64(uint64_t x, int b) { return (x << b) | (x >> (64 - b)); }
+
+	static inline uint64_t load64LE(const unsigned char *p) {
+		return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24)
+			| ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) | ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+	}
+
+	#define SIPROUND do { \
+		v0 += v1; v1 = rotl64(v1, 13); v1 ^= v0; v0 = rotl64(v0, 32); \
+		v2 += v3; v3 = rotl64(v3, 16); v3 ^= v2; \
+		v0 += v3; v3 = rotl64(v3, 21); v3 ^= v0; \
+		v2 += v1; v1 = rotl64(v1, 17); v1 ^= v2; v2 = rotl64(v2, 32); \
+	} while (0)
+
+	// See https://github.com/veorq/SipHash; this is the variant with one
+	// compression round and three finalization rounds.
+	uint64_t SipHash13(const void *data, size_t lenB, uint64_t k0, uint64_t k1) {
+		const unsigned char *p = (const unsigned char*)data;
+		uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+		uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+		uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+		uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+		const unsigned char *end = p + (lenB & ~(size_t)7);
+		for (; p != end; p += 8) {
+			uint64_t m = load64LE(p);
+			v3 ^= m;
+			SIPROUND;
+			v0 ^= m;
+		}
+		uint64_t b = (uint64_t)lenB << 56;
+		for (int i = (int)(lenB & 7) - 1; i >= 0; i--) b |= (uint64_t)p[i] << (8 * i);
+		v3 ^= b;
+		SIPROUND;
+		v0 ^= b;
+		v2 ^= 0xff;
+		SIPROUND;
+		SIPROUND;
+		SIPROUND;
+		return v0 ^ v1 ^ v2 ^ v3;
+	}
+
+	#undef SIPROUND
+
+	// The key for string hashing is random, and chosen once per process, so
+	// that whoever supplies the keys of a map can't make them all collide.
+	// For reproducible runs, set the environment variable MINISCRIPT_HASH_SEED
+	// to an integer, and the key is derived from that instead.
+	struct HashKey { uint64_t k0, k1; };
+
+	static uint64_t splitMix64(uint64_t& state) {
+		uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		return z ^ (z >> 31);
+	}
+
+	static HashKey makeHashKey() {
+		uint64_t state;
+		const char *seed = getenv("MINISCRIPT_HASH_SEED");
+		if (seed and seed[0]) {
+			state = strtoull(seed, nullptr, 0);
+		} else {
+			// (random_device may be unavailable, so mix in the clock and ASLR too)
+			state = (uint64_t)std::chrono::high_resolution_clock::now().time_since_epoch().count();
+			state ^= (uint64_t)(size_t)&state;
+			try {
+				std::random_device rd;
+				state ^= ((uint64_t)rd() << 32) ^ rd();
+			} catch (...) {}
+		}
+		HashKey key;
+		key.k0 = splitMix64(state);
+		key.k1 = splitMix64(state);
+		return key;
+	}
+
+	unsigned int String::Hash() const {
+		static const HashKey key = makeHashKey();
+		size_t bytes = LengthB();
+		uint64_t h = SipHash13(bytes ? ss->data : "", bytes, key.k0, key.k1);
+		return (unsigned int)(h ^ (h >> 32));
+	}
+
 	
 	// at
 	//
@@ -208,6 +300,14 @@ namespace MiniScript {
 	
 	void TestString::Run()
 	{
+		// SipHash-1-3 known answers, with key bytes 00 01 ... 0f
+		const uint64_t k0 = 0x0706050403020100ULL, k1 = 0x0f0e0d0c0b0a0908ULL;
+		const unsigned char msg[15] = {0,1,2,3,4,5,6,7,8,9,10,11,12,13,14};
+		Assert(SipHash13("", 0, k0, k1) == 0xabac0158050fc4dcULL);
+		Assert(SipHash13(msg, 15, k0, k1) == 0xd320d86d2a519956ULL);
+		Assert(SipHash13("abcdefgh", 8, k0, k1) == 0x12d8c08c2ee9e620ULL);
+		Assert(String("hello").Hash() == (String("hel") + "lo").Hash());
+
 		String foo("foo");
 		String bar("barber");
 		
@@ -226,6 +326,16 @@ namespace MiniScript {
 		
 		foo.Append(bar);
 		Assert(foo == "foobarber");
+		
+		// The tail end of a long string shares its data.
+		String longStr = String(60, 'x') + "0123456789ABCDEFGHIJ" + String(100, 'y');
+		String tail = longStr.SubstringB(60);
+		Assert(tail.c_str() == longStr.c_str() + 60);
+		Assert(tail.StartsWith("0123456789") and tail.LengthB() == 120);
+		String tailOfTail = tail.SubstringB(20);
+		longStr = tail = "";
+		Assert(tailOfTail == String(100, 'y'));
+		Assert(longStr.SubstringB(0, 3) == "" and tailOfTail.SubstringB(98) == "yy");
 
 		Assert(bar.at(0) == 'b');
 		
@@ -8,6 +8,7 @@
 
 #include <ciso646>  // (force non-conforming compilers to join the 21st century)
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <assert.h>
 #include <cctype>
@@ -19,12 +20,21 @@ namespace MiniScript {
 	using std::tolower;
 	using std::toupper;
 
+	// A substring running to the end of a string, of at least this many bytes
+	// (and at least half the original), shares the original's data rather than
+	// copying it.  (Since strings are immutable, and such a substring is already
+	// null-terminated, this is transparent to everything else.)  Only such tail
+	// substrings are shared: any substring that stops short of the end (which
+	// would need its own terminating null), or is shorter than that, is copied.
+	#define STRING_SHARE_MIN_BYTES 64
+
 	class String;
 	class StringStorage;
 
 	class StringStorage : public RefCountedStorage {
 	private:
-		StringStorage() : data(nullptr), dataSize(0), charCount(-1) {
+		StringStorage() : data(nullptr), dataSize(0), charCount(-1), base(nullptr) {
+			accountFor(MemoryKind::String, sizeof(StringStorage));
 #if(DEBUG)
 			instanceCount++;
 			_prev = nullptr; _next = head;
@@ -32,7 +42,8 @@ namespace MiniScript {
 			head = this;
 #endif
 		}
-		StringStorage(size_t bufSize) : dataSize(bufSize), charCount(-1) {
+		StringStorage(size_t bufSize) : data(nullptr), dataSize(bufSize), charCount(-1), base(nullptr) {
+			accountFor(MemoryKind::String, sizeof(StringStorage) + bufSize);	// (before allocating, in case this raises)
 			data = new char[bufSize];
 			memset(data, 0, bufSize);
 #if(DEBUG)
@@ -43,7 +54,8 @@ namespace MiniScript {
 #endif
 		}
 		virtual ~StringStorage() {
-			if (data) delete[] data;
+			if (base) base->release();
+			else if (data) delete[] data;
 #if(DEBUG)
 			instanceCount--;
 			if (_prev) _prev->_next = _next;
@@ -59,6 +71,8 @@ namespace MiniScript {
 		long charCount; // -1 when not yet known
 		bool isASCII;   // if charCount > 0 and isASCII==true, then this String is 1 byte per character
 		
+		StringStorage *base;	// storage whose data we share the tail end of, if any
+		
 		friend class String;
 		friend class Value;
 		inline friend String operator+ (const char *c, const String& s);
@@ -89,7 +103,7 @@ namespace MiniScript {
 		~String() { release(); }
 		
 		// operators
-		String& operator= (const String& other) { if (other != *this) { if (other.ss) other.ss->refCount++; release(); ss = other.ss; isTemp = false; } return *this; }
+		String& operator= (const String& other) { if (other != *this) { if (other.ss) other.ss->retain(); release(); ss = other.ss; isTemp = false; } return *this; }
 		inline String& operator=(const char c);
 		inline String& operator= (const char* c);
 		inline String operator+ (const String& other) const;
@@ -117,7 +131,7 @@ namespace MiniScript {
 		inline long LastIndexOfB(const String &s, long posB=-1) const;
 		inline long LastIndexOf(const char *c, long posB=-1) const;
 		inline long LastIndexOf(const String &s, long posB=-1) const;
-		inline String SubstringB(long posB, long LengthB=-1) const;
+		inline String SubstringB(long posB, long LengthB=-1) const;	// (shares data only for long tails; see STRING_SHARE_MIN_BYTES)
 		inline bool Contains(const String &other) const;
 		
 		inline long Length() const { if (!ss) return 0; if (ss->charCount < 0) ss->analyzeChars(); return ss->charCount; }
@@ -177,7 +191,17 @@ namespace MiniScript {
 		inline String ToLower() const;
 		inline String ToUpper() const;
 
-		inline unsigned int Hash() const;
+		unsigned int Hash() const;	// (seeded per process; see SimpleString.cpp)
+
+		// Make this string's storage immortal, so it can be shared between
+		// threads (see RefCountedStorage::MakeImmortal).  Returns *this.
+		String& MakeImmortal() {
+			if (!ss or isTemp) return *this;
+			Length();	// (fill in the cached data now, rather than on some other thread)
+			if (ss->base) ss->base->MakeImmortal();
+			ss->MakeImmortal();
+			return *this;
+		}
 		
 		friend class Value;
 		
@@ -208,7 +232,7 @@ namespace MiniScript {
 
 			ss = new StringStorage(count+1);
 			for (int i = 0; i < count; i++) ss->data[i] = c;
-			ss->data[count+1] = 0;
+			ss->data[count] = 0;
 		}
 	}
 
@@ -377,7 +401,25 @@ namespace MiniScript {
 		if (LengthB == -1 or LengthB > (long)ss->dataSize-1 - posB) {
 			LengthB = ss->dataSize-1 - posB;
 		}
-		if (posB == 0 and LengthB == (long)ss->dataSize) return *this;
+		if (posB == 0 and LengthB == (long)ss->dataSize-1) return *this;
+		
+		if (posB + LengthB == (long)ss->dataSize-1 and LengthB >= STRING_SHARE_MIN_BYTES) {
+			// Taking the tail end of this string; share its data if that's not too wasteful.
+			StringStorage *base = ss->base ? ss->base : ss;
+			if (LengthB * 2 >= (long)base->dataSize) {
+				StringStorage *newbie = new StringStorage();
+				newbie->data = ss->data + posB;
+				newbie->dataSize = LengthB + 1;
+				newbie->base = base;
+				base->retain();
+				if (ss->charCount >= 0 and ss->isASCII) {
+					// (The tail of an ASCII string is ASCII too, so we know its length.)
+					newbie->charCount = LengthB;
+					newbie->isASCII = true;
+				}
+				return String(newbie, false);
+			}
+		}
 		
 		StringStorage *newbie = new StringStorage(LengthB+1);
 		memcpy(newbie->data, ss->data+posB, LengthB);
@@ -476,6 +518,7 @@ namespace MiniScript {
 		else if (buffer) newbie->dataSize = strlen(buffer) + 1; // (same)
 		ss = newbie;
 		isTemp = false;
+		newbie->accountFor(MemoryKind::String, sizeof(StringStorage) + newbie->dataSize);
 		return *this;
 	}
 
@@ -546,20 +589,9 @@ namespace MiniScript {
 	bool operator>(const char *cstring, const String &str);
 	bool operator>=(const char *cstring, const String &str);
 
-	unsigned int String::Hash() const {
-		// http://isthe.com/chongo/tech/comp/fnv/#FNV-1a
-		
-		const unsigned int fnv_prime = 16777619u;
-		unsigned int hash = 2166136261u;
-		unsigned long bytes = LengthB();
-		for (unsigned long i = 0; i < bytes; i++) {
-			hash ^= ss->data[i];
-			hash *= fnv_prime;
-		}
-		
-		return hash;
-	}
-	
+	// SipHash-1-3 of the given bytes, with the given 128-bit key.
+	uint64_t SipHash13(const void *data, size_t lenB, uint64_t k0, uint64_t k1);
+
 	// hash interface compatible with Dictionary:
 	inline unsigned int hashString(const String& key) {
 		return key.Hash();
@@ -12,6 +12,17 @@
 
 namespace MiniScript {
 	
+	// A little class that keeps count of how many instances exist,
+	// so we can check that SimpleVector constructs and destroys properly.
+	class Counted {
+	public:
+		Counted(int v=0) : value(v) { instances++; }
+		Counted(const Counted& other) : value(other.value) { instances++; }
+		~Counted() { instances--; }
+		int value;
+		static long instances;
+	};
+	long Counted::instances = 0;
 
 	class TestSimpleVector : public UnitTest
 	{
@@ -132,6 +143,27 @@ namespace MiniScript {
 		list3.push_back(4);
 		list3.reverse();
 		check(list3, 4, 0, 1, 2, 3);		
+		list3.insert(list3[2], 0);
+		Assert(list3.size() == 6 and list3[0] == 1 and list3[1] == 4 and list3[3] == 1);
+		
+		// Only actual items should exist, through growth, shifting, and shrinking.
+		{
+			SimpleVector<Counted> v(5);
+			Assert(Counted::instances == 0);
+			for (int i=0; i<100; i++) v.push_back(Counted(i));
+			Assert(Counted::instances == 100);
+			v.insert(v[50], 0);
+			v.reposition(0, 99);
+			v.deleteIdx(10);
+			Assert(Counted::instances == 100);
+			Assert(v[0].value == 0 and v[9].value == 9 and v[10].value == 11 and v[98].value == 50);
+			Assert(v.pop_back().value == 99);
+			v.resize(10);
+			Assert(Counted::instances == 10);
+			SimpleVector<Counted> v2 = v;
+			Assert(Counted::instances == 20);
+		}
+		Assert(Counted::instances == 0);
 	}
 
 	RegisterUnitTest(TestSimpleVector);
@@ -8,9 +8,12 @@
 //	switch to the STL vector class or some other container, it shouldn't
 //	be too difficult.
 //
-//	NOTE: this container does bytewise copies of its elements, so it won't
-//	work for classes with non-trivial copy-constructors.  (It's mainly
-//	intended for small elements like numbers and pointers.)
+//	NOTE: the buffer is raw storage; only the first size() slots hold
+//	constructed items.  When items need to move (growing the buffer, or
+//	shifting for insert/delete), types for which IsRelocatable<T> is true
+//	are moved with a plain memcpy/memmove, so no copy constructors, assignment
+//	operators, or destructors run (and e.g. no reference counts change).
+//	Other types are copy-constructed into place and the originals destroyed.
 
 #ifndef SIMPLEVECTOR_H
 #define SIMPLEVECTOR_H
@@ -18,6 +21,21 @@
 #include "QA.h"
 
 #include <iostream> // HACK for debugging
+#include <new>
+#include <string.h>
+#include <type_traits>
+
+// IsRelocatable<T>::value is true if a T can be moved to a new address by
+// just copying its bytes (i.e., it holds no pointers into itself).  That's
+// true of any trivially copyable type; other classes can declare it with
+// SIMPLEVECTOR_RELOCATABLE (at global scope, before any use of SimpleVector<T>).
+template <class T>
+struct IsRelocatable {
+	static const bool value = std::is_trivially_copyable<T>::value;
+};
+
+#define SIMPLEVECTOR_RELOCATABLE(T) \
+	template <> struct IsRelocatable<T> { static const bool value = true; };
 
 template <class T>
 class SimpleVector {
@@ -78,6 +96,13 @@ class SimpleVector {
     
     
   protected:
+	// raw buffer management
+	inline static T* allocBuf(unsigned long n);
+	inline static void freeBuf(T* buf) { ::operator delete(buf); }	// (items must already be destroyed or moved out)
+	inline static void destroyRange(T* start, unsigned long n);
+	inline static void relocate(T* dest, T* src, unsigned long n);	// move n items; ranges may overlap
+	inline unsigned long grownSize() const;
+
 	T *mBuf;						// array of items
 	unsigned long mQtyItems;		// how many items we actually have
 	unsigned long mBufItems;		// number of items the buffer can hold
@@ -100,23 +125,12 @@ inline SimpleVector<T>::SimpleVector(long n)
 : mBlockItems(0), mQtyItems(0), mBufItems(n)
 {
 //	std::cout << "created SimpleVector with capacity " << n << " at " << (long)(this) << std::endl;
-	if (n) {
-		#if USE_EXCEPTIONS
-			try {
-				mBuf = new T[mBufItems];
-			} catch (...) {
-				throw memFullErr;
-			}
-		#else
-			mBuf = new T[mBufItems];
-			Assert(mBuf);
-		#endif
-	} else mBuf = nullptr;
+	mBuf = allocBuf(n);
 }
 
 template <class T>
 inline SimpleVector<T>::SimpleVector(const SimpleVector<T>& vec)
-: mBuf(nullptr), mBufItems(0)
+: mBuf(nullptr), mQtyItems(0), mBufItems(0)
 {
 //	std::cout << "created SimpleVector at " << (long)(this) << " by copying one at " << (long)(&vec) << std::endl;
 
@@ -126,24 +140,11 @@ inline SimpleVector<T>::SimpleVector(const SimpleVector<T>& vec)
 template <class T>
 inline SimpleVector<T>& SimpleVector<T>::operator=(const SimpleVector<T>& vec)
 {
-	if (mBuf) delete[] mBuf;
-	mBuf = nullptr;
+	if (&vec == this) return *this;
+	deleteAll();
 	mBlockItems = vec.mBlockItems;
+	mBuf = allocBuf(vec.mBufItems);
 	mBufItems = vec.mBufItems;
-	mQtyItems = vec.mQtyItems;
-	#if USE_EXCEPTIONS
-		try {
-			mBuf = new T[mBufItems];
-		} catch (...) {
-			mBufItems = mQtyItems = 0;
-			throw memFullErr;
-		}
-	#else
-		if (mBufItems > 0) {
-			mBuf = new T[mBufItems];
-			Assert(mBuf);
-		}
-	#endif
 	
 	if (mBuf) {
 		// Mar 04 2002 -- MJS (1)
@@ -151,9 +152,10 @@ inline SimpleVector<T>& SimpleVector<T>::operator=(const SimpleVector<T>& vec)
 		T* dest = mBuf;
 		T* end = &vec.mBuf[vec.mQtyItems];
 		while( src < end ) {
-			*dest++ = *src++;
+			new (dest++) T(*src++);
 		}
 	}
+	mQtyItems = vec.mQtyItems;
 	
 	return *this;
 }
@@ -161,7 +163,8 @@ inline SimpleVector<T>& SimpleVector<T>::operator=(const SimpleVector<T>& vec)
 template <class T>
 inline SimpleVector<T>::~SimpleVector()
 {
-	if (mBuf) delete[] mBuf;
+	destroyRange(mBuf, mQtyItems);
+	freeBuf(mBuf);
 //	std::cout << "Delete SimpleVector at " << (long)(this);
 }
 
@@ -248,15 +251,20 @@ template <class T>
 inline void SimpleVector<T>::push_back(const T& item)
 {
 	// do we need to increase the buffer size?
-	while (mQtyItems >= mBufItems) {
-		// yes -- expand it by one block (should never need more than that!),
-		// or by double the size
-		unsigned long expandBy = (mBlockItems > 0 ? mBlockItems : mBufItems);
-		if (expandBy < 16) expandBy = 16;
-		resizeBuffer( mBufItems + expandBy );
+	if (mQtyItems >= mBufItems) {
+		// yes -- move everything to a bigger buffer (constructing the new
+		// item first, in case it refers to one of our own items)
+		unsigned long newBufItems = grownSize();
+		T* newbuf = allocBuf(newBufItems);
+		new (&newbuf[mQtyItems]) T(item);
+		relocate(newbuf, mBuf, mQtyItems);
+		freeBuf(mBuf);
+		mBuf = newbuf;
+		mBufItems = newBufItems;
+	} else {
+		// stuff the item
+		new (&mBuf[mQtyItems]) T(item);
 	}
-	// stuff the item
-	mBuf[mQtyItems] = item;
 	mQtyItems++;
 }
 
@@ -268,7 +276,9 @@ inline T SimpleVector<T>::pop_back()
 	#else
 		if (mQtyItems > mBufItems || mQtyItems <= 0) Error("pop_back called on empty SimpleVector");;
 	#endif
-	return mBuf[--mQtyItems];
+	T result(mBuf[--mQtyItems]);
+	mBuf[mQtyItems].~T();
+	return result;
 }
 
 template <class T>
@@ -294,27 +304,27 @@ inline void SimpleVector<T>::insert(const T& item, const long idx)
 		return;
 	}
 
-	// resize the buffer if needed
-	while (mQtyItems >= mBufItems) {
-		// yes -- expand it by one block (should never need more than that!),
-		// or by double the size
-		unsigned long expandBy = (mBlockItems > 0 ? mBlockItems : mBufItems);
-		if (expandBy < 16) expandBy = 16;
-		resizeBuffer( mBufItems + expandBy );
-	}
-	
-	// move all items past idx
-	if (idx < (long)mQtyItems) {
-		T* src = &mBuf[mQtyItems-1];
-		T* dest = &mBuf[mQtyItems];
-		T* end = &mBuf[idx];
-		while (src >= end) {
-			*dest-- = *src--;
+	if (mQtyItems >= mBufItems) {
+		// move everything into a bigger buffer, leaving a gap at idx
+		unsigned long newBufItems = grownSize();
+		T* newbuf = allocBuf(newBufItems);
+		new (&newbuf[idx]) T(item);
+		relocate(newbuf, mBuf, idx);
+		relocate(&newbuf[idx+1], &mBuf[idx], mQtyItems - idx);
+		freeBuf(mBuf);
+		mBuf = newbuf;
+		mBufItems = newBufItems;
+	} else {
+		if (&item >= mBuf and &item < &mBuf[mQtyItems]) {
+			// item is one of ours, and about to be moved; insert a copy instead
+			T copy(item);
+			insert(copy, idx);
+			return;
 		}
+		// move all items past idx, then stuff the item
+		relocate(&mBuf[idx+1], &mBuf[idx], mQtyItems - idx);
+		new (&mBuf[idx]) T(item);
 	}
-	
-	// finally, stuff the item
-	mBuf[idx] = item;
 	mQtyItems++;	
 }
 
@@ -329,33 +339,26 @@ inline void SimpleVector<T>::reposition(const long idx1, const long idx2)
 		#else
 			Error("invalid index in SimpleVector::reposition");
 		#endif
+		return;
 	}
     
-    // Grab the item we're moving
-    T mover = mBuf[idx1];
+    // Grab the item we're moving (into raw temporary storage)
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type moverBuf;
+    T* mover = reinterpret_cast<T*>(&moverBuf);
+    relocate(mover, &mBuf[idx1], 1);
     
     if (idx2 < idx1) {
         // Moving this item towards 0; shift all elements
         // from idx2 to idx1-1 forward one position.
-		T* src = &mBuf[idx1-1];
-		T* dest = &mBuf[idx1];
-		T* end = &mBuf[idx2];	
-		while (src >= end) {
-			*dest-- = *src--;
-		}
+		relocate(&mBuf[idx2+1], &mBuf[idx2], idx1 - idx2);
     } else {
         // Moving this item away from 0; shift all elements
         // from idx1+1 to idx2 back one position.
-		T* src = &mBuf[idx1+1];
-		T* dest = &mBuf[idx1];
-		T* end = &mBuf[idx2+1];	
-		while (src < end) {
-			*dest++ = *src++;
-		}		
+		relocate(&mBuf[idx1], &mBuf[idx1+1], idx2 - idx1);
     }
     
     // Stuff the item we're moving.
-    mBuf[idx2] = mover;
+    relocate(&mBuf[idx2], mover, 1);
 }
 
 template <class T>
@@ -368,20 +371,12 @@ inline void SimpleVector<T>::deleteIdx(const long idx)
 		return;
 	}
 	
-	if (idx == (long)mQtyItems-1) {
-		// special case -- deleting last item, no need to copy
-		mQtyItems -= 1;
-	} else {
+	mBuf[idx].~T();
+	if (idx < (long)mQtyItems-1) {
 		// if deleting any but the last item, move remaining ones down
-		// Mar 04 2002 -- MJS (1)
-		T* dest = &mBuf[idx];
-		T* src = &mBuf[idx + 1];
-		T* end = &mBuf[mQtyItems];
-		while(src < end) {
-			*dest++ = *src++;
-		}
-		mQtyItems -= 1;
+		relocate(&mBuf[idx], &mBuf[idx + 1], mQtyItems - idx - 1);
 	}
+	mQtyItems -= 1;
 	// now check -- should we shrink the buffer down?					
 	// do so if the unused spaces are more than twice the block size,
 	// or in dynamic mode, if unused space is over twice the used space
@@ -405,7 +400,8 @@ inline void SimpleVector<T>::deleteIdx(const long idx)
 template <class T>
 inline void SimpleVector<T>::deleteAll()
 {
-	delete[] mBuf;
+	destroyRange(mBuf, mQtyItems);
+	freeBuf(mBuf);
 	mBuf = nullptr;
 	mBufItems = mQtyItems = 0;
 }
@@ -428,31 +424,79 @@ template <class T>
 inline void SimpleVector<T>::resizeBuffer(long n)
 {
 	if (n == (long)mBufItems) return;
-	T *newbuf = new T[n];
-//	if (!newbuf) throw memFullErr;	// (not needed, as new now throws if it fails)
-	if (mBuf) {
-		T* src = mBuf;
-		T* dest = newbuf;
-		T* end = &mBuf[((long)mQtyItems < n) ? mQtyItems : n];	// the smaller value
-		while (src < end) {
-			*dest++ = *src++;
-		}
-		delete[] mBuf;
-	}
+	T *newbuf = allocBuf(n);
+	unsigned long keep = ((long)mQtyItems < n) ? mQtyItems : n;	// the smaller value
+	relocate(newbuf, mBuf, keep);
+	destroyRange(&mBuf[keep], mQtyItems - keep);
+	freeBuf(mBuf);
 	mBuf = newbuf;
 	mBufItems = n;
-	if (mQtyItems > mBufItems) mQtyItems = mBufItems;
+	mQtyItems = keep;
  }
 
 template <class T>
 inline void SimpleVector<T>::resize(long n)
 {
+    if ((long)mQtyItems > n) {
+        destroyRange(&mBuf[n], mQtyItems - n);
+        mQtyItems = n;
+    }
     resizeBuffer(n);
-    mQtyItems = n;
+    while ((long)mQtyItems < n) new (&mBuf[mQtyItems++]) T();
+}
+
+template <class T>
+inline T* SimpleVector<T>::allocBuf(unsigned long n)
+{
+	if (n == 0) return nullptr;
+	#if USE_EXCEPTIONS
+		try {
+			return static_cast<T*>(::operator new(n * sizeof(T)));
+		} catch (...) {
+			throw memFullErr;
+		}
+	#else
+		return static_cast<T*>(::operator new(n * sizeof(T)));
+	#endif
+}
+
+template <class T>
+inline void SimpleVector<T>::destroyRange(T* start, unsigned long n)
+{
+	for (unsigned long i=0; i<n; i++) start[i].~T();
+}
+
+template <class T>
+inline void SimpleVector<T>::relocate(T* dest, T* src, unsigned long n)
+{
+	if (n == 0 or dest == src) return;
+	if (IsRelocatable<T>::value) {
+		memmove((void*)dest, (const void*)src, n * sizeof(T));
+	} else if (dest < src) {
+		for (unsigned long i=0; i<n; i++) {
+			new (&dest[i]) T(src[i]);
+			src[i].~T();
+		}
+	} else {
+		for (unsigned long i=n; i>0; i--) {
+			new (&dest[i-1]) T(src[i-1]);
+			src[i-1].~T();
+		}
+	}
+}
+
+template <class T>
+inline unsigned long SimpleVector<T>::grownSize() const
+{
+	// expand by one block, or by double the size
+	unsigned long expandBy = (mBlockItems > 0 ? mBlockItems : mBufItems);
+	if (expandBy < 16) expandBy = 16;
+	return mBufItems + expandBy;
 }
 
 template <class T>
 inline void SimpleVector<T>::reverse() {
+    if (mQtyItems < 2) return;
     unsigned long low = 0;
     unsigned long high = mQtyItems - 1;
     
@@ -0,0 +1,170 @@
+//
+//  SlabAllocator.cpp
+//  MiniScript
+//
+
+#include "SlabAllocator.h"
+#include "UnitTest.h"
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <mutex>
+#include <atomic>
+
+namespace MiniScript {
+namespace SlabAllocator {
+
+	// Size classes are multiples of kGranularity, up to kMaxSize.
+	static const size_t kGranularity = 16;
+	static const int kClassCount = (int)(kMaxSize / kGranularity);
+	static const size_t kSlabBytes = 64 * 1024;
+
+	struct FreeNode {
+		FreeNode* next;
+	};
+
+	static inline int sizeClass(size_t size) {
+		return size ? (int)((size - 1) / kGranularity) : 0;
+	}
+
+	// Free lists given up by threads that have exited, for other threads to use.
+	static std::mutex depotMutex;
+	static FreeNode* depot[kClassCount];
+	static std::atomic<size_t> reservedBytes(0);
+
+	// Set once this thread's cache has been destroyed.  This is a separate,
+	// trivially destructible variable (rather than a member of ThreadCache),
+	// so that it's still safe to read after the cache itself is gone.
+	static thread_local bool cacheDead = false;
+
+	// Per-thread free lists.  When a thread exits, it donates these to the depot.
+	struct ThreadCache {
+		FreeNode* freeList[kClassCount];
+
+		~ThreadCache() {
+			std::lock_guard<std::mutex> lock(depotMutex);
+			for (int c=0; c<kClassCount; c++) {
+				while (freeList[c]) {
+					FreeNode* node = freeList[c];
+					freeList[c] = node->next;
+					node->next = depot[c];
+					depot[c] = node;
+				}
+			}
+			cacheDead = true;
+		}
+	};
+	static thread_local ThreadCache cache;
+
+	// Refill the (empty) free list for the given size class: take whatever
+	// the depot has, or else carve up a new slab.
+	static void refill(int c) {
+		{
+			std::lock_guard<std::mutex> lock(depotMutex);
+			if (depot[c]) {
+				cache.freeList[c] = depot[c];
+				depot[c] = nullptr;
+				return;
+			}
+		}
+		size_t itemSize = (c + 1) * kGranularity;
+		char* slab = (char*)malloc(kSlabBytes);
+		if (!slab) throw std::bad_alloc();
+		reservedBytes += kSlabBytes;
+		FreeNode* head = nullptr;
+		for (size_t offset = kSlabBytes - kSlabBytes % itemSize; offset >= itemSize; offset -= itemSize) {
+			FreeNode* node = (FreeNode*)(slab + offset - itemSize);
+			node->next = head;
+			head = node;
+		}
+		cache.freeList[c] = head;
+	}
+
+	static bool readEnabledSetting() {
+		const char* setting = getenv("MINISCRIPT_SLAB_ALLOC");
+		return not (setting and strcmp(setting, "0") == 0);
+	}
+
+	bool Enabled() {
+		static const bool enabled = readEnabledSetting();
+		return enabled;
+	}
+
+	void* Alloc(size_t size) {
+		if (size > kMaxSize or not Enabled()) return ::operator new(size);
+		int c = sizeClass(size);
+		if (cacheDead) {
+			// Thread is shutting down; make do with the system allocator.
+			return ::operator new(c * kGranularity + kGranularity);
+		}
+		if (!cache.freeList[c]) refill(c);
+		FreeNode* node = cache.freeList[c];
+		cache.freeList[c] = node->next;
+		return node;
+	}
+
+	void Free(void* ptr, size_t size) {
+		if (!ptr) return;
+		if (size > kMaxSize or not Enabled()) {
+			::operator delete(ptr);
+			return;
+		}
+		int c = sizeClass(size);
+		FreeNode* node = (FreeNode*)ptr;
+		if (cacheDead) {
+			// Thread's cache is already gone (e.g. static objects being
+			// destroyed at exit), so put this straight into the depot.
+			std::lock_guard<std::mutex> lock(depotMutex);
+			node->next = depot[c];
+			depot[c] = node;
+			return;
+		}
+		node->next = cache.freeList[c];
+		cache.freeList[c] = node;
+	}
+
+	size_t ReservedBytes() {
+		return reservedBytes;
+	}
+
+}
+
+	class TestSlabAllocator : public UnitTest
+	{
+	public:
+		TestSlabAllocator() : UnitTest("SlabAllocator") {}
+		virtual void Run();
+	};
+
+	void TestSlabAllocator::Run()
+	{
+		void* a = SlabAllocator::Alloc(40);
+		void* b = SlabAllocator::Alloc(48);
+		void* c = SlabAllocator::Alloc(100);
+		Assert(a != b and a != c and b != c);
+		memset(a, 0xAA, 40);
+		memset(b, 0xBB, 48);
+		memset(c, 0xCC, 100);
+		Assert(((unsigned char*)a)[39] == 0xAA and ((unsigned char*)b)[0] == 0xBB);
+		Assert(((size_t)a % 16) == 0 and ((size_t)c % 16) == 0);
+
+		if (SlabAllocator::Enabled()) {
+			// A freed object should be reused for the next one of its size class.
+			SlabAllocator::Free(b, 48);
+			void* b2 = SlabAllocator::Alloc(33);
+			Assert(b2 == b);
+			b = b2;
+			Assert(SlabAllocator::ReservedBytes() > 0);
+		}
+		SlabAllocator::Free(a, 40);
+		SlabAllocator::Free(b, 48);
+		SlabAllocator::Free(c, 100);
+
+		// Big objects go to the system allocator (but still work the same way).
+		void* big = SlabAllocator::Alloc(SlabAllocator::kMaxSize + 1);
+		memset(big, 0, SlabAllocator::kMaxSize + 1);
+		SlabAllocator::Free(big, SlabAllocator::kMaxSize + 1);
+	}
+
+	RegisterUnitTest(TestSlabAllocator);
+}
@@ -0,0 +1,48 @@
+//
+//  SlabAllocator.h
+//  MiniScript
+//
+//  A size-class slab allocator for small runtime objects (everything
+//  derived from RefCountedStorage: strings, lists, maps, functions, etc.).
+//  Objects are carved out of big slabs, one slab per size class, and freed
+//  objects go onto a per-thread free list for their size class, so a typical
+//  allocate/free pair is just a couple of pointer moves with no locking.
+//
+//  Build with MINISCRIPT_SLAB_ALLOC=0 to leave it out entirely; or set the
+//  environment variable MINISCRIPT_SLAB_ALLOC=0 at runtime to have it pass
+//  everything through to the system allocator (e.g. for benchmarking).
+//
+
+#ifndef SLABALLOCATOR_H
+#define SLABALLOCATOR_H
+
+#include <stddef.h>
+
+#ifndef MINISCRIPT_SLAB_ALLOC
+#define MINISCRIPT_SLAB_ALLOC 1
+#endif
+
+namespace MiniScript {
+
+	namespace SlabAllocator {
+
+		// Largest object size we handle; bigger requests go to the system allocator.
+		const size_t kMaxSize = 512;
+
+		// Allocate/free an object of the given size.  Note that Free must be
+		// given the same size as was passed to Alloc.
+		void* Alloc(size_t size);
+		void Free(void* ptr, size_t size);
+
+		// Whether the slab allocator is in use (i.e., it was not disabled via
+		// the environment).  This is decided once, at the first allocation.
+		bool Enabled();
+
+		// Total bytes obtained from the system for slabs so far (slabs are
+		// kept for reuse, not given back).
+		size_t ReservedBytes();
+	}
+
+}
+
+#endif /* SLABALLOCATOR_H */
@@ -0,0 +1,143 @@
+//
+//  ThreadPool.cpp
+//  MiniScript
+//
+
+#include "ThreadPool.h"
+#include "UnitTest.h"
+#include <atomic>
+
+namespace MiniScript {
+
+	struct ThreadPool::Job {
+		long count;
+		const std::function<void(long)> *piece;
+		std::atomic<long> next;		// next piece to claim
+		long active;				// pool threads working on it (guarded by the pool's lock)
+		std::condition_variable finished;
+
+		Job(long count, const std::function<void(long)> *piece) : count(count), piece(piece), next(0), active(0) {}
+	};
+
+	ThreadPool::ThreadPool(int threadCount) : stopping(false) {
+		if (threadCount < 0) threadCount = (int)std::thread::hardware_concurrency() - 1;
+		for (int i=0; i<threadCount; i++) threads.push_back(std::thread(&ThreadPool::workerLoop, this));
+	}
+
+	ThreadPool::~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
+		}
+		jobAvailable.notify_all();
+		for (std::thread& t : threads) t.join();
+	}
+
+	ThreadPool& ThreadPool::Shared() {
+		static ThreadPool pool;
+		return pool;
+	}
+
+	void ThreadPool::Run(long count, const std::function<void(long)>& piece) {
+		if (count <= 0) return;
+		if (count == 1 or threads.empty()) {
+			for (long i=0; i<count; i++) piece(i);
+			return;
+		}
+		Job job(count, &piece);
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			jobs.push_back(&job);
+		}
+		jobAvailable.notify_all();
+		work(&job);
+
+		// Every piece is claimed; wait for the pool threads to finish theirs.
+		// (Take the job off the queue first, so no more can start on it.)
+		std::unique_lock<std::mutex> guard(lock);
+		auto found = std::find(jobs.begin(), jobs.end(), &job);
+		if (found != jobs.end()) jobs.erase(found);
+		job.finished.wait(guard, [&job] { return job.active == 0; });
+	}
+
+	void ThreadPool::work(Job *job) {
+		long i;
+		while ((i = job->next++) < job->count) (*job->piece)(i);
+	}
+
+	void ThreadPool::workerLoop() {
+		std::unique_lock<std::mutex> guard(lock);
+		while (true) {
+			jobAvailable.wait(guard, [this] { return stopping or not jobs.empty(); });
+			if (stopping) return;
+			Job *job = jobs.front();
+			if (job->next >= job->count) {
+				jobs.pop_front();	// (all claimed; its caller will wait for the rest)
+				continue;
+			}
+			job->active++;
+			guard.unlock();
+			work(job);
+			guard.lock();
+			if (--job->active == 0) job->finished.notify_all();
+		}
+	}
+
+
+	#pragma mark -
+
+	class TestThreadPool : public UnitTest
+	{
+	public:
+		TestThreadPool() : UnitTest("ThreadPool") {}
+		virtual void Run();
+	};
+
+	struct TestSortItem {
+		int key;
+		long index;
+	};
+
+	void TestThreadPool::Run()
+	{
+		ThreadPool pool(3);
+		Assert(pool.Size() == 4);
+
+		// Every piece runs exactly once, even with several callers at once.
+		std::atomic<long> counts[100];
+		for (long i=0; i<100; i++) counts[i] = 0;
+		std::thread callers[3];
+		for (int c=0; c<3; c++) {
+			callers[c] = std::thread([&pool, &counts] {
+				for (int rep=0; rep<20; rep++) pool.Run(100, [&counts](long i) { counts[i]++; });
+			});
+		}
+		for (int c=0; c<3; c++) callers[c].join();
+		for (long i=0; i<100; i++) Assert(counts[i] == 60);
+
+		// ParallelStableSort sorts, keeping equal items in their original order.
+		const long count = 100003;
+		std::vector<TestSortItem> items(count);
+		unsigned int x = 12345;
+		for (long i=0; i<count; i++) {
+			x = x * 1103515245 + 12345;
+			items[i].key = (int)((x >> 8) % 1000);
+			items[i].index = i;
+		}
+		ParallelStableSort(items.data(), count, [](const TestSortItem& a, const TestSortItem& b) { return a.key < b.key; }, pool);
+		bool ok = true;
+		for (long i=1; i<count; i++) {
+			if (items[i-1].key > items[i].key) ok = false;
+			if (items[i-1].key == items[i].key and items[i-1].index > items[i].index) ok = false;
+		}
+		Assert(ok);
+
+		// A pool with no threads runs everything on the caller.
+		ThreadPool solo(0);
+		long sum = 0;
+		solo.Run(10, [&sum](long i) { sum += i; });
+		Assert(sum == 45);
+	}
+
+	RegisterSlowUnitTest(TestThreadPool);
+}
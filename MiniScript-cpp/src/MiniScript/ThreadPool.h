@@ -0,0 +1,132 @@
+//
+//  ThreadPool.h
+//  MiniScript
+//
+//  A ThreadPool keeps a few threads around for intrinsics that split one big
+//  job (like sorting a huge list) into pieces that can run at once.  The
+//  thread that calls Run works on the pieces too, so a pool of N threads
+//  runs N+1 pieces at a time, and a pool with no threads just runs them in
+//  order.  Any number of threads may call Run on the same pool at once.
+//
+//  Pieces run while their interpreter is waiting in Run, so they may read
+//  its values; but they must not retain or release them (which isn't safe
+//  from two threads at once), and must not raise exceptions.
+//
+//  Also here is ParallelStableSort, a merge sort that uses a pool.
+//
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace MiniScript {
+
+	class ThreadPool {
+	public:
+		// Start the given number of threads (or one less than the number of
+		// cores, if -1, so that the caller makes up the difference).
+		ThreadPool(int threadCount=-1);
+
+		// Stop the threads (after any pieces in progress).
+		~ThreadPool();
+
+		// The pool shared by the intrinsics (started on first use).
+		static ThreadPool& Shared();
+
+		// How many pieces may run at once: our threads, plus the caller.
+		int Size() const { return (int)threads.size() + 1; }
+
+		// Call piece(i) for each i from 0 to count-1, spread over our threads
+		// and this one, and return when they're all done.
+		void Run(long count, const std::function<void(long)>& piece);
+
+	private:
+		struct Job;
+
+		void workerLoop();
+		static void work(Job *job);
+
+		std::vector<std::thread> threads;
+
+		// Everything below is guarded by `lock`.
+		std::mutex lock;
+		std::condition_variable jobAvailable;
+		std::deque<Job*> jobs;
+		bool stopping;
+	};
+
+	// Sort the given items, like std::stable_sort, using the given pool.  The
+	// items are split into a run for each thread, which are sorted at once and
+	// then merged in pairs; each merge is split up among the threads too.
+	// T must be default-constructible and cheap to copy.
+	template <class T, class Less>
+	void ParallelStableSort(T *items, long count, Less less, ThreadPool& pool);
+
+	#pragma mark -
+
+	namespace ParallelSortHelpers {
+		// How many of the first k items of the (stable) merge of a and b come from a.
+		template <class T, class Less>
+		long coRank(long k, const T *a, long na, const T *b, long nb, Less less) {
+			long lo = std::max(0L, k - nb), hi = std::min(k, na);
+			while (lo < hi) {
+				long i = (lo + hi) / 2, j = k - i;
+				if (j > 0 and not less(b[j-1], a[i])) lo = i + 1;	// a[i] comes before b[j-1]
+				else hi = i;
+			}
+			return lo;
+		}
+	}
+
+	template <class T, class Less>
+	void ParallelStableSort(T *items, long count, Less less, ThreadPool& pool) {
+		long parts = pool.Size();
+		if (parts < 2 or count < parts * 2) {
+			std::stable_sort(items, items + count, less);
+			return;
+		}
+		// Sort the runs (a power of two of them, so they merge evenly).
+		long runs = 1;
+		while (runs < parts) runs *= 2;
+		std::vector<long> bounds(runs + 1);
+		for (long r=0; r<=runs; r++) bounds[r] = count * r / runs;
+		pool.Run(runs, [&](long r) {
+			std::stable_sort(items + bounds[r], items + bounds[r+1], less);
+		});
+
+		// Merge pairs of runs, back and forth between the items and a buffer,
+		// splitting each merge into pieces of about the same size.
+		std::vector<T> buffer(count);
+		T *src = items, *dst = buffer.data();
+		for (long width = 1; width < runs; width *= 2) {
+			long merges = runs / (width * 2);
+			long pieces = std::max(1L, parts / merges);
+			pool.Run(merges * pieces, [&](long t) {
+				long m = t / pieces, p = t % pieces;
+				long lo = bounds[m * width * 2], mid = bounds[m * width * 2 + width], hi = bounds[(m + 1) * width * 2];
+				const T *a = src + lo, *b = src + mid;
+				long na = mid - lo, nb = hi - mid;
+				long k0 = (na + nb) * p / pieces, k1 = (na + nb) * (p + 1) / pieces;
+				long i0 = ParallelSortHelpers::coRank(k0, a, na, b, nb, less);
+				long i1 = ParallelSortHelpers::coRank(k1, a, na, b, nb, less);
+				std::merge(a + i0, a + i1, b + (k0 - i0), b + (k1 - i1), dst + lo + k0, less);
+			});
+			std::swap(src, dst);
+		}
+		if (src != items) {
+			pool.Run(parts, [&](long p) {
+				long from = count * p / parts, to = count * (p + 1) / parts;
+				std::copy(src + from, src + to, items + from);
+			});
+		}
+	}
+}
+
+#endif // THREADPOOL_H
@@ -6,6 +6,7 @@
 #include "Dictionary.h"
 #include "QA.h"
 #include "UnitTest.h"
+#include <mutex>
 
 namespace MiniScript {
 	
@@ -13,7 +14,7 @@ namespace MiniScript {
 	// Maps which convert a Unicode code point into the corresponding upper/lower case code point.
 	static Dictionary<unsigned short, unsigned short, hashUShort> sUpperToLowerMap;
 	static Dictionary<unsigned short, unsigned short, hashUShort> sLowerToUpperMap;
-	static bool sMapsInitialized = false;
+	static std::once_flag sMapsOnce;
 
 	// table of upper-case code points (each corresponds to the entry at the same
 	// position in sLowerTable, and where an entry appears more than once, the
@@ -185,8 +186,6 @@ namespace MiniScript {
 			sUpperToLowerMap.SetValue( sUpperTable[i], sLowerTable[i] );
 			sLowerToUpperMap.SetValue( sLowerTable[i], sUpperTable[i] );
 		}
-		
-		sMapsInitialized = true;								// Mar 09 2003 -- JJS (1)
 	}
 
 	// MARK: -
@@ -401,7 +400,7 @@ namespace MiniScript {
 	unsigned long UnicodeCharToUpper( unsigned long lower )
 	{
 		if (lower > 0xFFFF) return lower;	// (our case folder only handles 16-bit code points)
-		if (!sMapsInitialized) InitCaseMaps();
+		std::call_once(sMapsOnce, InitCaseMaps);
 		unsigned short result = (unsigned short)lower;
 		result = sLowerToUpperMap.Lookup(result, result);
 		return result;
@@ -419,7 +418,7 @@ namespace MiniScript {
 	unsigned long UnicodeCharToLower( unsigned long upper )
 	{
 		if (upper > 0xFFFF) return upper;	// (our case folder only handles 16-bit code points)
-		if (!sMapsInitialized) InitCaseMaps();
+		std::call_once(sMapsOnce, InitCaseMaps);
 		unsigned short result = (unsigned short)upper;
 		result = sUpperToLowerMap.Lookup(result, result);
 		return result;
@@ -75,4 +75,13 @@ namespace MiniScript {
 #define RegisterUnitTest(testclass) static testclass _inst##testclass; \
 									UnitTestRegistrar _reg##testclass(&_inst##testclass)
 
+// Macro to register a unit test that takes a while (say, because it runs
+// threads, or waits), so should be run only by the unit test program, and
+// not by a host that calls RunAllTests every time it starts up.
+#ifdef UNIT_TEST_MAIN
+	#define RegisterSlowUnitTest(testclass) RegisterUnitTest(testclass)
+#else
+	#define RegisterSlowUnitTest(testclass) static testclass _inst##testclass
+#endif
+
 #endif
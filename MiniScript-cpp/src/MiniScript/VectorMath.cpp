@@ -0,0 +1,292 @@
+//
+//  VectorMath.cpp
+//  MiniScript
+//
+
+#include "VectorMath.h"
+#include "UnitTest.h"
+#include <cmath>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+	#define VECTORMATH_AVX2 1
+	#include <immintrin.h>
+	#define AVX2_TARGET __attribute__((target("avx2")))
+#else
+	#define VECTORMATH_AVX2 0
+#endif
+
+namespace MiniScript {
+
+	// Operations, each with a scalar form and (where we have AVX2) a vector form
+	// that does exactly the same thing to each lane.  Note that for Min and Max,
+	// that includes what happens with NaN: like the MINPD/MAXPD instructions,
+	// we return the second argument unless the comparison is true.
+	struct AddOp {
+		static inline double apply(double a, double b) { return a + b; }
+		#if VECTORMATH_AVX2
+		static inline AVX2_TARGET __m256d apply(__m256d a, __m256d b) { return _mm256_add_pd(a, b); }
+		#endif
+	};
+	struct SubtractOp {
+		static inline double apply(double a, double b) { return a - b; }
+		#if VECTORMATH_AVX2
+		static inline AVX2_TARGET __m256d apply(__m256d a, __m256d b) { return _mm256_sub_pd(a, b); }
+		#endif
+	};
+	struct MultiplyOp {
+		static inline double apply(double a, double b) { return a * b; }
+		#if VECTORMATH_AVX2
+		static inline AVX2_TARGET __m256d apply(__m256d a, __m256d b) { return _mm256_mul_pd(a, b); }
+		#endif
+	};
+	struct DivideOp {
+		static inline double apply(double a, double b) { return a / b; }
+		#if VECTORMATH_AVX2
+		static inline AVX2_TARGET __m256d apply(__m256d a, __m256d b) { return _mm256_div_pd(a, b); }
+		#endif
+	};
+	struct MinOp {
+		static inline double apply(double a, double b) { return a < b ? a : b; }
+		#if VECTORMATH_AVX2
+		static inline AVX2_TARGET __m256d apply(__m256d a, __m256d b) { return _mm256_min_pd(a, b); }
+		#endif
+	};
+	struct MaxOp {
+		static inline double apply(double a, double b) { return a > b ? a : b; }
+		#if VECTORMATH_AVX2
+		static inline AVX2_TARGET __m256d apply(__m256d a, __m256d b) { return _mm256_max_pd(a, b); }
+		#endif
+	};
+
+	#pragma mark - Scalar versions
+
+	// Reductions keep 8 running values, x[i] going into acc[i % 8] (the same
+	// as two 4-lane vectors), and combine them at the end in a fixed order.
+	template <class Op>
+	static double finishReduce(const double *acc, const double *x, long i, long n) {
+		double result = Op::apply(Op::apply(Op::apply(acc[0], acc[4]), Op::apply(acc[1], acc[5])),
+								  Op::apply(Op::apply(acc[2], acc[6]), Op::apply(acc[3], acc[7])));
+		for (; i < n; i++) result = Op::apply(result, x[i]);
+		return result;
+	}
+
+	static double sumScalar(const double *x, long n) {
+		double acc[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+		long i = 0;
+		for (; i + 8 <= n; i += 8) {
+			for (int j=0; j<8; j++) acc[j] += x[i+j];
+		}
+		return finishReduce<AddOp>(acc, x, i, n);
+	}
+
+	static double dotScalar(const double *a, const double *b, long n) {
+		double acc[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+		long i = 0;
+		for (; i + 8 <= n; i += 8) {
+			for (int j=0; j<8; j++) acc[j] += a[i+j] * b[i+j];
+		}
+		double result = ((acc[0] + acc[4]) + (acc[1] + acc[5])) + ((acc[2] + acc[6]) + (acc[3] + acc[7]));
+		for (; i < n; i++) result += a[i] * b[i];
+		return result;
+	}
+
+	template <class Op>
+	static double reduceScalar(const double *x, long n) {
+		if (n < 8) {
+			double result = x[0];
+			for (long i=1; i<n; i++) result = Op::apply(result, x[i]);
+			return result;
+		}
+		double acc[8];
+		for (int j=0; j<8; j++) acc[j] = x[j];
+		long i = 8;
+		for (; i + 8 <= n; i += 8) {
+			for (int j=0; j<8; j++) acc[j] = Op::apply(acc[j], x[i+j]);
+		}
+		return finishReduce<Op>(acc, x, i, n);
+	}
+
+	template <class Op>
+	static void elementwiseScalar(const double *a, const double *b, double *result, long n) {
+		for (long i=0; i<n; i++) result[i] = Op::apply(a[i], b[i]);
+	}
+
+	template <class Op>
+	static void elementwiseScalar(const double *a, double b, double *result, long n) {
+		for (long i=0; i<n; i++) result[i] = Op::apply(a[i], b);
+	}
+
+	static void addScaledScalar(double *y, const double *x, double a, long n) {
+		for (long i=0; i<n; i++) y[i] += a * x[i];
+	}
+
+	#pragma mark - AVX2 versions
+
+	#if VECTORMATH_AVX2
+
+	static AVX2_TARGET double sumAVX2(const double *x, long n) {
+		__m256d acc0 = _mm256_setzero_pd();
+		__m256d acc1 = _mm256_setzero_pd();
+		long i = 0;
+		for (; i + 8 <= n; i += 8) {
+			acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(x + i));
+			acc1 = _mm256_add_pd(acc1, _mm256_loadu_pd(x + i + 4));
+		}
+		double acc[8];
+		_mm256_storeu_pd(acc, acc0);
+		_mm256_storeu_pd(acc + 4, acc1);
+		return finishReduce<AddOp>(acc, x, i, n);
+	}
+
+	static AVX2_TARGET double dotAVX2(const double *a, const double *b, long n) {
+		__m256d acc0 = _mm256_setzero_pd();
+		__m256d acc1 = _mm256_setzero_pd();
+		long i = 0;
+		for (; i + 8 <= n; i += 8) {
+			// (Not FMA, which would round differently from the scalar version.)
+			acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+			acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4)));
+		}
+		double acc[8];
+		_mm256_storeu_pd(acc, acc0);
+		_mm256_storeu_pd(acc + 4, acc1);
+		double result = ((acc[0] + acc[4]) + (acc[1] + acc[5])) + ((acc[2] + acc[6]) + (acc[3] + acc[7]));
+		for (; i < n; i++) result += a[i] * b[i];
+		return result;
+	}
+
+	template <class Op>
+	static AVX2_TARGET double reduceAVX2(const double *x, long n) {
+		if (n < 8) return reduceScalar<Op>(x, n);
+		__m256d acc0 = _mm256_loadu_pd(x);
+		__m256d acc1 = _mm256_loadu_pd(x + 4);
+		long i = 8;
+		for (; i + 8 <= n; i += 8) {
+			acc0 = Op::apply(acc0, _mm256_loadu_pd(x + i));
+			acc1 = Op::apply(acc1, _mm256_loadu_pd(x + i + 4));
+		}
+		double acc[8];
+		_mm256_storeu_pd(acc, acc0);
+		_mm256_storeu_pd(acc + 4, acc1);
+		return finishReduce<Op>(acc, x, i, n);
+	}
+
+	template <class Op>
+	static AVX2_TARGET void elementwiseAVX2(const double *a, const double *b, double *result, long n) {
+		long i = 0;
+		for (; i + 4 <= n; i += 4) {
+			_mm256_storeu_pd(result + i, Op::apply(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+		}
+		for (; i < n; i++) result[i] = Op::apply(a[i], b[i]);
+	}
+
+	template <class Op>
+	static AVX2_TARGET void elementwiseAVX2(const double *a, double b, double *result, long n) {
+		__m256d bv = _mm256_set1_pd(b);
+		long i = 0;
+		for (; i + 4 <= n; i += 4) {
+			_mm256_storeu_pd(result + i, Op::apply(_mm256_loadu_pd(a + i), bv));
+		}
+		for (; i < n; i++) result[i] = Op::apply(a[i], b);
+	}
+
+	static AVX2_TARGET void addScaledAVX2(double *y, const double *x, double a, long n) {
+		__m256d av = _mm256_set1_pd(a);
+		long i = 0;
+		for (; i + 4 <= n; i += 4) {
+			_mm256_storeu_pd(y + i, _mm256_add_pd(_mm256_loadu_pd(y + i), _mm256_mul_pd(av, _mm256_loadu_pd(x + i))));
+		}
+		for (; i < n; i++) y[i] += a * x[i];
+	}
+
+	static bool detectAVX2() {
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2");
+	}
+
+	#define DISPATCH(avx2Call, scalarCall) return UsingAVX2() ? avx2Call : scalarCall
+
+	#else
+
+	static bool detectAVX2() { return false; }
+
+	#define DISPATCH(avx2Call, scalarCall) return scalarCall
+
+	#endif
+
+	#pragma mark - VectorMath
+
+	bool VectorMath::UsingAVX2() {
+		static const bool result = detectAVX2();
+		return result;
+	}
+
+	double VectorMath::Sum(const double *x, long n) { DISPATCH(sumAVX2(x, n), sumScalar(x, n)); }
+	double VectorMath::Min(const double *x, long n) { DISPATCH(reduceAVX2<MinOp>(x, n), reduceScalar<MinOp>(x, n)); }
+	double VectorMath::Max(const double *x, long n) { DISPATCH(reduceAVX2<MaxOp>(x, n), reduceScalar<MaxOp>(x, n)); }
+	double VectorMath::Dot(const double *a, const double *b, long n) { DISPATCH(dotAVX2(a, b, n), dotScalar(a, b, n)); }
+
+	void VectorMath::Add(const double *a, const double *b, double *result, long n) {
+		DISPATCH(elementwiseAVX2<AddOp>(a, b, result, n), elementwiseScalar<AddOp>(a, b, result, n));
+	}
+	void VectorMath::Subtract(const double *a, const double *b, double *result, long n) {
+		DISPATCH(elementwiseAVX2<SubtractOp>(a, b, result, n), elementwiseScalar<SubtractOp>(a, b, result, n));
+	}
+	void VectorMath::Multiply(const double *a, const double *b, double *result, long n) {
+		DISPATCH(elementwiseAVX2<MultiplyOp>(a, b, result, n), elementwiseScalar<MultiplyOp>(a, b, result, n));
+	}
+	void VectorMath::Divide(const double *a, const double *b, double *result, long n) {
+		DISPATCH(elementwiseAVX2<DivideOp>(a, b, result, n), elementwiseScalar<DivideOp>(a, b, result, n));
+	}
+
+	void VectorMath::Add(const double *a, double b, double *result, long n) {
+		DISPATCH(elementwiseAVX2<AddOp>(a, b, result, n), elementwiseScalar<AddOp>(a, b, result, n));
+	}
+	void VectorMath::Subtract(const double *a, double b, double *result, long n) {
+		DISPATCH(elementwiseAVX2<SubtractOp>(a, b, result, n), elementwiseScalar<SubtractOp>(a, b, result, n));
+	}
+	void VectorMath::Multiply(const double *a, double b, double *result, long n) {
+		DISPATCH(elementwiseAVX2<MultiplyOp>(a, b, result, n), elementwiseScalar<MultiplyOp>(a, b, result, n));
+	}
+	void VectorMath::Divide(const double *a, double b, double *result, long n) {
+		DISPATCH(elementwiseAVX2<DivideOp>(a, b, result, n), elementwiseScalar<DivideOp>(a, b, result, n));
+	}
+
+	void VectorMath::AddScaled(double *y, const double *x, double a, long n) {
+		DISPATCH(addScaledAVX2(y, x, a, n), addScaledScalar(y, x, a, n));
+	}
+
+	#pragma mark -
+
+	class TestVectorMath : public UnitTest
+	{
+	public:
+		TestVectorMath() : UnitTest("VectorMath") {}
+		virtual void Run();
+	};
+
+	void TestVectorMath::Run()
+	{
+		const long n = 37;	// (not a multiple of 4 or 8, to exercise the tails)
+		double a[n], b[n], c[n];
+		for (long i=0; i<n; i++) {
+			a[i] = i * 0.1;
+			b[i] = 3 - i;
+		}
+		Assert(VectorMath::Min(a, n) == 0);
+		Assert(VectorMath::Max(b, n) == 3);
+		Assert(VectorMath::Min(b, 3) == 1);
+		Assert(std::fabs(VectorMath::Sum(a, n) - 66.6) < 1e-9);
+		VectorMath::Add(a, b, c, n);
+		Assert(c[10] == a[10] + b[10] and c[n-1] == a[n-1] + b[n-1]);
+		VectorMath::Multiply(b, 2, c, n);
+		Assert(c[0] == 6 and c[n-1] == 2 * b[n-1]);
+
+		// The scalar and AVX2 versions must agree exactly, even on sums.
+		Assert(VectorMath::Sum(a, n) == sumScalar(a, n));
+		Assert(VectorMath::Dot(a, b, n) == dotScalar(a, b, n));
+		Assert(VectorMath::Max(a, n) == reduceScalar<MaxOp>(a, n));
+	}
+
+	RegisterUnitTest(TestVectorMath);
+}
@@ -0,0 +1,48 @@
+//
+//  VectorMath.h
+//  MiniScript
+//
+//  Native loops over arrays of doubles, used by the numeric list intrinsics
+//  (sum, min, max, mean, dot, and the elementwise arithmetic methods).
+//
+//  On x86 with GCC or Clang, these use AVX2 when the CPU supports it (checked
+//  once, at run time, so the build doesn't need -mavx2); everywhere else they
+//  use plain C++.  Both versions combine values in the same order, so they
+//  give the same results.
+//
+
+#ifndef VECTORMATH_H
+#define VECTORMATH_H
+
+namespace MiniScript {
+
+	class VectorMath {
+	public:
+		// Reductions over x[0..n-1].  (Min and Max require n > 0.)
+		static double Sum(const double *x, long n);
+		static double Min(const double *x, long n);
+		static double Max(const double *x, long n);
+		static double Dot(const double *a, const double *b, long n);
+
+		// Elementwise: result[i] = a[i] (op) b[i].
+		static void Add(const double *a, const double *b, double *result, long n);
+		static void Subtract(const double *a, const double *b, double *result, long n);
+		static void Multiply(const double *a, const double *b, double *result, long n);
+		static void Divide(const double *a, const double *b, double *result, long n);
+
+		// Elementwise with a scalar: result[i] = a[i] (op) b.
+		static void Add(const double *a, double b, double *result, long n);
+		static void Subtract(const double *a, double b, double *result, long n);
+		static void Multiply(const double *a, double b, double *result, long n);
+		static void Divide(const double *a, double b, double *result, long n);
+
+		// y[i] += a * x[i] (the inner loop of matrix multiplication).
+		static void AddScaled(double *y, const double *x, double a, long n);
+
+		// Whether the AVX2 versions are in use.
+		static bool UsingAVX2();
+	};
+
+}
+
+#endif /* VECTORMATH_H */
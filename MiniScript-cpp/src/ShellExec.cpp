@@ -19,6 +19,10 @@
 #else
 	#include <unistd.h>	// for read()
 	#include <sys/wait.h>   // for waitpid()
+	#include <sys/syscall.h>	// for SYS_pidfd_open
+	#include <fcntl.h>
+	#include <errno.h>
+	#include <string>
 #endif
 
 
@@ -179,40 +183,45 @@ bool FinishExec(ValueList data, double currentTime, String* outStdout, String* o
 	return true;
 }
 
+bool ExecWakeFds(ValueList data, std::vector<int>& outFds) {
+	return false;	// (no file descriptors to wait on here)
+}
+
 
 #else
 
-// Helper function to read from file descriptor into string
-String readFromFd(int fd, bool trimTrailingNewline=true) {
-	String output;
-	const int bufferSize = 1024;
+// Helper function to read whatever is ready from one of the pipes in our
+// partial result (data[fdIndex]), without blocking, adding it to the list
+// of chunks read so far (data[chunksIndex]).  At the end of the output,
+// close the pipe, and set it to -1 in the data.
+static void readAvailable(ValueList& data, int fdIndex, int chunksIndex) {
+	int fd = data[fdIndex].IntValue();
+	if (fd < 0) return;
+	ValueList chunks = data[chunksIndex].GetList();
+	const int bufferSize = 16384;
 	char buffer[bufferSize];
 	ssize_t bytesRead;
-
-	bool trimmed = false;
-	while ((bytesRead = read(fd, buffer, bufferSize)) > 0) {
-		if (trimTrailingNewline and bytesRead < bufferSize and bytesRead > 0 and buffer[bytesRead-1] == '\n') {
-			// Efficiently trim \n or \r\n from the end of the buffer
-			bytesRead--;
-			if (bytesRead > 0 and buffer[bytesRead-1] == '\r') bytesRead--;
-			trimmed = true;
-		}
-		output += String(buffer, bytesRead);
+	while ((bytesRead = read(fd, buffer, bufferSize)) != 0) {
+		if (bytesRead > 0) chunks.Add(Value(String(buffer, bytesRead)));
+		else if (errno == EAGAIN or errno == EWOULDBLOCK) return;	// (that's all for now)
+		else if (errno != EINTR) break;
 	}
+	close(fd);
+	data.SetItem(fdIndex, Value(-1));
+}
 
-	if (trimTrailingNewline && !trimmed) {
-		// Not-so-efficiently trim our final string, in the case where our data happened
-		// to exactly align with the buffer size, so we couldn't know we were at the
-		// end of it to trim it above.  (This is a rare edge case.)
-		int cut = 0;
-		if (output.LengthB() > 1 and output[-1] == '\n') {
-			cut = 1;
-			if (output.LengthB() > 2 and output[-2] == '\r') cut = 2;
-		}
-		if (cut) output = output.SubstringB(0, output.LengthB() - cut);
+// Helper function to join the chunks read from a pipe into one string.
+static String joinChunks(ValueList chunks, bool trimTrailingNewline=true) {
+	std::string output;
+	for (long i=0; i<chunks.Count(); i++) {
+		String chunk = chunks[i].GetString();
+		output.append(chunk.c_str(), chunk.sizeB());
 	}
-	
-	return output;
+	if (trimTrailingNewline and not output.empty() and output.back() == '\n') {
+		output.pop_back();
+		if (not output.empty() and output.back() == '\r') output.pop_back();
+	}
+	return String(output.c_str(), output.size());
 }
 
 bool BeginExec(String cmd, double timeout, double currentTime, ValueList* outResult) {
@@ -225,6 +234,10 @@ bool BeginExec(String cmd, double timeout, double currentTime, ValueList* outRes
 	int stderrPipe[2];
 	pipe(stdoutPipe);
 	pipe(stderrPipe);
+	// (Our ends don't block: we read what's there as it comes, so that the
+	// child never waits on a full pipe.)
+	fcntl(stdoutPipe[0], F_SETFL, fcntl(stdoutPipe[0], F_GETFL) | O_NONBLOCK);
+	fcntl(stderrPipe[0], F_SETFL, fcntl(stderrPipe[0], F_GETFL) | O_NONBLOCK);
 	
 	pid_t pid = fork(); // Fork the process
 	
@@ -254,23 +267,35 @@ bool BeginExec(String cmd, double timeout, double currentTime, ValueList* outRes
 	close(stdoutPipe[1]);
 	close(stderrPipe[1]);
 	
-	// As our partial result, return a list with the pid, the two read pipes, and the final time.
+	// Get a file descriptor that becomes readable when the child exits, if we can.
+	int pidFd = -1;
+	#ifdef SYS_pidfd_open
+	pidFd = (int)syscall(SYS_pidfd_open, pid, 0);
+	#endif
+	
+	// As our partial result, return a list with the pid, the two read pipes, the
+	// final time, the pidfd, and the chunks of output read from each pipe so far.
 	ValueList data;
 	data.Add(Value(pid));
 	data.Add(Value(stdoutPipe[0]));
 	data.Add(Value(stderrPipe[0]));
 	data.Add(Value(currentTime + timeout));
+	data.Add(Value(pidFd));
+	data.Add(Value(ValueList()));
+	data.Add(Value(ValueList()));
 	*outResult = data;
 	return true;
 }
 
 bool FinishExec(ValueList data, double currentTime, String* outStdout, String* outStderr, int* outStatus) {
-	// Start by getting the pid, the two read pipes, and the final time out of the partial result.
+	// Start by getting the pid and the final time out of the partial result.
 	int pid = data[0].IntValue();
-	int stdoutPipe = data[1].IntValue();
-	int stderrPipe = data[2].IntValue();
 	double finalTime = data[3].DoubleValue();
 	
+	// Collect any output that's ready.
+	readAvailable(data, 1, 5);
+	readAvailable(data, 2, 6);
+	
 	// Then, see if the child process has finished.
 	int returnCode;
 	String stdoutContent, stderrContent;
@@ -288,13 +313,16 @@ bool FinishExec(ValueList data, double currentTime, String* outStdout, String* o
 		returnCode = 124 << 8;	// (124 is status code used by `timeout` command)
 	} else {
 		// Child process completed successfully.  Huzzah!
-		// Read output from pipes.
-		stdoutContent = readFromFd(stdoutPipe);
-		stderrContent = readFromFd(stderrPipe);
+		// Read the rest of its output from the pipes.
+		readAvailable(data, 1, 5);
+		readAvailable(data, 2, 6);
+		stdoutContent = joinChunks(data[5].GetList());
+		stderrContent = joinChunks(data[6].GetList());
+	}
+	// Close our pipes (if not closed already), and pidfd.
+	for (int i : {1, 2, 4}) {
+		if (data[i].IntValue() >= 0) close(data[i].IntValue());
 	}
-	// Close our pipes.
-	close(stdoutPipe);
-	close(stderrPipe);
 
 	// Return results.
 	*outStdout = stdoutContent;
@@ -303,6 +331,16 @@ bool FinishExec(ValueList data, double currentTime, String* outStdout, String* o
 	return true;
 }
 
+bool ExecWakeFds(ValueList data, std::vector<int>& outFds) {
+	// Without a pidfd, we can't tell when the child exits (its pipes may be
+	// held open by others, or closed long before).
+	if (data[4].IntValue() < 0) return false;
+	for (int i : {1, 2, 4}) {
+		if (data[i].IntValue() >= 0) outFds.push_back(data[i].IntValue());
+	}
+	return true;
+}
+
 #endif
 
 }  // end of namespace MiniScript
@@ -10,6 +10,7 @@
 #define SHELLEXEC_H
 
 #include <stdio.h>
+#include <vector>
 #include "SimpleString.h"
 #include "MiniscriptTypes.h"
 
@@ -24,6 +25,12 @@ bool BeginExec(String cmd, double timeout, double currentTime, ValueList* outRes
 // into output parameters and return true.  If not, return false.
 bool FinishExec(ValueList data, double currentTime, String* outStdout, String* outStderr, int* outStatus);
 
+// Add to outFds the file descriptors that FinishExec might have something
+// to do after any of becomes readable (see Machine::wakeFds): the child
+// process's pipes, and its exit.  Return false if we can't tell when it
+// will exit that way (so, the caller should just check now and then).
+bool ExecWakeFds(ValueList data, std::vector<int>& outFds);
+
 
 
 }
@@ -17,12 +17,14 @@
 #include "MiniScript/Dictionary.h"
 #include "MiniScript/MiniscriptParser.h"
 #include "MiniScript/MiniscriptInterpreter.h"
+#include "MiniScript/IOPool.h"
 #include "OstreamSupport.h"
 #include "MiniScript/SplitJoin.h"
 #include "whereami/whereami.h"
 #include "DateTimeUtils.h"
 #include "ShellExec.h"
 #include "Key.h"
+#include "Matrix.h"
 
 #include <cstdlib>
 #include <sstream>
@@ -31,6 +33,8 @@
 #include <stdexcept>
 #include <array>
 #include <vector>
+#include <mutex>
+#include <string>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -74,8 +78,8 @@ bool exitASAP = false;
 int exitResult = 0;
 ValueList shellArgs;
 
-static Value _handle("_handle");
-static Value _MS_IMPORT_PATH("MS_IMPORT_PATH");
+static Value _handle = Value("_handle").MakeImmortal();
+static Value _MS_IMPORT_PATH = Value("MS_IMPORT_PATH").MakeImmortal();
 
 static ValueDict getEnvMap();
 
@@ -83,23 +87,28 @@ static ValueDict getEnvMap();
 class FileHandleStorage : public RefCountedStorage {
 public:
 	FileHandleStorage(FILE *file) : f(file) {}
-	virtual ~FileHandleStorage() { if (f) fclose(f); }
+	virtual ~FileHandleStorage() { waitUntilIdle(); if (f) fclose(f); }
+
+	// Wait for any background job using our file to finish (so we can use it).
+	void waitUntilIdle() {
+		if (busy) busy->WaitFor(-1);
+		busy = nullptr;
+	}
 
 	FILE *f;
+	std::shared_ptr<IOJob> busy;	// job reading f in the background, if any
 };
 
 // RefCountedStorage class to wrap raw data
 class RawDataHandleStorage : public RefCountedStorage {
 public:
 	RawDataHandleStorage() : data(nullptr), dataSize(0) {}
-	RawDataHandleStorage(FILE *f) {
-		fseek(f, 0, SEEK_END);
-		dataSize = ftell(f);
-		data = malloc(dataSize);
-		if (data) {
-			fseek(f, 0, SEEK_SET);
-			fread(data, 1, dataSize, f);
-		}
+	// Take over the given (malloc'd) data -- unless this raises, by going over
+	// a memory limit, in which case it's still the caller's.
+	RawDataHandleStorage(void *newData, size_t newSize) : data(nullptr), dataSize(0) {
+		accountFor(MemoryKind::Handle, sizeof(RawDataHandleStorage) + newSize);
+		data = newData;
+		dataSize = newSize;
 	}
 	virtual ~RawDataHandleStorage() { free(data); }
 	void resize(size_t newSize) {
@@ -114,6 +123,7 @@ public:
 				dataSize = newSize;
 			}
 		}
+		accountFor(MemoryKind::Handle, sizeof(RawDataHandleStorage) + dataSize);
 	}
 
 	void *data;
@@ -168,6 +178,19 @@ Intrinsic *i_rawDataSetDouble = nullptr;
 Intrinsic *i_rawDataUtf8 = nullptr;
 Intrinsic *i_rawDataSetUtf8 = nullptr;
 
+Intrinsic *i_matrixMake = nullptr;
+Intrinsic *i_matrixIdentity = nullptr;
+Intrinsic *i_matrixFromList = nullptr;
+Intrinsic *i_matrixToList = nullptr;
+Intrinsic *i_matrixRows = nullptr;
+Intrinsic *i_matrixCols = nullptr;
+Intrinsic *i_matrixGet = nullptr;
+Intrinsic *i_matrixSet = nullptr;
+Intrinsic *i_matrixTranspose = nullptr;
+Intrinsic *i_matrixPlus = nullptr;
+Intrinsic *i_matrixTimes = nullptr;
+Intrinsic *i_matrixScale = nullptr;
+
 Intrinsic *i_keyAvailable = nullptr;
 Intrinsic *i_keyGet = nullptr;
 Intrinsic *i_keyPut = nullptr;
@@ -197,7 +220,7 @@ static int UnixishCopyFile(const char* source, const char* destination) {
 	return result;
 #else
 	// on Linux, the best way to copy a file with metadata is to let the shell do it:
-	String command = String("cp -p \"") + source + "\" \"" + destination + "\"";
+	std::string command = std::string("cp -p \"") + source + "\" \"" + destination + "\"";
 	return system(command.c_str());
 #endif
 }
@@ -258,6 +281,7 @@ static String ExpandVariables(String path) {
 
 static ValueDict& FileHandleClass();
 static ValueDict& RawDataType();
+static ValueDict& MatrixType();
 static ValueDict& KeyModule();
 
 static IntrinsicResult intrinsic_input(Context *context, IntrinsicResult partialResult) {
@@ -544,11 +568,170 @@ static IntrinsicResult intrinsic_rename(Context *context, IntrinsicResult partia
 	return IntrinsicResult(Value::Truth(err == 0));
 }
 
+static std::string readFromFile(FILE *handle, long bytesToRead) {
+	// If bytesToRead < 0, read to EOF.
+	// Otherwise, read bytesToRead bytes (1k at a time).
+	char buf[1024];
+	std::string result;
+	while (!feof(handle) && (bytesToRead != 0)) {
+		size_t read = fread(buf, 1, bytesToRead > 0 && bytesToRead < 1024 ? bytesToRead : 1024, handle);
+		if (read == 0) break;
+		if (bytesToRead > 0) bytesToRead -= read;
+		result.append(buf, read);
+	}
+	return result;
+}
+
+static String ReadFileHelper(FILE *handle, long bytesToRead) {
+	std::string result = readFromFile(handle, bytesToRead);
+	return String(result.c_str(), result.size());
+}
+
+// File operations that may take a while (reading or writing a whole file, or
+// a big piece of one, or copying one) are done in the background, on the
+// shared IOPool.  The intrinsic starts a job and returns it as its partial
+// result, and is then called again until the job's done, when it turns the
+// job's results into Values.  (Most jobs are done almost at once, when the
+// file is cached; so we give them a moment, before settling in to wait.)
+
+static const double quickJobWait = 0.001;		// (seconds)
+static const long backgroundReadSize = 65536;	// (smaller reads mostly come out of stdio's buffer)
+
+// Handle storage for a job, as an intrinsic's partial result.
+class IOJobStorage : public RefCountedStorage {
+public:
+	IOJobStorage(std::shared_ptr<IOJob> job) : job(job) {
+		accountFor(MemoryKind::Handle, sizeof(IOJobStorage));
+	}
+
+	std::shared_ptr<IOJob> job;
+};
+
+// Start the given job, and return it as a partial result.
+static IntrinsicResult startJob(std::shared_ptr<IOJob> job) {
+	IOPool::Shared().Submit(job);
+	job->WaitFor(quickJobWait);
+	return IntrinsicResult(Value::NewHandle(new IOJobStorage(job)), false);
+}
+
+// Get the job from an intrinsic's partial result, if it's done.  If not,
+// note what the machine should wake on, and return nullptr (so, return the
+// partial result again).
+template <class JobType>
+static JobType* finishedJob(Context *context, IntrinsicResult& partialResult) {
+	IOJob *job = ((IOJobStorage*)partialResult.Result().data.ref)->job.get();
+	if (job->Done()) return (JobType*)job;
+	job->AddWakeFd(context->vm->wakeFds);
+	return nullptr;
+}
+
+// Read a whole file, into a malloc'd buffer.  (If we run out of memory, we
+// say so, rather than give back part of it.)
+class ReadFileJob : public IOJob {
+public:
+	ReadFileJob(String path, const char *mode) : path(path.c_str()), mode(mode), opened(false), failed(false), data(nullptr), size(0) {}
+	virtual ~ReadFileJob() { free(data); }
+
+	virtual void Run() {
+		FILE *f = fopen(path.c_str(), mode);
+		if (f == nullptr) return;
+		opened = true;
+		// Start with room for the whole file (and one more byte, so we'll see
+		// the end without growing), but grow if it's more than that.
+		size_t capacity = 16384;
+		if (fseek(f, 0, SEEK_END) == 0) {
+			long fileSize = ftell(f);
+			if (fileSize >= 0) capacity = (size_t)fileSize + 1;
+			fseek(f, 0, SEEK_SET);
+		}
+		while (true) {
+			if (size == capacity or data == nullptr) {
+				if (data) capacity *= 2;
+				char *newData = (char*)realloc(data, capacity);
+				if (newData == nullptr) {
+					failed = true;
+					break;
+				}
+				data = newData;
+			}
+			size_t bytesRead = fread(data + size, 1, capacity - size, f);
+			if (bytesRead == 0) break;
+			size += bytesRead;
+		}
+		fclose(f);
+		if (failed) {
+			free(data);
+			data = nullptr;
+			size = 0;
+			return;
+		}
+		if (data and size + 1 < capacity) {
+			char *trimmed = (char*)realloc(data, size + 1);
+			if (trimmed) data = trimmed;
+		}
+	}
+
+	std::string path;
+	const char *mode;
+	bool opened;
+	bool failed;	// (ran out of memory)
+	char *data;		// (ours to free, unless taken)
+	size_t size;
+};
+
+// Write a whole file.
+class WriteFileJob : public IOJob {
+public:
+	WriteFileJob(String path, const char *mode, std::string content) : path(path.c_str()), mode(mode), content(content), opened(false), written(0) {}
+
+	virtual void Run() {
+		FILE *f = fopen(path.c_str(), mode);
+		if (f == nullptr) return;
+		opened = true;
+		written = fwrite(content.data(), 1, content.size(), f);
+		fclose(f);
+	}
+
+	std::string path;
+	const char *mode;
+	std::string content;
+	bool opened;
+	size_t written;
+};
+
+// Read from an open file (for FileHandle.read).
+class FileReadJob : public IOJob {
+public:
+	FileReadJob(FILE *handle, long bytesToRead) : handle(handle), bytesToRead(bytesToRead) {}
+
+	virtual void Run() { result = readFromFile(handle, bytesToRead); }
+
+	FILE *handle;		// (kept open by the FileHandleStorage, which waits for us)
+	long bytesToRead;
+	std::string result;
+};
+
+// Copy a file.
+class CopyFileJob : public IOJob {
+public:
+	CopyFileJob(String oldPath, String newPath) : oldPath(oldPath.c_str()), newPath(newPath.c_str()), result(-1) {}
+
+	virtual void Run() { result = UnixishCopyFile(oldPath.c_str(), newPath.c_str()); }
+
+	std::string oldPath;
+	std::string newPath;
+	int result;
+};
+
 static IntrinsicResult intrinsic_copy(Context *context, IntrinsicResult partialResult) {
-	String oldPath = context->GetVar("oldPath").ToString();
-	String newPath = context->GetVar("newPath").ToString();
-	int result = UnixishCopyFile(oldPath.c_str(), newPath.c_str());
-	return IntrinsicResult(Value::Truth(result == 0));
+	if (partialResult.Done()) {
+		String oldPath = context->GetVar("oldPath").ToString();
+		String newPath = context->GetVar("newPath").ToString();
+		partialResult = startJob(std::make_shared<CopyFileJob>(oldPath, newPath));
+	}
+	CopyFileJob *job = finishedJob<CopyFileJob>(context, partialResult);
+	if (job == nullptr) return partialResult;
+	return IntrinsicResult(Value::Truth(job->result == 0));
 }
 
 static IntrinsicResult intrinsic_remove(Context *context, IntrinsicResult partialResult) {
@@ -600,6 +783,7 @@ static IntrinsicResult intrinsic_fclose(Context *context, IntrinsicResult partia
 	Value fileWrapper = self.Lookup(_handle);
 	if (fileWrapper.IsNull() or fileWrapper.type != ValueType::Handle) return IntrinsicResult::Null;
 	FileHandleStorage *storage = (FileHandleStorage*)fileWrapper.data.ref;
+	storage->waitUntilIdle();
 	FILE *handle = storage->f;
 	if (handle == nullptr) return IntrinsicResult(Value::zero);
 	fclose(handle);
@@ -622,6 +806,7 @@ static IntrinsicResult intrinsic_fwrite(Context *context, IntrinsicResult partia
 	Value fileWrapper = self.Lookup(_handle);
 	if (fileWrapper.IsNull() or fileWrapper.type != ValueType::Handle) return IntrinsicResult::Null;
 	FileHandleStorage *storage = (FileHandleStorage*)fileWrapper.data.ref;
+	storage->waitUntilIdle();
 	FILE *handle = storage->f;
 	if (handle == nullptr) return IntrinsicResult(Value::zero);
 
@@ -635,6 +820,7 @@ static IntrinsicResult intrinsic_fwriteLine(Context *context, IntrinsicResult pa
 	Value fileWrapper = self.Lookup(_handle);
 	if (fileWrapper.IsNull() or fileWrapper.type != ValueType::Handle) return IntrinsicResult::Null;
 	FileHandleStorage *storage = (FileHandleStorage*)fileWrapper.data.ref;
+	storage->waitUntilIdle();
 	FILE *handle = storage->f;
 	if (handle == nullptr) return IntrinsicResult(Value::zero);
 	size_t written = fwrite(data.c_str(), 1, data.sizeB(), handle);
@@ -642,32 +828,30 @@ static IntrinsicResult intrinsic_fwriteLine(Context *context, IntrinsicResult pa
 	return IntrinsicResult((int)written);
 }
 
-static String ReadFileHelper(FILE *handle, long bytesToRead) {
-	// If bytesToRead < 0, read to EOF.
-	// Otherwise, read bytesToRead bytes (1k at a time).
-	char buf[1024];
-	String result;
-	while (!feof(handle) && (bytesToRead != 0)) {
-		size_t read = fread(buf, 1, bytesToRead > 0 && bytesToRead < 1024 ? bytesToRead : 1024, handle);
-		if (bytesToRead > 0) bytesToRead -= read;
-		result += String(buf, read);
-	}
-	return result;
-}
-
 static IntrinsicResult intrinsic_fread(Context *context, IntrinsicResult partialResult) {
-	Value self = context->GetVar("self");
-	long bytesToRead = context->GetVar("byteCount").IntValue();
-	if (bytesToRead == 0) return IntrinsicResult(Value::emptyString);
-
-	Value fileWrapper = self.Lookup(_handle);
-	if (fileWrapper.IsNull() or fileWrapper.type != ValueType::Handle) return IntrinsicResult::Null;
-	FileHandleStorage *storage = (FileHandleStorage*)fileWrapper.data.ref;
-	FILE *handle = storage->f;
-	if (handle == nullptr) return IntrinsicResult(Value::zero);
-	
-	String result = ReadFileHelper(handle, bytesToRead);
-	return IntrinsicResult(result);
+	if (partialResult.Done()) {
+		Value self = context->GetVar("self");
+		long bytesToRead = context->GetVar("byteCount").IntValue();
+		if (bytesToRead == 0) return IntrinsicResult(Value::emptyString);
+
+		Value fileWrapper = self.Lookup(_handle);
+		if (fileWrapper.IsNull() or fileWrapper.type != ValueType::Handle) return IntrinsicResult::Null;
+		FileHandleStorage *storage = (FileHandleStorage*)fileWrapper.data.ref;
+		storage->waitUntilIdle();
+		FILE *handle = storage->f;
+		if (handle == nullptr) return IntrinsicResult(Value::zero);
+		
+		if (bytesToRead > 0 and bytesToRead < backgroundReadSize) {
+			String result = ReadFileHelper(handle, bytesToRead);
+			return IntrinsicResult(result);
+		}
+		std::shared_ptr<IOJob> job = std::make_shared<FileReadJob>(handle, bytesToRead);
+		storage->busy = job;
+		partialResult = startJob(job);
+	}
+	FileReadJob *job = finishedJob<FileReadJob>(context, partialResult);
+	if (job == nullptr) return partialResult;
+	return IntrinsicResult(String(job->result.c_str(), job->result.size()));
 }
 
 static IntrinsicResult intrinsic_fposition(Context *context, IntrinsicResult partialResult) {
@@ -676,6 +860,7 @@ static IntrinsicResult intrinsic_fposition(Context *context, IntrinsicResult par
 	Value fileWrapper = self.Lookup(_handle);
 	if (fileWrapper.IsNull() or fileWrapper.type != ValueType::Handle) return IntrinsicResult::Null;
 	FileHandleStorage *storage = (FileHandleStorage*)fileWrapper.data.ref;
+	storage->waitUntilIdle();
 	FILE *handle = storage->f;
 	if (handle == nullptr) return IntrinsicResult::Null;
 
@@ -688,6 +873,7 @@ static IntrinsicResult intrinsic_feof(Context *context, IntrinsicResult partialR
 	Value fileWrapper = self.Lookup(_handle);
 	if (fileWrapper.IsNull() or fileWrapper.type != ValueType::Handle) return IntrinsicResult::Null;
 	FileHandleStorage *storage = (FileHandleStorage*)fileWrapper.data.ref;
+	storage->waitUntilIdle();
 	FILE *handle = storage->f;
 	if (handle == nullptr) return IntrinsicResult::Null;
 
@@ -701,6 +887,7 @@ static IntrinsicResult intrinsic_freadLine(Context *context, IntrinsicResult par
 	Value fileWrapper = self.Lookup(_handle);
 	if (fileWrapper.IsNull() or fileWrapper.type != ValueType::Handle) return IntrinsicResult::Null;
 	FileHandleStorage *storage = (FileHandleStorage*)fileWrapper.data.ref;
+	storage->waitUntilIdle();
 	FILE *handle = storage->f;
 	if (handle == nullptr) return IntrinsicResult::Null;
 
@@ -721,74 +908,68 @@ static IntrinsicResult intrinsic_freadLine(Context *context, IntrinsicResult par
 }
 
 static IntrinsicResult intrinsic_readLines(Context *context, IntrinsicResult partialResult) {
-	Value self = context->GetVar("self");
-	String path = context->GetVar("path").ToString();
-	
-	FILE *handle = fopen(path.c_str(), "r");
-	if (handle == nullptr) return IntrinsicResult::Null;
+	if (partialResult.Done()) {
+		String path = context->GetVar("path").ToString();
+		partialResult = startJob(std::make_shared<ReadFileJob>(path, "r"));
+	}
+	ReadFileJob *job = finishedJob<ReadFileJob>(context, partialResult);
+	if (job == nullptr) return partialResult;
+	if (not job->opened or job->failed) return IntrinsicResult::Null;
 
-	// Read in 1K chunks, dividing into lines.
+	// Divide into lines.
 	ValueList list;
-	char buf[1024];
-	String partialLine;
-	while (!feof(handle)) {
-		size_t bytesRead = fread(buf, 1, sizeof(buf), handle);
-		if (bytesRead == 0) break;
-		int lineStart = 0;
-		for (int i=0; i<bytesRead; i++) {
-			if (buf[i] == '\n' || buf[i] == '\r') {
-				String line(&buf[lineStart], i - lineStart);
-				if (!partialLine.empty()) {
-					line = partialLine + line;
-					partialLine = "";
-				}
-				list.Add(line);
-				if (buf[i] == '\r' && i+1 < bytesRead && buf[i+1] == '\n') i++;
-				if (i+1 < bytesRead && buf[i+1] == 0) i++;
-				lineStart = i + 1;
-			}
-		}
-		if (lineStart < bytesRead) {
-			partialLine += String(&buf[lineStart], bytesRead - lineStart);
+	const char *buf = job->data;
+	size_t bytesRead = job->size;
+	size_t lineStart = 0;
+	for (size_t i=0; i<bytesRead; i++) {
+		if (buf[i] == '\n' || buf[i] == '\r') {
+			list.Add(String(&buf[lineStart], i - lineStart));
+			if (buf[i] == '\r' && i+1 < bytesRead && buf[i+1] == '\n') i++;
+			if (i+1 < bytesRead && buf[i+1] == 0) i++;
+			lineStart = i + 1;
 		}
 	}
-	if (!partialLine.empty()) list.Add(partialLine);
-	fclose(handle);
+	if (lineStart < bytesRead) list.Add(String(&buf[lineStart], bytesRead - lineStart));
 	return IntrinsicResult(list);
 }
 
 static IntrinsicResult intrinsic_writeLines(Context *context, IntrinsicResult partialResult) {
-	Value self = context->GetVar("self");
-	String path = context->GetVar("path").ToString();
-	Value lines = context->GetVar("lines");
-
-	FILE *handle = fopen(path.c_str(), "w");
-	if (handle == nullptr) return IntrinsicResult::Null;
-
-	size_t written = 0;
-	if (lines.type == ValueType::List) {
-		ValueList list = lines.GetList();
-		for (int i=0; i<list.Count(); i++) {
-			String data = list[i].ToString();
-			written += fwrite(data.c_str(), 1, data.sizeB(), handle);
-			written += fwrite("\n", 1, 1, handle);
+	if (partialResult.Done()) {
+		String path = context->GetVar("path").ToString();
+		Value lines = context->GetVar("lines");
+
+		std::string content;
+		if (lines.type == ValueType::List) {
+			ValueList list = lines.GetList();
+			for (int i=0; i<list.Count(); i++) {
+				String data = list[i].ToString();
+				content.append(data.c_str(), data.sizeB());
+				content += '\n';
+			}
+		} else {
+			// Anything other than a list, just convert to a string and write it out.
+			String data = lines.ToString();
+			content.append(data.c_str(), data.sizeB());
+			content += '\n';
 		}
-	} else {
-		// Anything other than a list, just convert to a string and write it out.
-		String data = lines.ToString();
-		written = fwrite(data.c_str(), 1, data.sizeB(), handle);
-		written += fwrite("\n", 1, 1, handle);
+		partialResult = startJob(std::make_shared<WriteFileJob>(path, "w", content));
 	}
-	
-	fclose(handle);
-	return IntrinsicResult((int)written);
+	WriteFileJob *job = finishedJob<WriteFileJob>(context, partialResult);
+	if (job == nullptr) return partialResult;
+	if (not job->opened) return IntrinsicResult::Null;
+	return IntrinsicResult((int)job->written);
 }
 
 static IntrinsicResult intrinsic_loadRaw(Context *context, IntrinsicResult partialResult) {
-	String path = context->GetVar("path").ToString();
-	FILE *f = fopen(path.c_str(), "rb");
-	if (f == nullptr) return IntrinsicResult::Null;
-	Value dataWrapper = Value::NewHandle(new RawDataHandleStorage(f));
+	if (partialResult.Done()) {
+		String path = context->GetVar("path").ToString();
+		partialResult = startJob(std::make_shared<ReadFileJob>(path, "rb"));
+	}
+	ReadFileJob *job = finishedJob<ReadFileJob>(context, partialResult);
+	if (job == nullptr) return partialResult;
+	if (not job->opened or job->failed) return IntrinsicResult::Null;
+	Value dataWrapper = Value::NewHandle(new RawDataHandleStorage(job->data, job->size));
+	job->data = nullptr;
 	ValueDict instance;
 	instance.SetValue(Value::magicIsA, RawDataType());
 	instance.SetValue(_handle, dataWrapper);
@@ -797,31 +978,36 @@ static IntrinsicResult intrinsic_loadRaw(Context *context, IntrinsicResult parti
 }
 
 static IntrinsicResult intrinsic_saveRaw(Context *context, IntrinsicResult partialResult) {
-	String path = context->GetVar("path").ToString();
-	Value rawData = context->GetVar("rawData");
-	if (!rawData.IsA(RawDataType(), context->vm)) {
-		Value errMsg("Error: RawData parameter is required");
-		return IntrinsicResult(errMsg);
-	}
-	Value dataWrapper = rawData.Lookup(_handle);
-	if (dataWrapper.IsNull() or dataWrapper.type != ValueType::Handle) {
-		Value errMsg("Error: RawData parameter is required");
-		return IntrinsicResult(errMsg);
-	}
-	RawDataHandleStorage *storage = (RawDataHandleStorage*)dataWrapper.data.ref;
-	if (storage->dataSize == 0) {
-		Value errMsg("Error: RawData parameter is required");
-		return IntrinsicResult(errMsg);
+	if (partialResult.Done()) {
+		String path = context->GetVar("path").ToString();
+		Value rawData = context->GetVar("rawData");
+		if (!rawData.IsA(RawDataType(), context->vm)) {
+			Value errMsg("Error: RawData parameter is required");
+			return IntrinsicResult(errMsg);
+		}
+		Value dataWrapper = rawData.Lookup(_handle);
+		if (dataWrapper.IsNull() or dataWrapper.type != ValueType::Handle) {
+			Value errMsg("Error: RawData parameter is required");
+			return IntrinsicResult(errMsg);
+		}
+		RawDataHandleStorage *storage = (RawDataHandleStorage*)dataWrapper.data.ref;
+		if (storage->dataSize == 0) {
+			Value errMsg("Error: RawData parameter is required");
+			return IntrinsicResult(errMsg);
+		}
+		// (The job gets its own copy of the data, since the script may change
+		// this while it's writing.)
+		std::string content((const char*)storage->data, storage->dataSize);
+		partialResult = startJob(std::make_shared<WriteFileJob>(path, "wb", content));
 	}
-	FILE *f = fopen(path.c_str(), "wb");
-	if (f == nullptr) return IntrinsicResult::Null;
-	size_t written = fwrite(storage->data, 1, storage->dataSize, f);
-	fclose(f);
-	if (written < storage->dataSize) {
+	WriteFileJob *job = finishedJob<WriteFileJob>(context, partialResult);
+	if (job == nullptr) return partialResult;
+	if (not job->opened) return IntrinsicResult::Null;
+	if (job->written < job->content.size()) {
 		String s("Error: expected to write ");
-		s += String::Format((long)storage->dataSize);
+		s += String::Format((long)job->content.size());
 		s += " bytes, written ";
-		s += String::Format((long)written);
+		s += String::Format((long)job->written);
 		Value errMsg(s);
 		return IntrinsicResult(errMsg);
 	}
@@ -1143,6 +1329,118 @@ static IntrinsicResult intrinsic_rawDataSetUtf8(Context *context, IntrinsicResul
 	return IntrinsicResult(nBytes);
 }
 
+// Wrap the given storage up as a new Matrix instance.
+static Value newMatrix(MatrixStorage *storage) {
+	Value dataWrapper = Value::NewHandle(storage);
+	ValueDict instance;
+	instance.SetValue(Value::magicIsA, MatrixType());
+	instance.SetValue(_handle, dataWrapper);
+	return Value(instance);
+}
+
+// Get the storage behind the given Matrix instance, raising a TypeException
+// if it isn't one.
+static MatrixStorage *matrixStorage(Context *context, Value matrix, const char *paramName) {
+	if (matrix.type == ValueType::Map and matrix.IsA(MatrixType(), context->vm)) {
+		Value dataWrapper = matrix.Lookup(_handle);
+		if (dataWrapper.type == ValueType::Handle and dataWrapper.data.ref) return (MatrixStorage*)dataWrapper.data.ref;
+	}
+	TypeException(String("Matrix required for ") + paramName + " parameter").raise();
+	return nullptr;
+}
+
+// Get a row or column index, counting from the end if negative.
+static long matrixIndex(Value index, long count) {
+	long i = index.IntValue();
+	if (i < 0) i += count;
+	if (i < 0 or i >= count) IndexException(String("Matrix index ") + index.ToString() + " out of range").raise();
+	return i;
+}
+
+static IntrinsicResult intrinsic_matrixMake(Context *context, IntrinsicResult partialResult) {
+	long rows = context->GetVar("rows").IntValue();
+	long cols = context->GetVar("cols").IntValue();
+	double value = context->GetVar("value").DoubleValue();
+	MatrixStorage *storage = new MatrixStorage(rows, cols);
+	Value result = newMatrix(storage);
+	if (value != 0) for (long i=0; i<storage->Count(); i++) storage->data[i] = value;
+	return IntrinsicResult(result);
+}
+
+static IntrinsicResult intrinsic_matrixIdentity(Context *context, IntrinsicResult partialResult) {
+	long size = context->GetVar("size").IntValue();
+	MatrixStorage *storage = new MatrixStorage(size, size);
+	Value result = newMatrix(storage);
+	for (long i=0; i<size; i++) storage->At(i, i) = 1;
+	return IntrinsicResult(result);
+}
+
+static IntrinsicResult intrinsic_matrixFromList(Context *context, IntrinsicResult partialResult) {
+	Value list = context->GetVar("list");
+	if (list.type != ValueType::List) TypeException("list required for list parameter").raise();
+	return IntrinsicResult(newMatrix(MatrixStorage::FromList(list)));
+}
+
+static IntrinsicResult intrinsic_matrixToList(Context *context, IntrinsicResult partialResult) {
+	MatrixStorage *self = matrixStorage(context, context->GetVar("self"), "self");
+	return IntrinsicResult(self->ToList());
+}
+
+static IntrinsicResult intrinsic_matrixRows(Context *context, IntrinsicResult partialResult) {
+	MatrixStorage *self = matrixStorage(context, context->GetVar("self"), "self");
+	return IntrinsicResult(self->rows);
+}
+
+static IntrinsicResult intrinsic_matrixCols(Context *context, IntrinsicResult partialResult) {
+	MatrixStorage *self = matrixStorage(context, context->GetVar("self"), "self");
+	return IntrinsicResult(self->cols);
+}
+
+static IntrinsicResult intrinsic_matrixGet(Context *context, IntrinsicResult partialResult) {
+	MatrixStorage *self = matrixStorage(context, context->GetVar("self"), "self");
+	long row = matrixIndex(context->GetVar("row"), self->rows);
+	long col = matrixIndex(context->GetVar("col"), self->cols);
+	return IntrinsicResult(self->At(row, col));
+}
+
+static IntrinsicResult intrinsic_matrixSet(Context *context, IntrinsicResult partialResult) {
+	MatrixStorage *self = matrixStorage(context, context->GetVar("self"), "self");
+	long row = matrixIndex(context->GetVar("row"), self->rows);
+	long col = matrixIndex(context->GetVar("col"), self->cols);
+	self->At(row, col) = context->GetVar("value").DoubleValue();
+	return IntrinsicResult::Null;
+}
+
+static IntrinsicResult intrinsic_matrixTranspose(Context *context, IntrinsicResult partialResult) {
+	MatrixStorage *self = matrixStorage(context, context->GetVar("self"), "self");
+	return IntrinsicResult(newMatrix(self->Transpose()));
+}
+
+static IntrinsicResult intrinsic_matrixPlus(Context *context, IntrinsicResult partialResult) {
+	MatrixStorage *self = matrixStorage(context, context->GetVar("self"), "self");
+	MatrixStorage *other = matrixStorage(context, context->GetVar("other"), "other");
+	if (other->rows != self->rows or other->cols != self->cols) {
+		RuntimeException("Matrix.plus: matrices must be the same size").raise();
+	}
+	return IntrinsicResult(newMatrix(MatrixStorage::Add(self, other)));
+}
+
+static IntrinsicResult intrinsic_matrixTimes(Context *context, IntrinsicResult partialResult) {
+	MatrixStorage *self = matrixStorage(context, context->GetVar("self"), "self");
+	Value otherVal = context->GetVar("other");
+	if (otherVal.type == ValueType::Number) return IntrinsicResult(newMatrix(self->Scale(otherVal.DoubleValue())));
+	MatrixStorage *other = matrixStorage(context, otherVal, "other");
+	if (other->rows != self->cols) {
+		RuntimeException("Matrix.times: columns of the first matrix must match rows of the second").raise();
+	}
+	return IntrinsicResult(newMatrix(MatrixStorage::Multiply(self, other)));
+}
+
+static IntrinsicResult intrinsic_matrixScale(Context *context, IntrinsicResult partialResult) {
+	MatrixStorage *self = matrixStorage(context, context->GetVar("self"), "self");
+	return IntrinsicResult(newMatrix(self->Scale(context->GetVar("factor").DoubleValue())));
+}
+
 static IntrinsicResult intrinsic_keyAvailable(Context *context, IntrinsicResult partialResult) {
 	return IntrinsicResult(KeyAvailable());
 }
@@ -1214,6 +1512,7 @@ static IntrinsicResult intrinsic_exec(Context *context, IntrinsicResult partialR
 		double timeout = context->GetVar("timeout").DoubleValue();
 		ValueList data;
 		if (BeginExec(cmd, timeout, now, &data)) {
+			if (ExecWakeFds(data, context->vm->wakeFds)) context->vm->wakeTime = now + timeout;
 			return IntrinsicResult(data, false);
 		}
 		return IntrinsicResult::Null;
@@ -1232,7 +1531,9 @@ static IntrinsicResult intrinsic_exec(Context *context, IntrinsicResult partialR
 		result.SetValue("status", Value(status));
 		return IntrinsicResult(result);
 	} else {
-		// Not done yet.
+		// Not done yet.  We'll have more to do when it writes or exits, or
+		// times out.
+		if (ExecWakeFds(data, context->vm->wakeFds)) context->vm->wakeTime = data[3].DoubleValue();
 		return IntrinsicResult(data, false);
 	}
 }
@@ -1243,8 +1544,11 @@ static bool disallowAssignment(ValueDict& dict, Value key, Value value) {
 
 static IntrinsicResult intrinsic_File(Context *context, IntrinsicResult partialResult) {
 	static ValueDict fileModule;
-	
-	if (fileModule.Count() == 0) {
+	static std::once_flag once;
+	std::call_once(once, [] {
+		// (These module and class maps are shared by all interpreters, so they're
+		// immortal, and not charged to whichever interpreter gets here first.)
+		MemoryAccount::Scope scope(nullptr);
 		fileModule.SetValue("curdir", i_getcwd->GetFunc());
 		fileModule.SetValue("setdir", i_chdir->GetFunc());
 		fileModule.SetValue("children", i_readdir->GetFunc());
@@ -1263,7 +1567,8 @@ static IntrinsicResult intrinsic_File(Context *context, IntrinsicResult partialR
 		fileModule.SetValue("loadRaw", i_loadRaw->GetFunc());
 		fileModule.SetValue("saveRaw", i_saveRaw->GetFunc());
 		fileModule.SetAssignOverride(disallowAssignment);
-	}
+		Value(fileModule).MakeImmortal();
+	});
 	
 	return IntrinsicResult(fileModule);
 }
@@ -1271,7 +1576,9 @@ static IntrinsicResult intrinsic_File(Context *context, IntrinsicResult partialR
 
 static ValueDict& FileHandleClass() {
 	static ValueDict result;
-	if (result.Count() == 0) {
+	static std::once_flag once;
+	std::call_once(once, [] {
+		MemoryAccount::Scope scope(nullptr);
 		result.SetValue("close", i_fclose->GetFunc());
 		result.SetValue("isOpen", i_isOpen->GetFunc());
 		result.SetValue("write", i_fwrite->GetFunc());
@@ -1280,7 +1587,8 @@ static ValueDict& FileHandleClass() {
 		result.SetValue("readLine", i_freadLine->GetFunc());
 		result.SetValue("position", i_fposition->GetFunc());
 		result.SetValue("atEnd", i_feof->GetFunc());
-	}
+		Value(result).MakeImmortal();
+	});
 	
 	return result;
 }
@@ -1303,8 +1611,9 @@ static bool assignKey(ValueDict& dict, Value key, Value value) {
 
 static ValueDict& KeyModule() {
 	static ValueDict keyModule;
-	
-	if (keyModule.Count() == 0) {
+	static std::once_flag once;
+	std::call_once(once, [] {
+		MemoryAccount::Scope scope(nullptr);
 		keyModule.SetValue("available", i_keyAvailable->GetFunc());
 		keyModule.SetValue("get", i_keyGet->GetFunc());
 		keyModule.SetValue("put", i_keyPut->GetFunc());
@@ -1316,7 +1625,8 @@ static ValueDict& KeyModule() {
 		keyModule.SetValue("_echo", i_keyEcho->GetFunc());
 		keyModule.SetAssignOverride(assignKey);
 		keyModule.ApplyAssignOverride("_scanMap", KeyDefaultScanMap());
-	}
+		Value(keyModule).MakeImmortal();
+	});
 	
 	return keyModule;
 }
@@ -1328,7 +1638,9 @@ static IntrinsicResult intrinsic_Key(Context *context, IntrinsicResult partialRe
 
 static ValueDict& RawDataType() {
 	static ValueDict result;
-	if (result.Count() == 0) {
+	static std::once_flag once;
+	std::call_once(once, [] {
+		MemoryAccount::Scope scope(nullptr);
 		result.SetValue("littleEndian", Value::Truth(true));
 		result.SetValue("len", i_rawDataLen->GetFunc());
 		result.SetValue("resize", i_rawDataResize->GetFunc());
@@ -1350,7 +1662,8 @@ static ValueDict& RawDataType() {
 		result.SetValue("setDouble", i_rawDataSetDouble->GetFunc());
 		result.SetValue("utf8", i_rawDataUtf8->GetFunc());
 		result.SetValue("setUtf8", i_rawDataSetUtf8->GetFunc());
-	}
+		Value(result).MakeImmortal();
+	});
 	
 	return result;
 }
@@ -1359,6 +1672,32 @@ static IntrinsicResult intrinsic_RawData(Context *context, IntrinsicResult parti
 	return IntrinsicResult(RawDataType());
 }
 
+static ValueDict& MatrixType() {
+	static ValueDict result;
+	static std::once_flag once;
+	std::call_once(once, [] {
+		MemoryAccount::Scope scope(nullptr);
+		result.SetValue("make", i_matrixMake->GetFunc());
+		result.SetValue("identity", i_matrixIdentity->GetFunc());
+		result.SetValue("fromList", i_matrixFromList->GetFunc());
+		result.SetValue("toList", i_matrixToList->GetFunc());
+		result.SetValue("rows", i_matrixRows->GetFunc());
+		result.SetValue("cols", i_matrixCols->GetFunc());
+		result.SetValue("get", i_matrixGet->GetFunc());
+		result.SetValue("set", i_matrixSet->GetFunc());
+		result.SetValue("transpose", i_matrixTranspose->GetFunc());
+		result.SetValue("plus", i_matrixPlus->GetFunc());
+		result.SetValue("times", i_matrixTimes->GetFunc());
+		result.SetValue("scale", i_matrixScale->GetFunc());
+		Value(result).MakeImmortal();
+	});
+	return result;
+}
+
+static IntrinsicResult intrinsic_Matrix(Context *context, IntrinsicResult partialResult) {
+	return IntrinsicResult(MatrixType());
+}
+
 static void setEnvVar(const char* key, const char* value) {
 	#if WINDOWS
 		_putenv_s(key, value);
@@ -1374,7 +1713,9 @@ static bool assignEnvVar(ValueDict& dict, Value key, Value value) {
 
 static ValueDict getEnvMap() {
 	static ValueDict envMap;
-	if (envMap.Count() == 0) {
+	static std::once_flag once;
+	std::call_once(once, [] {
+		MemoryAccount::Scope scope(nullptr);
 		// The stdlib-supplied `environ` is a null-terminated array of char* (C strings).
 		// Each such C string is of the form NAME=VALUE.  So we need to split on the
 		// first '=' to separate this into keys and values for our env map.
@@ -1389,7 +1730,8 @@ static ValueDict getEnvMap() {
 			envMap.SetValue(_MS_IMPORT_PATH, "$MS_SCRIPT_DIR:$MS_SCRIPT_DIR/lib:$MS_EXE_DIR/lib");
 		}
 		envMap.SetAssignOverride(assignEnvVar);
-	}
+		Value(envMap).MakeImmortal();
+	});
 	return envMap;
 }
 
@@ -1642,6 +1984,9 @@ void AddShellIntrinsics() {
 	f = Intrinsic::Create("key");
 	f->code = &intrinsic_Key;
 	
+	f = Intrinsic::Create("Matrix");
+	f->code = &intrinsic_Matrix;
+	
 	
 	// RawData methods
 	
@@ -1790,4 +2135,66 @@ void AddShellIntrinsics() {
 	
 	// END key.* methods
 	
+	// Matrix methods
+	
+	i_matrixMake = Intrinsic::Create("");
+	i_matrixMake->AddParam("rows", 0);
+	i_matrixMake->AddParam("cols", 0);
+	i_matrixMake->AddParam("value", 0);
+	i_matrixMake->code = &intrinsic_matrixMake;
+	
+	i_matrixIdentity = Intrinsic::Create("");
+	i_matrixIdentity->AddParam("size", 0);
+	i_matrixIdentity->code = &intrinsic_matrixIdentity;
+	
+	i_matrixFromList = Intrinsic::Create("");
+	i_matrixFromList->AddParam("list");
+	i_matrixFromList->code = &intrinsic_matrixFromList;
+	
+	i_matrixToList = Intrinsic::Create("");
+	i_matrixToList->AddParam("self");
+	i_matrixToList->code = &intrinsic_matrixToList;
+	
+	i_matrixRows = Intrinsic::Create("");
+	i_matrixRows->AddParam("self");
+	i_matrixRows->code = &intrinsic_matrixRows;
+	
+	i_matrixCols = Intrinsic::Create("");
+	i_matrixCols->AddParam("self");
+	i_matrixCols->code = &intrinsic_matrixCols;
+	
+	i_matrixGet = Intrinsic::Create("");
+	i_matrixGet->AddParam("self");
+	i_matrixGet->AddParam("row", 0);
+	i_matrixGet->AddParam("col", 0);
+	i_matrixGet->code = &intrinsic_matrixGet;
+	
+	i_matrixSet = Intrinsic::Create("");
+	i_matrixSet->AddParam("self");
+	i_matrixSet->AddParam("row", 0);
+	i_matrixSet->AddParam("col", 0);
+	i_matrixSet->AddParam("value", 0);
+	i_matrixSet->code = &intrinsic_matrixSet;
+	
+	i_matrixTranspose = Intrinsic::Create("");
+	i_matrixTranspose->AddParam("self");
+	i_matrixTranspose->code = &intrinsic_matrixTranspose;
+	
+	i_matrixPlus = Intrinsic::Create("");
+	i_matrixPlus->AddParam("self");
+	i_matrixPlus->AddParam("other");
+	i_matrixPlus->code = &intrinsic_matrixPlus;
+	
+	i_matrixTimes = Intrinsic::Create("");
+	i_matrixTimes->AddParam("self");
+	i_matrixTimes->AddParam("other");
+	i_matrixTimes->code = &intrinsic_matrixTimes;
+	
+	i_matrixScale = Intrinsic::Create("");
+	i_matrixScale->AddParam("self");
+	i_matrixScale->AddParam("factor", 1);
+	i_matrixScale->code = &intrinsic_matrixScale;
+	
+	// END Matrix methods
+	
 }
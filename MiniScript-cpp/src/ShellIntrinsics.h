@@ -24,6 +24,10 @@ extern MiniScript::ValueList shellArgs;
 
 void AddPathEnvVars();
 void AddScriptPathVar(const char* scriptPartialPath);
+// Add the shell intrinsics (file, env, key, etc.).  Call this before starting
+// any threads that run scripts.  Note that env and key stand for process-wide
+// things (the environment and the terminal), so they are shared by all
+// interpreters, and should only be changed from one thread at a time.
 void AddShellIntrinsics();
 
 #endif // SHELLINTRINSICS_H
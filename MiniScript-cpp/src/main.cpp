@@ -19,6 +19,7 @@
 #include "MiniScript/Dictionary.h"
 #include "MiniScript/MiniscriptParser.h"
 #include "MiniScript/MiniscriptInterpreter.h"
+#include "MiniScript/Reactor.h"
 #include "OstreamSupport.h"
 #include "MiniScript/SplitJoin.h"
 #include "ShellIntrinsics.h"
@@ -129,10 +130,17 @@ static int DoCommand(Interpreter &interp, String cmd) {
 		}
 	}
 	
+	Reactor reactor;
 	while (!interp.Done()) {
 		try {
 			interp.RunUntilDone();
-			std::this_thread::sleep_for(std::chrono::nanoseconds(YIELD_NANOSECONDS));
+			if (interp.Done()) break;
+			if (interp.vm->yielding) {
+				std::this_thread::sleep_for(std::chrono::nanoseconds(YIELD_NANOSECONDS));
+			} else {
+				// Waiting on something (like wait or exec): sleep until it's ready.
+				reactor.Wait(interp.vm);
+			}
 		} catch (MiniscriptException& mse) {
 			std::cerr << "Runtime Exception: " << mse.message << std::endl;
 			interp.vm->Stop();